@@ -23,6 +23,7 @@
 #include <common/fs.hh>
 #include <common/imglib.hh>
 #include <common/log.hh>
+#include <common/profile.hh>
 #include <common/settings.hh>
 #include <common/numeric_cast.hh>
 
@@ -2486,6 +2487,8 @@ void bspdata_t::bspxentries::transfer(const char *xname, std::vector<uint8_t> &&
  */
 void LoadBSPFile(fs::path &filename, bspdata_t *bspdata)
 {
+    PROFILE_ZONE("LoadBSPFile");
+
     int i;
 
     logging::funcprint("'{}'\n", filename);
@@ -2812,6 +2815,8 @@ public:
  */
 void WriteBSPFile(const fs::path &filename, bspdata_t *bspdata)
 {
+    PROFILE_ZONE("WriteBSPFile");
+
     bspfile_t bspfile{};
 
     bspfile.version = bspdata->version;
@@ -248,42 +248,6 @@ const dmodelh2_t *BSP_DModelForModelString(const mbsp_t *bsp, const std::string
     return nullptr;
 }
 
-static bool Light_PointInSolid_r(const mbsp_t *bsp, const int nodenum, const qvec3d &point)
-{
-    if (nodenum < 0) {
-        const mleaf_t *leaf = BSP_GetLeafFromNodeNum(bsp, nodenum);
-
-        // mxd
-        if (bsp->loadversion->game->id == GAME_QUAKE_II) {
-            return leaf->contents & Q2_CONTENTS_SOLID;
-        }
-
-        return (leaf->contents == CONTENTS_SOLID || leaf->contents == CONTENTS_SKY);
-    }
-
-    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
-    const vec_t dist = bsp->dplanes[node->planenum].distance_to_fast(point);
-
-    if (dist > 0.1)
-        return Light_PointInSolid_r(bsp, node->children[0], point);
-    if (dist < -0.1)
-        return Light_PointInSolid_r(bsp, node->children[1], point);
-
-    // too close to the plane, check both sides
-    return Light_PointInSolid_r(bsp, node->children[0], point) || Light_PointInSolid_r(bsp, node->children[1], point);
-}
-
-// Tests hull 0 of the given model
-bool Light_PointInSolid(const mbsp_t *bsp, const dmodelh2_t *model, const qvec3d &point)
-{
-    return Light_PointInSolid_r(bsp, model->headnode[0], point);
-}
-
-bool Light_PointInWorld(const mbsp_t *bsp, const qvec3d &point)
-{
-    return Light_PointInSolid(bsp, &bsp->dmodels[0], point);
-}
-
 static std::vector<qplane3d> Face_AllocInwardFacingEdgePlanes(const mbsp_t *bsp, const mface_t *face)
 {
     std::vector<qplane3d> out;
@@ -221,6 +221,79 @@ void clear()
     directories.clear();
 }
 
+/*
+ * Resident archives
+ *
+ * With set_keep_archives(true), every pak/wad opened is also remembered here
+ * along with the size and timestamp of its file. clear() doesn't touch this
+ * list, so the next addArchive() of an unchanged file reuses the open stream
+ * and parsed directory instead of reading it again.
+ */
+struct resident_archive_t
+{
+    std::shared_ptr<archive_like> archive;
+    file_time_type time;
+    uintmax_t size;
+};
+
+static bool keep_archives = false;
+static std::list<resident_archive_t> resident_archives;
+
+void set_keep_archives(bool keep)
+{
+    keep_archives = keep;
+
+    if (!keep) {
+        resident_archives.clear();
+    }
+}
+
+bool is_resident(const archive_like *arch)
+{
+    for (auto &resident : resident_archives) {
+        if (resident.archive.get() == arch) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static std::shared_ptr<archive_like> findResidentArchive(const path &p, bool external)
+{
+    std::error_code ec;
+
+    for (auto it = resident_archives.begin(); it != resident_archives.end(); ++it) {
+        if (it->archive->external != external || !equivalent(it->archive->pathname, p, ec)) {
+            continue;
+        }
+
+        const auto time = last_write_time(p, ec);
+        const auto size = file_size(p, ec);
+
+        if (!ec && time == it->time && size == it->size) {
+            return it->archive;
+        }
+
+        // changed on disk; reopen it
+        resident_archives.erase(it);
+        break;
+    }
+
+    return nullptr;
+}
+
+static void addResidentArchive(const std::shared_ptr<archive_like> &arch)
+{
+    std::error_code ec;
+    const auto time = last_write_time(arch->pathname, ec);
+    const auto size = file_size(arch->pathname, ec);
+
+    if (!ec) {
+        resident_archives.push_back({arch, time, size});
+    }
+}
+
 inline std::shared_ptr<archive_like> addArchiveInternal(const path &p, bool external)
 {
     if (is_directory(p)) {
@@ -240,6 +313,13 @@ inline std::shared_ptr<archive_like> addArchiveInternal(const path &p, bool exte
             }
         }
 
+        if (keep_archives) {
+            if (auto arch = findResidentArchive(p, external)) {
+                logging::print(logging::flag::VERBOSE, "Reusing archive '{}'\n", p);
+                return archives.emplace_front(arch);
+            }
+        }
+
         auto ext = p.extension();
 
         try {
@@ -247,11 +327,17 @@ inline std::shared_ptr<archive_like> addArchiveInternal(const path &p, bool exte
                 auto &arch = archives.emplace_front(std::make_shared<pak_archive>(p, external));
                 auto &pak = reinterpret_cast<std::shared_ptr<pak_archive> &>(arch);
                 logging::print(logging::flag::VERBOSE, "Added pak '{}' with {} files\n", p, pak->files.size());
+                if (keep_archives) {
+                    addResidentArchive(arch);
+                }
                 return arch;
             } else if (string_iequals(ext.generic_string(), ".wad")) {
                 auto &arch = archives.emplace_front(std::make_shared<wad_archive>(p, external));
                 auto &wad = reinterpret_cast<std::shared_ptr<wad_archive> &>(arch);
                 logging::print(logging::flag::VERBOSE, "Added wad '{}' with {} lumps\n", p, wad->files.size());
+                if (keep_archives) {
+                    addResidentArchive(arch);
+                }
                 return arch;
             } else {
                 logging::funcprint("WARNING: no idea what to do with archive '{}'\n", p);
@@ -6,6 +6,9 @@
 #include <common/log.hh>
 #include <common/settings.hh>
 
+#include <mutex>
+#include <unordered_map>
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "../3rdparty/stb_image.h"
 
@@ -291,6 +294,39 @@ std::optional<texture> load_stb(
     return tex;
 }
 
+/*
+ * Resident textures
+ *
+ * With set_keep_textures(true), load_texture() remembers what it decoded from
+ * the pak/wad archives kept by fs::set_keep_archives. An entry is only used
+ * while fs resolves the file to the very same archive object, which means the
+ * archive is unchanged on disk. Loose files are always reloaded, as they may
+ * have been edited. Entries also record the palette they were decoded with.
+ */
+struct resident_texture_t
+{
+    std::weak_ptr<fs::archive_like> archive;
+    fs::path filename;
+    std::vector<qvec3b> palette;
+    texture tex;
+    fs::data data;
+};
+
+static bool keep_textures = false;
+static std::mutex resident_textures_mutex;
+static std::unordered_map<std::string, resident_texture_t> resident_textures;
+
+void set_keep_textures(bool keep)
+{
+    std::unique_lock lock(resident_textures_mutex);
+
+    keep_textures = keep;
+
+    if (!keep) {
+        resident_textures.clear();
+    }
+}
+
 // texture cache
 std::unordered_map<std::string, texture, case_insensitive_hash, case_insensitive_equal> textures;
 
@@ -308,6 +344,11 @@ const texture *find(const std::string_view &str)
 void clear()
 {
     textures.clear();
+
+    // drop resident textures whose archive is gone for good
+    std::unique_lock lock(resident_textures_mutex);
+
+    std::erase_if(resident_textures, [](const auto &entry) { return entry.second.archive.expired(); });
 }
 
 qvec3b calculate_average(const std::vector<qvec4b> &pixels)
@@ -326,6 +367,12 @@ qvec3b calculate_average(const std::vector<qvec4b> &pixels)
     return avg /= n;
 }
 
+static std::string ResidentTextureKey(
+    const fs::path &p, const std::string_view &name, bool meta_only, const gamedef_t *game)
+{
+    return fmt::format("{}|{}|{}|{}", p.generic_string(), name, meta_only, static_cast<int>(game->id));
+}
+
 std::tuple<std::optional<img::texture>, fs::resolve_result, fs::data> load_texture(const std::string_view &name,
     bool meta_only, const gamedef_t *game, const settings::common_settings &options, bool no_prefix)
 {
@@ -339,8 +386,30 @@ std::tuple<std::optional<img::texture>, fs::resolve_result, fs::data> load_textu
         fs::path p = (no_prefix ? fs::path(name) : (prefix / name)) += ext.suffix;
 
         if (auto pos = fs::where(p, options.filepriority.value() == settings::search_priority_t::LOOSE)) {
+            std::string key;
+
+            if (keep_textures) {
+                key = ResidentTextureKey(p, name, meta_only, game);
+
+                std::unique_lock lock(resident_textures_mutex);
+
+                if (auto it = resident_textures.find(key); it != resident_textures.end()) {
+                    const resident_texture_t &entry = it->second;
+
+                    if (entry.archive.lock() == pos.archive && entry.filename == pos.filename &&
+                        entry.palette == palette) {
+                        return {entry.tex, pos, entry.data};
+                    }
+                }
+            }
+
             if (auto data = fs::load(pos)) {
                 if (auto texture = ext.loader(name.data(), data, meta_only, game)) {
+                    if (keep_textures && fs::is_resident(pos.archive.get())) {
+                        std::unique_lock lock(resident_textures_mutex);
+                        resident_textures[key] = {pos.archive, pos.filename, palette, *texture, data};
+                    }
+
                     return {texture, pos, data};
                 }
             }
@@ -26,6 +26,7 @@
 #include <fstream>
 #include <iostream>
 #include <mutex>
+#include <thread>
 #include <fmt/ostream.h>
 #include <fmt/chrono.h>
 #include <fmt/color.h>
@@ -63,40 +64,11 @@ void preinitialize()
 #endif
 }
 
-void init(const fs::path &filename, const settings::common_settings &settings)
-{
-    if (settings.log.value()) {
-        logfile.open(filename);
-        fmt::print(logfile, "---- {} / ericw-tools {} ----\n", settings.program_name, ERICWTOOLS_VERSION);
-    }
-}
-
-void close()
-{
-    if (logfile) {
-        logfile.close();
-    }
-}
-
 static std::mutex print_mutex;
 static print_callback_t active_print_callback;
 
-void set_print_callback(print_callback_t cb)
-{
-    active_print_callback = cb;
-}
-
-void print(flag logflag, const char *str)
+static fmt::text_style style_for_message(flag logflag, const char *str)
 {
-    if (!(mask & logflag)) {
-        return;
-    }
-
-    if (active_print_callback) {
-        active_print_callback(logflag, str);
-        return;
-    }
-
     fmt::text_style style;
 
     if (enable_color_codes) {
@@ -111,13 +83,17 @@ void print(flag logflag, const char *str)
         }
     }
 
-    print_mutex.lock();
+    return style;
+}
 
+// writes a single message to all targets; caller must hold print_mutex
+// or be the writer thread.
+static void write_message(flag logflag, const char *str)
+{
     if (logflag != flag::PERCENT) {
         // log file, if open
         if (logfile) {
             logfile << str;
-            logfile.flush();
         }
 
 #ifdef _WIN32
@@ -129,15 +105,276 @@ void print(flag logflag, const char *str)
 
     if (enable_color_codes) {
         // stdout (assume the terminal can render ANSI colors)
-        fmt::print(style, "{}", str);
+        fmt::print(style_for_message(logflag, str), "{}", str);
     } else {
-        std::cout << str;
+        std::fputs(str, stdout);
+    }
+}
+
+static void flush_targets()
+{
+    if (logfile) {
+        logfile.flush();
     }
 
     // for TB, etc...
     fflush(stdout);
+}
+
+/*
+ * Background writer
+ *
+ * While the writer is running, print() formats the message on the calling
+ * thread and pushes it onto an intrusive multi-producer/single-consumer
+ * queue (Vyukov-style; the push itself is an atomic exchange). The writer
+ * thread drains whatever is queued, writes it out as one batch and flushes
+ * once per batch rather than once per message.
+ *
+ * Producers count themselves in producers_in_flight from before the
+ * writer_running check until after the push. stop() clears the flag and then
+ * waits for the count to drain, so every message queued so far is ahead of
+ * the shutdown message, and later producers see the flag cleared and write
+ * synchronously. (Both sides use seq_cst, so a producer either sees the flag
+ * cleared or is seen by stop().)
+ */
+struct log_message_t
+{
+    std::atomic<log_message_t *> next = nullptr;
+    flag logflag = flag::NONE;
+    bool shutdown = false;
+    std::string str;
+};
+
+class log_queue_t
+{
+    std::atomic<log_message_t *> head; // producers push here
+    log_message_t *tail; // only touched by the consumer
+    log_message_t stub;
+
+public:
+    log_queue_t()
+        : head(&stub),
+          tail(&stub)
+    {
+    }
+
+    void push(log_message_t *msg)
+    {
+        msg->next.store(nullptr, std::memory_order_relaxed);
+        log_message_t *prev = head.exchange(msg, std::memory_order_acq_rel);
+        prev->next.store(msg, std::memory_order_release);
+    }
+
+    // returns nullptr if the queue is empty, or if a producer is
+    // between the exchange and the link in push(); try again later.
+    log_message_t *pop()
+    {
+        log_message_t *t = tail;
+        log_message_t *next = t->next.load(std::memory_order_acquire);
+
+        if (t == &stub) {
+            if (!next) {
+                return nullptr;
+            }
+
+            tail = t = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next) {
+            tail = next;
+            return t;
+        }
+
+        if (t != head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+
+        push(&stub);
+        next = t->next.load(std::memory_order_acquire);
+
+        if (next) {
+            tail = next;
+            return t;
+        }
+
+        return nullptr;
+    }
+};
+
+static log_queue_t log_queue;
+static std::atomic_bool writer_running = false;
+static std::atomic<uint32_t> producers_in_flight = 0;
+static std::atomic<uint64_t> messages_queued = 0;
+static std::atomic<uint64_t> messages_written = 0;
+
+static void writer_thread_main()
+{
+    uint64_t consumed = messages_written.load();
+    bool shutdown = false;
+    std::string batch;
+
+    while (!shutdown) {
+        size_t count = 0;
+
+        while (log_message_t *msg = log_queue.pop()) {
+            count++;
+
+            if (msg->shutdown) {
+                shutdown = true;
+            } else {
+                write_message(msg->logflag, msg->str.c_str());
+            }
+
+            delete msg;
+        }
+
+        if (count) {
+            flush_targets();
+            consumed += count;
+            messages_written.store(consumed, std::memory_order_release);
+            messages_written.notify_all();
+            continue;
+        }
+
+        if (shutdown) {
+            break;
+        }
+
+        const uint64_t queued = messages_queued.load(std::memory_order_acquire);
 
-    print_mutex.unlock();
+        if (queued == consumed) {
+            // nothing to do; sleep until a producer bumps the counter
+            messages_queued.wait(queued, std::memory_order_acquire);
+        } else {
+            // a producer is mid-push
+            std::this_thread::yield();
+        }
+    }
+}
+
+struct log_writer_t
+{
+    std::thread thread;
+
+    void start()
+    {
+        if (thread.joinable()) {
+            return;
+        }
+
+        thread = std::thread(writer_thread_main);
+        writer_running = true;
+    }
+
+    void stop()
+    {
+        if (!thread.joinable()) {
+            return;
+        }
+
+        writer_running = false;
+
+        // wait out any producer between the check and the push
+        while (producers_in_flight.load() != 0) {
+            std::this_thread::yield();
+        }
+
+        log_message_t *msg = new log_message_t;
+        msg->shutdown = true;
+        log_queue.push(msg);
+        messages_queued.fetch_add(1, std::memory_order_release);
+        messages_queued.notify_one();
+
+        thread.join();
+
+        // the writer stops at the shutdown message; write out anything behind it
+        std::unique_lock lock(print_mutex);
+
+        while (log_message_t *leftover = log_queue.pop()) {
+            write_message(leftover->logflag, leftover->str.c_str());
+            delete leftover;
+            messages_written++;
+        }
+
+        flush_targets();
+    }
+
+    ~log_writer_t() { stop(); }
+};
+
+static log_writer_t log_writer;
+
+void init(const fs::path &filename, const settings::common_settings &settings)
+{
+    if (settings.log.value()) {
+        logfile.open(filename);
+        fmt::print(logfile, "---- {} / ericw-tools {} ----\n", settings.program_name, ERICWTOOLS_VERSION);
+    }
+
+    if (settings.asynclog.value()) {
+        log_writer.start();
+    }
+}
+
+void close()
+{
+    log_writer.stop();
+
+    if (logfile) {
+        logfile.close();
+    }
+}
+
+void flush()
+{
+    if (!writer_running) {
+        return;
+    }
+
+    const uint64_t target = messages_queued.load(std::memory_order_acquire);
+    uint64_t written;
+
+    while ((written = messages_written.load(std::memory_order_acquire)) < target) {
+        messages_written.wait(written, std::memory_order_acquire);
+    }
+}
+
+void set_print_callback(print_callback_t cb)
+{
+    active_print_callback = cb;
+}
+
+void print(flag logflag, const char *str)
+{
+    if (!(mask & logflag)) {
+        return;
+    }
+
+    if (active_print_callback) {
+        active_print_callback(logflag, str);
+        return;
+    }
+
+    producers_in_flight.fetch_add(1);
+
+    if (writer_running) {
+        log_message_t *msg = new log_message_t;
+        msg->logflag = logflag;
+        msg->str = str;
+        log_queue.push(msg);
+        messages_queued.fetch_add(1, std::memory_order_release);
+        messages_queued.notify_one();
+        producers_in_flight.fetch_sub(1);
+        return;
+    }
+
+    producers_in_flight.fetch_sub(1);
+
+    std::unique_lock lock(print_mutex);
+
+    write_message(logflag, str);
+    flush_targets();
 }
 
 void vprint(flag logflag, fmt::string_view format, fmt::format_args args)
@@ -166,12 +403,14 @@ static std::atomic_bool locked = false;
 void header(const char *name)
 {
     print(flag::PROGRESS, "---- {} ----\n", name);
+    statsjson::begin_section(name);
 }
 
 void assert_(bool success, const char *expr, const char *file, int line)
 {
     if (!success) {
         print("{}:{}: Q_assert({}) failed.\n", file, line, expr);
+        flush();
         // assert(0);
 #ifdef _WIN32
         __debugbreak();
@@ -232,6 +471,9 @@ void percent(uint64_t count, uint64_t max, bool displayElapsed)
             }
         }
         last_count = -1;
+
+        // end of a stage; make sure everything is visible before moving on
+        flush();
     } else {
         if (max != indeterminate) {
             uint32_t pct = static_cast<uint32_t>((static_cast<float>(count) / max) * 100);
@@ -356,6 +598,8 @@ void stat_tracker_t::print_stats()
 
     stats_printed = true;
 
+    statsjson::add(*this);
+
     // add 8 char padding just to keep it away from the left side
     size_t number_padding = number_of_digit_padding() + 4;
 
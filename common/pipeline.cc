@@ -0,0 +1,37 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <common/pipeline.hh>
+
+#include <common/log.hh>
+
+void WritePipelineBSP(pipeline_data_t &data, const fs::path &bsp_path)
+{
+    bspdata_t &bspdata = data.bspdata;
+
+    Q_assert(bspdata.version == &bspver_generic);
+
+    const bspversion_t *output_version = bspdata.loadversion;
+    ConvertBSPFormat(&bspdata, output_version);
+
+    WriteBSPFile(bsp_path, &bspdata);
+    logging::print("Wrote {}\n", bsp_path);
+
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+}
@@ -0,0 +1,184 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <common/profile.hh>
+
+#include <common/log.hh>
+#include <common/ostream.hh>
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace profiling
+{
+std::atomic<bool> enabled = false;
+
+struct event_t
+{
+    const char *name;
+    const char *arg0_name, *arg1_name;
+    int64_t arg0, arg1;
+    int64_t start_ns, end_ns;
+};
+
+// per-thread buffers
+struct thread_buffer_t
+{
+    int tid;
+    // ring of detail zones; only its own thread writes to it
+    std::vector<event_t> events;
+    // total detail zones recorded; the ring holds the last `detail_capacity` of them
+    std::atomic<uint64_t> count = 0;
+    // stage zones, never dropped; guarded by buffers_mutex
+    std::vector<event_t> stages;
+
+    thread_buffer_t(int tid) : tid(tid), events(detail_capacity) { }
+};
+
+static std::mutex buffers_mutex;
+static std::vector<std::unique_ptr<thread_buffer_t>> buffers;
+// bumped by reset(), so threads know their buffer pointer is stale
+static std::atomic<uint64_t> generation = 0;
+static fs::path output_path;
+static std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+static thread_buffer_t *ThreadBuffer()
+{
+    thread_local thread_buffer_t *buffer = nullptr;
+    thread_local uint64_t buffer_generation = 0;
+
+    const uint64_t current = generation.load(std::memory_order_acquire);
+
+    if (!buffer || buffer_generation != current) {
+        std::unique_lock lock(buffers_mutex);
+
+        buffer = buffers.emplace_back(std::make_unique<thread_buffer_t>(static_cast<int>(buffers.size()))).get();
+        buffer_generation = current;
+    }
+
+    return buffer;
+}
+
+void record(bool detail, const char *name, int64_t start_ns, int64_t end_ns, const char *arg0_name, int64_t arg0,
+    const char *arg1_name, int64_t arg1)
+{
+    thread_buffer_t *buffer = ThreadBuffer();
+
+    if (!detail) {
+        std::unique_lock lock(buffers_mutex);
+        buffer->stages.push_back({name, arg0_name, arg1_name, arg0, arg1, start_ns, end_ns});
+        return;
+    }
+
+    const uint64_t index = buffer->count.load(std::memory_order_relaxed);
+    buffer->events[index % detail_capacity] = {name, arg0_name, arg1_name, arg0, arg1, start_ns, end_ns};
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+void enable(const fs::path &output)
+{
+    output_path = output;
+
+    if (!enabled.exchange(true)) {
+        epoch = std::chrono::steady_clock::now();
+    }
+}
+
+void reset()
+{
+    enabled = false;
+
+    std::unique_lock lock(buffers_mutex);
+
+    buffers.clear();
+    generation++;
+    output_path.clear();
+}
+
+static void WriteEvent(std::ofstream &f, const event_t &event, int tid, bool &first)
+{
+    // Chrome trace timestamps are in microseconds
+    ewt::print(f, "{}\n{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}",
+        first ? "" : ",", event.name, tid, event.start_ns / 1000.0, (event.end_ns - event.start_ns) / 1000.0);
+
+    if (event.arg0_name) {
+        ewt::print(f, ",\"args\":{{\"{}\":{}", event.arg0_name, event.arg0);
+        if (event.arg1_name) {
+            ewt::print(f, ",\"{}\":{}", event.arg1_name, event.arg1);
+        }
+        ewt::print(f, "}}");
+    }
+
+    ewt::print(f, "}}");
+    first = false;
+}
+
+void write()
+{
+    if (!enabled) {
+        return;
+    }
+
+    std::ofstream f(output_path, std::ios_base::out | std::ios_base::binary);
+
+    if (!f) {
+        logging::print("WARNING: couldn't write profile to {}\n", output_path);
+        return;
+    }
+
+    std::unique_lock lock(buffers_mutex);
+
+    uint64_t written = 0, dropped = 0;
+    bool first = true;
+
+    ewt::print(f, "{{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for (auto &buffer : buffers) {
+        ewt::print(f, "{}\n{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":\"thread {}\"}}}}",
+            first ? "" : ",", buffer->tid, buffer->tid);
+        first = false;
+
+        for (const event_t &event : buffer->stages) {
+            WriteEvent(f, event, buffer->tid, first);
+        }
+
+        const uint64_t count = buffer->count.load(std::memory_order_acquire);
+        const uint64_t begin = count > detail_capacity ? count - detail_capacity : 0;
+
+        for (uint64_t i = begin; i < count; i++) {
+            WriteEvent(f, buffer->events[i % detail_capacity], buffer->tid, first);
+        }
+
+        written += buffer->stages.size() + count - begin;
+        dropped += begin;
+    }
+
+    ewt::print(f, "\n],\"otherData\":{{\"dropped_events\":{}}}}}\n", dropped);
+
+    logging::print("Wrote profile to {} ({} zones, {} dropped)\n", output_path, written, dropped);
+}
+} // namespace profiling
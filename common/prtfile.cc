@@ -23,6 +23,7 @@
 #include <common/fs.hh>
 #include <common/bspfile.hh>
 #include <common/ostream.hh>
+#include <common/cmdlib.hh>
 
 #include <fstream>
 
@@ -32,8 +33,225 @@ constexpr const char *PORTALFILEAM = "PRT1-AM";
 
 constexpr size_t PRT_MAX_WINDING = 64;
 
+/*
+ * ==============
+ * PRTB
+ *
+ * Binary portal file, always little-endian:
+ *
+ *   prtb_header_t
+ *   prtb_portal_t[numportals]
+ *   double[numpoints][3]        - the points of all portals, in portal order
+ *   int32_t[numclustermap]      - cluster of each leaf when clusters are in use (as in PRT2), else empty
+ *
+ * The header and portal records are multiples of 8 bytes, so the point array is
+ * aligned for mapping the file into memory. Points are stored at full precision.
+ * ==============
+ */
+constexpr std::array<char, 4> PORTALFILEBINARY = {'P', 'R', 'T', 'B'};
+constexpr uint32_t PRTB_VERSION = 1;
+
+struct prtb_header_t
+{
+    std::array<char, 4> magic;
+    uint32_t version;
+    int32_t portalleafs;
+    int32_t portalleafs_real;
+    uint32_t numportals;
+    uint32_t numpoints;
+    uint32_t numclustermap;
+    uint32_t reserved;
+
+    auto stream_data()
+    {
+        return std::tie(
+            magic, version, portalleafs, portalleafs_real, numportals, numpoints, numclustermap, reserved);
+    }
+};
+
+struct prtb_portal_t
+{
+    uint32_t firstpoint;
+    uint32_t numpoints;
+    std::array<int32_t, 2> leafnums;
+
+    auto stream_data() { return std::tie(firstpoint, numpoints, leafnums); }
+};
+
+static bool IsBinaryPrtFile(const fs::path &name)
+{
+    std::ifstream f(name, std::ios_base::in | std::ios_base::binary);
+    std::array<char, 4> magic{};
+
+    f.read(magic.data(), magic.size());
+
+    return f && magic == PORTALFILEBINARY;
+}
+
+static prtfile_t LoadBinaryPrtFile(const fs::path &name, const bspversion_t *loadversion)
+{
+    std::ifstream f(name, std::ios_base::in | std::ios_base::binary);
+    f >> endianness<std::endian::little>;
+
+    prtb_header_t header;
+    f >= header;
+
+    if (!f)
+        FError("unable to read {} header\n", name);
+    if (header.version != PRTB_VERSION)
+        FError("{} has PRTB version {}, expected {}\n", name, header.version, PRTB_VERSION);
+    if (header.portalleafs < 0 || header.portalleafs_real < 0)
+        FError("{} has a bad header\n", name);
+
+    prtfile_t result{};
+    result.portalleafs = header.portalleafs;
+    result.portalleafs_real = header.portalleafs_real;
+
+    if (loadversion->game->id == GAME_QUAKE_II) {
+        if (header.numclustermap) {
+            FError("{} with a cluster map can not be used with Q2\n", name);
+        }
+        // since q2bsp has native cluster support, we shouldn't look at portalleafs_real at all.
+        result.portalleafs_real = 0;
+    }
+
+    std::vector<prtb_portal_t> portals(header.numportals);
+    for (auto &portal : portals) {
+        f >= portal;
+    }
+
+    if (!f)
+        FError("reading portals of {}\n", name);
+
+    result.portals.resize(header.numportals);
+
+    for (uint32_t i = 0; i < header.numportals; i++) {
+        const prtb_portal_t &src = portals[i];
+        prtfile_portal_t &p = result.portals[i];
+
+        if (src.numpoints > PRT_MAX_WINDING)
+            FError("portal {} has too many points", i);
+        if (src.firstpoint > header.numpoints || src.numpoints > header.numpoints - src.firstpoint)
+            FError("out of bounds points in portal {}", i);
+        if ((unsigned)src.leafnums[0] > (unsigned)result.portalleafs ||
+            (unsigned)src.leafnums[1] > (unsigned)result.portalleafs)
+            FError("out of bounds leaf in portal {}", i);
+
+        p.leafnums[0] = src.leafnums[0];
+        p.leafnums[1] = src.leafnums[1];
+        p.winding.resize(src.numpoints);
+    }
+
+    // points are stored in portal order, so they can be read straight into the windings
+    uint32_t nextpoint = 0;
+    for (uint32_t i = 0; i < header.numportals; i++) {
+        if (portals[i].firstpoint != nextpoint)
+            FError("points of portal {} are out of order", i);
+        nextpoint += portals[i].numpoints;
+
+        for (auto &point : result.portals[i].winding) {
+            f >= point[0] >= point[1] >= point[2];
+        }
+    }
+
+    if (nextpoint != header.numpoints)
+        FError("{} has {} points, but its portals use {}\n", name, header.numpoints, nextpoint);
+
+    if (!f)
+        FError("reading points of {}\n", name);
+
+    // Q2 doesn't need this, it's PRT1 has the data we need
+    if (loadversion->game->id == GAME_QUAKE_II) {
+        return result;
+    }
+
+    if (!header.numclustermap) {
+        if (result.portalleafs != result.portalleafs_real)
+            FError("{} uses clusters but has no cluster map\n", name);
+
+        // no clusters: assign the identity cluster numbers for consistency
+        result.dleafinfos.resize(result.portalleafs + 1);
+
+        for (int i = 0; i < result.portalleafs; i++) {
+            result.dleafinfos[i + 1].cluster = i;
+        }
+        return result;
+    }
+
+    if (header.numclustermap != (uint32_t)result.portalleafs_real)
+        FError("{} has a cluster map of {} leafs, expected {}\n", name, header.numclustermap, result.portalleafs_real);
+
+    result.dleafinfos.resize(result.portalleafs_real + 1);
+
+    for (int i = 0; i < result.portalleafs_real; i++) {
+        int32_t clusternum;
+        f >= clusternum;
+        if (!f) {
+            FError("Unexpected end of cluster map\n");
+        }
+        if (clusternum < 0 || clusternum >= result.portalleafs) {
+            FError("Invalid cluster number {} in cluster map, number of clusters: {}\n", clusternum,
+                result.portalleafs);
+        }
+        result.dleafinfos[i + 1].cluster = clusternum;
+    }
+
+    return result;
+}
+
+void WriteBinaryPrtFile(const fs::path &name, const prtfile_t &prtfile)
+{
+    std::ofstream f(name, std::ios_base::out | std::ios_base::binary);
+    if (!f)
+        FError("Failed to open {}: {}", name, strerror(errno));
+
+    f << endianness<std::endian::little>;
+
+    const bool has_clustermap = !prtfile.dleafinfos.empty() && prtfile.portalleafs != prtfile.portalleafs_real;
+
+    prtb_header_t header{};
+    header.magic = PORTALFILEBINARY;
+    header.version = PRTB_VERSION;
+    header.portalleafs = prtfile.portalleafs;
+    header.portalleafs_real = prtfile.portalleafs_real;
+    header.numportals = prtfile.portals.size();
+    header.numclustermap = has_clustermap ? prtfile.portalleafs_real : 0;
+
+    for (auto &p : prtfile.portals) {
+        header.numpoints += p.winding.size();
+    }
+
+    f <= header;
+
+    uint32_t firstpoint = 0;
+    for (auto &p : prtfile.portals) {
+        prtb_portal_t portal{firstpoint, static_cast<uint32_t>(p.winding.size()), {p.leafnums[0], p.leafnums[1]}};
+        f <= portal;
+        firstpoint += portal.numpoints;
+    }
+
+    for (auto &p : prtfile.portals) {
+        for (auto &point : p.winding) {
+            f <= point[0] <= point[1] <= point[2];
+        }
+    }
+
+    if (has_clustermap) {
+        for (int i = 0; i < prtfile.portalleafs_real; i++) {
+            f <= static_cast<int32_t>(prtfile.dleafinfos[i + 1].cluster);
+        }
+    }
+
+    if (!f)
+        FError("Failed to write {}", name);
+}
+
 prtfile_t LoadPrtFile(const fs::path &name, const bspversion_t *loadversion)
 {
+    if (IsBinaryPrtFile(name)) {
+        return LoadBinaryPrtFile(name, loadversion);
+    }
+
     std::ifstream f(name);
 
     /*
@@ -21,6 +21,7 @@
 #include "common/threads.hh"
 #include "common/fs.hh"
 #include <common/log.hh>
+#include <common/profile.hh>
 
 namespace settings
 {
@@ -727,6 +728,8 @@ common_settings::common_settings()
       nostat{this, "nostat", false, &logging_group, "don't output statistic messages"},
       noprogress{this, "noprogress", false, &logging_group, "don't output progress messages"},
       nocolor{this, "nocolor", false, &logging_group, "don't output color codes (for TB, etc)"},
+      asynclog{this, "asynclog", true, &logging_group,
+          "write stdout/log file output from a background thread, so worker threads don't block on printing"},
       quiet{this, {"quiet", "noverbose"}, {&nopercent, &nostat, &noprogress}, &logging_group,
           "suppress non-important messages (equivalent to -nopercent -nostat -noprogress)"},
       gamedir{this, "gamedir", "", &game_group,
@@ -742,14 +745,18 @@ common_settings::common_settings()
       defaultpaths{this, "defaultpaths", true, &game_group,
           "whether the compiler should attempt to automatically derive game/base paths for games that support it"},
       tex_saturation_boost{this, "tex_saturation_boost", 0.0f, 0.0f, 1.0f, &game_group,
-          "increase texture saturation to match original Q2 tools"}
+          "increase texture saturation to match original Q2 tools"},
+      profile{this, "profile", "", &performance_group,
+          "write a Chrome trace-event .json of where the time went (open in chrome://tracing or ui.perfetto.dev)"},
+      stats_json{this, "statsjson", "", &performance_group,
+          "write every stat, stage timings, thread count and peak memory use to a .json file"}
 {
 }
 
 void common_settings::set_parameters(int argc, const char **argv)
 {
     program_name = fs::path(argv[0]).stem().string();
-    fmt::print("---- {} / ericw-tools {} ----\n", program_name, ERICWTOOLS_VERSION);
+    logging::print("---- {} / ericw-tools {} ----\n", program_name, ERICWTOOLS_VERSION);
 }
 
 void common_settings::preinitialize(int argc, const char **argv)
@@ -769,6 +776,10 @@ void common_settings::postinitialize(int argc, const char **argv)
 
     configureTBB(threads.value(), lowpriority.value());
 
+    if (!profile.value().empty()) {
+        profiling::enable(profile.value());
+    }
+
     if (verbose.value()) {
         logging::mask |= logging::flag::VERBOSE;
     }
@@ -0,0 +1,270 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <common/statsjson.hh>
+
+#include <common/json.hh>
+#include <common/log.hh>
+#include <common/settings.hh>
+
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <tbb/global_control.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace statsjson
+{
+static constexpr int schema_version = 1;
+
+struct section_t
+{
+    std::string name;
+    size_t stage;
+    time_point start, end;
+    json stats = json::object();
+    json warnings = json::object();
+};
+
+struct stage_t
+{
+    std::string tool;
+    time_point start;
+    double seconds = 0;
+    size_t threads = 0;
+    uint64_t peak_rss_bytes = 0;
+    json counters = json::object();
+};
+
+static std::mutex stats_mutex;
+static std::atomic<bool> collecting = false;
+static fs::path output_path;
+static std::vector<stage_t> stages;
+static std::vector<section_t> sections;
+static std::atomic<size_t> section_index = 0;
+
+static uint64_t PeakRSSBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+
+    return 0;
+#else
+    rusage usage{};
+
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss; // bytes
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024; // kilobytes
+#endif
+#endif
+}
+
+static void BeginSectionLocked(const char *name, time_point now)
+{
+    // (the last section of an earlier, finished stage keeps its end time)
+    if (collecting && !sections.empty()) {
+        sections.back().end = now;
+    }
+
+    sections.push_back({name, stages.size() - 1, now, now});
+    section_index = sections.size() - 1;
+}
+
+static void ResetLocked()
+{
+    collecting = false;
+    output_path.clear();
+    stages.clear();
+    sections.clear();
+    section_index = 0;
+}
+
+void begin_stage(const char *tool, const settings::common_settings &options)
+{
+    std::unique_lock lock(stats_mutex);
+
+    if (options.stats_json.value().empty()) {
+        ResetLocked();
+        return;
+    }
+
+    // a new file starts over; the same file collects every stage run in this process
+    if (options.stats_json.value() != output_path) {
+        ResetLocked();
+        output_path = options.stats_json.value();
+    }
+
+    const time_point now = I_FloatTime();
+
+    stages.push_back({tool, now});
+    BeginSectionLocked(tool, now);
+    collecting = true;
+}
+
+static json ToJson()
+{
+    json stages_json = json::array();
+
+    for (const stage_t &stage : stages) {
+        stages_json.push_back({
+            {"tool", stage.tool},
+            {"seconds", stage.seconds},
+            {"threads", stage.threads},
+            {"peak_rss_bytes", stage.peak_rss_bytes},
+            {"counters", stage.counters},
+            {"sections", json::array()},
+        });
+    }
+
+    for (const section_t &section : sections) {
+        stages_json[section.stage]["sections"].push_back({
+            {"name", section.name},
+            {"seconds", duration(section.end - section.start).count()},
+            {"stats", section.stats},
+            {"warnings", section.warnings},
+        });
+    }
+
+    return {
+        {"schema_version", schema_version},
+        {"ericw_tools_version", ERICWTOOLS_VERSION},
+        {"hardware_threads", std::thread::hardware_concurrency()},
+        {"peak_rss_bytes", PeakRSSBytes()},
+        {"stages", stages_json},
+    };
+}
+
+void end_stage()
+{
+    std::unique_lock lock(stats_mutex);
+
+    if (!collecting) {
+        return;
+    }
+
+    collecting = false;
+
+    const time_point now = I_FloatTime();
+    stage_t &stage = stages.back();
+
+    sections.back().end = now;
+    stage.seconds = duration(now - stage.start).count();
+    stage.threads = tbb::global_control::active_value(tbb::global_control::max_allowed_parallelism);
+    stage.peak_rss_bytes = PeakRSSBytes();
+
+    std::ofstream f(output_path, std::ios_base::out | std::ios_base::trunc);
+
+    if (!f) {
+        logging::print("WARNING: couldn't write stats to {}\n", output_path);
+        return;
+    }
+
+    f << std::setw(4) << ToJson() << '\n';
+
+    logging::print("Wrote stats to {}\n", output_path);
+}
+
+void reset()
+{
+    std::unique_lock lock(stats_mutex);
+
+    ResetLocked();
+}
+
+bool enabled()
+{
+    return collecting.load(std::memory_order_relaxed);
+}
+
+void begin_section(const char *name)
+{
+    if (!enabled()) {
+        return;
+    }
+
+    std::unique_lock lock(stats_mutex);
+
+    if (!collecting) {
+        return;
+    }
+
+    BeginSectionLocked(name, I_FloatTime());
+}
+
+size_t current_section()
+{
+    return section_index.load(std::memory_order_relaxed);
+}
+
+void add(const logging::stat_tracker_t &tracker)
+{
+    if (!enabled()) {
+        return;
+    }
+
+    std::unique_lock lock(stats_mutex);
+
+    if (!collecting || sections.empty()) {
+        return;
+    }
+
+    // trackers from before a reset fall back to the current section
+    section_t &section = sections[tracker.section < sections.size() ? tracker.section : sections.size() - 1];
+
+    for (const auto &stat : tracker.stats) {
+        json &target = stat.is_warning ? section.warnings : section.stats;
+        // a section can hold more than one tracker, so names add up
+        target[stat.name] = target.value(stat.name, size_t{0}) + stat.count.load();
+    }
+}
+
+void add_counter(const char *name, uint64_t value)
+{
+    if (!enabled()) {
+        return;
+    }
+
+    std::unique_lock lock(stats_mutex);
+
+    if (!collecting) {
+        return;
+    }
+
+    stages.back().counters[name] = value;
+}
+} // namespace statsjson
@@ -56,8 +56,6 @@ bool Face_IsTranslucent(const mbsp_t *bsp, const mface_t *face); // mxd
 int Face_ContentsOrSurfaceFlags(
     const mbsp_t *bsp, const mface_t *face); // mxd. Returns CONTENTS_ value for Q1, Q2_SURF_ bitflags for Q2...
 const dmodelh2_t *BSP_DModelForModelString(const mbsp_t *bsp, const std::string &submodel_str);
-bool Light_PointInSolid(const mbsp_t *bsp, const dmodelh2_t *model, const qvec3d &point);
-bool Light_PointInWorld(const mbsp_t *bsp, const qvec3d &point);
 
 std::vector<const mface_t *> BSP_FindFacesAtPoint(
     const mbsp_t *bsp, const dmodelh2_t *model, const qvec3d &point, const qvec3d &wantedNormal = qvec3d(0, 0, 0));
@@ -52,6 +52,12 @@ struct archive_like
 // clear all initialized/loaded data from fs
 void clear();
 
+// keep pak/wad archives loaded across clear(), reopening them only if the
+// file changes on disk. for processes that compile more than one map
+void set_keep_archives(bool keep);
+// whether `arch` is one of the archives kept by set_keep_archives
+bool is_resident(const archive_like *arch);
+
 // add the specified archive to the search path. must be the full
 // path to the archive. Archives can be directories or archive-like
 // files. Returns the archive if it already exists, the new
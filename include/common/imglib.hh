@@ -116,6 +116,10 @@ constexpr struct
 std::tuple<std::optional<texture>, fs::resolve_result, fs::data> load_texture(const std::string_view &name,
     bool meta_only, const gamedef_t *game, const settings::common_settings &options, bool no_prefix = false);
 
+// keep textures decoded by load_texture() across clear(), for as long as the
+// archive they came from stays loaded (see fs::set_keep_archives)
+void set_keep_textures(bool keep);
+
 enum class meta_ext
 {
     WAL,
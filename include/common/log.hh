@@ -37,6 +37,7 @@
 #include <common/bitflags.hh>
 #include <common/fs.hh>
 #include <common/cmdlib.hh>
+#include <common/statsjson.hh>
 
 // forward declaration
 namespace settings
@@ -70,6 +71,11 @@ void init(const fs::path &filename, const settings::common_settings &settings);
 // shutdown logging subsystem
 void close();
 
+// blocks until every message printed so far has been written to
+// stdout and the log file. only does work if the background writer
+// is running (see -asynclog); called at the end of each stage and on errors.
+void flush();
+
 // print to respective targets based on log flag
 void print(flag logflag, const char *str);
 
@@ -192,6 +198,8 @@ struct stat_tracker_t
 
     std::list<stat> stats;
     bool stats_printed = false;
+    // the -statsjson section this tracker reports into
+    size_t section = statsjson::current_section();
 
     stat &register_stat(const std::string &name, bool show_even_if_zero = false, bool is_warning = false);
     static size_t number_of_digits(size_t n);
@@ -0,0 +1,54 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <common/bspfile.hh>
+#include <common/fs.hh>
+#include <common/json.hh>
+#include <common/prtfile.hh>
+
+#include <optional>
+
+/*
+ * ==============
+ * pipeline_data_t
+ *
+ * What qbsp, vis and light hand to each other when they run in one process
+ * (the `*_main(args, pipeline_data_t &)` overloads, used by qbspvislight and
+ * lightpreview). It replaces the .bsp, .prt and .texinfo.json files that the
+ * stages otherwise write and read back; nothing is written to disk in between.
+ * ==============
+ */
+struct pipeline_data_t
+{
+    // the compiled map, in bspver_generic form. loadversion is the version it
+    // will be written as
+    bspdata_t bspdata;
+    // the portals for vis; unset if the map leaked
+    std::optional<prtfile_t> prtfile;
+    // the contents of the .texinfo.json file, if qbsp needed one
+    std::optional<json> texinfo_flags;
+    // cleared by stages that must not overwrite the .bsp (e.g. light -litonly)
+    bool write_bsp = true;
+};
+
+// writes the .bsp of a finished pipeline in its target format. bspdata is left
+// in bspver_generic form
+void WritePipelineBSP(pipeline_data_t &data, const fs::path &bsp_path);
@@ -0,0 +1,113 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <common/fs.hh>
+
+#include <atomic>
+#include <cstdint>
+
+/*
+ * ==============
+ * profiling
+ *
+ * Scoped timing zones for finding out where a compile spends its time,
+ * written out as a Chrome trace (chrome://tracing, https://ui.perfetto.dev)
+ * by the -profile option.
+ *
+ *   void BrushBSP(...)
+ *   {
+ *       PROFILE_ZONE("BrushBSP");
+ *       ...
+ *   }
+ *
+ * Zones that run once per face, portal etc. should use PROFILE_DETAIL_ZONE
+ * instead. Each thread records its detail zones into its own fixed-size ring
+ * buffer, so recording them takes no locks; when a buffer wraps, its oldest
+ * events are dropped. Stage zones are rare, so they are kept in a separate,
+ * locked list that never drops anything - a big map's per-face zones can't
+ * push the stages out of the trace. While profiling is disabled a zone costs
+ * one relaxed atomic load.
+ *
+ * Zone names (and arg names) must be string literals or otherwise outlive the
+ * profile, as only the pointer is stored.
+ * ==============
+ */
+namespace profiling
+{
+extern std::atomic<bool> enabled;
+
+// starts recording (if not already) and sets the file written by write()
+void enable(const fs::path &output);
+// stops recording and drops everything recorded so far
+void reset();
+// writes everything recorded so far, if enabled. recording continues, so the
+// stages of an in-process compile can each call this and the last one wins
+void write();
+
+// detail zones recorded per thread before the oldest are dropped
+constexpr size_t detail_capacity = 1 << 16;
+
+void record(bool detail, const char *name, int64_t start_ns, int64_t end_ns, const char *arg0_name, int64_t arg0,
+    const char *arg1_name, int64_t arg1);
+int64_t now_ns();
+
+class zone_t
+{
+    bool detail;
+    const char *name;
+    const char *arg0_name, *arg1_name;
+    int64_t arg0, arg1;
+    int64_t start_ns = -1;
+
+public:
+    inline zone_t(bool detail, const char *name, const char *arg0_name = nullptr, int64_t arg0 = 0,
+        const char *arg1_name = nullptr, int64_t arg1 = 0)
+        : detail(detail),
+          name(name),
+          arg0_name(arg0_name),
+          arg1_name(arg1_name),
+          arg0(arg0),
+          arg1(arg1)
+    {
+        if (enabled.load(std::memory_order_relaxed)) {
+            start_ns = now_ns();
+        }
+    }
+
+    inline ~zone_t()
+    {
+        if (start_ns >= 0) {
+            record(detail, name, start_ns, now_ns(), arg0_name, arg0, arg1_name, arg1);
+        }
+    }
+
+    zone_t(const zone_t &) = delete;
+    zone_t &operator=(const zone_t &) = delete;
+};
+} // namespace profiling
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+// times the rest of the enclosing scope: PROFILE_ZONE("name"[, "arg", value[, "arg2", value2]])
+#define PROFILE_ZONE(...) const profiling::zone_t PROFILE_CONCAT(profile_zone_, __LINE__)(false, __VA_ARGS__)
+// same, for zones that run many times per stage (per face, per portal...)
+#define PROFILE_DETAIL_ZONE(...) const profiling::zone_t PROFILE_CONCAT(profile_zone_, __LINE__)(true, __VA_ARGS__)
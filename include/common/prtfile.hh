@@ -49,5 +49,9 @@ struct prtfile_t
 };
 
 struct bspversion_t;
+// loads PRT1, PRT2, PRT1-AM or PRTB (binary) portal files
 prtfile_t LoadPrtFile(const fs::path &name, const bspversion_t *loadversion);
+// writes `prtfile` in the binary PRTB format. dleafinfos is only written when the
+// leafs are grouped into clusters (portalleafs != portalleafs_real)
+void WriteBinaryPrtFile(const fs::path &name, const prtfile_t &prtfile);
 void WriteDebugPortals(const std::vector<polylib::winding_t> &portals, fs::path name);
@@ -594,6 +594,7 @@ public:
     setting_bool nostat;
     setting_bool noprogress;
     setting_bool nocolor;
+    setting_invertible_bool asynclog;
     setting_redirect quiet;
     setting_path gamedir;
     setting_path basedir;
@@ -602,6 +603,8 @@ public:
     setting_bool q2rtx;
     setting_invertible_bool defaultpaths;
     setting_scalar tex_saturation_boost;
+    setting_path profile;
+    setting_path stats_json;
 
     common_settings();
 
@@ -0,0 +1,84 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <common/fs.hh>
+
+#include <cstdint>
+#include <string>
+
+namespace settings
+{
+class common_settings;
+}
+
+namespace logging
+{
+struct stat_tracker_t;
+}
+
+/*
+ * ==============
+ * statsjson
+ *
+ * Collects every stat tracker, each stage's running time, the thread count
+ * and peak memory use, and writes them as JSON for the -statsjson option, so
+ * compiles can be compared from script. The layout is versioned by
+ * `schema_version`; fields are only ever added to it:
+ *
+ *   {
+ *     "schema_version": 1,
+ *     "ericw_tools_version": "...",
+ *     "hardware_threads": 16,
+ *     "peak_rss_bytes": 123456789,
+ *     "stages": [{
+ *       "tool": "qbsp", "seconds": 1.5, "threads": 16, "peak_rss_bytes": 123456789,
+ *       "counters": {"name": 1, ...},
+ *       "sections": [{
+ *         "name": "BrushBSP", "seconds": 0.25,
+ *         "stats": {"nodes": 1234, ...}, "warnings": {"name": 0, ...}
+ *       }, ...]
+ *     }, ...]
+ *   }
+ *
+ * A section runs from one logging::header() to the next; stat trackers report
+ * into the section they were created in, zeros included. Stages run in the
+ * same process (qbspvislight) keep adding to the same file.
+ * ==============
+ */
+namespace statsjson
+{
+// starts collecting for `tool` if -statsjson is set; otherwise stops
+void begin_stage(const char *tool, const settings::common_settings &options);
+// finishes the stage and (re)writes the file
+void end_stage();
+// drops everything collected so far
+void reset();
+bool enabled();
+
+// starts a new section; called by logging::header
+void begin_section(const char *name);
+// index of the current section, for stat trackers to remember
+size_t current_section();
+
+void add(const logging::stat_tracker_t &tracker);
+// a stage-wide counter that isn't kept in a stat tracker
+void add_counter(const char *name, uint64_t value);
+} // namespace statsjson
@@ -140,6 +140,15 @@ std::string TargetnameForLightStyle(int style);
 std::vector<std::unique_ptr<light_t>> &GetLights();
 const std::vector<entdict_t> &GetEntdicts();
 std::vector<sun_t> &GetSuns();
+
+// a direction shared by one or more skydome/penumbra suns (sun_t::sky_sample)
+struct sky_sample_dir_t
+{
+    qvec3d incoming; // normalized, points towards the sky
+    std::vector<const sun_t *> suns;
+};
+
+const std::vector<sky_sample_dir_t> &GetSkySampleDirs();
 std::vector<entdict_t> &GetRadLights();
 
 const std::vector<std::unique_ptr<light_t>> &GetSurfaceLightTemplates();
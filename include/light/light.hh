@@ -38,12 +38,6 @@ constexpr vec_t LIGHT_EQUAL_EPSILON = 0.001;
 // FIXME: use maximum dimension of level
 constexpr vec_t MAX_SKY_DIST = 1000000;
 
-struct lightsample_t
-{
-    qvec3f color;
-    qvec3d direction;
-};
-
 // CHECK: isn't average a bad algorithm for color brightness?
 template<typename T>
 constexpr float LightSample_Brightness(const T &color)
@@ -65,6 +59,9 @@ public:
     int style;
     std::string suntexture;
     const img::texture *suntexture_value;
+    // one of many suns making up a skydome or a sun penumbra; these are
+    // lit together through a shared, importance-sampled set of sky rays
+    bool sky_sample = false;
 };
 
 class modelinfo_t;
@@ -73,12 +70,52 @@ namespace settings
 class worldspawn_keys;
 };
 
+// compact copy of a lightmap's colors and directions, held between lighting
+// stages with -compactlightmaps. only luxels with a non-zero color or direction
+// are kept, in sample order; `mask` has one bit per sample marking them.
+struct packed_lightmap_t
+{
+    // number of samples in the unpacked lightmap; 0 if not packed
+    size_t numsamples = 0;
+    std::vector<uint64_t> mask;
+    // float storage, exact; used while later stages still accumulate into the lightmap
+    std::vector<qvec3f> colors, directions;
+    // half-float storage, used once the lightmap is final. values are
+    // multiplied by 2^-exponent to fit the half range.
+    std::vector<qvec<uint16_t, 3>> half_colors, half_directions;
+    int color_exponent = 0, direction_exponent = 0;
+
+    size_t memory_size() const;
+};
+
 class lightmap_t
 {
 public:
     int style;
-    std::vector<lightsample_t> samples;
+    // per-sample accumulated color and light direction, stored as parallel
+    // arrays (one entry per lightsurf sample) so the light loops can
+    // gate and accumulate across contiguous floats
+    std::vector<qvec3f> colors;
+    std::vector<qvec3f> directions;
     qvec3d bounce_color;
+    // colors/directions while packed; see Lightmap_Pack
+    packed_lightmap_t packed;
+
+    inline bool is_packed() const { return packed.numsamples != 0; }
+    inline size_t size() const { return is_packed() ? packed.numsamples : colors.size(); }
+
+    inline void resize(size_t n)
+    {
+        colors.resize(n);
+        directions.resize(n);
+    }
+
+    // zero the first n samples
+    inline void clear(size_t n)
+    {
+        std::fill_n(colors.begin(), n, qvec3f{});
+        std::fill_n(directions.begin(), n, qvec3f{});
+    }
 };
 
 using lightmapdict_t = std::vector<lightmap_t>;
@@ -112,27 +149,41 @@ struct lightsurf_t
 
     faceextents_t extents, vanilla_extents;
 
-    // width * height sample points in world space
+    // width * height sample points in world space, stored as
+    // parallel arrays indexed by sample number
     struct sample_data_t
     {
-        qvec3d point;
-        qvec3d normal;
-        bool occluded;
-        int32_t realfacenum;
+        std::vector<qvec3f> points;
+        std::vector<qvec3f> normals;
+        std::vector<uint8_t> occluded;
+        std::vector<int32_t> realfacenum;
         /*
         raw ambient occlusion amount per sample point, 0-1, where 1 is
         fully occluded. dirtgain/dirtscale are not applied yet
         */
-        float occlusion;
+        std::vector<float> occlusion;
+
+        inline size_t size() const { return points.size(); }
+        inline bool empty() const { return points.empty(); }
+
+        inline void resize(size_t n)
+        {
+            points.resize(n);
+            normals.resize(n);
+            occluded.resize(n);
+            realfacenum.resize(n);
+            occlusion.resize(n);
+        }
     };
 
-    std::vector<sample_data_t> samples;
+    sample_data_t samples;
 
     /*
      pvs for the entire light surface. generated by ORing together
-     the pvs at each of the sample points
+     the pvs at each of the sample points; interned, so faces touching
+     the same set of leaves share one. null if the bsp has no vis.
      */
-    std::vector<uint8_t> pvs;
+    std::shared_ptr<const std::vector<uint8_t>> pvs;
 
     // output width * extra
     int width;
@@ -241,6 +292,13 @@ enum class visapprox_t
     RAYS
 };
 
+// ray tracing backend; see trace.hh
+enum class tracer_t
+{
+    EMBREE,
+    BVH
+};
+
 enum class emissivequality_t
 {
     LOW,
@@ -376,6 +434,7 @@ public:
     setting_bool novanilla;
     setting_scalar gate;
     setting_int32 sunsamples;
+    setting_int32 skysamples;
     setting_bool arghradcompat;
     setting_bool nolighting;
     setting_vec3 debugface;
@@ -385,6 +444,11 @@ public:
     setting_set radlights;
     setting_int32 lightmap_scale;
     setting_extra extra;
+    setting_bool adaptiveextra;
+    setting_scalar adaptiveextra_threshold;
+    setting_bool compactlightmaps;
+    setting_enum<tracer_t> tracer;
+    setting_invertible_bool alphamicromaps;
     setting_enum<emissivequality_t> emissivequality;
     setting_enum<visapprox_t> visapprox;
     setting_func lit;
@@ -403,6 +467,8 @@ public:
     setting_bool lightgrid;
     setting_vec3 lightgrid_dist;
     setting_enum<lightgrid_format_t> lightgrid_format;
+    setting_bool lightgrid_adaptive;
+    setting_scalar lightgrid_adaptive_threshold;
 
     setting_func dirtdebug;
     setting_func bouncedebug;
@@ -454,9 +520,11 @@ extern std::vector<surfflags_t> extended_texinfo_flags;
 // public functions
 
 void FixupGlobalSettings(void);
-//void GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int size);
-//void GetFileSpace_PreserveOffsetInBsp(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int lightofs);
-void GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint32_t **hdrdata, uint8_t **deluxdata, int size);
+// lightmap output is two-pass: every face's size is planned and given an offset
+// (in samples) in face order, then AllocateFileSpace sizes the buffers once and
+// faces are written in parallel through GetFileSpace.
+void AllocateFileSpace(const mbsp_t *bsp, size_t size);
+void GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint32_t **hdrdata, uint8_t **deluxdata, int offset);
 void GetFileSpace_PreserveOffsetInBsp(uint8_t **lightdata, uint8_t **colordata, uint32_t **hdrdata, uint8_t **deluxdata, int lightofs);
 const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum);
 /**
@@ -467,5 +535,9 @@ const img::texture *Face_Texture(const mbsp_t *bsp, const mface_t *face);
 const qvec3b &Face_LookupTextureColor(const mbsp_t *bsp, const mface_t *face);
 const qvec3d &Face_LookupTextureBounceColor(const mbsp_t *bsp, const mface_t *face);
 void light_reset();
+struct pipeline_data_t;
+
 int light_main(int argc, const char **argv);
 int light_main(const std::vector<std::string> &args);
+// lights the bsp in `pipeline` and leaves the result there; see common/pipeline.hh
+int light_main(const std::vector<std::string> &args, pipeline_data_t &pipeline);
@@ -21,7 +21,34 @@
 
 #include <light/ltface.hh> // for lightgrid_samples_t
 
+#include <functional>
+#include <vector>
+
 struct bspdata_t;
 
+// a box of lightgrid points; both ends inclusive
+struct lightgrid_cell_t
+{
+    qvec3i mins, maxs;
+};
+
+struct lightgrid_adaptive_result_t
+{
+    // cells whose interior points were interpolated from their corners
+    std::vector<lightgrid_cell_t> interpolated_cells;
+    size_t evaluated_points = 0, interpolated_points = 0;
+    int levels = 0;
+};
+
+/**
+ * The cell subdivision behind -lightgrid_adaptive, on a grid of `grid_size`
+ * points. `evaluate` lights one grid point (from any thread); points marked in
+ * `occlusion` are never lit. Every other point of `results` is either lit
+ * directly or interpolated from the corners of a cell whose corners all have
+ * the same styles and are within `threshold` of each other.
+ */
+lightgrid_adaptive_result_t CalcLightgridAdaptive(const qvec3i &grid_size, const std::vector<uint8_t> &occlusion,
+    float threshold, const std::function<lightgrid_samples_t(int)> &evaluate, std::vector<lightgrid_samples_t> &results);
+
 std::tuple<lightgrid_samples_t, bool> FixPointAndCalcLightgrid(const mbsp_t *bsp, qvec3d world_point);
 void LightGrid(bspdata_t *bspdata);
@@ -23,6 +23,7 @@
 
 #include <atomic>
 #include <memory>
+#include <vector>
 
 struct mface_t;
 struct mbsp_t;
@@ -35,12 +36,21 @@ struct lightsurf_t;
 struct bspx_decoupled_lm_perface;
 class faceextents_t;
 class light_t;
+class lightmap_t;
 struct facesup_t;
 
 extern std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints;
 extern std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
 extern std::atomic<uint32_t> total_surflight_rays, total_surflight_ray_hits; // mxd
 extern std::atomic<uint32_t> fully_transparent_lightmaps;
+extern std::atomic<uint32_t> total_pvs_faces, total_pvs_sets;
+// -adaptiveextra, split by whether any luxel of the face was supersampled
+extern std::atomic<uint32_t> adaptive_flat_faces, adaptive_edge_faces;
+extern std::atomic<uint64_t> adaptive_flat_samples, adaptive_flat_samples_lit, adaptive_flat_rays;
+// adaptive_supersample_rays: the part of adaptive_edge_rays traced lighting the non-center samples
+extern std::atomic<uint64_t> adaptive_edge_samples, adaptive_edge_samples_lit, adaptive_edge_rays, adaptive_supersample_rays;
+// -compactlightmaps: size of the lightmaps currently packed, before and after packing
+extern std::atomic<uint64_t> compact_lightmap_dense_bytes, compact_lightmap_packed_bytes;
 
 void PrintFaceInfo(const mface_t *face, const mbsp_t *bsp);
 // FIXME: remove light param. add normal param and dir params.
@@ -54,9 +64,30 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
 void IndirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, size_t bounce_depth);
 void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg);
 void FinishLightmapSurface(const mbsp_t *bsp, lightsurf_t *lightsurf);
-void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
+void Lightmap_Pack(lightmap_t &lightmap, bool half);
+void Lightmap_Unpack(lightmap_t &lightmap);
+
+// one face's lightmap output, planned before any space is allocated
+struct lightmap_output_t
+{
+    mface_t *face = nullptr;
+    facesup_t *facesup = nullptr;
+    bspx_decoupled_lm_perface *facesup_decoupled = nullptr;
+    lightsurf_t *lightsurf = nullptr;
+    const faceextents_t *extents = nullptr;
+    const faceextents_t *output_extents = nullptr;
+    // styles to write, brightest first (with -litonly, in the bsp's order; null = skip)
+    std::vector<const lightmap_t *> lightmaps;
+    // space needed and assigned, in greyscale samples. the vanilla lightmap
+    // written alongside a decoupled one has its own range.
+    int size = 0, offset = -1;
+    int vanilla_size = 0, vanilla_offset = -1;
+};
+
+lightmap_output_t PlanLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
     bspx_decoupled_lm_perface *facesup_decoupled, lightsurf_t *lightsurf, const faceextents_t &extents,
     const faceextents_t &output_extents);
+void SaveLightmapSurface(const mbsp_t *bsp, const lightmap_output_t &output);
 
 struct lightgrid_sample_t
 {
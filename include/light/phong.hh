@@ -20,8 +20,8 @@
 
 #pragma once
 
-#include <set>
 #include <map>
+#include <span>
 #include <vector>
 
 #include <common/qvec.hh>
@@ -38,8 +38,8 @@ struct neighbour_t
 void CalculateVertexNormals(const mbsp_t *bsp);
 const face_normal_t &GetSurfaceVertexNormal(const mbsp_t *bsp, const mface_t *f, const int vertindex);
 bool FacesSmoothed(const mface_t *f1, const mface_t *f2);
-const std::set<const mface_t *> &GetSmoothFaces(const mface_t *face);
-const std::vector<const mface_t *> &GetPlaneFaces(const mface_t *face);
+std::span<const mface_t *const> GetSmoothFaces(const mface_t *face);
+std::span<const mface_t *const> GetPlaneFaces(const mface_t *face);
 const mface_t *Face_EdgeIndexSmoothed(const mbsp_t *bsp, const mface_t *f, const int edgeindex);
 int Q2_FacePhongValue(const mbsp_t *bsp, const mface_t *face);
 
@@ -20,6 +20,13 @@
 #pragma once
 
 #include <common/qvec.hh>
+#include <common/log.hh> // for FError
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <span>
+#include <vector>
 
 namespace img
 {
@@ -35,4 +42,316 @@ qvec4b SampleTexture(const mface_t *face, const mtexinfo_t *tex, const img::text
 
 class modelinfo_t;
 struct mleaf_t;
+struct dmodelh2_t;
+
+/*
+ * Point queries against hull 0 descend a flattened copy of the bsp nodes
+ * with the planes inlined, built by Light_BuildPointTree once the bsp is
+ * loaded. It must be rebuilt if the bsp's nodes change.
+ */
+void Light_BuildPointTree(const mbsp_t *bsp);
 const mleaf_t *Light_PointInLeaf(const mbsp_t *bsp, const qvec3d &point);
+// batched Light_PointInLeaf; leafs[i] receives the leaf containing points[i]
+void Light_PointsInLeafs(const mbsp_t *bsp, std::span<const qvec3f> points, std::span<const mleaf_t *> leafs);
+// Tests hull 0 of the given model for solid or sky. Points within 0.1 units
+// of a plane are tested on both sides.
+bool Light_PointInSolid(const mbsp_t *bsp, const dmodelh2_t *model, const qvec3d &point);
+bool Light_PointInWorld(const mbsp_t *bsp, const qvec3d &point);
+
+/*
+ * ==============
+ * ray tracing
+ *
+ * All of light's ray casts are batched in raystreams: rays are pushed, traced
+ * together by the active trace backend (see -tracer), then the results are read
+ * back per ray. The backends share the geometry in trace_scene_t and decide
+ * hits on filter geometry (glass, fences, dynamic shadows, channel masks) with
+ * Trace_FilterHit, so they agree on what blocks a ray.
+ * ==============
+ */
+
+struct triinfo
+{
+    const modelinfo_t *modelinfo;
+    const mface_t *face;
+    const mtexinfo_t *texinfo;
+
+    const img::texture *texture;
+    float alpha;
+    bool is_fence, is_glass;
+
+    // cached from modelinfo for faster access
+    bool shadowworldonly;
+    bool shadowself;
+    bool switchableshadow;
+    int32_t switchshadstyle;
+
+    int channelmask;
+
+    // alpha micromap of a fence triangle in trace_scene_t::micromaps; level -1 if none
+    int8_t micromap_level = -1;
+    uint32_t micromap_offset = 0;
+};
+
+enum class hittype_t : uint8_t
+{
+    NONE = 0,
+    SOLID = 1,
+    SKY = 2
+};
+
+class raystream_common_t
+{
+public:
+    // ray inputs
+    std::vector<qvec3f> _ray_origins;
+    std::vector<qvec3f> _ray_dirs; // can be un-normalized
+    std::vector<float> _rays_maxdist;
+    std::vector<int> _point_indices;
+    std::vector<qvec3f> _ray_colors;
+    std::vector<qvec3d> _ray_normalcontribs;
+
+    std::vector<bool> _ray_hit_glass;
+    std::vector<qvec3f> _ray_glass_color;
+    std::vector<float> _ray_glass_opacity;
+
+    // This is set to the modelinfo's switchshadstyle if the ray hit
+    // a dynamic shadow caster. (note that for rays that hit dynamic
+    // shadow casters, all of the other hit data is assuming the ray went
+    // straight through).
+    std::vector<int> _ray_dynamic_styles;
+
+    int _numrays = 0;
+    int _maxrays = 0;
+
+public:
+    inline raystream_common_t() = default;
+    virtual ~raystream_common_t() = default;
+
+    virtual void resize(size_t size)
+    {
+        _maxrays = size;
+
+        _ray_origins.resize(size);
+        _ray_dirs.resize(size);
+        _rays_maxdist.resize(size);
+        _point_indices.resize(size);
+        _ray_colors.resize(size);
+        _ray_normalcontribs.resize(size);
+        _ray_hit_glass.resize(size);
+        _ray_glass_color.resize(size);
+        _ray_glass_opacity.resize(size);
+        _ray_dynamic_styles.resize(size);
+    }
+
+    constexpr size_t numPushedRays() { return _numrays; }
+
+    inline int &getPushedRayPointIndex(size_t j) { return _point_indices[j]; }
+
+    inline qvec3f getPushedRayColor(size_t j)
+    {
+        qvec3f result = _ray_colors[j];
+
+        if (_ray_hit_glass[j]) {
+            const qvec3f glasscolor = _ray_glass_color[j];
+            const float opacity = _ray_glass_opacity[j];
+
+            // multiply ray color by glass color
+            const qvec3f tinted = result * glasscolor;
+
+            // lerp ray color between original ray color and fully tinted by the glass texture color, based on the glass
+            // opacity
+            result = mix(result, tinted, opacity);
+        }
+
+        return result;
+    }
+
+    inline qvec3d &getPushedRayNormalContrib(size_t j) { return _ray_normalcontribs[j]; }
+
+    inline int &getPushedRayDynamicStyle(size_t j) { return _ray_dynamic_styles[j]; }
+
+    inline qvec3d getPushedRayDir(size_t j) { return _ray_dirs[j]; }
+
+    inline void clearPushedRays() { _numrays = 0; }
+
+protected:
+    inline void pushRayCommon(int i, const qvec3d &origin, const qvec3d &dir, float dist, const qvec3f *color,
+        const qvec3d *normalcontrib)
+    {
+        _ray_origins[_numrays] = origin;
+        _ray_dirs[_numrays] = dir;
+        _rays_maxdist[_numrays] = dist;
+        _point_indices[_numrays] = i;
+        if (color) {
+            _ray_colors[_numrays] = *color;
+        }
+        if (normalcontrib) {
+            _ray_normalcontribs[_numrays] = *normalcontrib;
+        }
+        _ray_hit_glass[_numrays] = false;
+        _ray_dynamic_styles[_numrays] = 0;
+    }
+};
+
+class raystream_intersection_t : public raystream_common_t
+{
+public:
+    // results, written by the trace backend. for misses, the hit distance
+    // is the ray's max distance and the triinfo is null.
+    std::vector<float> _ray_hit_dist;
+    std::vector<hittype_t> _ray_hit_type;
+    std::vector<const triinfo *> _ray_hit_info;
+
+    inline raystream_intersection_t() = default;
+
+    inline raystream_intersection_t(size_t maxRays) { resize(maxRays); }
+
+    void resize(size_t size) override
+    {
+        _ray_hit_dist.resize(size);
+        _ray_hit_type.resize(size);
+        _ray_hit_info.resize(size);
+        raystream_common_t::resize(size);
+    }
+
+    inline void pushRay(int i, const qvec3d &origin, const qvec3d &dir, float dist, const qvec3f *color = nullptr,
+        const qvec3d *normalcontrib = nullptr)
+    {
+        pushRayCommon(i, origin, dir, dist, color, normalcontrib);
+        _ray_hit_dist[_numrays] = dist;
+        _ray_hit_type[_numrays] = hittype_t::NONE;
+        _ray_hit_info[_numrays] = nullptr;
+        _numrays++;
+    }
+
+    void tracePushedRaysIntersection(const modelinfo_t *self, int shadowmask);
+
+    inline float getPushedRayHitDist(size_t j) { return _ray_hit_dist[j]; }
+
+    inline hittype_t getPushedRayHitType(size_t j) { return _ray_hit_type[j]; }
+
+    // null for misses, and for hits on skip-textured bmodels
+    inline const triinfo *getPushedRayHitFaceInfo(size_t j) { return _ray_hit_info[j]; }
+};
+
+class raystream_occlusion_t : public raystream_common_t
+{
+public:
+    // result, written by the trace backend
+    std::vector<uint8_t> _ray_occluded;
+
+    inline raystream_occlusion_t() = default;
+
+    inline raystream_occlusion_t(size_t maxRays) { resize(maxRays); }
+
+    void resize(size_t size) override
+    {
+        _ray_occluded.resize(size);
+        raystream_common_t::resize(size);
+    }
+
+    inline void pushRay(int i, const qvec3d &origin, const qvec3d &dir, float dist, const qvec3f *color = nullptr,
+        const qvec3d *normalcontrib = nullptr)
+    {
+        pushRayCommon(i, origin, dir, dist, color, normalcontrib);
+        _ray_occluded[_numrays] = false;
+        _numrays++;
+    }
+
+    void tracePushedRaysOcclusion(const modelinfo_t *self, int shadowmask);
+
+    inline bool getPushedRayOccluded(size_t j) { return _ray_occluded[j]; }
+};
+
+// a set of triangles; triangle n is vertices 3n, 3n+1, 3n+2
+struct trace_geometry_t
+{
+    std::vector<qvec3f> vertices;
+    // one per triangle; empty for the skip geometry
+    std::vector<triinfo> triInfo;
+
+    inline size_t size() const { return vertices.size() / 3; }
+};
+
+// the shadow casting geometry of the bsp, as gathered by Trace_Init
+struct trace_scene_t
+{
+    trace_geometry_t sky; // sky. always occludes.
+    trace_geometry_t solid; // solids. always occludes.
+    trace_geometry_t filter; // conditional occluders; hits are decided by Trace_FilterHit
+    trace_geometry_t skip; // solid leafs of shadow casting skip-textured bmodels. always occludes.
+
+    // storage for the alpha micromaps of filter triangles
+    std::vector<uint64_t> micromaps;
+};
+
+/*
+ * ==============
+ * alpha micromaps
+ *
+ * A fence triangle is split into 4^level micro-triangles by subdividing its
+ * barycentric domain; each one is classified as opaque, transparent or unknown
+ * from the texels it can sample. Hits in opaque or transparent micro-triangles
+ * are decided without sampling the texture. States are packed 2 bits each.
+ * ==============
+ */
+
+enum class micromap_state_t : uint8_t
+{
+    UNKNOWN = 0, // mixed texels; sample the texture
+    OPAQUE = 1,
+    TRANSPARENT = 2
+};
+
+constexpr int MICROMAP_MAX_LEVEL = 5;
+
+// subdivision level giving micro-triangles of about 2 texels, up to MICROMAP_MAX_LEVEL
+int Micromap_LevelFor(const std::array<qvec3f, 3> &tri, const mtexinfo_t *texinfo, const img::texture *texture);
+constexpr size_t Micromap_NumWords(int level)
+{
+    return std::max<size_t>(1, (size_t(1) << (2 * level)) / 32);
+}
+// writes Micromap_NumWords(level) words to `out`
+void Micromap_Build(const std::array<qvec3f, 3> &tri, const mtexinfo_t *texinfo, const img::texture *texture,
+    int level, uint64_t *out);
+// state at barycentric (u, v), where the point is (1 - u - v) * v0 + u * v1 + v * v2
+micromap_state_t Micromap_State(const uint64_t *micromap, int level, float u, float v);
+
+class trace_backend_t
+{
+public:
+    virtual ~trace_backend_t() = default;
+
+    virtual const char *name() const = 0;
+
+    // finds the closest hit of each pushed ray
+    virtual void intersect(raystream_intersection_t &rs, const modelinfo_t *self, int shadowmask) = 0;
+
+    // finds whether anything blocks each pushed ray
+    virtual void occluded(raystream_occlusion_t &rs, const modelinfo_t *self, int shadowmask) = 0;
+
+    // bytes used by the backend's acceleration structures
+    virtual size_t memory_size() const = 0;
+};
+
+enum class tracer_t;
+
+void ResetTrace();
+// gathers the shadow casting geometry and builds the backend chosen by -tracer
+void Trace_Init(const mbsp_t *bsp);
+const trace_scene_t &Trace_Scene();
+trace_backend_t &Trace_Backend();
+// rays traced by raystreams on the calling thread so far
+uint64_t Trace_ThreadRayCount();
+std::unique_ptr<trace_backend_t> Trace_CreateBackend(tracer_t tracer, const trace_scene_t &scene);
+
+/*
+ * Decides whether a ray from `self` (traced with `shadowmask`) is blocked by
+ * its candidate hit on filter geometry triangle `tri`, `t` units along `dir`
+ * at barycentric (u, v). Records glass tint and dynamic shadow styles on `rs`
+ * (if not null) for the hits it lets through. `normal` is the triangle's
+ * geometric normal, (v1 - v0) x (v2 - v0); it need not be normalized.
+ */
+bool Trace_FilterHit(raystream_common_t *rs, unsigned rayIndex, const modelinfo_t *self, int shadowmask,
+    const triinfo &tri, const qvec3f &origin, const qvec3f &dir, float t, float u, float v, const qvec3f &normal);
@@ -0,0 +1,98 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <light/trace.hh>
+
+#include <common/aligned_allocator.hh>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+ * ==============
+ * bvh_t
+ *
+ * Triangle BVH used by -tracer bvh. Built top-down with binned SAH into a
+ * binary tree, which is then collapsed into 4-wide nodes so a ray can test
+ * all four child boxes at once (SSE when available). Rays are traversed in
+ * packets of up to packet_size rays sharing one stack of (node, ray mask).
+ * ==============
+ */
+class bvh_t
+{
+public:
+    static constexpr int width = 4;
+    static constexpr int packet_size = 8;
+    static constexpr uint32_t no_hit = UINT32_MAX;
+
+    struct alignas(16) node_t
+    {
+        // child bounds, one lane per child: min x/y/z then max x/y/z.
+        // empty lanes have inverted bounds, so no ray enters them
+        float bounds[6][width];
+        // >= 0: inner node index; < 0: leaf holding triangles ~child .. ~child + count - 1
+        int32_t child[width];
+        uint32_t count[width];
+    };
+
+    struct triangle_t
+    {
+        qvec3f v0, e1, e2; // e1 = v1 - v0, e2 = v2 - v0
+        uint32_t id; // index of the triangle in the vertices passed to build()
+    };
+
+    struct ray_packet_t
+    {
+        int count = 0;
+        qvec3f origin[packet_size];
+        qvec3f dir[packet_size]; // can be un-normalized
+        // in: max distance; out: distance to the closest accepted hit (intersect only)
+        float tfar[packet_size];
+        // out: id of the accepted triangle, or no_hit
+        uint32_t hit[packet_size];
+    };
+
+    // decides whether ray `ray` of the packet is stopped by candidate hit `tri` at distance `t`
+    // and barycentric (u, v)
+    using filter_t = bool (*)(void *ctx, int ray, const triangle_t &tri, float t, float u, float v);
+
+private:
+    aligned_vector<node_t> nodes;
+    std::vector<triangle_t> triangles;
+
+    template<bool any_hit>
+    void traverse(ray_packet_t &packet, filter_t filter, void *ctx) const;
+
+public:
+    // triangle n is vertices 3n, 3n+1, 3n+2
+    void build(const std::vector<qvec3f> &vertices);
+
+    // closest accepted hit per ray. `filter` may be null to accept every hit
+    void intersect(ray_packet_t &packet, filter_t filter = nullptr, void *ctx = nullptr) const;
+    // any accepted hit per ray; traversal of a ray stops at its first one
+    void occluded(ray_packet_t &packet, filter_t filter = nullptr, void *ctx = nullptr) const;
+
+    inline size_t num_nodes() const { return nodes.size(); }
+    size_t memory_size() const;
+};
+
+std::unique_ptr<trace_backend_t> BVH_CreateBackend(const trace_scene_t &scene);
@@ -37,6 +37,8 @@
 #include <shared_mutex>
 #include <string_view>
 
+struct pipeline_data_t;
+
 struct mapface_t
 {
     size_t planenum;
@@ -275,6 +277,10 @@ struct mapdata_t
 
     int skip_texinfo;
 
+    // when compiling in-memory (qbsp_main overload taking a pipeline_data_t), the
+    // .bsp, .prt and .texinfo.json outputs are handed over here instead of written
+    pipeline_data_t *pipeline = nullptr;
+
     mapentity_t &world_entity();
     bool is_world_entity(const mapentity_t &entity);
 
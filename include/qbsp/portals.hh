@@ -26,7 +26,11 @@
 #include <qbsp/qbsp.hh>
 
 #include <atomic>
+#include <cstdint>
 #include <memory>
+#include <vector>
+
+#include <tbb/scalable_allocator.h>
 
 struct side_t;
 struct tree_t;
@@ -51,6 +55,7 @@ struct portal_t
 };
 
 // helper used for building the portals in paralllel.
+// move-only; fragments are moved between the buffers of MakeTreePortals_r, never copied.
 struct buildportal_t
 {
     qbsp_plane_t plane;
@@ -59,11 +64,37 @@ struct buildportal_t
     // .front/.back side of planenum
     twosided<node_t *> nodes = {nullptr, nullptr};
     winding_t winding;
+
+    buildportal_t() = default;
+    buildportal_t(buildportal_t &&) noexcept = default;
+    buildportal_t &operator=(buildportal_t &&) noexcept = default;
+    buildportal_t(const buildportal_t &) = delete;
+    buildportal_t &operator=(const buildportal_t &) = delete;
+};
+
+// contiguous buffer of portal fragments. each task of MakeTreePortals_r appends
+// to its own buffer; the scalable allocator keeps the buffers in per-thread pools.
+using buildportal_list_t = std::vector<buildportal_t, tbb::scalable_allocator<buildportal_t>>;
+
+// peak memory held by portal fragments while building portals.
+// updated once per node, not once per fragment
+struct buildportal_memory_t
+{
+    std::atomic_size_t fragments_created = 0;
+    std::atomic_int64_t live_fragments = 0;
+    std::atomic_int64_t live_points = 0;
+    std::atomic_int64_t peak_fragments = 0;
+    std::atomic_int64_t peak_bytes = 0;
+
+    void add(int64_t created, int64_t fragments, int64_t points);
+    void print_memory_stats() const;
 };
 
 struct portalstats_t : logging::stat_tracker_t
 {
     stat &c_tinyportals = register_stat("tiny portals");
+
+    buildportal_memory_t memory;
 };
 
 contentflags_t ClusterContents(const node_t *node);
@@ -74,10 +105,10 @@ enum class portaltype_t
     TREE,
     VIS
 };
-std::list<buildportal_t> MakeTreePortals_r(node_t *node, portaltype_t type, std::list<buildportal_t> boundary_portals,
-    portalstats_t &stats, logging::percent_clock &clock);
+void MakeTreePortals_r(node_t *node, portaltype_t type, buildportal_list_t boundary_portals,
+    buildportal_list_t &result, portalstats_t &stats, logging::percent_clock &clock);
 void MakeTreePortals(tree_t &tree);
-std::list<buildportal_t> MakeHeadnodePortals(tree_t &tree);
-void MakePortalsFromBuildportals(tree_t &tree, std::list<buildportal_t> &buildportals);
+buildportal_list_t MakeHeadnodePortals(tree_t &tree);
+void MakePortalsFromBuildportals(tree_t &tree, buildportal_list_t &buildportals, portalstats_t &stats);
 void EmitAreaPortals(node_t *headnode);
 void MarkVisibleSides(tree_t &tree, bspbrush_t::container &brushes);
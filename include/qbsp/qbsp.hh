@@ -207,7 +207,9 @@ public:
     setting_scalar worldextent;
     setting_int32 leakdist;
     setting_bool forceprt1;
+    setting_bool binaryprt;
     setting_tjunc tjunc;
+    setting_bool oldtjuncsearch;
     setting_bool objexport;
     setting_bool noextendedsurfflags;
     setting_bool wrbrushes;
@@ -421,6 +423,7 @@ struct node_t
                           // portals used to write leak lines that take the shortest path to the void
     int occupied; // 0=can't reach entity, 1 = has entity, >1 = distance from leaf with entity
     mapentity_t *occupant; // example occupant, for leak hunting
+    uint32_t leafgraph_index; // index in tree_t::leafgraph, leafs only
     bool detail_separator; // for vis portal generation. true if ALL faces on node, and on all descendant nodes/leafs,
                            // are detail.
     uint32_t firstleafbrush; // Q2
@@ -430,9 +433,12 @@ struct node_t
     bspbrush_t::container bsp_brushes;
 };
 
+struct pipeline_data_t;
+
 void InitQBSP(int argc, const char **argv);
 void InitQBSP(const std::vector<std::string> &args);
 void CountLeafs(node_t *headnode);
 void ProcessFile();
 
 int qbsp_main(int argc, const char **argv);
+int qbsp_main(const std::vector<std::string> &args, pipeline_data_t &pipeline);
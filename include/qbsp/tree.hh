@@ -26,7 +26,10 @@
 
 #include <common/qvec.hh>
 
+#include <algorithm>
+#include <cstddef>
 #include <memory>
+#include <new>
 #include <vector>
 
 #include <tbb/concurrent_vector.h>
@@ -36,6 +39,96 @@ struct tree_t;
 
 void FreeTreePortals(tree_t &tree);
 
+// slab allocator for objects owned by a tree_t. objects are constructed in
+// fixed-size blocks that are kept across clear() calls, so rebuilding the
+// portals for every hull reuses the same memory instead of doing one heap
+// allocation (and one free) per object. pointers stay valid until clear().
+//
+// not thread-safe; T only needs to be complete where the members are used.
+template<typename T, size_t slab_size = 1024>
+class tree_pool_t
+{
+    std::vector<std::unique_ptr<std::byte[]>> slabs;
+    size_t live = 0;
+    size_t peak = 0;
+    size_t allocations = 0;
+
+    T *slot(size_t i) const
+    {
+        return reinterpret_cast<T *>(slabs[i / slab_size].get() + (i % slab_size) * sizeof(T));
+    }
+
+public:
+    tree_pool_t() = default;
+    tree_pool_t(const tree_pool_t &) = delete;
+    tree_pool_t &operator=(const tree_pool_t &) = delete;
+
+    ~tree_pool_t() { clear(); }
+
+    T *create()
+    {
+        static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+        if (live == slabs.size() * slab_size) {
+            slabs.emplace_back(new std::byte[slab_size * sizeof(T)]);
+        }
+
+        T *object = new (slot(live)) T{};
+        live++;
+        allocations++;
+        peak = std::max(peak, live);
+        return object;
+    }
+
+    // destroys every object, but keeps the slabs for reuse
+    void clear()
+    {
+        for (size_t i = 0; i < live; i++) {
+            std::launder(slot(i))->~T();
+        }
+        live = 0;
+    }
+
+    // calls f(const T &) for every live object, in creation order
+    template<typename F>
+    void for_each(F &&f) const
+    {
+        for (size_t i = 0; i < live; i++) {
+            f(*std::launder(slot(i)));
+        }
+    }
+
+    size_t size() const { return live; }
+    size_t peak_size() const { return peak; }
+    // high-water mark of the memory used by live objects (not counting memory they own)
+    size_t peak_bytes() const { return peak * sizeof(T); }
+    size_t total_allocations() const { return allocations; }
+    size_t reserved_bytes() const { return slabs.size() * slab_size * sizeof(T); }
+};
+
+// portal adjacency of the leafs of a tree in compressed sparse row form, so the
+// flood fills in outside.cc walk flat arrays instead of the portal lists. only
+// portals between two leafs are included (not those to outside_node). built on
+// first use after MakeTreePortals and cleared with the portals.
+struct leaf_graph_t
+{
+    std::vector<node_t *> leafs; // node_t::leafgraph_index indexes this
+    // the edges of leafs[i] are [offsets[i], offsets[i + 1]), in node_t::portals order
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> neighbours; // leaf index on the other side of each edge
+    std::vector<portal_t *> portals;
+
+    inline bool empty() const { return leafs.empty(); }
+
+    inline void clear()
+    {
+        leafs.clear();
+        offsets.clear();
+        neighbours.clear();
+        portals.clear();
+    }
+};
+
 struct tree_t
 {
     node_t *headnode = nullptr;
@@ -43,7 +136,12 @@ struct tree_t
     aabb3d bounds;
 
     // here for ownership/memory management - not intended to be iterated directly
-    std::vector<std::unique_ptr<portal_t>> portals;
+    tree_pool_t<portal_t> portals;
+    // high-water mark of the portal winding points, measured whenever the portals are freed
+    size_t peak_portal_winding_bytes = 0;
+
+    // see leaf_graph_t; valid while the portals are
+    leaf_graph_t leafgraph;
 
     // here for ownership/memory management - not intended to be iterated directly
     //
@@ -51,7 +149,7 @@ struct tree_t
     // promises not to move elements so we can omit the std::unique_ptr wrapper.
     tbb::concurrent_vector<node_t> nodes;
 
-    // creates a new portal owned by `this` (stored in the `portals` vector) and
+    // creates a new portal owned by `this` (stored in the `portals` pool) and
     // returns a raw pointer to it
     portal_t *create_portal();
 
@@ -59,8 +157,18 @@ struct tree_t
     // returns a raw pointer to it
     node_t *create_node();
 
+    tree_t() = default;
+    // defined in tree.cc, where portal_t is complete
+    ~tree_t();
+
     // reset the tree without clearing allocated vector space
     void clear();
+
+    // bytes of winding points held by the live portals
+    size_t portal_winding_bytes() const;
+
+    // prints node/portal counts and memory use; called after each hull is built
+    void print_memory_stats() const;
 };
 
 void PruneNodes(node_t *node);
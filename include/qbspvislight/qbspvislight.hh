@@ -0,0 +1,54 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+struct pipeline_data_t;
+
+/*
+ * Runs qbsp, then optionally vis and light, handing the bsp, portals and
+ * extended texinfo flags from one stage to the next in memory.
+ *
+ * qbspvislight [qbsp options] [-vis [vis options]] [-light [light options]] mapname
+ *
+ * Only the final .bsp (plus whatever side files the stages write, e.g. .lit,
+ * .pts) ends up on disk.
+ */
+int qbspvislight_main(int argc, const char **argv);
+
+// `qbspvislight -server`: compiles maps on request, reading JSON requests from
+// `in` and writing responses to `out` (see qbspvislight.cc for the protocol).
+// Texture archives, decoded textures and the embree device stay loaded
+// between requests. Returns when `in` ends or on a "quit" request.
+int qbspvislight_server(std::istream &in, std::ostream &out);
+
+// splits `args` (without the exe path, with the map name last) into the
+// argument lists for each stage. vis/light args are left empty if the
+// stage wasn't requested.
+struct qbspvislight_args_t
+{
+    std::vector<std::string> qbsp, vis, light;
+    bool run_vis = false, run_light = false;
+};
+
+qbspvislight_args_t SplitQbspVisLightArgs(const std::vector<std::string> &args);
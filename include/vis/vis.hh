@@ -289,5 +289,9 @@ public:
 
 extern settings::vis_settings vis_options;
 
+struct pipeline_data_t;
+
 int vis_main(int argc, const char **argv);
 int vis_main(const std::vector<std::string> &args);
+// runs on the bsp and portals in `pipeline` and leaves the result there; see common/pipeline.hh
+int vis_main(const std::vector<std::string> &args, pipeline_data_t &pipeline);
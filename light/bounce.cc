@@ -27,7 +27,7 @@
 #include <light/entities.hh> // for EstimateVisibleBoundsAtPoint
 #include <light/ltface.hh>
 #include <light/surflight.hh>
-#include <light/trace.hh> // for Light_PointInLeaf
+#include <light/trace.hh> // for Light_PointsInLeafs
 
 #include <common/polylib.hh>
 #include <common/bsputils.hh>
@@ -38,6 +38,7 @@
 
 #include <common/qvec.hh>
 #include <common/parallel.hh>
+#include <common/profile.hh>
 
 static bool Face_ShouldBounce(const mbsp_t *bsp, const mface_t *face)
 {
@@ -115,10 +116,11 @@ static void MakeBounceLight(const mbsp_t *bsp, const settings::worldspawn_keys &
             l->bounds = EstimateVisibleBoundsAtPoint(facemidpoint);
         }
 
-        for (auto &pt : l->points) {
-            if (light_options.visapprox.value() == visapprox_t::VIS) {
-                l->leaves.push_back(Light_PointInLeaf(bsp, pt));
-            } else if (light_options.visapprox.value() == visapprox_t::RAYS) {
+        if (light_options.visapprox.value() == visapprox_t::VIS) {
+            l->leaves.resize(l->points.size());
+            Light_PointsInLeafs(bsp, l->points, l->leaves);
+        } else if (light_options.visapprox.value() == visapprox_t::RAYS) {
+            for (auto &pt : l->points) {
                 l->bounds += EstimateVisibleBoundsAtPoint(pt);
             }
         }
@@ -170,7 +172,7 @@ static bool MakeBounceLightsThread(const settings::worldspawn_keys &cfg, const m
     // grab the average color across the whole set of lightmaps for this face.
     // this doesn't change regardless of the above settings.
     std::unordered_map<int, qvec3d> sum;
-    vec_t sample_divisor = surf.lightmapsByStyle.front().samples.size();
+    vec_t sample_divisor = surf.lightmapsByStyle.front().size();
 
     bool has_any_color = false;
 
@@ -238,6 +240,7 @@ static bool MakeBounceLightsThread(const settings::worldspawn_keys &cfg, const m
 bool MakeBounceLights(const settings::worldspawn_keys &cfg, const mbsp_t *bsp, size_t depth)
 {
     logging::funcheader();
+    PROFILE_ZONE("MakeBounceLights", "depth", depth);
 
     std::atomic_bool any_to_bounce = false;
 
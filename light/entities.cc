@@ -22,6 +22,7 @@
 #include <algorithm>
 #include <cstring>
 #include <fstream>
+#include <map>
 #include <common/imglib.hh> // for img::find
 #include <common/log.hh>
 #include <common/cmdlib.hh>
@@ -29,13 +30,13 @@
 
 #include <light/litfile.hh>
 #include <light/trace.hh>
-#include <light/trace_embree.hh>
 #include <light/light.hh>
 #include <common/bsputils.hh>
 #include <common/parallel.hh>
 
 static std::vector<std::unique_ptr<light_t>> all_lights;
 static std::vector<sun_t> all_suns;
+static std::vector<sky_sample_dir_t> sky_sample_dirs;
 static std::vector<entdict_t> entdicts;
 static std::vector<entdict_t> radlights;
 static std::vector<std::pair<std::string, int>> lightstyleForTargetname;
@@ -50,6 +51,7 @@ void ResetLightEntities()
 {
     all_lights.clear();
     all_suns.clear();
+    sky_sample_dirs.clear();
     entdicts.clear();
     radlights.clear();
 
@@ -75,6 +77,11 @@ std::vector<sun_t> &GetSuns()
     return all_suns;
 }
 
+const std::vector<sky_sample_dir_t> &GetSkySampleDirs()
+{
+    return sky_sample_dirs;
+}
+
 std::vector<entdict_t> &GetRadLights()
 {
     return radlights;
@@ -377,7 +384,7 @@ static bool Dirt_ResolveFlag(const settings::worldspawn_keys &cfg, int dirtInt)
  * =============
  */
 static void AddSun(const settings::worldspawn_keys &cfg, const qvec3d &sunvec, vec_t light, const qvec3d &color,
-    int dirtInt, vec_t sun_anglescale, const int style, const std::string &suntexture)
+    int dirtInt, vec_t sun_anglescale, const int style, const std::string &suntexture, bool sky_sample = false)
 {
     if (light == 0.0f)
         return;
@@ -395,6 +402,7 @@ static void AddSun(const settings::worldspawn_keys &cfg, const qvec3d &sunvec, v
         sun.suntexture_value = img::find(suntexture);
     else
         sun.suntexture_value = nullptr;
+    sun.sky_sample = sky_sample;
     // fmt::print( "sun is using vector {} {} {} light {} color {} {} {} anglescale {} dirt {} resolved to {}\n",
     //  sun->sunvec[0], sun->sunvec[1], sun->sunvec[2], sun->sunlight.light,
     //  sun->sunlight.color[0], sun->sunlight.color[1], sun->sunlight.color[2],
@@ -458,7 +466,7 @@ static void SetupSun(const settings::worldspawn_keys &cfg, vec_t light, const qv
 
         // fmt::print( "sun {} is using vector {} {} {}\n", i, direction[0], direction[1], direction[2]);
 
-        AddSun(cfg, direction, light, color, sunlight_dirt, sun_anglescale, style, suntexture);
+        AddSun(cfg, direction, light, color, sunlight_dirt, sun_anglescale, style, suntexture, sun_num_samples > 1);
     }
 }
 
@@ -558,7 +566,7 @@ static void SetupSkyDome(const settings::worldspawn_keys &cfg, vec_t upperLight,
             /* insert top hemisphere light */
             if (sunlight2value > 0) {
                 AddSun(cfg, direction, sunlight2value, upperColor, upperDirt, upperAnglescale, upperStyle,
-                    upperSuntexture);
+                    upperSuntexture, true);
             }
 
             direction[2] = -direction[2];
@@ -566,7 +574,7 @@ static void SetupSkyDome(const settings::worldspawn_keys &cfg, vec_t upperLight,
             /* insert bottom hemisphere light */
             if (sunlight3value > 0) {
                 AddSun(cfg, direction, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle,
-                    lowerSuntexture);
+                    lowerSuntexture, true);
             }
 
             /* move */
@@ -580,13 +588,13 @@ static void SetupSkyDome(const settings::worldspawn_keys &cfg, vec_t upperLight,
 
     /* create vertical sun */
     if (sunlight2value > 0) {
-        AddSun(
-            cfg, {0.0, 0.0, -1.0}, sunlight2value, upperColor, upperDirt, upperAnglescale, upperStyle, upperSuntexture);
+        AddSun(cfg, {0.0, 0.0, -1.0}, sunlight2value, upperColor, upperDirt, upperAnglescale, upperStyle,
+            upperSuntexture, true);
     }
 
     if (sunlight3value > 0) {
-        AddSun(
-            cfg, {0.0, 0.0, 1.0}, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle, lowerSuntexture);
+        AddSun(cfg, {0.0, 0.0, 1.0}, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle,
+            lowerSuntexture, true);
     }
 }
 
@@ -617,6 +625,41 @@ static void SetupSkyDomes(const settings::worldspawn_keys &cfg)
     }
 }
 
+/*
+ * =============
+ * SetupSkySampleDirs
+ *
+ * With -skysamples, groups the skydome/penumbra suns by direction, so
+ * that a single sky ray per sample point can be shared by every sun along
+ * it. Must be called after all suns are created, since it holds pointers
+ * into all_suns.
+ * =============
+ */
+static void SetupSkySampleDirs()
+{
+    if (!light_options.skysamples.value()) {
+        return;
+    }
+
+    std::map<qvec3d, size_t> dir_index;
+
+    for (const sun_t &sun : all_suns) {
+        if (!sun.sky_sample)
+            continue;
+
+        const qvec3d incoming = qv::normalize(sun.sunvec);
+        auto [it, inserted] = dir_index.try_emplace(incoming, sky_sample_dirs.size());
+        if (inserted) {
+            sky_sample_dirs.push_back({incoming, {}});
+        }
+        sky_sample_dirs[it->second].suns.push_back(&sun);
+    }
+
+    if (!sky_sample_dirs.empty()) {
+        logging::print("{} sky sample directions\n", sky_sample_dirs.size());
+    }
+}
+
 /*
  * =============
  * DuplicateEntity
@@ -1193,6 +1236,7 @@ void SetupLights(const settings::worldspawn_keys &cfg, const mbsp_t *bsp)
     SetupSpotlights(bsp, cfg);
     SetupSuns(cfg);
     SetupSkyDomes(cfg);
+    SetupSkySampleDirs();
     FixLightsOnFaces(bsp);
     if (light_options.visapprox.value() == visapprox_t::RAYS) {
         EstimateLightVisibility();
@@ -30,7 +30,7 @@
 #include <light/entities.hh>
 #include <light/ltface.hh>
 #include <light/litfile.hh> // for facesup_t
-#include <light/trace_embree.hh>
+#include <light/trace.hh>
 
 #include <common/log.hh>
 #include <common/bsputils.hh>
@@ -38,6 +38,9 @@
 #include <common/fs.hh>
 #include <common/imglib.hh>
 #include <common/parallel.hh>
+#include <common/pipeline.hh>
+#include <common/profile.hh>
+#include <common/statsjson.hh>
 #include <common/ostream.hh>
 
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
@@ -50,6 +53,8 @@
 #include <map>
 #include <set>
 #include <algorithm>
+#include <array>
+#include <limits>
 #include <mutex>
 #include <string>
 
@@ -94,33 +99,14 @@ bool IsOutputtingSupplementaryData()
     return !faces_sup.empty();
 }
 
-/// start of lightmap data
+/// lightmap data; sized exactly by AllocateFileSpace
 std::vector<uint8_t> filebase;
-/// offset of start of free space after data (should be kept a multiple of 4)
-static int file_p;
-/// offset of end of free space for lightmap data
-static int file_end;
-
-/// start of litfile data
+/// litfile data (3 bytes per sample)
 std::vector<uint8_t> lit_filebase;
-/// offset of start of free space after litfile data (should be kept a multiple of 12)
-static int lit_file_p;
-/// offset of end of space for litfile data
-static int lit_file_end;
-
-/// start of litfile data
-uint32_t *hdr_filebase;
-/// offset of start of free space after litfile data (should be kept a multiple of 12)
-static int hdr_file_p;
-/// offset of end of space for litfile data
-static int hdr_file_end;
-
-/// start of luxfile data
+/// hdr litfile data (one packed value per sample)
+std::vector<uint32_t> hdr_filebase;
+/// luxfile data (3 bytes per sample)
 std::vector<uint8_t> lux_filebase;
-/// offset of start of free space after luxfile data (should be kept a multiple of 12)
-static int lux_file_p;
-/// offset of end of space for luxfile data
-static int lux_file_end;
 
 static std::unordered_map<int, std::vector<uint8_t>> all_uncompressed_vis;
 
@@ -317,6 +303,9 @@ light_settings::light_settings()
       novanilla{this, "novanilla", false, &experimental_group, "implies -bspxlit; don't write vanilla lighting"},
       gate{this, "gate", LIGHT_EQUAL_EPSILON, &performance_group, "cutoff lights at this brightness level"},
       sunsamples{this, "sunsamples", 64, 8, 2048, &performance_group, "set samples for _sunlight2, default 64"},
+      skysamples{this, "skysamples", 0, 0, 2048, &performance_group,
+          "max sky directions traced per face for _sunlight2/3 and sun penumbra; importance sampled, 0 = light each "
+          "sun on its own"},
       arghradcompat{this, "arghradcompat", false, &output_group, "enable compatibility for Arghrad-specific keys"},
       nolighting{this, "nolighting", false, &output_group, "don't output main world lighting (Q2RTX)"},
       debugface{this, "debugface", std::numeric_limits<vec_t>::quiet_NaN(), std::numeric_limits<vec_t>::quiet_NaN(),
@@ -332,6 +321,22 @@ light_settings::light_settings()
           this, "lightmap_scale", 0, &experimental_group, "force change lightmap scale; vanilla engines only allow 16"},
       extra{
           this, {"extra", "extra4"}, 1, &performance_group, "supersampling; 2x2 (extra) or 4x4 (extra4) respectively"},
+      adaptiveextra{this, "adaptiveextra", false, &performance_group,
+          "with -extra/-extra4, only supersample luxels on edges or with contrast against their neighbours"},
+      adaptiveextra_threshold{this, "adaptiveextra_threshold", 0.05, 0.0, 1.0, &performance_group,
+          "relative brightness difference between neighbouring luxels that -adaptiveextra supersamples"},
+      compactlightmaps{this, "compactlightmaps", false, &performance_group,
+          "keep lightmaps sparse (and half-float once final) between lighting stages to save memory"},
+      tracer{this, "tracer",
+#ifdef HAVE_EMBREE
+          tracer_t::EMBREE,
+#else
+          tracer_t::BVH,
+#endif
+          {{"embree", tracer_t::EMBREE}, {"bvh", tracer_t::BVH}}, &performance_group,
+          "ray tracing backend. embree = Intel Embree, bvh = built-in 4-wide BVH"},
+      alphamicromaps{this, "alphamicromaps", true, &performance_group,
+          "precompute per-triangle opacity of fence textures, so most fence hits don't sample the texture"},
       emissivequality{this, "emissivequality", emissivequality_t::LOW,
           {{"LOW", emissivequality_t::LOW}, {"MEDIUM", emissivequality_t::MEDIUM}, {"HIGH", emissivequality_t::HIGH}},
           &performance_group,
@@ -375,6 +380,10 @@ light_settings::light_settings()
           "distance between lightgrid sample points, in world units. controls lightgrid size."},
       lightgrid_format{this, "lightgrid_format", lightgrid_format_t::OCTREE, {{"octree", lightgrid_format_t::OCTREE}},
           &experimental_group, "lightgrid BSPX lump to use"},
+      lightgrid_adaptive{this, "lightgrid_adaptive", false, &experimental_group,
+          "only fully evaluate lightgrid points where neighbouring samples differ; interpolate the rest"},
+      lightgrid_adaptive_threshold{this, "lightgrid_adaptive_threshold", 2.0, 0.0, 255.0, &experimental_group,
+          "with -lightgrid_adaptive, maximum per-channel difference (0..255) between any two cell corners for the cell to be interpolated"},
 
       dirtdebug{this, {"dirtdebug", "debugdirt"},
           [&](source) {
@@ -561,61 +570,58 @@ void FixupGlobalSettings()
     }
 }
 
-static std::mutex light_mutex;
-
 /*
- * Return space for the lightmap and colourmap at the same time so it can
- * be done in a thread-safe manner.
- *
- * size is the number of greyscale pixels = number of bytes to allocate
- * and return in *lightdata
+ * Sizes the output buffers for `size` greyscale samples of lightmap data.
+ * Called once all faces have been planned, so the buffers are exactly as
+ * large as the map needs.
  */
-void GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint32_t **hdrdata, uint8_t **deluxdata, int size)
+void AllocateFileSpace(const mbsp_t *bsp, size_t size)
 {
-    light_mutex.lock();
-
-    *lightdata = *colordata = *deluxdata = nullptr;
+    filebase.clear();
+    lit_filebase.clear();
+    hdr_filebase.clear();
+    lux_filebase.clear();
 
-    if (!filebase.empty()) {
-        *lightdata = filebase.data() + file_p;
-    }
-    if (!lit_filebase.empty()) {
-        *colordata = lit_filebase.data() + lit_file_p;
-    }
-    if (!lit_filebase.empty()) {
-        *hdrdata = hdr_filebase.data() + hdr_file_p;
+    if (!bsp->loadversion->game->has_rgb_lightmap) {
+        /* greyscale data stored in a separate buffer */
+        filebase.resize(size);
     }
-    if (!lux_filebase.empty()) {
-        *deluxdata = lux_filebase.data() + lux_file_p;
+
+    if (bsp->loadversion->game->has_rgb_lightmap || light_options.write_litfile) {
+        /* litfile data stored in a separate buffer */
+        lit_filebase.resize(size * 3);
     }
 
-    // if size isn't a multiple of 4, round up to the next multiple of 4
-    if ((size % 4) != 0) {
-        size += (4 - (size % 4));
+    if (light_options.write_luxfile) {
+        /* lux data stored in a separate buffer */
+        lux_filebase.resize(size * 3);
     }
+}
+
+/*
+ * Return the space for the lightmap and colourmap at `offset`, in greyscale
+ * samples. Offsets are assigned in face order before any face is written,
+ * so this needs no locking.
+ */
+void GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint32_t **hdrdata, uint8_t **deluxdata, int offset)
+{
+    Q_assert(offset >= 0);
+
+    *lightdata = *colordata = *deluxdata = nullptr;
+    *hdrdata = nullptr;
 
-    // increment the next writing offsets, aligning them to 4 uint8_t boundaries (file_p)
-    // and 12-uint8_t boundaries (lit_file_p/lux_file_p)
     if (!filebase.empty()) {
-        file_p += size;
+        *lightdata = filebase.data() + offset;
     }
     if (!lit_filebase.empty()) {
-        lit_file_p += 3 * size;
+        *colordata = lit_filebase.data() + (offset * 3);
     }
     if (!hdr_filebase.empty()) {
-        hdr_file_p += size;
+        *hdrdata = hdr_filebase.data() + offset;
     }
     if (!lux_filebase.empty()) {
-        lux_file_p += 3 * size;
+        *deluxdata = lux_filebase.data() + (offset * 3);
     }
-
-    light_mutex.unlock();
-
-    if (file_p > file_end)
-        FError("overrun");
-
-    if (lit_file_p > lit_file_end)
-        FError("overrun");
 }
 
 /**
@@ -627,6 +633,9 @@ void GetFileSpace_PreserveOffsetInBsp(uint8_t **lightdata, uint8_t **colordata,
     Q_assert(lightofs >= 0);
 
     *lightdata = *colordata = *deluxdata = nullptr;
+    if (hdrdata) {
+        *hdrdata = nullptr;
+    }
 
     if (!filebase.empty()) {
         *lightdata = filebase.data() + lightofs;
@@ -643,8 +652,6 @@ void GetFileSpace_PreserveOffsetInBsp(uint8_t **lightdata, uint8_t **colordata,
     if (deluxdata && !lux_filebase.empty()) {
         *deluxdata = lux_filebase.data() + (lightofs * 3);
     }
-
-    // NOTE: file_p et. al. are not updated, since we're not dynamically allocating the lightmaps
 }
 
 const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum)
@@ -753,7 +760,11 @@ static void CreateLightmapSurfaces(mbsp_t *bsp)
 static void SaveLightmapSurfaces(mbsp_t *bsp)
 {
     logging::funcheader();
-    logging::parallel_for(static_cast<size_t>(0), bsp->dfaces.size(), [&bsp](size_t i) {
+
+    // up to two outputs per face (vanilla + LMSCALE, or decoupled + its vanilla lightmap)
+    std::vector<std::array<lightmap_output_t, 2>> outputs(bsp->dfaces.size());
+
+    logging::parallel_for(static_cast<size_t>(0), bsp->dfaces.size(), [&bsp, &outputs](size_t i) {
         auto &surf = light_surfaces[i];
 
         if (!surf || surf->samples.empty()) {
@@ -766,24 +777,62 @@ static void SaveLightmapSurfaces(mbsp_t *bsp)
         const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, i);
 
         if (!facesup_decoupled_global.empty()) {
-            SaveLightmapSurface(
+            outputs[i][0] = PlanLightmapSurface(
                 bsp, f, nullptr, &facesup_decoupled_global[i], surf.get(), surf->extents, surf->extents);
         } else if (faces_sup.empty()) {
-            SaveLightmapSurface(bsp, f, nullptr, nullptr, surf.get(), surf->extents, surf->extents);
+            outputs[i][0] = PlanLightmapSurface(bsp, f, nullptr, nullptr, surf.get(), surf->extents, surf->extents);
         } else if (light_options.novanilla.value() || faces_sup[i].lmscale == face_modelinfo->lightmapscale) {
             if (faces_sup[i].lmscale == face_modelinfo->lightmapscale) {
                 f->lightofs = faces_sup[i].lightofs;
             } else {
                 f->lightofs = -1;
             }
-            SaveLightmapSurface(bsp, f, &faces_sup[i], nullptr, surf.get(), surf->extents, surf->extents);
+            outputs[i][0] =
+                PlanLightmapSurface(bsp, f, &faces_sup[i], nullptr, surf.get(), surf->extents, surf->extents);
             for (int j = 0; j < MAXLIGHTMAPS; j++) {
                 f->styles[j] =
                     faces_sup[i].styles[j] == INVALID_LIGHTSTYLE ? INVALID_LIGHTSTYLE_OLD : faces_sup[i].styles[j];
             }
         } else {
-            SaveLightmapSurface(bsp, f, nullptr, nullptr, surf.get(), surf->extents, surf->vanilla_extents);
-            SaveLightmapSurface(bsp, f, &faces_sup[i], nullptr, surf.get(), surf->extents, surf->extents);
+            outputs[i][0] =
+                PlanLightmapSurface(bsp, f, nullptr, nullptr, surf.get(), surf->extents, surf->vanilla_extents);
+            outputs[i][1] =
+                PlanLightmapSurface(bsp, f, &faces_sup[i], nullptr, surf.get(), surf->extents, surf->extents);
+        }
+    });
+
+    if (light_options.litonly.value()) {
+        // offsets come from the bsp being relit
+        AllocateFileSpace(bsp, bsp->dlightdata.size());
+    } else {
+        // assign offsets in face order; keeps the layout independent of thread count.
+        // each allocation is rounded up to a multiple of 4 samples, as before
+        auto align = [](int size) { return (size + 3) & ~3; };
+        size_t total = 0;
+
+        for (auto &face_outputs : outputs) {
+            for (lightmap_output_t &output : face_outputs) {
+                if (output.size) {
+                    output.offset = total;
+                    total += align(output.size);
+                }
+                if (output.vanilla_size) {
+                    output.vanilla_offset = total;
+                    total += align(output.vanilla_size);
+                }
+            }
+        }
+
+        if (total > std::numeric_limits<int32_t>::max() / 3) {
+            FError("lightmap data too large ({} samples)", total);
+        }
+
+        AllocateFileSpace(bsp, total);
+    }
+
+    logging::parallel_for(static_cast<size_t>(0), bsp->dfaces.size(), [&bsp, &outputs](size_t i) {
+        for (const lightmap_output_t &output : outputs[i]) {
+            SaveLightmapSurface(bsp, output);
         }
     });
 }
@@ -869,11 +918,6 @@ static void FindModelInfo(const mbsp_t *bsp)
     Q_assert(modelinfo.size() == bsp->dmodels.size());
 }
 
-// FIXME: in theory can't we calculate the exact amount of
-// storage required? we'd have to expand it by 4 to account for
-// lightstyles though
-static constexpr size_t MAX_MAP_LIGHTING = 0x8000000;
-
 /*
  * =============
  *  LightWorld
@@ -882,34 +926,17 @@ static constexpr size_t MAX_MAP_LIGHTING = 0x8000000;
 static void LightWorld(bspdata_t *bspdata, bool forcedscale)
 {
     logging::funcheader();
+    PROFILE_ZONE("LightWorld");
 
     mbsp_t &bsp = std::get<mbsp_t>(bspdata->bsp);
 
     light_surfaces.clear();
     filebase.clear();
     lit_filebase.clear();
+    hdr_filebase.clear();
     lux_filebase.clear();
 
-    if (!bsp.loadversion->game->has_rgb_lightmap) {
-        /* greyscale data stored in a separate buffer */
-        filebase.resize(MAX_MAP_LIGHTING);
-        file_p = 0;
-        file_end = MAX_MAP_LIGHTING;
-    }
-
-    if (bsp.loadversion->game->has_rgb_lightmap || light_options.write_litfile) {
-        /* litfile data stored in a separate buffer */
-        lit_filebase.resize(MAX_MAP_LIGHTING * 3);
-        lit_file_p = 0;
-        lit_file_end = (MAX_MAP_LIGHTING * 3);
-    }
-
-    if (light_options.write_luxfile) {
-        /* lux data stored in a separate buffer */
-        lux_filebase.resize(MAX_MAP_LIGHTING * 3);
-        lux_file_p = 0;
-        lux_file_end = (MAX_MAP_LIGHTING * 3);
-    }
+    // the output buffers are sized by SaveLightmapSurfaces, once every face's lightmap size is known
 
     if (forcedscale) {
         bspdata->bspx.entries.erase("LMSHIFT");
@@ -965,19 +992,23 @@ static void LightWorld(bspdata_t *bspdata, bool forcedscale)
     UpdateEmissiveLightSurfacesList();
 
     logging::header("Direct Lighting"); // mxd
-    logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
-        if (light_surfaces[i] && Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
+    {
+        PROFILE_ZONE("DirectLighting");
+        logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
+            if (light_surfaces[i] && Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
-            _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+                _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 #endif
 
-            DirectLightFace(&bsp, *light_surfaces[i].get(), light_options);
-        }
-    });
+                DirectLightFace(&bsp, *light_surfaces[i].get(), light_options);
+            }
+        });
+    }
 
     if (bouncerequired && !light_options.nolighting.value()) {
 
         for (size_t i = 0; i < light_options.bounce.value(); i++) {
+            PROFILE_ZONE("BouncePass", "bounce", i);
 
             if (!MakeBounceLights(light_options, &bsp, i)) {
                 logging::header("No bounces; indirect lighting halted");
@@ -1001,6 +1032,7 @@ static void LightWorld(bspdata_t *bspdata, bool forcedscale)
 
     if (!light_options.nolighting.value()) {
         logging::header("Post-Processing"); // mxd
+        PROFILE_ZONE("PostProcessing");
         logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
             if (light_surfaces[i] && Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
@@ -1012,6 +1044,11 @@ static void LightWorld(bspdata_t *bspdata, bool forcedscale)
         });
     }
 
+    if (light_options.compactlightmaps.value()) {
+        logging::print(logging::flag::STAT, "     {:8} KB lightmaps packed into {} KB\n",
+            compact_lightmap_dense_bytes.load() / 1024, compact_lightmap_packed_bytes.load() / 1024);
+    }
+
     SaveLightmapSurfaces(&bsp);
 
     logging::print("Lighting Completed.\n\n");
@@ -1019,11 +1056,9 @@ static void LightWorld(bspdata_t *bspdata, bool forcedscale)
     // Transfer greyscale lightmap (or color lightmap for Q2/HL) to the bsp and update lightdatasize
     if (!light_options.litonly.value()) {
         if (bsp.loadversion->game->has_rgb_lightmap) {
-            bsp.dlightdata.resize(lit_file_p);
-            memcpy(bsp.dlightdata.data(), lit_filebase.data(), bsp.dlightdata.size());
+            bsp.dlightdata = lit_filebase;
         } else {
-            bsp.dlightdata.resize(file_p);
-            memcpy(bsp.dlightdata.data(), filebase.data(), bsp.dlightdata.size());
+            bsp.dlightdata = filebase;
         }
     } else {
         // NOTE: bsp.lightdatasize is already valid in the -litonly case
@@ -1133,25 +1168,9 @@ static void LightWorld(bspdata_t *bspdata, bool forcedscale)
     }
 }
 
-static void LoadExtendedTexinfoFlags(const fs::path &sourcefilename, const mbsp_t *bsp)
+// `filename` is only used for messages
+static void LoadExtendedTexinfoFlags(const json &j, const fs::path &filename, const mbsp_t *bsp)
 {
-    // always create the zero'ed array
-    extended_texinfo_flags.resize(bsp->texinfo.size());
-
-    fs::path filename(sourcefilename);
-    filename.replace_extension("texinfo.json");
-
-    std::ifstream texinfofile(filename, std::ios_base::in | std::ios_base::binary);
-
-    if (!texinfofile)
-        return;
-
-    logging::print("Loading extended texinfo flags from {}...\n", filename);
-
-    json j;
-
-    texinfofile >> j;
-
     for (auto it = j.begin(); it != j.end(); ++it) {
         size_t index = std::stoull(it.key());
 
@@ -1251,6 +1270,28 @@ static void LoadExtendedTexinfoFlags(const fs::path &sourcefilename, const mbsp_
     }
 }
 
+static void LoadExtendedTexinfoFlags(const fs::path &sourcefilename, const mbsp_t *bsp)
+{
+    // always create the zero'ed array
+    extended_texinfo_flags.resize(bsp->texinfo.size());
+
+    fs::path filename(sourcefilename);
+    filename.replace_extension("texinfo.json");
+
+    std::ifstream texinfofile(filename, std::ios_base::in | std::ios_base::binary);
+
+    if (!texinfofile)
+        return;
+
+    logging::print("Loading extended texinfo flags from {}...\n", filename);
+
+    json j;
+
+    texinfofile >> j;
+
+    LoadExtendedTexinfoFlags(j, filename, bsp);
+}
+
 // obj
 
 static void ExportObjFace(std::ofstream &f, const mbsp_t *bsp, const mface_t *face, int *vertcount)
@@ -1493,16 +1534,9 @@ static void ResetLight()
     facesup_decoupled_global.clear();
 
     filebase.clear();
-    file_p = 0;
-    file_end = 0;
-
     lit_filebase.clear();
-    lit_file_p = 0;
-    lit_file_end = 0;
-
+    hdr_filebase.clear();
     lux_filebase.clear();
-    lux_file_p = 0;
-    lux_file_end = 0;
 
     all_uncompressed_vis.clear();
     modelinfo.clear();
@@ -1524,7 +1558,7 @@ void light_reset()
     ResetLtFace();
     ResetPhong();
     ResetSurflight();
-    ResetEmbree();
+    ResetTrace();
 
     light_options.reset();
 }
@@ -1535,7 +1569,7 @@ void light_reset()
  * light modelfile
  * ==================
  */
-int light_main(int argc, const char **argv)
+static int light_main(int argc, const char **argv, pipeline_data_t *pipeline)
 {
     light_reset();
 
@@ -1544,11 +1578,17 @@ int light_main(int argc, const char **argv)
     light_options.preinitialize(argc, argv);
     light_options.initialize(argc, argv);
 
+    // postinitialize only runs once the bsp is loaded; start recording now so that's covered too
+    if (!light_options.profile.value().empty()) {
+        profiling::enable(light_options.profile.value());
+    }
+
     auto start = I_FloatTime();
     fs::path source = light_options.sourceMap;
 
     logging::init(
         fs::path(source).replace_filename(source.stem().string() + "-light").replace_extension("log"), light_options);
+    statsjson::begin_stage("light", light_options);
 
     // delete previous litfile
     if (!light_options.onlyents.value()) {
@@ -1562,12 +1602,16 @@ int light_main(int argc, const char **argv)
     ParseLightsFile(source); // map-specific file name
 
     source.replace_extension("bsp");
-    LoadBSPFile(source, &bspdata);
-
-    bspdata.version->game->init_filesystem(source, light_options);
+    if (pipeline) {
+        bspdata = std::move(pipeline->bspdata);
+    } else {
+        LoadBSPFile(source, &bspdata);
+    }
 
     ConvertBSPFormat(&bspdata, &bspver_generic);
 
+    bspdata.loadversion->game->init_filesystem(source, light_options);
+
     mbsp_t &bsp = std::get<mbsp_t>(bspdata.bsp);
 
     // mxd. Use 1.0 rangescale as a default to better match with qrad3/arghrad
@@ -1609,10 +1653,20 @@ int light_main(int argc, const char **argv)
 
     img::load_textures(&bsp, light_options);
 
-    LoadExtendedTexinfoFlags(source, &bsp);
+    if (pipeline) {
+        extended_texinfo_flags.resize(bsp.texinfo.size());
+
+        if (pipeline->texinfo_flags) {
+            LoadExtendedTexinfoFlags(*pipeline->texinfo_flags, fs::path(source).replace_extension("texinfo.json"), &bsp);
+        }
+    } else {
+        LoadExtendedTexinfoFlags(source, &bsp);
+    }
 
     CacheTextures(bsp);
 
+    Light_BuildPointTree(&bsp);
+
     LoadEntities(light_options, &bsp);
 
     light_options.postinitialize(argc, argv);
@@ -1623,13 +1677,20 @@ int light_main(int argc, const char **argv)
     FindDebugFace(&bsp);
     FindDebugVert(&bsp);
 
-    Embree_TraceInit(&bsp);
+    Trace_Init(&bsp);
 
     if (light_options.debugmode == debugmodes::phong_obj) {
         CalculateVertexNormals(&bsp);
         source.replace_extension("obj");
         ExportObj(source, &bsp);
 
+        if (pipeline) {
+            pipeline->bspdata = std::move(bspdata);
+            pipeline->write_bsp = false;
+        }
+
+        statsjson::end_stage();
+        profiling::write();
         logging::close();
         return 0;
     }
@@ -1664,6 +1725,12 @@ int light_main(int argc, const char **argv)
 
         if (light_options.write_litfile == lightfile::lit2) {
             WriteLitFile(&bsp, faces_sup, source, 2);
+            if (pipeline) {
+                pipeline->bspdata = std::move(bspdata);
+                pipeline->write_bsp = false;
+            }
+            statsjson::end_stage();
+            profiling::write();
             return 0; // run away before any files are written
         }
 
@@ -1694,11 +1761,17 @@ int light_main(int argc, const char **argv)
     }
 
     WriteEntitiesToString(light_options, &bsp);
-    /* Convert data format back if necessary */
-    ConvertBSPFormat(&bspdata, bspdata.loadversion);
 
-    if (!light_options.litonly.value()) {
-        WriteBSPFile(source, &bspdata);
+    if (pipeline) {
+        pipeline->bspdata = std::move(bspdata);
+        pipeline->write_bsp = !light_options.litonly.value();
+    } else {
+        /* Convert data format back if necessary */
+        ConvertBSPFormat(&bspdata, bspdata.loadversion);
+
+        if (!light_options.litonly.value()) {
+            WriteBSPFile(source, &bspdata);
+        }
     }
 
     auto end = I_FloatTime();
@@ -1715,17 +1788,63 @@ int light_main(int argc, const char **argv)
         static_cast<double>(total_bounce_rays) / static_cast<double>(total_samplepoints),
         static_cast<double>(total_bounce_ray_hits) / static_cast<double>(total_samplepoints));
     logging::print("{} empty lightmaps\n", static_cast<int>(fully_transparent_lightmaps));
+    logging::print("{} unique PVS sets for {} faces\n", static_cast<int>(total_pvs_sets),
+        static_cast<int>(total_pvs_faces));
+    if (light_options.adaptiveextra.value() && light_options.extra.value() > 1) {
+        logging::print("-adaptiveextra: {} flat faces lit {} of {} samples, tracing {} rays\n",
+            static_cast<int>(adaptive_flat_faces), static_cast<uint64_t>(adaptive_flat_samples_lit),
+            static_cast<uint64_t>(adaptive_flat_samples), static_cast<uint64_t>(adaptive_flat_rays));
+        logging::print("-adaptiveextra: {} supersampled faces lit {} of {} samples, tracing {} rays ({} supersampling)\n",
+            static_cast<int>(adaptive_edge_faces), static_cast<uint64_t>(adaptive_edge_samples_lit),
+            static_cast<uint64_t>(adaptive_edge_samples), static_cast<uint64_t>(adaptive_edge_rays),
+            static_cast<uint64_t>(adaptive_supersample_rays));
+    }
+
+    statsjson::add_counter("total_samplepoints", total_samplepoints);
+    statsjson::add_counter("total_light_rays", total_light_rays);
+    statsjson::add_counter("total_light_ray_hits", total_light_ray_hits);
+    statsjson::add_counter("total_surflight_rays", total_surflight_rays);
+    statsjson::add_counter("total_surflight_ray_hits", total_surflight_ray_hits);
+    statsjson::add_counter("total_bounce_rays", total_bounce_rays);
+    statsjson::add_counter("total_bounce_ray_hits", total_bounce_ray_hits);
+    statsjson::add_counter("fully_transparent_lightmaps", fully_transparent_lightmaps);
+    statsjson::add_counter("total_pvs_sets", total_pvs_sets);
+    statsjson::add_counter("total_pvs_faces", total_pvs_faces);
+    if (light_options.adaptiveextra.value() && light_options.extra.value() > 1) {
+        statsjson::add_counter("adaptive_flat_rays", adaptive_flat_rays);
+        statsjson::add_counter("adaptive_edge_rays", adaptive_edge_rays);
+        statsjson::add_counter("adaptive_supersample_rays", adaptive_supersample_rays);
+    }
+
+    statsjson::end_stage();
+    profiling::write();
     logging::close();
 
     return 0;
 }
 
-int light_main(const std::vector<std::string> &args)
+int light_main(int argc, const char **argv)
+{
+    return light_main(argc, argv, nullptr);
+}
+
+static std::vector<const char *> ArgPointers(const std::vector<std::string> &args)
 {
     std::vector<const char *> argPtrs;
     for (const std::string &arg : args) {
         argPtrs.push_back(arg.data());
     }
+    return argPtrs;
+}
+
+int light_main(const std::vector<std::string> &args)
+{
+    auto argPtrs = ArgPointers(args);
+    return light_main(argPtrs.size(), argPtrs.data(), nullptr);
+}
 
-    return light_main(argPtrs.size(), argPtrs.data());
+int light_main(const std::vector<std::string> &args, pipeline_data_t &pipeline)
+{
+    auto argPtrs = ArgPointers(args);
+    return light_main(argPtrs.size(), argPtrs.data(), &pipeline);
 }
@@ -30,9 +30,11 @@
 #include <light/light.hh>
 #include <light/entities.hh>
 #include <light/ltface.hh>
+#include <light/trace.hh>
 
 #include <common/prtfile.hh>
 #include <common/parallel.hh>
+#include <common/profile.hh>
 #include <common/qvec.hh>
 
 static std::vector<uint8_t> StringToVector(const std::string &str)
@@ -369,7 +371,11 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
     return vec;
 }
 
-std::tuple<lightgrid_samples_t, bool> FixPointAndCalcLightgrid(const mbsp_t *bsp, qvec3d world_point)
+/**
+ * Returns the point to sample the lightgrid at, and whether it's occluded.
+ * Points in solid are nudged out if there is open space nearby.
+ */
+static std::tuple<qvec3d, bool> FixLightgridPoint(const mbsp_t *bsp, qvec3d world_point)
 {
     bool occluded = Light_PointInWorld(bsp, world_point);
     if (occluded) {
@@ -381,20 +387,334 @@ std::tuple<lightgrid_samples_t, bool> FixPointAndCalcLightgrid(const mbsp_t *bsp
         }
     }
 
+    return {world_point, occluded};
+}
+
+std::tuple<lightgrid_samples_t, bool> FixPointAndCalcLightgrid(const mbsp_t *bsp, qvec3d world_point)
+{
+    auto [fixed_point, occluded] = FixLightgridPoint(bsp, world_point);
+
     lightgrid_samples_t samples;
 
     if (!occluded)
-        samples = CalcLightgridAtPoint(bsp, world_point);
+        samples = CalcLightgridAtPoint(bsp, fixed_point);
 
     return {samples, occluded};
 }
 
+/**
+ * Whether the samples at a cell's corners are close enough that the points
+ * between them can be interpolated: every corner needs the same styles in the
+ * same slots, and each channel's spread over all the corners (not just the
+ * difference from one of them) must be within `threshold`.
+ */
+static bool LightgridCornersSimilar(const std::array<const lightgrid_samples_t *, 8> &corners, float threshold)
+{
+    const lightgrid_samples_t &first = *corners[0];
+
+    for (size_t i = 0; i < first.samples_by_style.size(); ++i) {
+        const lightgrid_sample_t &sa = first.samples_by_style[i];
+
+        for (int k = 1; k < 8; ++k) {
+            const lightgrid_sample_t &sb = corners[k]->samples_by_style[i];
+
+            if (sa.used != sb.used)
+                return false;
+            if (sa.used && sa.style != sb.style)
+                return false;
+        }
+
+        if (!sa.used)
+            break;
+
+        qvec3d mins = sa.color, maxs = sa.color;
+        for (int k = 1; k < 8; ++k) {
+            mins = qv::min(mins, corners[k]->samples_by_style[i].color);
+            maxs = qv::max(maxs, corners[k]->samples_by_style[i].color);
+        }
+
+        for (int j = 0; j < 3; ++j) {
+            if (!(maxs[j] - mins[j] <= threshold))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Adaptive version of the dense grid evaluation in LightGrid().
+ *
+ * 1. tile the grid into coarse cells and light their corners only.
+ * 2. cells entirely inside solid are dropped; cells whose corners agree
+ *    (LightgridCornersSimilar) and that contain no occluded points are
+ *    accepted; the rest are split in half along each axis and the new
+ *    corners are lit, level by level.
+ * 3. the points inside accepted cells that weren't lit as a corner are
+ *    trilinearly interpolated from the cell corners.
+ */
+lightgrid_adaptive_result_t CalcLightgridAdaptive(const qvec3i &grid_size, const std::vector<uint8_t> &occlusion,
+    float threshold, const std::function<lightgrid_samples_t(int)> &evaluate, std::vector<lightgrid_samples_t> &results)
+{
+    // initial cell size, in grid points
+    constexpr int INITIAL_CELL_SPAN = 8;
+
+    enum class point_state_t : uint8_t
+    {
+        NONE,
+        QUEUED,
+        EVALUATED
+    };
+
+    enum class cell_action_t : uint8_t
+    {
+        ACCEPT,
+        SUBDIVIDE,
+        DROP
+    };
+
+    const int num_points = grid_size[0] * grid_size[1] * grid_size[2];
+
+    std::vector<point_state_t> states(num_points, point_state_t::NONE);
+
+    // initial tiling; cells share their boundary points
+    std::vector<lightgrid_cell_t> cells;
+    {
+        const qvec3i last = grid_size - qvec3i(1, 1, 1);
+
+        for (int z = 0; z == 0 || z < last[2]; z += INITIAL_CELL_SPAN) {
+            for (int y = 0; y == 0 || y < last[1]; y += INITIAL_CELL_SPAN) {
+                for (int x = 0; x == 0 || x < last[0]; x += INITIAL_CELL_SPAN) {
+                    const qvec3i mins{x, y, z};
+                    cells.push_back({mins, qv::min(mins + qvec3i(INITIAL_CELL_SPAN), last)});
+                }
+            }
+        }
+    }
+
+    auto cell_corners = [](const lightgrid_cell_t &cell) {
+        std::array<qvec3i, 8> corners;
+        for (int i = 0; i < 8; ++i) {
+            corners[i] = {(i & 4) ? cell.maxs[0] : cell.mins[0], (i & 2) ? cell.maxs[1] : cell.mins[1],
+                (i & 1) ? cell.maxs[2] : cell.mins[2]};
+        }
+        return corners;
+    };
+
+    auto grid_index = [&](int x, int y, int z) { return (grid_size[0] * grid_size[1] * z) + (grid_size[0] * y) + x; };
+    auto corner_samples = [&](const lightgrid_cell_t &cell) {
+        std::array<const lightgrid_samples_t *, 8> samples;
+        const auto corners = cell_corners(cell);
+        for (int i = 0; i < 8; ++i) {
+            samples[i] = &results[grid_index(corners[i][0], corners[i][1], corners[i][2])];
+        }
+        return samples;
+    };
+
+    lightgrid_adaptive_result_t result;
+
+    while (!cells.empty()) {
+        result.levels++;
+
+        // classify against the solid first, so cells entirely inside it
+        // are dropped before any of their corners are lit
+        std::vector<cell_action_t> actions(cells.size(), cell_action_t::ACCEPT);
+
+        logging::parallel_for(static_cast<size_t>(0), cells.size(), [&](size_t c) {
+            const lightgrid_cell_t &cell = cells[c];
+            int occluded = 0, total = 0;
+
+            for (int z = cell.mins[2]; z <= cell.maxs[2]; ++z) {
+                for (int y = cell.mins[1]; y <= cell.maxs[1]; ++y) {
+                    for (int x = cell.mins[0]; x <= cell.maxs[0]; ++x) {
+                        occluded += occlusion[grid_index(x, y, z)] ? 1 : 0;
+                        total++;
+                    }
+                }
+            }
+
+            const qvec3i extent = cell.maxs - cell.mins;
+
+            if (occluded == total) {
+                actions[c] = cell_action_t::DROP;
+            } else if (extent[0] <= 1 && extent[1] <= 1 && extent[2] <= 1) {
+                // nothing inside but corners; it's fully lit once they are
+                actions[c] = cell_action_t::ACCEPT;
+            } else if (occluded) {
+                // we can't interpolate across solid
+                actions[c] = cell_action_t::SUBDIVIDE;
+            }
+        });
+
+        // light every unoccluded corner we haven't lit yet
+        std::vector<int> to_evaluate;
+        for (size_t c = 0; c < cells.size(); ++c) {
+            if (actions[c] == cell_action_t::DROP)
+                continue;
+            for (auto &corner : cell_corners(cells[c])) {
+                const int i = grid_index(corner[0], corner[1], corner[2]);
+                if (occlusion[i] || states[i] != point_state_t::NONE)
+                    continue;
+                states[i] = point_state_t::QUEUED;
+                to_evaluate.push_back(i);
+            }
+        }
+
+        logging::parallel_for(static_cast<size_t>(0), to_evaluate.size(), [&](size_t j) {
+            const int i = to_evaluate[j];
+            results[i] = evaluate(i);
+            states[i] = point_state_t::EVALUATED;
+        });
+
+        result.evaluated_points += to_evaluate.size();
+
+        // the remaining cells are only accepted if their corners agree
+        logging::parallel_for(static_cast<size_t>(0), cells.size(), [&](size_t c) {
+            const qvec3i extent = cells[c].maxs - cells[c].mins;
+
+            if (actions[c] == cell_action_t::ACCEPT && (extent[0] > 1 || extent[1] > 1 || extent[2] > 1) &&
+                !LightgridCornersSimilar(corner_samples(cells[c]), threshold)) {
+                actions[c] = cell_action_t::SUBDIVIDE;
+            }
+        });
+
+        std::vector<lightgrid_cell_t> next_cells;
+
+        for (size_t c = 0; c < cells.size(); ++c) {
+            const lightgrid_cell_t &cell = cells[c];
+
+            if (actions[c] == cell_action_t::DROP) {
+                continue;
+            } else if (actions[c] == cell_action_t::ACCEPT) {
+                result.interpolated_cells.push_back(cell);
+                continue;
+            }
+
+            // split each axis that has interior points at its midpoint
+            std::array<std::array<int, 3>, 3> splits; // [axis] -> {mins, mid, maxs}
+            std::array<int, 3> halves;
+            for (int axis = 0; axis < 3; ++axis) {
+                const int extent = cell.maxs[axis] - cell.mins[axis];
+                splits[axis] = {cell.mins[axis], cell.mins[axis] + (extent / 2), cell.maxs[axis]};
+                halves[axis] = (extent >= 2) ? 2 : 1;
+                if (halves[axis] == 1)
+                    splits[axis][1] = cell.maxs[axis];
+            }
+
+            for (int hz = 0; hz < halves[2]; ++hz) {
+                for (int hy = 0; hy < halves[1]; ++hy) {
+                    for (int hx = 0; hx < halves[0]; ++hx) {
+                        lightgrid_cell_t child;
+                        child.mins = {splits[0][hx], splits[1][hy], splits[2][hz]};
+                        child.maxs = {halves[0] == 2 ? splits[0][hx + 1] : splits[0][2],
+                            halves[1] == 2 ? splits[1][hy + 1] : splits[1][2],
+                            halves[2] == 2 ? splits[2][hz + 1] : splits[2][2]};
+                        next_cells.push_back(child);
+                    }
+                }
+            }
+        }
+
+        cells = std::move(next_cells);
+    }
+
+    // fill in the interiors of accepted cells. cells own their points half-open
+    // (except on the last grid point of an axis), so no two cells write the same point.
+    std::atomic_size_t interpolated_points = 0;
+
+    logging::parallel_for(static_cast<size_t>(0), result.interpolated_cells.size(), [&](size_t c) {
+        const lightgrid_cell_t &cell = result.interpolated_cells[c];
+        const auto samples = corner_samples(cell);
+
+        qvec3i owned_maxs;
+        for (int axis = 0; axis < 3; ++axis) {
+            owned_maxs[axis] = (cell.maxs[axis] == grid_size[axis] - 1) ? cell.maxs[axis] : cell.maxs[axis] - 1;
+        }
+
+        size_t count = 0;
+
+        for (int z = cell.mins[2]; z <= owned_maxs[2]; ++z) {
+            for (int y = cell.mins[1]; y <= owned_maxs[1]; ++y) {
+                for (int x = cell.mins[0]; x <= owned_maxs[0]; ++x) {
+                    const int i = grid_index(x, y, z);
+                    if (occlusion[i] || states[i] == point_state_t::EVALUATED)
+                        continue;
+
+                    qvec3d t;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        const int extent = cell.maxs[axis] - cell.mins[axis];
+                        t[axis] = extent ? (qvec3i{x, y, z}[axis] - cell.mins[axis]) / static_cast<double>(extent) : 0.0;
+                    }
+
+                    lightgrid_samples_t point = *samples[0];
+                    for (size_t s = 0; s < point.samples_by_style.size(); ++s) {
+                        if (!point.samples_by_style[s].used)
+                            break;
+
+                        qvec3d color{};
+                        for (int k = 0; k < 8; ++k) {
+                            const double weight = ((k & 4) ? t[0] : 1.0 - t[0]) * ((k & 2) ? t[1] : 1.0 - t[1]) *
+                                                  ((k & 1) ? t[2] : 1.0 - t[2]);
+                            color += samples[k]->samples_by_style[s].color * weight;
+                        }
+                        point.samples_by_style[s].color = color;
+                    }
+
+                    results[i] = point;
+                    count++;
+                }
+            }
+        }
+
+        interpolated_points += count;
+    });
+
+    result.interpolated_points = interpolated_points.load();
+
+    return result;
+}
+
+/**
+ * -lightgrid_adaptive: classifies every grid point as occluded or not (only
+ * a point-in-leaf test, plus a nudge for points just inside solid, no rays),
+ * then lights the grid with the cell subdivision above.
+ *
+ * Fills in data.grid_result/data.occlusion exactly like the dense path, so
+ * MakeOctreeLump is unaffected.
+ */
+static void CalcLightgridAdaptive(const mbsp_t &bsp, lightgrid_raw_data &data)
+{
+    const int num_points = data.grid_size[0] * data.grid_size[1] * data.grid_size[2];
+
+    std::vector<qvec3d> positions(num_points);
+
+    logging::parallel_for(0, num_points, [&](int sample_index) {
+        const int z = (sample_index / (data.grid_size[0] * data.grid_size[1]));
+        const int y = (sample_index / data.grid_size[0]) % data.grid_size[1];
+        const int x = sample_index % data.grid_size[0];
+
+        auto [world_point, occluded] = FixLightgridPoint(&bsp, data.grid_mins + (qvec3d{x, y, z} * data.grid_dist));
+
+        positions[sample_index] = world_point;
+        data.occlusion[sample_index] = occluded;
+    });
+
+    const lightgrid_adaptive_result_t result = CalcLightgridAdaptive(data.grid_size, data.occlusion,
+        light_options.lightgrid_adaptive_threshold.value(),
+        [&](int i) { return CalcLightgridAtPoint(&bsp, positions[i]); }, data.grid_result);
+
+    logging::print("     {} of {} lightgrid points lit ({:.1f}%), {} interpolated, {} levels\n",
+        result.evaluated_points, num_points, 100.0 * result.evaluated_points / num_points, result.interpolated_points,
+        result.levels);
+}
+
 void LightGrid(bspdata_t *bspdata)
 {
     if (!light_options.lightgrid.value())
         return;
 
     logging::funcheader();
+    PROFILE_ZONE("LightGrid");
 
     auto &bsp = std::get<mbsp_t>(bspdata->bsp);
 
@@ -415,21 +735,25 @@ void LightGrid(bspdata_t *bspdata)
 
     data.occlusion.resize(data.grid_size[0] * data.grid_size[1] * data.grid_size[2]);
 
-    logging::parallel_for(0, data.grid_size[0] * data.grid_size[1] * data.grid_size[2], [&](int sample_index) {
-        const int z = (sample_index / (data.grid_size[0] * data.grid_size[1]));
-        const int y = (sample_index / data.grid_size[0]) % data.grid_size[1];
-        const int x = sample_index % data.grid_size[0];
+    if (light_options.lightgrid_adaptive.value()) {
+        CalcLightgridAdaptive(bsp, data);
+    } else {
+        logging::parallel_for(0, data.grid_size[0] * data.grid_size[1] * data.grid_size[2], [&](int sample_index) {
+            const int z = (sample_index / (data.grid_size[0] * data.grid_size[1]));
+            const int y = (sample_index / data.grid_size[0]) % data.grid_size[1];
+            const int x = sample_index % data.grid_size[0];
 
-        qvec3d world_point = data.grid_mins + (qvec3d{x, y, z} * data.grid_dist);
+            qvec3d world_point = data.grid_mins + (qvec3d{x, y, z} * data.grid_dist);
 
-        bool occluded;
-        lightgrid_samples_t samples;
+            bool occluded;
+            lightgrid_samples_t samples;
 
-        std::tie(samples, occluded) = FixPointAndCalcLightgrid(&bsp, world_point);
+            std::tie(samples, occluded) = FixPointAndCalcLightgrid(&bsp, world_point);
 
-        data.grid_result[sample_index] = samples;
-        data.occlusion[sample_index] = occluded;
-    });
+            data.grid_result[sample_index] = samples;
+            data.occlusion[sample_index] = occluded;
+        });
+    }
 
     // the maximum used styles across the map.
     data.num_styles = [&]() {
@@ -20,7 +20,6 @@
 #include <light/ltface.hh>
 
 #include <light/light.hh>
-#include <light/trace_embree.hh>
 #include <light/phong.hh>
 #include <light/surflight.hh> //mxd
 #include <light/entities.hh>
@@ -33,17 +32,26 @@
 #include <common/bsputils.hh>
 #include <common/qvec.hh>
 #include <common/ostream.hh>
+#include <common/profile.hh>
 
 #include <atomic>
+#include <bit>
 #include <cassert>
 #include <cmath>
 #include <algorithm>
 #include <fstream>
+#include <map>
+#include <mutex>
 
 std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints;
 std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
 std::atomic<uint32_t> total_surflight_rays, total_surflight_ray_hits; // mxd
 std::atomic<uint32_t> fully_transparent_lightmaps;
+std::atomic<uint32_t> total_pvs_faces, total_pvs_sets;
+std::atomic<uint32_t> adaptive_flat_faces, adaptive_edge_faces;
+std::atomic<uint64_t> adaptive_flat_samples, adaptive_flat_samples_lit, adaptive_flat_rays;
+std::atomic<uint64_t> adaptive_edge_samples, adaptive_edge_samples_lit, adaptive_edge_rays, adaptive_supersample_rays;
+std::atomic<uint64_t> compact_lightmap_dense_bytes, compact_lightmap_packed_bytes;
 static bool warned_about_light_map_overflow, warned_about_light_style_overflow;
 
 /* Debug helper - move elsewhere? */
@@ -267,16 +275,15 @@ static void CalcPoints_Debug(const lightsurf_t *surf, const mbsp_t *bsp)
     for (int t = 0; t < surf->height; t++) {
         for (int s = 0; s < surf->width; s++) {
             const int i = t * surf->width + s;
-            const auto &sample = surf->samples[i];
-            const qvec3d &point = sample.point;
-            const qvec3d mangle = qv::mangle_from_vec(sample.normal);
+            const qvec3d point = surf->samples.points[i];
+            const qvec3d mangle = qv::mangle_from_vec(qvec3d(surf->samples.normals[i]));
 
             f << "{\n";
             f << "\"classname\" \"light\"\n";
             ewt::print(f, "\"origin\" \"{}\"\n", point);
             ewt::print(f, "\"mangle\" \"{}\"\n", mangle);
-            ewt::print(f, "\"face\" \"{}\"\n", sample.realfacenum);
-            ewt::print(f, "\"occluded\" \"{}\"\n", sample.occluded);
+            ewt::print(f, "\"face\" \"{}\"\n", surf->samples.realfacenum[i]);
+            ewt::print(f, "\"occluded\" \"{}\"\n", (bool)surf->samples.occluded[i]);
             ewt::print(f, "\"s\" \"{}\"\n", s);
             ewt::print(f, "\"t\" \"{}\"\n", t);
             f << "}\n";
@@ -433,22 +440,21 @@ static void CalcPoints(
     for (int t = 0; t < surf->height; t++) {
         for (int s = 0; s < surf->width; s++) {
             const int i = t * surf->width + s;
-            auto &sample = surf->samples[i];
 
             const vec_t us = starts + s * st_step;
             const vec_t ut = startt + t * st_step;
 
-            sample.point =
+            const qvec3d point =
                 surf->extents.LMCoordToWorld(qvec2f(us, ut)) + surf->plane.normal; // one unit in front of face
 
             // do this before correcting the point, so we can wrap around the inside of pipes
             const bool phongshaded = (surf->curved && cfg.phongallowed.value());
-            const auto res = CalcPointNormal(bsp, face, sample.point, phongshaded, surf->extents, 0, offset);
+            const auto res = CalcPointNormal(bsp, face, point, phongshaded, surf->extents, 0, offset);
 
-            sample.occluded = !res.m_unoccluded;
-            sample.realfacenum = res.m_actualFace != nullptr ? Face_GetNum(bsp, res.m_actualFace) : -1;
-            sample.point = res.m_position + offset;
-            sample.normal = res.m_interpolatedNormal;
+            surf->samples.occluded[i] = !res.m_unoccluded;
+            surf->samples.realfacenum[i] = res.m_actualFace != nullptr ? Face_GetNum(bsp, res.m_actualFace) : -1;
+            surf->samples.points[i] = res.m_position + offset;
+            surf->samples.normals[i] = res.m_interpolatedNormal;
         }
     }
 
@@ -457,32 +463,6 @@ static void CalcPoints(
     }
 }
 
-static bool Mod_LeafPvs(const mbsp_t *bsp, const mleaf_t *leaf, uint8_t *out)
-{
-    const size_t num_pvsclusterbytes = DecompressedVisSize(bsp);
-
-    // init to all visible
-    memset(out, 0xFF, num_pvsclusterbytes);
-
-    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
-        auto it = UncompressedVis().find(leaf->cluster);
-        if (it == UncompressedVis().end()) {
-            return false;
-        }
-
-        memcpy(out, it->second.data(), num_pvsclusterbytes);
-    } else {
-        auto it = UncompressedVis().find(leaf->visofs);
-        if (it == UncompressedVis().end()) {
-            return false;
-        }
-
-        memcpy(out, it->second.data(), num_pvsclusterbytes);
-    }
-
-    return true;
-}
-
 static const std::vector<uint8_t> *Mod_LeafPvs(const mbsp_t *bsp, const mleaf_t *leaf)
 {
     if (bsp->loadversion->game->contents_are_liquid({leaf->contents})) {
@@ -499,49 +479,108 @@ static const std::vector<uint8_t> *Mod_LeafPvs(const mbsp_t *bsp, const mleaf_t
     return nullptr;
 }
 
+/*
+ * PVS intern table. A face's pvs is the OR of the decompressed pvs of each
+ * leaf its sample points are in, so it's keyed by the sorted set of vis keys
+ * (cluster or visofs) of those leaves. Most faces touch one or two leaves,
+ * so many faces share each merged pvs.
+ */
+static std::mutex pvs_intern_lock;
+static std::map<std::vector<int>, std::shared_ptr<const std::vector<uint8_t>>> pvs_intern;
+static std::shared_ptr<const std::vector<uint8_t>> pvs_all_visible;
+
 static void CalcPvs(const mbsp_t *bsp, lightsurf_t *lightsurf)
 {
     const int pvssize = DecompressedVisSize(bsp);
     const mleaf_t *lastleaf = nullptr;
 
     // set defaults
-    lightsurf->pvs.clear();
+    lightsurf->pvs = nullptr;
 
     if (!bsp->dvis.bits.size()) {
         return;
     }
 
-    // set lightsurf->pvs
-    uint8_t *pointpvs = (uint8_t *)alloca(pvssize);
-    lightsurf->pvs.resize(pvssize);
+    total_pvs_faces++;
 
-    for (auto &sample : lightsurf->samples) {
-        const mleaf_t *leaf = Light_PointInLeaf(bsp, sample.point);
+    thread_local std::vector<const mleaf_t *> leafs;
+    leafs.resize(lightsurf->samples.size());
+    Light_PointsInLeafs(bsp, lightsurf->samples.points, leafs);
 
+    thread_local std::vector<int> keys;
+    keys.clear();
+    bool all_visible = false;
+
+    for (const mleaf_t *leaf : leafs) {
         /* most/all of the surface points are probably in the same leaf */
         if (leaf == lastleaf)
             continue;
 
         lastleaf = leaf;
 
-        /* copy the pvs for this leaf into pointpvs */
-        Mod_LeafPvs(bsp, leaf, pointpvs);
-
         if (bsp->loadversion->game->contents_are_liquid({leaf->contents})) {
             // hack for when the sample point might be in an opaque liquid, blocking vis,
             // but we typically want light to pass through these.
             // see also VisCullEntity() which handles the case when the light emitter is in liquid.
-            for (int j = 0; j < pvssize; j++) {
-                lightsurf->pvs[j] |= 0xff;
-            }
+            all_visible = true;
+            break;
+        }
+
+        const int key = (bsp->loadversion->game->id == GAME_QUAKE_II) ? leaf->cluster : leaf->visofs;
+
+        if (UncompressedVis().find(key) == UncompressedVis().end()) {
+            // no vis for this leaf, so it sees everything
+            all_visible = true;
             break;
         }
 
-        /* merge the pvs for this sample point into lightsurf->pvs */
+        keys.push_back(key);
+    }
+
+    if (all_visible) {
+        std::unique_lock lock(pvs_intern_lock);
+
+        if (!pvs_all_visible) {
+            pvs_all_visible = std::make_shared<const std::vector<uint8_t>>(pvssize, 0xff);
+            total_pvs_sets++;
+        }
+
+        lightsurf->pvs = pvs_all_visible;
+        return;
+    }
+
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    {
+        std::unique_lock lock(pvs_intern_lock);
+
+        if (auto it = pvs_intern.find(keys); it != pvs_intern.end()) {
+            lightsurf->pvs = it->second;
+            return;
+        }
+    }
+
+    /* merge the pvs for each leaf; read straight from the decompressed vis */
+    auto merged = std::make_shared<std::vector<uint8_t>>(pvssize, 0);
+
+    for (const int key : keys) {
+        const std::vector<uint8_t> &leafpvs = UncompressedVis().at(key);
+
         for (int j = 0; j < pvssize; j++) {
-            lightsurf->pvs[j] |= pointpvs[j];
+            (*merged)[j] |= leafpvs[j];
         }
     }
+
+    std::unique_lock lock(pvs_intern_lock);
+
+    auto [it, inserted] = pvs_intern.emplace(keys, std::move(merged));
+
+    if (inserted) {
+        total_pvs_sets++;
+    }
+
+    lightsurf->pvs = it->second;
 }
 
 static std::unique_ptr<lightsurf_t> Lightsurf_Init(const modelinfo_t *modelinfo, const settings::worldspawn_keys &cfg,
@@ -719,12 +758,12 @@ static std::unique_ptr<lightsurf_t> Lightsurf_Init(const modelinfo_t *modelinfo,
 
 static void Lightmap_AllocOrClear(lightmap_t *lightmap, const lightsurf_t *lightsurf)
 {
-    if (!lightmap->samples.size()) {
+    if (!lightmap->size()) {
         /* first use of this lightmap, allocate the storage for it. */
-        lightmap->samples.resize(lightsurf->samples.size());
+        lightmap->resize(lightsurf->samples.size());
     } else if (lightmap->style != INVALID_LIGHTSTYLE) {
         /* clear only the data that is going to be merged to it. there's no point clearing more */
-        std::fill_n(lightmap->samples.begin(), lightsurf->samples.size(), lightsample_t{});
+        lightmap->clear(lightsurf->samples.size());
         lightmap->bounce_color = {};
     }
 }
@@ -785,6 +824,198 @@ static void Lightmap_Save(
     }
 }
 
+/*
+ * ============================================================================
+ * COMPACT LIGHTMAPS (-compactlightmaps)
+ * ============================================================================
+ */
+
+// IEEE half-float conversion, round to nearest even. out of range values
+// saturate to the largest finite half; callers scale into range first.
+static uint16_t FloatToHalf(float f)
+{
+    uint32_t x = std::bit_cast<uint32_t>(f);
+    const uint16_t sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+
+    if (x >= 0x477ff000) {
+        // rounds to 65536 or above (or nan/inf)
+        return sign | 0x7bff;
+    } else if (x < 0x38800000) {
+        // below the smallest normal half (2^-14); subnormal or zero
+        return sign | static_cast<uint16_t>(std::nearbyint(std::bit_cast<float>(x) * 16777216.0f));
+    }
+
+    // rebias the exponent from 127 to 15 and round off 13 bits of mantissa
+    x += 0xc8000fff + ((x >> 13) & 1);
+    return sign | static_cast<uint16_t>(x >> 13);
+}
+
+static float HalfToFloat(uint16_t h)
+{
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    const uint32_t exponent = (h >> 10) & 0x1f;
+    const uint32_t mantissa = h & 0x3ff;
+
+    if (exponent == 0) {
+        const float value = mantissa * (1.0f / 16777216.0f);
+        return sign ? -value : value;
+    }
+
+    return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+// exponent that brings the largest component of `values` below 2^15,
+// leaving headroom under the half maximum (65504)
+static int HalfExponentFor(const std::vector<qvec3f> &values)
+{
+    float max_abs = 0;
+    for (const qvec3f &v : values) {
+        max_abs = std::max({max_abs, std::abs(v[0]), std::abs(v[1]), std::abs(v[2])});
+    }
+    if (max_abs == 0 || !std::isfinite(max_abs)) {
+        return 0;
+    }
+    int exponent;
+    std::frexp(max_abs, &exponent);
+    return exponent - 15;
+}
+
+static qvec<uint16_t, 3> PackHalf(const qvec3f &v, int exponent)
+{
+    return {FloatToHalf(std::ldexp(v[0], -exponent)), FloatToHalf(std::ldexp(v[1], -exponent)),
+        FloatToHalf(std::ldexp(v[2], -exponent))};
+}
+
+static qvec3f UnpackHalf(const qvec<uint16_t, 3> &v, int exponent)
+{
+    return {std::ldexp(HalfToFloat(v[0]), exponent), std::ldexp(HalfToFloat(v[1]), exponent),
+        std::ldexp(HalfToFloat(v[2]), exponent)};
+}
+
+size_t packed_lightmap_t::memory_size() const
+{
+    return (mask.capacity() * sizeof(uint64_t)) + ((colors.capacity() + directions.capacity()) * sizeof(qvec3f)) +
+           ((half_colors.capacity() + half_directions.capacity()) * sizeof(qvec<uint16_t, 3>));
+}
+
+/*
+ * Lightmap_Pack
+ *
+ * Moves the lightmap's colors and directions into its packed form, keeping
+ * only the luxels that have any light. `half` stores them as half-floats,
+ * which is only accurate enough once nothing more will be added to them.
+ */
+void Lightmap_Pack(lightmap_t &lightmap, bool half)
+{
+    if (lightmap.is_packed() || lightmap.colors.empty()) {
+        return;
+    }
+
+    packed_lightmap_t &packed = lightmap.packed;
+    const size_t n = lightmap.colors.size();
+    const int color_exponent = half ? HalfExponentFor(lightmap.colors) : 0;
+    const int direction_exponent = half ? HalfExponentFor(lightmap.directions) : 0;
+
+    packed.numsamples = n;
+    packed.mask.assign((n + 63) / 64, 0);
+    packed.color_exponent = color_exponent;
+    packed.direction_exponent = direction_exponent;
+
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!qv::emptyExact(lightmap.colors[i]) || !qv::emptyExact(lightmap.directions[i])) {
+            packed.mask[i / 64] |= uint64_t(1) << (i % 64);
+            count++;
+        }
+    }
+
+    if (half) {
+        packed.half_colors.reserve(count);
+        packed.half_directions.reserve(count);
+    } else {
+        packed.colors.reserve(count);
+        packed.directions.reserve(count);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (!(packed.mask[i / 64] & (uint64_t(1) << (i % 64)))) {
+            continue;
+        }
+        if (half) {
+            packed.half_colors.push_back(PackHalf(lightmap.colors[i], color_exponent));
+            packed.half_directions.push_back(PackHalf(lightmap.directions[i], direction_exponent));
+        } else {
+            packed.colors.push_back(lightmap.colors[i]);
+            packed.directions.push_back(lightmap.directions[i]);
+        }
+    }
+
+    compact_lightmap_dense_bytes += n * 2 * sizeof(qvec3f);
+    compact_lightmap_packed_bytes += packed.memory_size();
+
+    lightmap.colors.clear();
+    lightmap.colors.shrink_to_fit();
+    lightmap.directions.clear();
+    lightmap.directions.shrink_to_fit();
+}
+
+/*
+ * Lightmap_Unpack
+ *
+ * Restores the dense colors and directions of a packed lightmap.
+ */
+void Lightmap_Unpack(lightmap_t &lightmap)
+{
+    if (!lightmap.is_packed()) {
+        return;
+    }
+
+    packed_lightmap_t &packed = lightmap.packed;
+    const size_t n = packed.numsamples;
+    const bool half = !packed.half_colors.empty();
+
+    compact_lightmap_dense_bytes -= n * 2 * sizeof(qvec3f);
+    compact_lightmap_packed_bytes -= packed.memory_size();
+
+    lightmap.colors.assign(n, {});
+    lightmap.directions.assign(n, {});
+
+    size_t j = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!(packed.mask[i / 64] & (uint64_t(1) << (i % 64)))) {
+            continue;
+        }
+        if (half) {
+            lightmap.colors[i] = UnpackHalf(packed.half_colors[j], packed.color_exponent);
+            lightmap.directions[i] = UnpackHalf(packed.half_directions[j], packed.direction_exponent);
+        } else {
+            lightmap.colors[i] = packed.colors[j];
+            lightmap.directions[i] = packed.directions[j];
+        }
+        j++;
+    }
+
+    packed = {};
+}
+
+static void LightSurface_Pack(lightsurf_t &lightsurf, bool half)
+{
+    if (!light_options.compactlightmaps.value()) {
+        return;
+    }
+    for (lightmap_t &lightmap : lightsurf.lightmapsByStyle) {
+        Lightmap_Pack(lightmap, half);
+    }
+}
+
+static void LightSurface_Unpack(lightsurf_t &lightsurf)
+{
+    for (lightmap_t &lightmap : lightsurf.lightmapsByStyle) {
+        Lightmap_Unpack(lightmap);
+    }
+}
+
 /*
  * ============================================================================
  * FACE LIGHTING
@@ -978,15 +1209,15 @@ constexpr vec_t SQR(vec_t x)
 }
 
 // CHECK: naming? why clamp*min*?
-constexpr bool Light_ClampMin(lightsample_t &sample, const vec_t light, const qvec3d &color)
+constexpr bool Light_ClampMin(qvec3f &sample_color, const vec_t light, const qvec3d &color)
 {
     bool changed = false;
 
     for (int i = 0; i < 3; i++) {
         float c = (float)(color[i] * (light / 255.0f));
 
-        if (c > sample.color[i]) {
-            sample.color[i] = c;
+        if (c > sample_color[i]) {
+            sample_color[i] = c;
             changed = true;
         }
     }
@@ -1127,9 +1358,9 @@ inline bool CullLight(const light_t *entity, const lightsurf_t *lightsurf)
     return fabs(GetLightValue(cfg, entity, dist)) <= light_options.gate.value();
 }
 
-static bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, const mleaf_t *entleaf)
+static bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> *pvs, const mleaf_t *entleaf)
 {
-    if (pvs.empty()) {
+    if (pvs == nullptr) {
         return false;
     }
     if (entleaf == nullptr) {
@@ -1145,7 +1376,7 @@ static bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, co
         return false;
     }
 
-    return !Pvs_LeafVisible(bsp, pvs, entleaf);
+    return !Pvs_LeafVisible(bsp, *pvs, entleaf);
 }
 
 /*
@@ -1164,7 +1395,7 @@ static void LightFace_Entity(
     if (light_options.visapprox.value() == visapprox_t::VIS &&
         entity->light_channel_mask.value() == CHANNEL_MASK_DEFAULT &&
         entity->shadow_channel_mask.value() == CHANNEL_MASK_DEFAULT &&
-        VisCullEntity(bsp, lightsurf->pvs, entity->leaf)) {
+        VisCullEntity(bsp, lightsurf->pvs.get(), entity->leaf)) {
         return;
     }
 
@@ -1197,14 +1428,14 @@ static void LightFace_Entity(
     raystream_occlusion_t &rs = *lightsurf->occlusion_stream;
     rs.clearPushedRays();
 
-    for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const auto &sample = lightsurf->samples[i];
+    const auto &samples = lightsurf->samples;
 
-        if (sample.occluded)
+    for (int i = 0; i < samples.size(); i++) {
+        if (samples.occluded[i])
             continue;
 
-        const qvec3d &surfpoint = sample.point;
-        const qvec3d &surfnorm = sample.normal;
+        const qvec3d surfpoint = samples.points[i];
+        const qvec3d surfnorm = samples.normals[i];
 
         qvec3d surfpointToLightDir;
         float surfpointToLightDist;
@@ -1214,7 +1445,8 @@ static void LightFace_Entity(
         GetLightContrib(cfg, entity, surfnorm, true, surfpoint, lightsurf->twosided, color, surfpointToLightDir,
             normalcontrib, &surfpointToLightDist);
 
-        const float occlusion = Dirt_GetScaleFactor(cfg, sample.occlusion, entity, surfpointToLightDist, lightsurf);
+        const float occlusion =
+            Dirt_GetScaleFactor(cfg, samples.occlusion[i], entity, surfpointToLightDist, lightsurf);
         color *= occlusion;
 
         /* Quick distance check first */
@@ -1264,11 +1496,9 @@ static void LightFace_Entity(
             cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
         }
 
-        lightsample_t &sample = cached_lightmap->samples[i];
-
-        sample.color += rs.getPushedRayColor(j);
+        cached_lightmap->colors[i] += rs.getPushedRayColor(j);
         cached_lightmap->bounce_color += rs.getPushedRayColor(j);
-        sample.direction += rs.getPushedRayNormalContrib(j);
+        cached_lightmap->directions[i] += rs.getPushedRayNormalContrib(j);
 
         Lightmap_Save(bsp, lightmaps, lightsurf, cached_lightmap, cached_style);
     }
@@ -1362,41 +1592,51 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
     raystream_intersection_t &rs = *lightsurf->intersection_stream;
     rs.clearPushedRays();
 
-    for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const auto &sample = lightsurf->samples[i];
+    const auto &samples = lightsurf->samples;
+    const size_t numsamples = samples.size();
 
-        if (sample.occluded)
-            continue;
+    // first pass: light value at every sample. this is branch-free over
+    // the contiguous normal array so the compiler can vectorize it.
+    thread_local static std::vector<float> values;
+    values.resize(numsamples);
 
-        const qvec3d &surfpoint = sample.point;
-        const qvec3d &surfnorm = sample.normal;
+    const qvec3f incoming_f = incoming;
+    const float anglescale = sun->anglescale;
+    const float sunlight = sun->sunlight;
+    const bool twosided = lightsurf->twosided;
 
-        vec_t angle = qv::dot(incoming, surfnorm);
-        if (lightsurf->twosided) {
-            if (angle < 0) {
-                angle = -angle;
-            }
-        }
+    for (size_t i = 0; i < numsamples; i++) {
+        float angle = qv::dot(incoming_f, samples.normals[i]);
+        angle = twosided ? std::abs(angle) : angle;
+        angle = std::max(0.0f, angle);
+        values[i] = ((1.0f - anglescale) + anglescale * angle) * sunlight;
+    }
 
-        angle = std::max(0.0, angle);
+    if (sun->dirt) {
+        for (size_t i = 0; i < numsamples; i++) {
+            values[i] *= Dirt_GetScaleFactor(cfg, samples.occlusion[i], NULL, 0.0, lightsurf);
+        }
+    }
 
-        angle = (1.0 - sun->anglescale) + sun->anglescale * angle;
-        vec_t value = angle * sun->sunlight;
+    // second pass: gate and push rays for the samples that matter
+    const float color_brightness = LightSample_Brightness(sun->sunlight_color) / 255.0f;
+    const float gate = light_options.gate.value();
 
-        if (sun->dirt) {
-            value *= Dirt_GetScaleFactor(cfg, sample.occlusion, NULL, 0.0, lightsurf);
-        }
+    for (size_t i = 0; i < numsamples; i++) {
+        if (samples.occluded[i])
+            continue;
 
-        qvec3f color = sun->sunlight_color * (value / 255.0);
+        const float value = values[i];
 
         /* Quick distance check first */
-        if (fabs(LightSample_Brightness(color)) <= light_options.gate.value()) {
+        if (std::abs(value * color_brightness) <= gate) {
             continue;
         }
 
+        qvec3f color = sun->sunlight_color * (value / 255.0);
         qvec3d normalcontrib = incoming * value;
 
-        rs.pushRay(i, surfpoint, incoming, MAX_SKY_DIST, &color, &normalcontrib);
+        rs.pushRay(i, samples.points[i], incoming, MAX_SKY_DIST, &color, &normalcontrib);
     }
 
     // We need to check if the first hit face is a sky face, so we need
@@ -1437,17 +1677,251 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
             cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
         }
 
-        lightsample_t &sample = cached_lightmap->samples[i];
-
-        sample.color += rs.getPushedRayColor(j);
+        cached_lightmap->colors[i] += rs.getPushedRayColor(j);
         cached_lightmap->bounce_color += rs.getPushedRayColor(j);
-        sample.direction += rs.getPushedRayNormalContrib(j);
+        cached_lightmap->directions[i] += rs.getPushedRayNormalContrib(j);
         total_light_ray_hits++;
 
         Lightmap_Save(bsp, lightmaps, lightsurf, cached_lightmap, cached_style);
     }
 }
 
+/*
+ * =============
+ * SunIsSkySampled
+ *
+ * Whether `sun` is lit through LightFace_SkySamples rather than on its own
+ * by LightFace_Sky. Only with -skysamples; by default every sun is lit
+ * separately, so the output doesn't change.
+ * =============
+ */
+static bool SunIsSkySampled(const sun_t &sun)
+{
+    return sun.sky_sample && light_options.skysamples.value() > 0;
+}
+
+/*
+ * =============
+ * LightFace_SkySamples
+ *
+ * With -skysamples, lights a face from all of the skydome/penumbra suns
+ * (sun_t::sky_sample). Each sky direction is traced once per sample point
+ * and the result is shared by every sun along it. Only -skysamples
+ * directions are traced, picked in proportion to the light each one
+ * delivers to this face; their contribution is scaled up by the inverse
+ * of the pick probability.
+ * =============
+ */
+static void LightFace_SkySamples(
+    const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps, bool negative)
+{
+    const auto &dirs = GetSkySampleDirs();
+    if (dirs.empty() || !light_options.skysamples.value()) {
+        return;
+    }
+
+    // check lighting channels (currently sunlight is always on CHANNEL_MASK_DEFAULT)
+    if (!(lightsurf->object_channel_mask & CHANNEL_MASK_DEFAULT)) {
+        return;
+    }
+
+    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+    const qplane3d &plane = lightsurf->plane;
+
+    auto sun_applies = [negative](const sun_t *sun) { return negative ? sun->sunlight < 0 : sun->sunlight > 0; };
+
+    // importance of each direction to this face: the brightness its suns
+    // would deliver to the face plane. curved faces use the unoccluded
+    // maximum, since their sample normals vary.
+    thread_local static std::vector<float> weights;
+    weights.assign(dirs.size(), 0.0f);
+
+    float total_weight = 0;
+    size_t active_dirs = 0;
+
+    for (size_t d = 0; d < dirs.size(); d++) {
+        const vec_t dp = qv::dot(dirs[d].incoming, plane.normal);
+
+        /* Don't bother if surface facing away from sun */
+        if (dp < -LIGHT_ANGLE_EPSILON && !lightsurf->curved && !lightsurf->twosided) {
+            continue;
+        }
+
+        vec_t angle = lightsurf->curved ? 1.0 : lightsurf->twosided ? std::abs(dp) : std::max(0.0, dp);
+
+        for (const sun_t *sun : dirs[d].suns) {
+            if (!sun_applies(sun)) {
+                continue;
+            }
+            const vec_t scaled = (1.0 - sun->anglescale) + sun->anglescale * angle;
+            weights[d] += std::abs(sun->sunlight * scaled * LightSample_Brightness(sun->sunlight_color) / 255.0);
+        }
+
+        if (weights[d] > 0) {
+            total_weight += weights[d];
+            active_dirs++;
+        }
+    }
+
+    if (!active_dirs) {
+        return;
+    }
+
+    // pick directions: (direction index, contribution scale)
+    thread_local static std::vector<std::pair<size_t, float>> picked;
+    picked.clear();
+
+    const size_t budget = light_options.skysamples.value();
+
+    if (active_dirs <= budget) {
+        for (size_t d = 0; d < dirs.size(); d++) {
+            if (weights[d] > 0) {
+                picked.emplace_back(d, 1.0f);
+            }
+        }
+    } else {
+        // stratified sampling of the weight CDF, taking the midpoint of each
+        // stratum. this is deterministic, so faces on the same plane pick the
+        // same directions and don't get seams between them. any direction
+        // brighter than one stratum is always picked, with a scale of ~1.
+        const float step = total_weight / budget;
+        float target = step * 0.5f;
+        float accum = 0;
+        size_t num_picks = 0;
+
+        for (size_t d = 0; d < dirs.size() && num_picks < budget; d++) {
+            if (weights[d] <= 0) {
+                continue;
+            }
+
+            accum += weights[d];
+
+            int hits = 0;
+            while (target < accum && num_picks < budget) {
+                hits++;
+                num_picks++;
+                target += step;
+            }
+
+            if (hits) {
+                // hits / (budget * (weight / total_weight))
+                picked.emplace_back(d, hits * step / weights[d]);
+            }
+        }
+    }
+
+    const auto &samples = lightsurf->samples;
+    raystream_intersection_t &rs = *lightsurf->intersection_stream;
+    const float gate = light_options.gate.value();
+
+    // light value of `sun` along `dir` at sample i, before shadowing
+    auto sun_value = [&](const sky_sample_dir_t &dir, const sun_t *sun, int i, float scale) {
+        vec_t dp = qv::dot(dir.incoming, qvec3d(samples.normals[i]));
+        if (lightsurf->twosided) {
+            dp = std::abs(dp);
+        }
+        dp = std::max(0.0, dp);
+
+        const vec_t angle = (1.0 - sun->anglescale) + sun->anglescale * dp;
+        vec_t value = angle * sun->sunlight * scale;
+
+        if (sun->dirt) {
+            value *= Dirt_GetScaleFactor(cfg, samples.occlusion[i], NULL, 0.0, lightsurf);
+        }
+
+        return value;
+    };
+
+    for (const auto &[d, scale] : picked) {
+        const sky_sample_dir_t &dir = dirs[d];
+
+        rs.clearPushedRays();
+
+        for (int i = 0; i < samples.size(); i++) {
+            if (samples.occluded[i])
+                continue;
+
+            /* Quick distance check first; the ray is only needed if one of the suns gets through the gate */
+            bool needed = false;
+            for (const sun_t *sun : dir.suns) {
+                if (!sun_applies(sun)) {
+                    continue;
+                }
+                const qvec3f color = sun->sunlight_color * (sun_value(dir, sun, i, scale) / 255.0);
+                if (fabs(LightSample_Brightness(color)) > gate) {
+                    needed = true;
+                    break;
+                }
+            }
+            if (!needed)
+                continue;
+
+            rs.pushRay(i, samples.points[i], dir.incoming, MAX_SKY_DIST);
+        }
+
+        // We need to check if the first hit face is a sky face, so we need
+        // to test intersection (not occlusion)
+        rs.tracePushedRaysIntersection(modelinfo, CHANNEL_MASK_DEFAULT);
+
+        const int N = rs.numPushedRays();
+        total_light_rays += N;
+
+        int cached_style = -1;
+        lightmap_t *cached_lightmap = nullptr;
+
+        for (int j = 0; j < N; j++) {
+            if (rs.getPushedRayHitType(j) != hittype_t::SKY) {
+                continue;
+            }
+
+            const int i = rs.getPushedRayPointIndex(j);
+            const triinfo *hitface = rs.getPushedRayHitFaceInfo(j);
+            const int dynamic_style = rs.getPushedRayDynamicStyle(j);
+
+            bool hit = false;
+
+            for (const sun_t *sun : dir.suns) {
+                if (!sun_applies(sun)) {
+                    continue;
+                }
+
+                // check if we hit the wrong texture
+                if (sun->suntexture_value && sun->suntexture_value != hitface->texture) {
+                    continue;
+                }
+
+                const vec_t value = sun_value(dir, sun, i, scale);
+                const qvec3f color = sun->sunlight_color * (value / 255.0);
+
+                if (fabs(LightSample_Brightness(color)) <= gate) {
+                    continue;
+                }
+
+                // check if we hit a dynamic shadow caster
+                const int desired_style = sun->style ? sun->style : dynamic_style;
+
+                // if necessary, switch which lightmap we are writing to.
+                if (desired_style != cached_style) {
+                    cached_style = desired_style;
+                    cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+                }
+
+                cached_lightmap->colors[i] += color;
+                cached_lightmap->bounce_color += color;
+                cached_lightmap->directions[i] += dir.incoming * value;
+
+                Lightmap_Save(bsp, lightmaps, lightsurf, cached_lightmap, cached_style);
+                hit = true;
+            }
+
+            if (hit) {
+                total_light_ray_hits++;
+            }
+        }
+    }
+}
+
 static void LightPoint_Sky(const mbsp_t *bsp, raystream_intersection_t &rs, const sun_t *sun, const qvec3d &surfpoint,
     lightgrid_samples_t &result)
 {
@@ -1630,21 +2104,18 @@ static void LightFace_Min(const mbsp_t *bsp, const mface_t *face, const qvec3d &
 
     bool hit = false;
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const auto &surf_sample = lightsurf->samples[i];
-        lightsample_t &sample = lightmap->samples[i];
-
         vec_t value = light;
         if (cfg.minlight_dirt.value()) {
-            value *= Dirt_GetScaleFactor(cfg, surf_sample.occlusion, NULL, 0.0, lightsurf);
+            value *= Dirt_GetScaleFactor(cfg, lightsurf->samples.occlusion[i], NULL, 0.0, lightsurf);
         }
         if (cfg.addminlight.value()) {
-            sample.color += color * (value / 255.0);
+            lightmap->colors[i] += color * (value / 255.0);
             hit = true;
         } else {
             if (lightsurf->minlightMottle) {
-                value += Mottle(surf_sample.point);
+                value += Mottle(lightsurf->samples.points[i]);
             }
-            hit = Light_ClampMin(sample, value, color) || hit;
+            hit = Light_ClampMin(lightmap->colors[i], value, color) || hit;
         }
     }
 
@@ -1688,14 +2159,11 @@ static void LightFace_LocalMin(
 
         bool hit = false;
         for (int i = 0; i < lightsurf->samples.size(); i++) {
-            const auto &surf_sample = lightsurf->samples[i];
-
-            if (surf_sample.occluded)
+            if (lightsurf->samples.occluded[i])
                 continue;
 
-            const lightsample_t &sample = lightmap->samples[i];
-            const qvec3d &surfpoint = surf_sample.point;
-            if (cfg.addminlight.value() || LightSample_Brightness(sample.color) < entity->light.value()) {
+            const qvec3d surfpoint = lightsurf->samples.points[i];
+            if (cfg.addminlight.value() || LightSample_Brightness(lightmap->colors[i]) < entity->light.value()) {
                 qvec3d surfpointToLightDir;
                 const vec_t surfpointToLightDist = GetDir(surfpoint, entity->origin.value(), surfpointToLightDir);
 
@@ -1715,15 +2183,15 @@ static void LightFace_LocalMin(
 
             int i = rs.getPushedRayPointIndex(j);
             vec_t value = entity->light.value();
-            lightsample_t &sample = lightmap->samples[i];
+            qvec3f &color = lightmap->colors[i];
 
             value *= Dirt_GetScaleFactor(
-                cfg, lightsurf->samples[i].occlusion, entity.get(), 0.0 /* TODO: pass distance */, lightsurf);
+                cfg, lightsurf->samples.occlusion[i], entity.get(), 0.0 /* TODO: pass distance */, lightsurf);
             if (cfg.addminlight.value()) {
-                sample.color += entity->color.value() * (value / 255.0);
+                color += entity->color.value() * (value / 255.0);
                 hit = true;
             } else {
-                hit = Light_ClampMin(sample, value, entity->color.value()) || hit;
+                hit = Light_ClampMin(color, value, entity->color.value()) || hit;
             }
 
             total_light_ray_hits++;
@@ -1747,8 +2215,8 @@ static void LightFace_AutoMin(const mbsp_t *bsp, const mface_t *face, lightsurf_
      */
     bool apply_to_all = false;
 
-    const bool any_occluded = std::any_of(lightsurf->samples.begin(), lightsurf->samples.end(),
-        [](const lightsurf_t::sample_data_t &v) { return v.occluded; });
+    const bool any_occluded = std::any_of(
+        lightsurf->samples.occluded.begin(), lightsurf->samples.occluded.end(), [](uint8_t v) { return v; });
 
     if (!modelinfo->autominlight.is_changed()) {
         // default: apply autominlight to occluded luxels only
@@ -1789,8 +2257,8 @@ static void LightFace_AutoMin(const mbsp_t *bsp, const mface_t *face, lightsurf_
             // for each luxel (or only occluded luxels, depending on the setting),
             // apply the minlight
             for (int i = 0; i < lightsurf->samples.size(); i++) {
-                if (apply_to_all || lightsurf->samples[i].occluded) {
-                    lightmap->samples[i].color = qv::max(qvec3f{grid_sample.color}, lightmap->samples[i].color);
+                if (apply_to_all || lightsurf->samples.occluded[i]) {
+                    lightmap->colors[i] = qv::max(qvec3f{grid_sample.color}, lightmap->colors[i]);
                 }
             }
 
@@ -1798,9 +2266,7 @@ static void LightFace_AutoMin(const mbsp_t *bsp, const mface_t *face, lightsurf_
         }
 
         // clear occluded state, since we filled in all occluded samples with a color
-        for (int i = 0; i < lightsurf->samples.size(); i++) {
-            lightsurf->samples[i].occluded = false;
-        }
+        std::fill(lightsurf->samples.occluded.begin(), lightsurf->samples.occluded.end(), false);
     }
 }
 
@@ -1817,9 +2283,8 @@ static void LightFace_DirtDebug(const mbsp_t *bsp, const lightsurf_t *lightsurf,
 
     /* Overwrite each point with the dirt value for that sample... */
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        lightsample_t &sample = lightmap->samples[i];
-        const float light = 255 * Dirt_GetScaleFactor(cfg, lightsurf->samples[i].occlusion, nullptr, 0.0, lightsurf);
-        sample.color = {light};
+        const float light = 255 * Dirt_GetScaleFactor(cfg, lightsurf->samples.occlusion[i], nullptr, 0.0, lightsurf);
+        lightmap->colors[i] = {light};
     }
 
     Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, 0);
@@ -1837,11 +2302,11 @@ static void LightFace_PhongDebug(const mbsp_t *bsp, const lightsurf_t *lightsurf
 
     /* Overwrite each point with the normal for that sample... */
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        lightsample_t &sample = lightmap->samples[i];
+        qvec3f &color = lightmap->colors[i];
         // scale from [-1..1] to [0..1], then multiply by 255
-        sample.color = lightsurf->samples[i].normal;
+        color = lightsurf->samples.normals[i];
 
-        for (auto &v : sample.color) {
+        for (auto &v : color) {
             v = std::abs(v) * 255;
         }
     }
@@ -1856,11 +2321,10 @@ static void LightFace_DebugMottle(const mbsp_t *bsp, const lightsurf_t *lightsur
 
     /* Overwrite each point with the mottle noise for that sample... */
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        lightsample_t &sample = lightmap->samples[i];
         // mottle is meant to be applied on top of minlight, so add some here
         // for preview purposes.
         const float minlight = 20.0f;
-        sample.color = qvec3f(minlight + Mottle(lightsurf->samples[i].point));
+        lightmap->colors[i] = qvec3f(minlight + Mottle(lightsurf->samples.points[i]));
     }
 
     Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, 0);
@@ -1978,20 +2442,18 @@ LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t
 
             for (int c = 0; c < vpl.points.size(); c++) {
                 if (light_options.visapprox.value() == visapprox_t::VIS &&
-                    VisCullEntity(bsp, lightsurf->pvs, vpl.leaves[c])) {
+                    VisCullEntity(bsp, lightsurf->pvs.get(), vpl.leaves[c])) {
                     continue;
                 }
 
                 rs.clearPushedRays();
 
                 for (int i = 0; i < lightsurf->samples.size(); i++) {
-                    const auto &sample = lightsurf->samples[i];
-
-                    if (sample.occluded)
+                    if (lightsurf->samples.occluded[i])
                         continue;
 
-                    const qvec3d &lightsurf_pos = sample.point;
-                    const qvec3d &lightsurf_normal = sample.normal;
+                    const qvec3f &lightsurf_pos = lightsurf->samples.points[i];
+                    const qvec3f &lightsurf_normal = lightsurf->samples.normals[i];
 
                     const qvec3f &pos = vpl.points[c];
                     qvec3f dir = lightsurf_pos - pos;
@@ -2037,11 +2499,10 @@ LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t
 
                     // Use dirt scaling on the surface lighting.
                     const vec_t dirtscale =
-                        Dirt_GetScaleFactor(cfg, lightsurf->samples[i].occlusion, nullptr, 0.0, lightsurf);
+                        Dirt_GetScaleFactor(cfg, lightsurf->samples.occlusion[i], nullptr, 0.0, lightsurf);
                     indirect *= dirtscale;
 
-                    lightsample_t &sample = lightmap->samples[i];
-                    sample.color += indirect;
+                    lightmap->colors[i] += indirect;
                     lightmap->bounce_color += indirect;
 
                     hit = true;
@@ -2068,7 +2529,7 @@ LightPoint_SurfaceLight(const mbsp_t *bsp, const std::vector<uint8_t> *pvs, rays
         const surfacelight_t &vpl = *surf->vpl;
 
         for (int c = 0; c < vpl.points.size(); c++) {
-            if (light_options.visapprox.value() == visapprox_t::VIS && pvs && VisCullEntity(bsp, *pvs, vpl.leaves[c])) {
+            if (light_options.visapprox.value() == visapprox_t::VIS && VisCullEntity(bsp, pvs, vpl.leaves[c])) {
                 continue;
             }
 
@@ -2145,15 +2606,13 @@ static void LightFace_OccludedDebug(const mbsp_t *bsp, lightsurf_t *lightsurf, l
 
     /* Overwrite each point, red=occluded, green=ok */
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        auto &surf_sample = lightsurf->samples[i];
-        lightsample_t &sample = lightmap->samples[i];
-        if (surf_sample.occluded) {
-            sample.color = {255, 0, 0};
+        if (lightsurf->samples.occluded[i]) {
+            lightmap->colors[i] = {255, 0, 0};
         } else {
-            sample.color = {0, 255, 0};
+            lightmap->colors[i] = {0, 255, 0};
         }
         // N.B.: Mark it as un-occluded now, to disable special handling later in the -extra/-extra4 downscaling code
-        surf_sample.occluded = false;
+        lightsurf->samples.occluded[i] = false;
     }
 
     Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, 0);
@@ -2174,7 +2633,7 @@ static void LightFace_DebugNeighbours(const mbsp_t *bsp, lightsurf_t *lightsurf,
 
     bool has_sample_on_dumpface = false;
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        if (lightsurf->samples[i].realfacenum == dump_facenum) {
+        if (lightsurf->samples.realfacenum[i] == dump_facenum) {
             has_sample_on_dumpface = true;
             break;
         }
@@ -2182,20 +2641,19 @@ static void LightFace_DebugNeighbours(const mbsp_t *bsp, lightsurf_t *lightsurf,
 
     /* Overwrite each point */
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        lightsample_t &sample = lightmap->samples[i];
-        const int &sample_face = lightsurf->samples[i].realfacenum;
+        const int sample_face = lightsurf->samples.realfacenum[i];
 
         if (sample_face == dump_facenum) {
             /* Red - the sample is on the selected face */
-            sample.color = {255, 0, 0};
+            lightmap->colors[i] = {255, 0, 0};
         } else if (has_sample_on_dumpface) {
             /* Green - the face has some samples on the selected face */
-            sample.color = {0, 255, 0};
+            lightmap->colors[i] = {0, 255, 0};
         } else {
-            sample.color = {};
+            lightmap->colors[i] = {};
         }
         // N.B.: Mark it as un-occluded now, to disable special handling later in the -extra/-extra4 downscaling code
-        lightsurf->samples[i].occluded = false;
+        lightsurf->samples.occluded[i] = false;
     }
 
     Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, 0);
@@ -2313,13 +2771,12 @@ static void LightFace_CalculateDirt(lightsurf_t *lightsurf)
     myRts.resize(lightsurf->samples.size());
 
     // init
-    for (int i = 0; i < lightsurf->samples.size(); i++) {
-        lightsurf->samples[i].occlusion = 0;
-    }
+    std::fill(lightsurf->samples.occlusion.begin(), lightsurf->samples.occlusion.end(), 0.0f);
 
     // this stuff is just per-point
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const auto [tangent, bitangent] = qv::MakeTangentAndBitangentUnnormalized(lightsurf->samples[i].normal);
+        const auto [tangent, bitangent] =
+            qv::MakeTangentAndBitangentUnnormalized(qvec3d(lightsurf->samples.normals[i]));
 
         myUps[i] = qv::normalize(tangent);
         myRts[i] = qv::normalize(bitangent);
@@ -2332,15 +2789,13 @@ static void LightFace_CalculateDirt(lightsurf_t *lightsurf)
         // fill in input buffers
 
         for (int i = 0; i < lightsurf->samples.size(); i++) {
-            const auto &sample = lightsurf->samples[i];
-
-            if (sample.occluded)
+            if (lightsurf->samples.occluded[i])
                 continue;
 
             qvec3d dirtvec = GetDirtVector(cfg, j);
-            qvec3d dir = TransformToTangentSpace(sample.normal, myUps[i], myRts[i], dirtvec);
+            qvec3d dir = TransformToTangentSpace(lightsurf->samples.normals[i], myUps[i], myRts[i], dirtvec);
 
-            rs.pushRay(i, sample.point, dir, cfg.dirtdepth.value());
+            rs.pushRay(i, lightsurf->samples.points[i], dir, cfg.dirtdepth.value());
         }
 
         // trace the batch. need closest hit for dirt, so intersection.
@@ -2354,17 +2809,17 @@ static void LightFace_CalculateDirt(lightsurf_t *lightsurf)
             const int i = rs.getPushedRayPointIndex(k);
             if (rs.getPushedRayHitType(k) == hittype_t::SOLID) {
                 vec_t dist = rs.getPushedRayHitDist(k);
-                lightsurf->samples[i].occlusion += std::min(cfg.dirtdepth.value(), dist);
+                lightsurf->samples.occlusion[i] += std::min(cfg.dirtdepth.value(), dist);
             } else {
-                lightsurf->samples[i].occlusion += cfg.dirtdepth.value();
+                lightsurf->samples.occlusion[i] += cfg.dirtdepth.value();
             }
         }
     }
 
     // process the results.
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        vec_t avgHitdist = lightsurf->samples[i].occlusion / (float)numDirtVectors;
-        lightsurf->samples[i].occlusion = 1.0 - (avgHitdist / cfg.dirtdepth.value());
+        vec_t avgHitdist = lightsurf->samples.occlusion[i] / (float)numDirtVectors;
+        lightsurf->samples.occlusion[i] = 1.0 - (avgHitdist / cfg.dirtdepth.value());
     }
 }
 
@@ -2376,7 +2831,7 @@ inline void LightFace_ScaleAndClamp(lightsurf_t *lightsurf)
 
     for (lightmap_t &lightmap : lightsurf->lightmapsByStyle) {
         for (int i = 0; i < lightsurf->samples.size(); i++) {
-            qvec3f &color = lightmap.samples[i].color;
+            qvec3f &color = lightmap.colors[i];
 
             /* Fix any negative values */
             color = qv::max(color, {0});
@@ -2469,6 +2924,8 @@ static void LightPoint_ScaleAndClamp(lightgrid_samples_t &result)
 
 void FinishLightmapSurface(const mbsp_t *bsp, lightsurf_t *lightsurf)
 {
+    LightSurface_Unpack(*lightsurf);
+
     /* Apply gamma, rangescale, and clamp */
     LightFace_ScaleAndClamp(lightsurf);
 }
@@ -2477,7 +2934,7 @@ static float Lightmap_AvgBrightness(const lightmap_t *lm, const lightsurf_t *lig
 {
     float avgb = 0;
     for (int j = 0; j < lightsurf->samples.size(); j++) {
-        avgb += LightSample_Brightness(lm->samples[j].color);
+        avgb += LightSample_Brightness(lm->colors[j]);
     }
     avgb /= lightsurf->samples.size();
     return avgb;
@@ -2487,7 +2944,7 @@ static float Lightmap_MaxBrightness(const lightmap_t *lm, const lightsurf_t *lig
 {
     float maxb = 0;
     for (int j = 0; j < lightsurf->samples.size(); j++) {
-        const float b = LightSample_Brightness(lm->samples[j].color);
+        const float b = LightSample_Brightness(lm->colors[j]);
         if (b > maxb) {
             maxb = b;
         }
@@ -2514,7 +2971,7 @@ static void DumpFullSizeLightmap(const mbsp_t *bsp, const lightsurf_t *lightsurf
 
         std::vector<uint8_t> rgbdata;
         for (int i = 0; i < lightsurf->numpoints; i++) {
-            const qvec3d &color = lm->samples[i].color;
+            const qvec3f &color = lm->colors[i];
             for (int j = 0; j < 3; j++) {
                 int intval = static_cast<int>(clamp(color[j], 0.0, 255.0));
                 rgbdata.push_back(static_cast<uint8_t>(intval));
@@ -2566,8 +3023,8 @@ static std::vector<qvec4f> LightmapColorsToGLMVector(const lightsurf_t *lightsur
 {
     std::vector<qvec4f> res;
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const qvec3d &color = lm->samples[i].color;
-        const float alpha = lightsurf->samples[i].occluded ? 0.0f : 1.0f;
+        const qvec3f &color = lm->colors[i];
+        const float alpha = lightsurf->samples.occluded[i] ? 0.0f : 1.0f;
         res.emplace_back(color[0], color[1], color[2], alpha);
     }
     return res;
@@ -2577,8 +3034,8 @@ static std::vector<qvec4f> LightmapNormalsToGLMVector(const lightsurf_t *lightsu
 {
     std::vector<qvec4f> res;
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const qvec3d &color = lm->samples[i].direction;
-        const float alpha = lightsurf->samples[i].occluded ? 0.0f : 1.0f;
+        const qvec3f &color = lm->directions[i];
+        const float alpha = lightsurf->samples.occluded[i] ? 0.0f : 1.0f;
         res.emplace_back(color[0], color[1], color[2], alpha);
     }
     return res;
@@ -2844,8 +3301,8 @@ bool Face_IsEmissive(const mbsp_t *bsp, const mface_t *face)
  * - Writes (actual_width * actual_height * 3) bytes to `lux`
  */
 static void WriteSingleLightmap(const mbsp_t *bsp, const mface_t *face, const lightsurf_t *lightsurf,
-    const lightmap_t *lm, const int actual_width, const int actual_height, uint8_t *out, uint8_t *lit, uint8_t *lux,
-    const faceextents_t &output_extents)
+    const lightmap_t *lm, const int actual_width, const int actual_height, uint8_t *out, uint8_t *lit, uint32_t *hdr,
+    uint8_t *lux, const faceextents_t &output_extents)
 {
     const int oversampled_width = actual_width * light_options.extra.value();
     const int oversampled_height = actual_height * light_options.extra.value();
@@ -3051,16 +3508,29 @@ static unsigned int HDR_PackResult(qvec4f rgba)
 
 
 
-void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
+/*
+ * ============
+ * PlanLightmapSurface
+ *
+ * First pass of saving a face: picks the styles to save, fills in the
+ * face's style info and returns how much output space it needs. The
+ * space is assigned in face order once every face has been planned.
+ * ============
+ */
+lightmap_output_t PlanLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
     bspx_decoupled_lm_perface *facesup_decoupled, lightsurf_t *lightsurf, const faceextents_t &extents,
     const faceextents_t &output_extents)
 {
     lightmapdict_t &lightmaps = lightsurf->lightmapsByStyle;
-    const int actual_width = extents.width();
-    const int actual_height = extents.height();
     const int output_width = output_extents.width();
     const int output_height = output_extents.height();
-    const int size = output_extents.numsamples();
+
+    lightmap_output_t output{.face = face,
+        .facesup = facesup,
+        .facesup_decoupled = facesup_decoupled,
+        .lightsurf = lightsurf,
+        .extents = &extents,
+        .output_extents = &output_extents};
 
     if (light_options.litonly.value()) {
         // special case for writing a .lit for a bsp without modifying the bsp.
@@ -3069,12 +3539,10 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
 
         if (face->lightofs == -1) {
             // nothing to write for this face
-            return;
+            return output;
         }
 
-        uint8_t *out, *lit, *lux;
-        uint32_t *hdr
-        GetFileSpace_PreserveOffsetInBsp(&out, &lit, &hdr, &lux, face->lightofs);
+        output.offset = face->lightofs;
 
         for (int mapnum = 0; mapnum < MAXLIGHTMAPS; mapnum++) {
             const int style = face->styles[mapnum];
@@ -3084,30 +3552,20 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
             }
 
             // see if we have computed lighting for this style
+            // if we didn't find a matching lightmap, just don't write anything
+            const lightmap_t *found = nullptr;
+
             for (const lightmap_t &lm : lightmaps) {
                 if (lm.style == style) {
-                    WriteSingleLightmap(
-                        bsp, face, lightsurf, &lm, actual_width, actual_height, out, lit, hdr, lux, output_extents);
+                    found = &lm;
                     break;
                 }
             }
-            // if we didn't find a matching lightmap, just don't write anything
 
-            if (out) {
-                out += size;
-            }
-            if (lit) {
-                lit += (size * 3);
-            }
-            if (hdr) {
-                hdr += size;
-            }
-            if (lux) {
-                lux += (size * 3);
-            }
+            output.lightmaps.push_back(found);
         }
 
-        return;
+        return output;
     }
 
     size_t maxfstyles = std::min((size_t)light_options.facestyles.value(), facesup ? MAXLIGHTMAPSSUP : MAXLIGHTMAPS);
@@ -3125,16 +3583,16 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
                 if (IsOutputtingSupplementaryData()) {
                     logging::print(
                         "INFO: a face has exceeded max light style id ({});\n LMSTYLE16 will be output to hold the non-truncated data.\n Use -verbose to find which faces.\n",
-                        maxstyle, lightsurf->samples[0].point);
+                        maxstyle, lightsurf->samples.points[0]);
                 } else {
                     logging::print(
                         "WARNING: a face has exceeded max light style id ({}). Use -verbose to find which faces.\n",
-                        maxstyle, lightsurf->samples[0].point);
+                        maxstyle, lightsurf->samples.points[0]);
                 }
                 warned_about_light_style_overflow = true;
             }
             logging::print(logging::flag::VERBOSE, "WARNING: Style {} too high on face near {}\n", lightmap.style,
-                lightsurf->samples[0].point);
+                lightsurf->samples.points[0]);
             continue;
         }
 
@@ -3156,9 +3614,7 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
         if (!sortable.size()) {
             lightmap_t *lm = Lightmap_ForStyle(&lightmaps, 0, lightsurf);
             lm->style = 0;
-            for (auto &sample : lightsurf->samples) {
-                sample.occluded = false;
-            }
+            std::fill(lightsurf->samples.occluded.begin(), lightsurf->samples.occluded.end(), false);
             sortable.emplace_back(0, lm);
         }
     }
@@ -3174,17 +3630,17 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
                 if (IsOutputtingSupplementaryData()) {
                     logging::print(
                         "INFO: a face has exceeded max light styles ({});\n LMSTYLE/LMSTYLE16 will be output to hold the non-truncated data.\n Use -verbose to find which faces.\n",
-                        maxfstyles, lightsurf->samples[0].point);
+                        maxfstyles, lightsurf->samples.points[0]);
                 } else {
                     logging::print(
                         "WARNING: a face has exceeded max light styles ({}). Use -verbose to find which faces.\n",
-                        maxfstyles, lightsurf->samples[0].point);
+                        maxfstyles, lightsurf->samples.points[0]);
                 }
                 warned_about_light_map_overflow = true;
             }
             logging::print(logging::flag::VERBOSE,
                 "WARNING: {} light styles (max {}) on face near {}; styles: ", sortable.size(), maxfstyles,
-                lightsurf->samples[0].point);
+                lightsurf->samples.points[0]);
             for (auto &p : sortable) {
                 logging::print(logging::flag::VERBOSE, "{} ", p.second->style);
             }
@@ -3234,38 +3690,77 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
     }
 
     if (!numstyles)
-        return;
+        return output;
 
-    uint8_t *out, *lit, *lux;
-    GetFileSpace(&out, &lit, &lux, size * numstyles);
+    // sanity check that we don't save a lightmap for a non-lightmapped face
+    {
+        Q_assert(Face_IsLightmapped(bsp, face));
+    }
 
-    int lightofs;
+    output.lightmaps = std::move(sorted);
+    output.size = output_extents.numsamples() * numstyles;
 
+    // write vanilla lightmap if -world_units_per_luxel is in use but not -novanilla
+    if (facesup_decoupled && !light_options.novanilla.value()) {
+        output.vanilla_size = lightsurf->vanilla_extents.numsamples() * numstyles;
+    }
+
+    return output;
+}
+
+// lightofs as stored in the bsp for an offset in samples
+static int LightmapOffsetToLightofs(const mbsp_t *bsp, int offset)
+{
     // Q2/HL native colored lightmaps
-    if (bsp->loadversion->game->has_rgb_lightmap) {
-        lightofs = lit - lit_filebase.data();
-    } else {
-        lightofs = out - filebase.data();
+    return bsp->loadversion->game->has_rgb_lightmap ? offset * 3 : offset;
+}
+
+/*
+ * ============
+ * SaveLightmapSurface
+ *
+ * Second pass: writes the lightmaps planned by PlanLightmapSurface at the
+ * offsets assigned to `output`. Each face owns its range, so faces can be
+ * saved in parallel.
+ * ============
+ */
+void SaveLightmapSurface(const mbsp_t *bsp, const lightmap_output_t &output)
+{
+    if (output.lightmaps.empty()) {
+        return;
     }
 
-    if (facesup_decoupled) {
-        facesup_decoupled->offset = lightofs;
-        face->lightofs = -1;
-    } else if (facesup) {
-        facesup->lightofs = lightofs;
+    const mface_t *face = output.face;
+    const lightsurf_t *lightsurf = output.lightsurf;
+    const int actual_width = output.extents->width();
+    const int actual_height = output.extents->height();
+    const int size = output.output_extents->numsamples();
+
+    uint8_t *out, *lit, *lux;
+    uint32_t *hdr;
+
+    if (light_options.litonly.value()) {
+        GetFileSpace_PreserveOffsetInBsp(&out, &lit, &hdr, &lux, output.offset);
     } else {
-        face->lightofs = lightofs;
-    }
+        GetFileSpace(&out, &lit, &hdr, &lux, output.offset);
 
-    // sanity check that we don't save a lightmap for a non-lightmapped face
-    {
-        Q_assert(Face_IsLightmapped(bsp, face));
-    }
+        const int lightofs = LightmapOffsetToLightofs(bsp, output.offset);
 
-    for (int mapnum = 0; mapnum < numstyles; mapnum++) {
-        const lightmap_t *lm = sorted.at(mapnum);
+        if (output.facesup_decoupled) {
+            output.facesup_decoupled->offset = lightofs;
+            output.face->lightofs = -1;
+        } else if (output.facesup) {
+            output.facesup->lightofs = lightofs;
+        } else {
+            output.face->lightofs = lightofs;
+        }
+    }
 
-        WriteSingleLightmap(bsp, face, lightsurf, lm, actual_width, actual_height, out, lit, lux, output_extents);
+    for (const lightmap_t *lm : output.lightmaps) {
+        if (lm) {
+            WriteSingleLightmap(
+                bsp, face, lightsurf, lm, actual_width, actual_height, out, lit, hdr, lux, *output.output_extents);
+        }
 
         if (out) {
             out += size;
@@ -3273,39 +3768,37 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
         if (lit) {
             lit += (size * 3);
         }
+        if (hdr) {
+            hdr += size;
+        }
         if (lux) {
             lux += (size * 3);
         }
     }
 
-    // write vanilla lightmap if -world_units_per_luxel is in use but not -novanilla
-    if (facesup_decoupled && !light_options.novanilla.value()) {
-        // FIXME: duplicates some code from above
-        GetFileSpace(&out, &lit, &lux, lightsurf->vanilla_extents.numsamples() * numstyles);
-
-        // Q2/HL native colored lightmaps
-        if (bsp->loadversion->game->has_rgb_lightmap) {
-            lightofs = lit - lit_filebase.data();
-        } else {
-            lightofs = out - filebase.data();
-        }
-        face->lightofs = lightofs;
+    if (!output.vanilla_size) {
+        return;
+    }
 
-        for (int mapnum = 0; mapnum < numstyles; mapnum++) {
-            const lightmap_t *lm = sorted.at(mapnum);
+    // FIXME: duplicates some code from above
+    GetFileSpace(&out, &lit, &hdr, &lux, output.vanilla_offset);
+    output.face->lightofs = LightmapOffsetToLightofs(bsp, output.vanilla_offset);
 
-            WriteSingleLightmap_FromDecoupled(bsp, face, lightsurf, lm, lightsurf->vanilla_extents.width(),
-                lightsurf->vanilla_extents.height(), out, lit, lux);
+    for (const lightmap_t *lm : output.lightmaps) {
+        WriteSingleLightmap_FromDecoupled(bsp, face, lightsurf, lm, lightsurf->vanilla_extents.width(),
+            lightsurf->vanilla_extents.height(), out, lit, hdr, lux);
 
-            if (out) {
-                out += lightsurf->vanilla_extents.numsamples();
-            }
-            if (lit) {
-                lit += (lightsurf->vanilla_extents.numsamples() * 3);
-            }
-            if (lux) {
-                lux += (lightsurf->vanilla_extents.numsamples() * 3);
-            }
+        if (out) {
+            out += lightsurf->vanilla_extents.numsamples();
+        }
+        if (lit) {
+            lit += (lightsurf->vanilla_extents.numsamples() * 3);
+        }
+        if (hdr) {
+            hdr += lightsurf->vanilla_extents.numsamples();
+        }
+        if (lux) {
+            lux += (lightsurf->vanilla_extents.numsamples() * 3);
         }
     }
 }
@@ -3333,53 +3826,229 @@ std::unique_ptr<lightsurf_t> CreateLightmapSurface(const mbsp_t *bsp, const mfac
 
 /*
  * ============
- * LightFace
+ * LightFace_DirectLights
+ *
+ * positive lights and local minlight; the part of DirectLightFace that
+ * casts rays
  * ============
  */
-void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg)
+static void LightFace_DirectLights(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg)
 {
     auto face = lightsurf.face;
-    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
-
+    const modelinfo_t *modelinfo = lightsurf.modelinfo;
     lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
 
-    /* calculate dirt (ambient occlusion) but don't use it yet */
-    if (dirt_in_use && (light_options.debugmode != debugmodes::phong))
-        LightFace_CalculateDirt(&lightsurf);
+    const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
 
-    /*
-     * The lighting procedure is: cast all positive lights, fix
-     * minlight levels, then cast all negative lights. Finally, we
-     * clamp any values that may have gone negative.
-     */
+    /* positive lights */
+    if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
+        for (const auto &entity : GetLights()) {
+            if (entity->getFormula() == LF_LOCALMIN)
+                continue;
+            if (entity->nostaticlight.value())
+                continue;
+            if (entity->light.value() > 0)
+                LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps);
+        }
+        for (const sun_t &sun : GetSuns())
+            if (sun.sunlight > 0 && !SunIsSkySampled(sun))
+                LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
+        LightFace_SkySamples(bsp, &lightsurf, lightmaps, false);
 
-    if (light_options.debugmode == debugmodes::none) {
+        // mxd. Add surface lights...
+        // FIXME: negative surface lights
+        LightFace_SurfaceLight(
+            bsp, &lightsurf, lightmaps, std::nullopt, cfg.surflightscale.value(), cfg.surflightskyscale.value(), 16.0f);
+    }
 
-        total_samplepoints += lightsurf.samples.size();
+    LightFace_LocalMin(bsp, face, &lightsurf, lightmaps);
+}
 
-        const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+/*
+ * ============
+ * LightFace_AdaptiveExtra
+ *
+ * -adaptiveextra: light the sample nearest the center of each luxel,
+ * then light the rest of the samples only in luxels that are partially
+ * covered or whose center differs from a neighbouring luxel's by more
+ * than -adaptiveextra_threshold. The other samples copy their center.
+ *
+ * Every light loop already skips samples.occluded, so each pass hides
+ * the samples it doesn't want lit behind it. Rays are counted as traced
+ * (Trace_ThreadRayCount), dirt rays included.
+ * ============
+ */
+static void LightFace_AdaptiveExtra(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg)
+{
+    auto &samples = lightsurf.samples;
+    const int extra = light_options.extra.value();
+    const int luxels_w = lightsurf.width / extra;
+    const int luxels_h = lightsurf.height / extra;
+    const float threshold = light_options.adaptiveextra_threshold.value();
+
+    const auto center_sample = [&](int lx, int ly) {
+        return static_cast<size_t>((ly * extra + extra / 2) * lightsurf.width + lx * extra + extra / 2);
+    };
+    const auto luxel_of = [&](size_t i) {
+        return static_cast<size_t>((i / lightsurf.width) / extra * luxels_w + (i % lightsurf.width) / extra);
+    };
 
-        /* positive lights */
-        if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
-            for (const auto &entity : GetLights()) {
-                if (entity->getFormula() == LF_LOCALMIN)
-                    continue;
-                if (entity->nostaticlight.value())
-                    continue;
-                if (entity->light.value() > 0)
-                    LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps);
+    const std::vector<uint8_t> occluded = samples.occluded;
+    const uint64_t start_rays = Trace_ThreadRayCount();
+    std::vector<uint8_t> is_center(samples.size(), 0);
+    std::vector<uint8_t> flagged(luxels_w * luxels_h, 0);
+
+    for (int ly = 0; ly < luxels_h; ly++) {
+        for (int lx = 0; lx < luxels_w; lx++) {
+            is_center[center_sample(lx, ly)] = 1;
+        }
+    }
+
+    const auto run_pass = [&](auto &&active) {
+        size_t lit = 0;
+
+        for (size_t i = 0; i < samples.size(); i++) {
+            samples.occluded[i] = occluded[i] || !active(i);
+            lit += !samples.occluded[i];
+        }
+
+        if (dirt_in_use) {
+            // LightFace_CalculateDirt resets every sample; keep what earlier passes found
+            thread_local std::vector<float> previous;
+            previous = samples.occlusion;
+
+            LightFace_CalculateDirt(&lightsurf);
+
+            for (size_t i = 0; i < samples.size(); i++) {
+                if (samples.occluded[i]) {
+                    samples.occlusion[i] = previous[i];
+                }
             }
-            for (const sun_t &sun : GetSuns())
-                if (sun.sunlight > 0)
-                    LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
+        }
 
-            // mxd. Add surface lights...
-            // FIXME: negative surface lights
-            LightFace_SurfaceLight(
-                bsp, &lightsurf, lightmaps, std::nullopt, cfg.surflightscale.value(), cfg.surflightskyscale.value(), 16.0f);
+        LightFace_DirectLights(bsp, lightsurf, cfg);
+        return lit;
+    };
+
+    size_t lit = run_pass([&](size_t i) { return is_center[i]; });
+
+    // luxels that are partially covered (or whose center is outside the face)
+    for (size_t i = 0; i < samples.size(); i++) {
+        if (occluded[i]) {
+            flagged[luxel_of(i)] = 1;
         }
+    }
 
-        LightFace_LocalMin(bsp, face, &lightsurf, lightmaps);
+    const auto differs = [&](size_t a, size_t b) {
+        for (const lightmap_t &lm : lightsurf.lightmapsByStyle) {
+            if (lm.style == INVALID_LIGHTSTYLE) {
+                continue;
+            }
+
+            const float la = LightSample_Brightness(lm.colors[a]);
+            const float lb = LightSample_Brightness(lm.colors[b]);
+            const float delta = fabs(la - lb);
+
+            // ignore differences below one output step
+            if (delta > 1.0f && delta > threshold * std::max(fabs(la), fabs(lb))) {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    for (int ly = 0; ly < luxels_h; ly++) {
+        for (int lx = 0; lx < luxels_w; lx++) {
+            const size_t a = center_sample(lx, ly);
+
+            if (lx + 1 < luxels_w && differs(a, center_sample(lx + 1, ly))) {
+                flagged[ly * luxels_w + lx] = flagged[ly * luxels_w + lx + 1] = 1;
+            }
+            if (ly + 1 < luxels_h && differs(a, center_sample(lx, ly + 1))) {
+                flagged[ly * luxels_w + lx] = flagged[(ly + 1) * luxels_w + lx] = 1;
+            }
+        }
+    }
+
+    const uint64_t center_rays = Trace_ThreadRayCount();
+    lit += run_pass([&](size_t i) { return !is_center[i] && flagged[luxel_of(i)]; });
+    const uint64_t supersample_rays = Trace_ThreadRayCount() - center_rays;
+
+    samples.occluded = occluded;
+
+    // fill the samples of the flat luxels from their center
+    for (size_t i = 0; i < samples.size(); i++) {
+        if (occluded[i] || is_center[i] || flagged[luxel_of(i)]) {
+            continue;
+        }
+
+        const size_t luxel = luxel_of(i);
+        const size_t center = center_sample(luxel % luxels_w, luxel / luxels_w);
+
+        samples.occlusion[i] = samples.occlusion[center];
+
+        for (lightmap_t &lm : lightsurf.lightmapsByStyle) {
+            if (lm.style == INVALID_LIGHTSTYLE) {
+                continue;
+            }
+
+            lm.colors[i] = lm.colors[center];
+            lm.directions[i] = lm.directions[center];
+        }
+    }
+
+    const size_t coverable = std::count(occluded.begin(), occluded.end(), 0);
+
+    if (std::find(flagged.begin(), flagged.end(), 1) == flagged.end()) {
+        adaptive_flat_faces++;
+        adaptive_flat_samples += coverable;
+        adaptive_flat_samples_lit += lit;
+        adaptive_flat_rays += Trace_ThreadRayCount() - start_rays;
+    } else {
+        adaptive_edge_faces++;
+        adaptive_edge_samples += coverable;
+        adaptive_edge_samples_lit += lit;
+        adaptive_edge_rays += Trace_ThreadRayCount() - start_rays;
+        adaptive_supersample_rays += supersample_rays;
+    }
+}
+
+/*
+ * ============
+ * LightFace
+ * ============
+ */
+void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg)
+{
+    PROFILE_DETAIL_ZONE("DirectLightFace", "face", Face_GetNum(bsp, lightsurf.face));
+
+    lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
+
+    const bool adaptive = light_options.adaptiveextra.value() && light_options.extra.value() > 1 &&
+                          light_options.debugmode == debugmodes::none;
+
+    if (adaptive) {
+        total_samplepoints += lightsurf.samples.size();
+
+        /* dirt is calculated per pass, for the samples being lit */
+        LightFace_AdaptiveExtra(bsp, lightsurf, cfg);
+    } else {
+        /* calculate dirt (ambient occlusion) but don't use it yet */
+        if (dirt_in_use && (light_options.debugmode != debugmodes::phong))
+            LightFace_CalculateDirt(&lightsurf);
+
+        /*
+         * The lighting procedure is: cast all positive lights, fix
+         * minlight levels, then cast all negative lights. Finally, we
+         * clamp any values that may have gone negative.
+         */
+
+        if (light_options.debugmode == debugmodes::none) {
+            total_samplepoints += lightsurf.samples.size();
+
+            LightFace_DirectLights(bsp, lightsurf, cfg);
+        }
     }
 
     /* replace lightmaps with AO for debugging */
@@ -3394,6 +4063,9 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
 
     if (light_options.debugmode == debugmodes::debugneighbours)
         LightFace_DebugNeighbours(bsp, &lightsurf, lightmaps);
+
+    /* bounce and post-processing still accumulate into these, so keep them exact */
+    LightSurface_Pack(lightsurf, false);
 }
 
 /*
@@ -3403,10 +4075,14 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
  */
 void IndirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, size_t bounce_depth)
 {
+    PROFILE_DETAIL_ZONE("IndirectLightFace", "face", Face_GetNum(bsp, lightsurf.face), "bounce", bounce_depth);
+
     auto face = lightsurf.face;
     const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
     lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
 
+    LightSurface_Unpack(lightsurf);
+
     if (light_options.debugmode == debugmodes::none) {
         const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
 
@@ -3419,6 +4095,8 @@ void IndirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings
                 bsp, &lightsurf, lightmaps, bounce_depth, cfg.bouncescale.value() * 0.5, cfg.bouncescale.value(), 128.0f);
         }
     }
+
+    LightSurface_Pack(lightsurf, false);
 }
 
 /*
@@ -3433,6 +4111,8 @@ void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const setti
 
     lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
 
+    LightSurface_Unpack(lightsurf);
+
     if (light_options.debugmode == debugmodes::none) {
 
         total_samplepoints += lightsurf.samples.size();
@@ -3485,13 +4165,17 @@ void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const setti
                     LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps);
             }
             for (const sun_t &sun : GetSuns())
-                if (sun.sunlight < 0)
+                if (sun.sunlight < 0 && !SunIsSkySampled(sun))
                     LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
+            LightFace_SkySamples(bsp, &lightsurf, lightmaps, true);
         }
     }
 
     if (light_options.debugmode == debugmodes::mottle)
         LightFace_DebugMottle(bsp, &lightsurf, lightmaps);
+
+    /* nothing more is added after this, so half precision is enough until FinishLightmapSurface */
+    LightSurface_Pack(lightsurf, true);
 }
 // lightgrid
 
@@ -3622,7 +4306,7 @@ lightgrid_samples_t CalcLightgridAtPoint(const mbsp_t *bsp, const qvec3d &world_
     raystream_occlusion_t rs(1);
     raystream_intersection_t rsi(1);
 
-    const auto *pvs = Mod_LeafPvs(bsp, BSP_FindLeafAtPoint(bsp, &bsp->dmodels[0], world_point));
+    const auto *pvs = Mod_LeafPvs(bsp, Light_PointInLeaf(bsp, world_point));
 
     auto &cfg = light_options;
 
@@ -3705,6 +4389,22 @@ void ResetLtFace()
 
     fully_transparent_lightmaps = 0;
 
+    total_pvs_faces = 0;
+    total_pvs_sets = 0;
+    adaptive_flat_faces = 0;
+    adaptive_edge_faces = 0;
+    adaptive_flat_samples = 0;
+    adaptive_flat_samples_lit = 0;
+    adaptive_edge_samples = 0;
+    adaptive_edge_samples_lit = 0;
+    adaptive_flat_rays = 0;
+    adaptive_edge_rays = 0;
+    adaptive_supersample_rays = 0;
+    compact_lightmap_dense_bytes = 0;
+    compact_lightmap_packed_bytes = 0;
+    pvs_intern.clear();
+    pvs_all_visible = nullptr;
+
     warned_about_light_map_overflow = false;
     warned_about_light_style_overflow = false;
 }
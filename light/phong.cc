@@ -33,9 +33,11 @@
 #include <unordered_map>
 #include <set>
 #include <algorithm>
-#include <mutex>
+#include <atomic>
+#include <numeric>
 
 #include <common/qvec.hh>
+#include <tbb/parallel_for.h>
 #include <tbb/parallel_for_each.h>
 
 face_cache_t::face_cache_t(){};
@@ -177,33 +179,97 @@ static float AngleBetweenPoints(const qvec3f &p1, const qvec3f &p2, const qvec3f
     return result;
 }
 
+/**
+ * Compressed sparse row adjacency table: the items for key `i` are
+ * `items[offsets[i] .. offsets[i + 1])`.
+ */
+template<typename T>
+struct csr_table_t
+{
+    std::vector<uint32_t> offsets;
+    std::vector<T> items;
+
+    size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+    std::span<const T> operator[](size_t key) const
+    {
+        if (key >= size())
+            return {};
+        return {items.data() + offsets[key], items.data() + offsets[key + 1]};
+    }
+};
+
+/**
+ * Builds a csr_table_t with `num_keys` keys in parallel.
+ *
+ * `visit(source_index, emit)` is called once per source in [0, num_sources),
+ * twice over (a counting pass and a filling pass); it must call
+ * `emit(key, value)` for each entry and be deterministic. Each key's items
+ * are sorted afterwards, so the result doesn't depend on thread scheduling.
+ */
+template<typename T, typename Visit>
+static csr_table_t<T> MakeCSRTable(size_t num_keys, size_t num_sources, Visit visit)
+{
+    csr_table_t<T> result;
+    std::vector<std::atomic<uint32_t>> cursors(num_keys);
+
+    tbb::parallel_for(static_cast<size_t>(0), num_sources, [&](size_t i) {
+        visit(i, [&](size_t key, const T &) { cursors[key].fetch_add(1, std::memory_order_relaxed); });
+    });
+
+    result.offsets.resize(num_keys + 1);
+    result.offsets[0] = 0;
+    for (size_t key = 0; key < num_keys; key++) {
+        result.offsets[key + 1] = result.offsets[key] + cursors[key].load(std::memory_order_relaxed);
+        cursors[key].store(result.offsets[key], std::memory_order_relaxed);
+    }
+
+    result.items.resize(result.offsets[num_keys]);
+
+    tbb::parallel_for(static_cast<size_t>(0), num_sources, [&](size_t i) {
+        visit(i, [&](size_t key, const T &value) {
+            result.items[cursors[key].fetch_add(1, std::memory_order_relaxed)] = value;
+        });
+    });
+
+    tbb::parallel_for(static_cast<size_t>(0), num_keys, [&](size_t key) {
+        std::sort(result.items.begin() + result.offsets[key], result.items.begin() + result.offsets[key + 1]);
+    });
+
+    return result;
+}
+
 static bool s_builtPhongCaches;
-static std::unordered_map<const mface_t *, std::vector<face_normal_t>> vertex_normals;
-static std::map<const mface_t *, std::set<const mface_t *>> smoothFaces;
-static std::map<int, std::vector<const mface_t *>> vertsToFaces;
-static std::map<int, std::vector<const mface_t *>> planesToFaces;
+// face number -> offset of the face's first vertex normal in vertex_normals
+static std::vector<uint32_t> vertex_normal_offsets;
+static std::vector<face_normal_t> vertex_normals;
+// face number -> faces to smooth with (sorted, unique)
+static csr_table_t<const mface_t *> smoothFaces;
+// vertex number -> faces using it (sorted by face number)
+static csr_table_t<const mface_t *> vertsToFaces;
+// plane number -> faces on it (sorted by face number)
+static csr_table_t<const mface_t *> planesToFaces;
 static edgeToFaceMap_t EdgeToFaceMap;
 static std::vector<face_cache_t> FaceCache;
+static const mbsp_t *s_phongBsp;
 
 void ResetPhong()
 {
     s_builtPhongCaches = false;
+    vertex_normal_offsets = {};
     vertex_normals = {};
     smoothFaces = {};
     vertsToFaces = {};
     planesToFaces = {};
     EdgeToFaceMap = {};
     FaceCache = {};
+    s_phongBsp = nullptr;
 }
 
 std::vector<const mface_t *> FacesUsingVert(int vertnum)
 {
-    const auto &vertsToFaces_const = vertsToFaces;
-
-    auto it = vertsToFaces_const.find(vertnum);
-    if (it != vertsToFaces_const.end())
-        return it->second;
-    return {};
+    auto faces = vertsToFaces[vertnum];
+    return {faces.begin(), faces.end()};
 }
 
 const edgeToFaceMap_t &GetEdgeToFaceMap()
@@ -217,41 +283,22 @@ bool FacesSmoothed(const mface_t *f1, const mface_t *f2)
 {
     Q_assert(s_builtPhongCaches);
 
-    const auto &facesIt = smoothFaces.find(f1);
-    if (facesIt == smoothFaces.end())
-        return false;
-
-    const std::set<const mface_t *> &faceSet = facesIt->second;
-    if (faceSet.find(f2) == faceSet.end())
-        return false;
-
-    return true;
+    const auto faces = smoothFaces[Face_GetNum(s_phongBsp, f1)];
+    return std::binary_search(faces.begin(), faces.end(), f2);
 }
 
-const std::set<const mface_t *> &GetSmoothFaces(const mface_t *face)
+std::span<const mface_t *const> GetSmoothFaces(const mface_t *face)
 {
     Q_assert(s_builtPhongCaches);
 
-    static std::set<const mface_t *> empty;
-    const auto it = smoothFaces.find(face);
-
-    if (it == smoothFaces.end())
-        return empty;
-
-    return it->second;
+    return smoothFaces[Face_GetNum(s_phongBsp, face)];
 }
 
-const std::vector<const mface_t *> &GetPlaneFaces(const mface_t *face)
+std::span<const mface_t *const> GetPlaneFaces(const mface_t *face)
 {
     Q_assert(s_builtPhongCaches);
 
-    static std::vector<const mface_t *> empty;
-    const auto it = planesToFaces.find(face->planenum);
-
-    if (it == planesToFaces.end())
-        return empty;
-
-    return it->second;
+    return planesToFaces[face->planenum];
 }
 
 // Adapted from https://github.com/NVIDIAGameWorks/donut/blob/main/src/engine/GltfImporter.cpp#L684
@@ -277,13 +324,13 @@ const face_normal_t &GetSurfaceVertexNormal(const mbsp_t *bsp, const mface_t *f,
     Q_assert(s_builtPhongCaches);
 
     // handle degenerate faces
-    const auto it = vertex_normals.find(f);
-    if (it == vertex_normals.end()) {
+    if (f->numedges < 3) {
         static const face_normal_t empty{};
         return empty;
     }
-    const auto &face_normals_vec = it->second;
-    return face_normals_vec.at(vertindex);
+
+    Q_assert(vertindex >= 0 && vertindex < f->numedges);
+    return vertex_normals[vertex_normal_offsets[Face_GetNum(bsp, f)] + vertindex];
 }
 
 const mface_t *Face_EdgeIndexSmoothed(const mbsp_t *bsp, const mface_t *f, const int edgeindex)
@@ -370,7 +417,9 @@ static edgeToFaceMap_t MakeEdgeToFaceMap(const mbsp_t *bsp)
 static std::vector<face_normal_t> Face_VertexNormals(const mbsp_t *bsp, const mface_t *face)
 {
     std::vector<face_normal_t> normals(face->numedges);
-    tbb::parallel_for(0, face->numedges, [&](size_t i) { normals[i] = GetSurfaceVertexNormal(bsp, face, i); });
+    for (int i = 0; i < face->numedges; i++) {
+        normals[i] = GetSurfaceVertexNormal(bsp, face, i);
+    }
     return normals;
 }
 
@@ -427,6 +476,7 @@ void CalculateVertexNormals(const mbsp_t *bsp)
 
     Q_assert(!s_builtPhongCaches);
     s_builtPhongCaches = true;
+    s_phongBsp = bsp;
 
     EdgeToFaceMap = MakeEdgeToFaceMap(bsp);
 
@@ -446,111 +496,151 @@ void CalculateVertexNormals(const mbsp_t *bsp)
         }
     }
 
-    for (auto &f : bsp->dfaces) {
-        // build "plane -> faces" map
-        planesToFaces[f.planenum].push_back(&f);
+    const size_t num_faces = bsp->dfaces.size();
+
+    // build "plane -> faces" map
+    planesToFaces = MakeCSRTable<const mface_t *>(bsp->dplanes.size(), num_faces, [bsp](size_t i, auto &&emit) {
+        const mface_t &f = bsp->dfaces[i];
+        emit(f.planenum, &f);
+    });
 
-        // build "vert index -> faces" map
+    // build "vert index -> faces" map
+    vertsToFaces = MakeCSRTable<const mface_t *>(bsp->dvertexes.size(), num_faces, [bsp](size_t i, auto &&emit) {
+        const mface_t &f = bsp->dfaces[i];
         for (size_t j = 0; j < f.numedges; j++) {
-            const int v = Face_VertexAtIndex(bsp, &f, j);
-            vertsToFaces[v].push_back(&f);
+            emit(Face_VertexAtIndex(bsp, &f, j), &f);
         }
-    }
+    });
 
-    // build the "face -> faces to smooth with" map
-    for (auto &f : bsp->dfaces) {
-        // Q2 shading groups
-        const int f_phongValue = Q2_FacePhongValue(bsp, &f);
+    // per-face phong settings, evaluated once instead of once per neighbour
+    struct face_phong_t
+    {
+        bool wants_phong;
+        int phong_value;
+        vec_t phong_angle;
+        vec_t phong_angle_concave;
+        const mtexinfo_t *texinfo;
+        qvec3d normal;
+        qplane3d plane;
+        qvec3f centroid;
+    };
+
+    std::vector<face_phong_t> face_phong(num_faces);
+
+    tbb::parallel_for(static_cast<size_t>(0), num_faces, [&](size_t i) {
+        const mface_t &f = bsp->dfaces[i];
+        face_phong_t &fp = face_phong[i];
 
-        // Q1 phong angle stuff
-        auto *f_texinfo = Face_Texinfo(bsp, &f);
-        const auto f_points = Face_Points(bsp, &f);
-        const qvec3d f_norm = Face_Normal(bsp, &f);
-        const qplane3d f_plane = Face_Plane(bsp, &f);
+        // Q2 shading groups
+        fp.phong_value = Q2_FacePhongValue(bsp, &f);
 
         // any face normal within this many degrees can be smoothed with this face
-        vec_t f_phong_angle = extended_texinfo_flags[f.texinfo].phong_angle;
-        if (f_phong_angle == 0 && f_phongValue != 0) {
+        fp.phong_angle = extended_texinfo_flags[f.texinfo].phong_angle;
+        if (fp.phong_angle == 0 && fp.phong_value != 0) {
             // if Q2 style phong is requested, but Q1 is not in use, set the default phong angle
-            f_phong_angle = modelinfo_t::DEFAULT_PHONG_ANGLE;
+            fp.phong_angle = modelinfo_t::DEFAULT_PHONG_ANGLE;
         }
-        vec_t f_phong_angle_concave = extended_texinfo_flags[f.texinfo].phong_angle_concave;
-        if (f_phong_angle_concave == 0) {
-            f_phong_angle_concave = f_phong_angle;
+        fp.phong_angle_concave = extended_texinfo_flags[f.texinfo].phong_angle_concave;
+        if (fp.phong_angle_concave == 0) {
+            fp.phong_angle_concave = fp.phong_angle;
         }
-        const bool f_wants_phong = (f_phong_angle || f_phong_angle_concave);
+        fp.wants_phong = (fp.phong_angle || fp.phong_angle_concave) && !extended_texinfo_flags[f.texinfo].no_phong;
 
-        if (!f_wants_phong)
-            continue;
+        if (!fp.wants_phong)
+            return;
 
-        if (extended_texinfo_flags[f.texinfo].no_phong)
-            continue;
+        fp.texinfo = Face_Texinfo(bsp, &f);
+        fp.normal = Face_Normal(bsp, &f);
+        fp.plane = Face_Plane(bsp, &f);
 
-        for (int j = 0; j < f.numedges; j++) {
-            const int v = Face_VertexAtIndex(bsp, &f, j);
-            // walk over all faces incident to f (we will walk over neighbours multiple times, doesn't matter)
-            for (const mface_t *f2 : vertsToFaces[v]) {
-                if (f2 == &f)
-                    continue;
+        const auto points = Face_Points(bsp, &f);
+        fp.centroid = qv::PolyCentroid(points.begin(), points.end());
+    });
 
-                // FIXME: factor out and share with above?
-                const int f2_phongValue = Q2_FacePhongValue(bsp, f2);
-                vec_t f2_phong_angle = extended_texinfo_flags[f2->texinfo].phong_angle;
-                if (f2_phong_angle == 0 && f2_phongValue != 0) {
-                    // if Q2 style phong is requested, but Q1 is not in use, set the default phong angle
-                    f2_phong_angle = modelinfo_t::DEFAULT_PHONG_ANGLE;
-                }
-                vec_t f2_phong_angle_concave = extended_texinfo_flags[f2->texinfo].phong_angle_concave;
-                if (f2_phong_angle_concave == 0) {
-                    f2_phong_angle_concave = f2_phong_angle;
-                }
-                const bool f2_wants_phong = (f2_phong_angle || f2_phong_angle_concave);
+    // build the "face -> faces to smooth with" map
+    {
+        std::vector<std::vector<const mface_t *>> smoothed(num_faces);
+
+        tbb::parallel_for(static_cast<size_t>(0), num_faces, [&](size_t i) {
+            const mface_t &f = bsp->dfaces[i];
+            const face_phong_t &fp = face_phong[i];
 
-                if (!f2_wants_phong)
+            if (!fp.wants_phong)
+                return;
+
+            // gather all faces incident to f, once each
+            std::vector<const mface_t *> candidates;
+            for (int j = 0; j < f.numedges; j++) {
+                const auto faces = vertsToFaces[Face_VertexAtIndex(bsp, &f, j)];
+                candidates.insert(candidates.end(), faces.begin(), faces.end());
+            }
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            auto &result = smoothed[i];
+
+            for (const mface_t *f2 : candidates) {
+                if (f2 == &f)
                     continue;
 
-                if (extended_texinfo_flags[f2->texinfo].no_phong)
+                const face_phong_t &f2p = face_phong[Face_GetNum(bsp, f2)];
+
+                if (!f2p.wants_phong)
                     continue;
 
-                auto *f2_texinfo = Face_Texinfo(bsp, f2);
-                if (f2_texinfo != nullptr && f_texinfo != nullptr) {
-                    if (!bsp->loadversion->game->surfflags_may_phong(f_texinfo->flags, f2_texinfo->flags)) {
+                if (f2p.texinfo != nullptr && fp.texinfo != nullptr) {
+                    if (!bsp->loadversion->game->surfflags_may_phong(fp.texinfo->flags, f2p.texinfo->flags)) {
                         // phong may be blocked by the gamedef, e.g. warping and non-warping never phong
                         continue;
                     }
                 }
 
-                const auto f2_points = Face_Points(bsp, f2);
-                const qvec3f f2_centroid = qv::PolyCentroid(f2_points.begin(), f2_points.end());
-                const qvec3d f2_norm = Face_Normal(bsp, f2);
+                const vec_t cosangle = qv::dot(fp.normal, f2p.normal);
 
-                const vec_t cosangle = qv::dot(f_norm, f2_norm);
-
-                const bool concave = f_plane.distance_to(f2_centroid) > 0.1;
-                const vec_t f_threshold = concave ? f_phong_angle_concave : f_phong_angle;
-                const vec_t f2_threshold = concave ? f2_phong_angle_concave : f2_phong_angle;
+                const bool concave = fp.plane.distance_to(f2p.centroid) > 0.1;
+                const vec_t f_threshold = concave ? fp.phong_angle_concave : fp.phong_angle;
+                const vec_t f2_threshold = concave ? f2p.phong_angle_concave : f2p.phong_angle;
                 const vec_t min_threshold = std::min(f_threshold, f2_threshold);
                 const vec_t cosmaxangle = cos(DEG2RAD(min_threshold));
 
-                if (f_phongValue != f2_phongValue) {
+                if (fp.phong_value != f2p.phong_value) {
                     // mismatched smoothing groups never phong
                     continue;
                 }
 
                 // check the angle between the face normals
                 if (cosangle >= cosmaxangle) {
-                    smoothFaces[&f].insert(f2);
+                    result.push_back(f2);
                 }
             }
+        });
+
+        // flatten; candidates were sorted, so each face's list already is
+        smoothFaces = MakeCSRTable<const mface_t *>(num_faces, num_faces, [&](size_t i, auto &&emit) {
+            for (const mface_t *f2 : smoothed[i]) {
+                emit(i, f2);
+            }
+        });
+    }
+
+    size_t num_smoothed_faces = 0;
+    for (size_t i = 0; i < num_faces; i++) {
+        if (!smoothFaces[i].empty()) {
+            num_smoothed_faces++;
         }
     }
+    logging::print(logging::flag::VERBOSE, "        {} faces for smoothing\n", num_smoothed_faces);
 
-    logging::print(logging::flag::VERBOSE, "        {} faces for smoothing\n", smoothFaces.size());
+    // one normal per vertex of each face
+    vertex_normal_offsets.resize(num_faces + 1);
+    vertex_normal_offsets[0] = 0;
+    for (size_t i = 0; i < num_faces; i++) {
+        vertex_normal_offsets[i + 1] = vertex_normal_offsets[i] + std::max(0, bsp->dfaces[i].numedges);
+    }
+    vertex_normals.resize(vertex_normal_offsets[num_faces]);
 
     // finally do the smoothing for each face
-    std::mutex normalsMutex;
-
-    logging::parallel_for_each(bsp->dfaces, [bsp, &normalsMutex](const mface_t &f) {
+    logging::parallel_for_each(bsp->dfaces, [bsp](const mface_t &f) {
         if (f.numedges < 3) {
             logging::funcprint("face {} is degenerate with {} edges\n", Face_GetNum(bsp, &f), f.numedges);
             for (int j = 0; j < f.numedges; j++) {
@@ -566,14 +656,11 @@ void CalculateVertexNormals(const mbsp_t *bsp)
         std::tuple<qvec3f, qvec3f> tangents(t1.col(0).xyz(), qv::normalize(t1.col(1).xyz()));
 
         // gather up f and neighboursToSmooth
+        const auto neighboursToSmooth = smoothFaces[Face_GetNum(bsp, &f)];
         std::vector<const mface_t *> fPlusNeighbours;
+        fPlusNeighbours.reserve(neighboursToSmooth.size() + 1);
         fPlusNeighbours.push_back(&f);
-        auto neighboursIt = smoothFaces.find(&f);
-
-        if (neighboursIt != smoothFaces.end()) {
-            const auto &neighboursToSmooth = neighboursIt->second;
-            std::copy(neighboursToSmooth.begin(), neighboursToSmooth.end(), std::back_inserter(fPlusNeighbours));
-        }
+        fPlusNeighbours.insert(fPlusNeighbours.end(), neighboursToSmooth.begin(), neighboursToSmooth.end());
 
         // global vertex index -> smoothed normal
         std::unordered_map<int, face_normal_t> smoothedNormals;
@@ -649,24 +736,13 @@ void CalculateVertexNormals(const mbsp_t *bsp)
             }
         }
 
-        // sanity check
-        if (neighboursIt != smoothFaces.end()) {
-            const auto &neighboursToSmooth = neighboursIt->second;
-            if (!neighboursToSmooth.size()) {
-                for (auto &vertIndexNormalPair : smoothedNormals) {
-                    Q_assert(qv::epsilonEqual(vertIndexNormalPair.second.normal, f_norm, (float)LIGHT_EQUAL_EPSILON));
-                }
-            }
-        }
-
         // now, record all of the smoothed normals that are actually part of `f`
+        face_normal_t *out = &vertex_normals[vertex_normal_offsets[Face_GetNum(bsp, &f)]];
         for (int j = 0; j < f.numedges; j++) {
             int v = Face_VertexAtIndex(bsp, &f, j);
             Q_assert(smoothedNormals.find(v) != smoothedNormals.end());
 
-            normalsMutex.lock();
-            vertex_normals[&f].push_back(smoothedNormals[v]);
-            normalsMutex.unlock();
+            out[j] = smoothedNormals[v];
         }
     });
 
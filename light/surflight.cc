@@ -23,7 +23,7 @@ See file, 'COPYING', for details.
 #include <cassert>
 
 #include <light/entities.hh> // for FixLightOnFace
-#include <light/trace.hh> // for Light_PointInLeaf
+#include <light/trace.hh> // for Light_PointsInLeafs
 #include <light/light.hh>
 #include <light/ltface.hh>
 
@@ -174,10 +174,11 @@ static void MakeSurfaceLight(const mbsp_t *bsp, const settings::worldspawn_keys
             l->bounds = EstimateVisibleBoundsAtPoint(l->pos);
         }
 
-        for (auto &pt : l->points) {
-            if (light_options.visapprox.value() == visapprox_t::VIS) {
-                l->leaves.push_back(Light_PointInLeaf(bsp, pt));
-            } else if (light_options.visapprox.value() == visapprox_t::RAYS) {
+        if (light_options.visapprox.value() == visapprox_t::VIS) {
+            l->leaves.resize(l->points.size());
+            Light_PointsInLeafs(bsp, l->points, l->leaves);
+        } else if (light_options.visapprox.value() == visapprox_t::RAYS) {
+            for (auto &pt : l->points) {
                 l->bounds += EstimateVisibleBoundsAtPoint(pt);
             }
         }
@@ -19,8 +19,77 @@
 
 #include <light/trace.hh>
 
+#include <light/light.hh>
+#include <light/trace_bvh.hh>
+#ifdef HAVE_EMBREE
+#include <light/trace_embree.hh>
+#endif
+
 #include <common/imglib.hh>
 #include <common/bsputils.hh>
+#include <common/bspfile.hh>
+#include <common/polylib.hh>
+#include <common/profile.hh>
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include <fmt/chrono.h>
+
+/*
+==============
+point tree
+
+bsp2_dnode_t only holds a plane number, so walking dnodes touches a node
+and then a plane per level. The point tree copies each node's plane in,
+so a level is one 32 byte record (two per cache line.) Node numbers match
+dnodes, so any model's headnode can be used as a root.
+==============
+*/
+struct alignas(32) point_tree_node_t
+{
+    dplane_t plane;
+    std::array<int32_t, 2> children; /* negative numbers are -(leafs+1), as in dnodes */
+};
+
+static_assert(sizeof(point_tree_node_t) == 32);
+
+static struct
+{
+    const mbsp_t *bsp = nullptr;
+    std::vector<point_tree_node_t> nodes;
+    std::vector<uint8_t> leaf_solid; // solid or sky, for Light_PointInSolid
+} point_tree;
+
+void Light_BuildPointTree(const mbsp_t *bsp)
+{
+    point_tree.bsp = bsp;
+    point_tree.nodes.resize(bsp->dnodes.size());
+    point_tree.leaf_solid.resize(bsp->dleafs.size());
+
+    for (size_t i = 0; i < bsp->dnodes.size(); i++) {
+        const bsp2_dnode_t &node = bsp->dnodes[i];
+        point_tree.nodes[i] = {bsp->dplanes[node.planenum], node.children};
+    }
+
+    for (size_t i = 0; i < bsp->dleafs.size(); i++) {
+        const int contents = bsp->dleafs[i].contents;
+
+        // mxd
+        if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+            point_tree.leaf_solid[i] = (contents & Q2_CONTENTS_SOLID) != 0;
+        } else {
+            point_tree.leaf_solid[i] = (contents == CONTENTS_SOLID || contents == CONTENTS_SKY);
+        }
+    }
+}
+
+static const point_tree_node_t *PointTreeNodes(const mbsp_t *bsp)
+{
+    Q_assert(point_tree.bsp == bsp);
+    return point_tree.nodes.data();
+}
 
 /*
 ==============
@@ -31,14 +100,91 @@ from hmap2
 */
 const mleaf_t *Light_PointInLeaf(const mbsp_t *bsp, const qvec3d &point)
 {
+    const point_tree_node_t *nodes = PointTreeNodes(bsp);
     int num = 0;
 
     while (num >= 0)
-        num = bsp->dnodes[num].children[bsp->dplanes[bsp->dnodes[num].planenum].distance_to_fast(point) < 0];
+        num = nodes[num].children[nodes[num].plane.distance_to_fast(point) < 0];
 
     return &bsp->dleafs[-1 - num];
 }
 
+void Light_PointsInLeafs(const mbsp_t *bsp, std::span<const qvec3f> points, std::span<const mleaf_t *> leafs)
+{
+    Q_assert(points.size() == leafs.size());
+
+    const point_tree_node_t *nodes = PointTreeNodes(bsp);
+
+    // descend a block of points one level at a time, so the node fetches for
+    // different points overlap instead of each point waiting on its own chain
+    constexpr size_t block_size = 16;
+
+    for (size_t base = 0; base < points.size(); base += block_size) {
+        const size_t count = std::min(block_size, points.size() - base);
+        std::array<int, block_size> num{};
+        bool active = true;
+
+        while (active) {
+            active = false;
+
+            for (size_t i = 0; i < count; i++) {
+                if (num[i] < 0) {
+                    continue;
+                }
+
+                const point_tree_node_t &node = nodes[num[i]];
+                num[i] = node.children[node.plane.distance_to_fast(qvec3d(points[base + i])) < 0];
+                active |= num[i] >= 0;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            leafs[base + i] = &bsp->dleafs[-1 - num[i]];
+        }
+    }
+}
+
+bool Light_PointInSolid(const mbsp_t *bsp, const dmodelh2_t *model, const qvec3d &point)
+{
+    const point_tree_node_t *nodes = PointTreeNodes(bsp);
+
+    // far sides still to test, for points too close to a plane
+    thread_local std::vector<int> pending;
+    pending.clear();
+    pending.push_back(model->headnode[0]);
+
+    while (!pending.empty()) {
+        int num = pending.back();
+        pending.pop_back();
+
+        while (num >= 0) {
+            const point_tree_node_t &node = nodes[num];
+            const vec_t dist = node.plane.distance_to_fast(point);
+
+            if (dist > 0.1) {
+                num = node.children[0];
+            } else if (dist < -0.1) {
+                num = node.children[1];
+            } else {
+                // too close to the plane, check both sides
+                pending.push_back(node.children[1]);
+                num = node.children[0];
+            }
+        }
+
+        if (point_tree.leaf_solid[-1 - num]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Light_PointInWorld(const mbsp_t *bsp, const qvec3d &point)
+{
+    return Light_PointInSolid(bsp, &bsp->dmodels[0], point);
+}
+
 /**
  * Given a float texture coordinate, returns a pixel index to sample in [0, width-1].
  * This assumes the texture repeats and nearest filtering
@@ -68,3 +214,744 @@ qvec4b SampleTexture(
 
     return texture->pixels[(texture->width * y) + x];
 }
+
+/*
+==============
+ray tracing
+==============
+*/
+
+static const mbsp_t *trace_bsp;
+static trace_scene_t trace_scene;
+static std::unique_ptr<trace_backend_t> trace_backend;
+
+void ResetTrace()
+{
+    trace_backend.reset();
+    trace_scene = {};
+    trace_bsp = nullptr;
+}
+
+const trace_scene_t &Trace_Scene()
+{
+    return trace_scene;
+}
+
+trace_backend_t &Trace_Backend()
+{
+    Q_assert(trace_backend != nullptr);
+    return *trace_backend;
+}
+
+static thread_local uint64_t thread_ray_count = 0;
+
+uint64_t Trace_ThreadRayCount()
+{
+    return thread_ray_count;
+}
+
+void raystream_intersection_t::tracePushedRaysIntersection(const modelinfo_t *self, int shadowmask)
+{
+    if (!_numrays)
+        return;
+
+    thread_ray_count += _numrays;
+    Trace_Backend().intersect(*this, self, shadowmask);
+}
+
+void raystream_occlusion_t::tracePushedRaysOcclusion(const modelinfo_t *self, int shadowmask)
+{
+    if (!_numrays)
+        return;
+
+    thread_ray_count += _numrays;
+    Trace_Backend().occluded(*this, self, shadowmask);
+}
+
+static void AddGlassToRay(raystream_common_t *rs, unsigned rayIndex, float opacity, const qvec3f &glasscolor)
+{
+    if (rs == nullptr) {
+        return;
+    }
+
+    // clamp opacity
+    opacity = std::clamp(opacity, 0.0f, 1.0f);
+
+    Q_assert(rayIndex < rs->_numrays);
+
+    rs->_ray_hit_glass[rayIndex] = true;
+    rs->_ray_glass_color[rayIndex] = glasscolor;
+    rs->_ray_glass_opacity[rayIndex] = opacity;
+}
+
+static void AddDynamicOccluderToRay(raystream_common_t *rs, unsigned rayIndex, int style)
+{
+    if (rs != nullptr) {
+        rs->_ray_dynamic_styles[rayIndex] = style;
+    }
+}
+
+bool Trace_FilterHit(raystream_common_t *rs, unsigned rayIndex, const modelinfo_t *self, int shadowmask,
+    const triinfo &tri, const qvec3f &origin, const qvec3f &dir, float t, float u, float v, const qvec3f &normal)
+{
+    if (!(tri.channelmask & shadowmask)) {
+        return false;
+    }
+
+    if (!tri.modelinfo) {
+        // we hit a "skip" face with no associated model
+        // reject hit (???)
+        return false;
+    }
+
+    if (tri.shadowworldonly) {
+        // we hit "_shadowworldonly" "1" geometry. Ignore the hit unless we are from world.
+        if (!self || !self->isWorld()) {
+            return false;
+        }
+    }
+
+    if (tri.shadowself) {
+        // only casts shadows on itself
+        if (self != tri.modelinfo) {
+            return false;
+        }
+    }
+
+    if (tri.switchableshadow) {
+        // we hit a dynamic shadow caster. reject the hit, but store the
+        // info about what we hit.
+        AddDynamicOccluderToRay(rs, rayIndex, tri.switchshadstyle);
+        return false;
+    }
+
+    // test fence textures and glass
+    if (tri.is_fence || tri.is_glass) {
+        const qvec3f rayDir = qv::normalize(dir);
+
+        if (tri.is_glass) {
+            const float raySurfaceCosAngle = qv::dot(rayDir, qv::normalize(normal));
+
+            // only pick up the color of the glass on the _exiting_ side of the glass.
+            // (we currently trace "backwards", from surface point --> light source)
+            if (raySurfaceCosAngle >= 0) {
+                return false;
+            }
+
+            const qvec3f hitpoint = origin + (rayDir * t);
+            const qvec4b sample = SampleTexture(
+                tri.face, tri.texinfo, tri.texture, trace_bsp, hitpoint); // mxd. Palette index -> color_rgba
+
+            float alpha = tri.alpha;
+
+            // mxd. Adjust alpha by texture alpha?
+            if (sample[3] < 255)
+                alpha = sample[3] / 255.0f;
+
+            AddGlassToRay(rs, rayIndex, alpha, qvec3f(sample.xyz()) * (1.0f / 255.0f));
+
+            return false;
+        }
+
+        if (tri.micromap_level != -1) {
+            switch (Micromap_State(&trace_scene.micromaps[tri.micromap_offset], tri.micromap_level, u, v)) {
+                case micromap_state_t::OPAQUE: return true;
+                case micromap_state_t::TRANSPARENT: return false;
+                case micromap_state_t::UNKNOWN: break;
+            }
+        }
+
+        const qvec3f hitpoint = origin + (rayDir * t);
+        const qvec4b sample =
+            SampleTexture(tri.face, tri.texinfo, tri.texture, trace_bsp, hitpoint); // mxd. Palette index -> color_rgba
+
+        if (sample[3] < 255) {
+            // fence texel is transparent
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+==============
+Alpha micromaps
+==============
+*/
+
+// position of a world point in texel units, before wrapping; see SampleTexture
+static qvec2d Micromap_TexelCoord(const qvec3d &point, const mtexinfo_t *texinfo, const img::texture *texture)
+{
+    const qvec2d texcoord = WorldToTexCoord(point, texinfo);
+    return {texcoord[0] * texture->width_scale, texcoord[1] * texture->height_scale};
+}
+
+int Micromap_LevelFor(const std::array<qvec3f, 3> &tri, const mtexinfo_t *texinfo, const img::texture *texture)
+{
+    if (texture == nullptr || !texture->width) {
+        return 0;
+    }
+
+    const qvec2d t0 = Micromap_TexelCoord(tri[0], texinfo, texture);
+    const qvec2d e1 = Micromap_TexelCoord(tri[1], texinfo, texture) - t0;
+    const qvec2d e2 = Micromap_TexelCoord(tri[2], texinfo, texture) - t0;
+    const double texel_area = std::abs(e1[0] * e2[1] - e1[1] * e2[0]) * 0.5;
+
+    int level = 0;
+    while (level < MICROMAP_MAX_LEVEL && texel_area / static_cast<double>(1 << (2 * level)) > 2.0) {
+        level++;
+    }
+    return level;
+}
+
+// classifies the texels SampleTexture can return for points of the triangle with
+// texel coordinates a, b, c. conservative: a texel counts if it overlaps the
+// triangle after growing it by a small epsilon
+static micromap_state_t Micromap_Classify(const img::texture *texture, const qvec2d &a, const qvec2d &b, const qvec2d &c)
+{
+    // slack for rounding differences between the hit's barycentrics and its hit point
+    constexpr double epsilon = 0.05;
+
+    // bounding boxes bigger than this (huge slivers) aren't worth scanning
+    constexpr int64_t max_texels = 4096;
+
+    const int64_t width = texture->width, height = texture->height;
+
+    // the texture repeats, but the box isn't clamped to one period: a sliver can
+    // cover texels whose wrapped copies within the first period are outside of it
+    const int64_t x0 = static_cast<int64_t>(std::floor(std::min({a[0], b[0], c[0]}) - epsilon));
+    const int64_t y0 = static_cast<int64_t>(std::floor(std::min({a[1], b[1], c[1]}) - epsilon));
+    const int64_t x1 = static_cast<int64_t>(std::floor(std::max({a[0], b[0], c[0]}) + epsilon));
+    const int64_t y1 = static_cast<int64_t>(std::floor(std::max({a[1], b[1], c[1]}) + epsilon));
+
+    if ((x1 - x0 + 1) * (y1 - y0 + 1) > max_texels) {
+        return micromap_state_t::UNKNOWN;
+    }
+
+    // edge functions, positive inside; a degenerate triangle only uses its bounds
+    const std::array<qvec2d, 3> corners{a, b, c};
+    const double winding = ((b[0] - a[0]) * (c[1] - a[1])) - ((b[1] - a[1]) * (c[0] - a[0]));
+    auto texel_outside = [&](int64_t x, int64_t y) {
+        if (winding == 0.0) {
+            return false;
+        }
+        for (int e = 0; e < 3; e++) {
+            const qvec2d &p = corners[e];
+            const qvec2d edge = corners[(e + 1) % 3] - p;
+            bool all_outside = true;
+            for (int corner = 0; corner < 4 && all_outside; corner++) {
+                const double cx = (corner & 1) ? (x + 1 + epsilon) : (x - epsilon);
+                const double cy = (corner & 2) ? (y + 1 + epsilon) : (y - epsilon);
+                const double side = (edge[0] * (cy - p[1])) - (edge[1] * (cx - p[0]));
+                all_outside = (winding > 0) ? (side < 0) : (side > 0);
+            }
+            if (all_outside) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    bool any_opaque = false, any_transparent = false;
+    for (int64_t y = y0; y <= y1; y++) {
+        const int64_t row = ((y % height) + height) % height;
+        for (int64_t x = x0; x <= x1; x++) {
+            if (texel_outside(x, y)) {
+                continue;
+            }
+            const int64_t column = ((x % width) + width) % width;
+            if (texture->pixels[(row * width) + column][3] < 255) {
+                any_transparent = true;
+            } else {
+                any_opaque = true;
+            }
+            if (any_opaque && any_transparent) {
+                return micromap_state_t::UNKNOWN;
+            }
+        }
+    }
+
+    return any_transparent ? micromap_state_t::TRANSPARENT : micromap_state_t::OPAQUE;
+}
+
+static void Micromap_Set(uint64_t *micromap, uint32_t index, micromap_state_t state)
+{
+    micromap[index / 32] |= static_cast<uint64_t>(state) << ((index % 32) * 2);
+}
+
+static micromap_state_t Micromap_Get(const uint64_t *micromap, uint32_t index)
+{
+    return static_cast<micromap_state_t>((micromap[index / 32] >> ((index % 32) * 2)) & 3);
+}
+
+/*
+ * Micro-triangles are numbered row by row: row `iv` holds the upright
+ * micro-triangle of each column `iu`, each followed by the inverted one
+ * sharing its diagonal (except in the last column), so row `iv` starts
+ * at iv * (2n - iv) for n = 2^level.
+ */
+void Micromap_Build(const std::array<qvec3f, 3> &tri, const mtexinfo_t *texinfo, const img::texture *texture,
+    int level, uint64_t *out)
+{
+    Q_assert(level >= 0 && level <= MICROMAP_MAX_LEVEL);
+
+    std::fill(out, out + Micromap_NumWords(level), 0);
+
+    const int n = 1 << level;
+    const uint32_t count = 1u << (2 * level);
+
+    if (texture == nullptr || !texture->width) {
+        // SampleTexture returns transparent black without a texture
+        for (uint32_t i = 0; i < count; i++) {
+            Micromap_Set(out, i, micromap_state_t::TRANSPARENT);
+        }
+        return;
+    }
+
+    const qvec3d v0 = tri[0];
+    const qvec3d e1 = qvec3d(tri[1]) - v0;
+    const qvec3d e2 = qvec3d(tri[2]) - v0;
+    auto lattice = [&](int iu, int iv) {
+        return Micromap_TexelCoord(v0 + (e1 * (iu / static_cast<double>(n))) + (e2 * (iv / static_cast<double>(n))),
+            texinfo, texture);
+    };
+
+    uint32_t index = 0;
+    for (int iv = 0; iv < n; iv++) {
+        for (int iu = 0; iu < n - iv; iu++) {
+            const qvec2d a = lattice(iu, iv), b = lattice(iu + 1, iv), c = lattice(iu, iv + 1);
+            Micromap_Set(out, index++, Micromap_Classify(texture, a, b, c));
+
+            if (iu + iv < n - 1) {
+                Micromap_Set(out, index++, Micromap_Classify(texture, b, c, lattice(iu + 1, iv + 1)));
+            }
+        }
+    }
+
+    Q_assert(index == count);
+}
+
+micromap_state_t Micromap_State(const uint64_t *micromap, int level, float u, float v)
+{
+    const int n = 1 << level;
+    const float fu = u * n, fv = v * n;
+
+    // clamp points that rounding put just outside the triangle
+    const int iv = std::clamp(static_cast<int>(std::floor(fv)), 0, n - 1);
+    const int iu = std::clamp(static_cast<int>(std::floor(fu)), 0, n - 1 - iv);
+    const bool inverted = (iu + iv < n - 1) && ((fu - iu) + (fv - iv) > 1.0f);
+
+    return Micromap_Get(micromap, (iv * (2 * n - iv)) + (2 * iu) + (inverted ? 1 : 0));
+}
+
+/*
+ * Builds micromaps for the fence triangles of the filter geometry. Triangles
+ * that are only filtered for their fence texture and turn out entirely opaque
+ * move to the solid geometry, and entirely transparent ones are dropped, so
+ * the backends don't filter them at all.
+ */
+static void Trace_BuildMicromaps(trace_scene_t &scene)
+{
+    size_t num_micromaps = 0, num_opaque = 0, num_transparent = 0;
+
+    trace_geometry_t filter;
+    for (size_t i = 0; i < scene.filter.size(); i++) {
+        const std::array<qvec3f, 3> tri{
+            scene.filter.vertices[i * 3], scene.filter.vertices[i * 3 + 1], scene.filter.vertices[i * 3 + 2]};
+        triinfo info = scene.filter.triInfo[i];
+
+        if (info.is_fence && !info.is_glass) {
+            const int level = Micromap_LevelFor(tri, info.texinfo, info.texture);
+            const size_t offset = scene.micromaps.size();
+            scene.micromaps.resize(offset + Micromap_NumWords(level));
+            Micromap_Build(tri, info.texinfo, info.texture, level, &scene.micromaps[offset]);
+
+            const bool only_fence = !info.shadowworldonly && !info.shadowself && !info.switchableshadow &&
+                                    info.channelmask == CHANNEL_MASK_DEFAULT;
+
+            if (only_fence) {
+                const micromap_state_t first = Micromap_Get(&scene.micromaps[offset], 0);
+                bool uniform = (first != micromap_state_t::UNKNOWN);
+                for (uint32_t j = 1; uniform && j < (1u << (2 * level)); j++) {
+                    uniform = (Micromap_Get(&scene.micromaps[offset], j) == first);
+                }
+
+                if (uniform) {
+                    scene.micromaps.resize(offset);
+
+                    if (first == micromap_state_t::OPAQUE) {
+                        scene.solid.vertices.insert(scene.solid.vertices.end(), tri.begin(), tri.end());
+                        scene.solid.triInfo.push_back(info);
+                        num_opaque++;
+                    } else {
+                        num_transparent++;
+                    }
+                    continue;
+                }
+            }
+
+            info.micromap_level = level;
+            info.micromap_offset = offset;
+            num_micromaps++;
+        }
+
+        filter.vertices.insert(filter.vertices.end(), tri.begin(), tri.end());
+        filter.triInfo.push_back(info);
+    }
+
+    scene.filter = std::move(filter);
+
+    logging::print("\t{} fence triangles with alpha micromaps ({} KB), {} opaque, {} transparent\n", num_micromaps,
+        (scene.micromaps.size() * sizeof(uint64_t)) / 1024, num_opaque, num_transparent);
+}
+
+/**
+ * Returns 1.0 unless a custom alpha value is set.
+ * The priority is: "_light_alpha" (read from extended_texinfo_flags), then "alpha", then Q2 surface flags
+ */
+static float Face_Alpha(const mbsp_t *bsp, const modelinfo_t *modelinfo, const mface_t *face)
+{
+    const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+    const int surf_flags = Face_ContentsOrSurfaceFlags(bsp, face);
+    const bool is_q2 = bsp->loadversion->game->id == GAME_QUAKE_II;
+
+    if (extended_flags.light_alpha) {
+        return *extended_flags.light_alpha;
+    }
+
+    // next check "alpha" key (q1)
+    if (modelinfo->alpha.is_changed()) {
+        return modelinfo->alpha.value();
+    }
+
+    // next handle q2 surface flags
+    if (is_q2) {
+        if (surf_flags & Q2_SURF_TRANS33) {
+            return 0.33f;
+        }
+        if (surf_flags & Q2_SURF_TRANS66) {
+            return 0.66f;
+        }
+    }
+
+    // no alpha requested
+    return 1.0f;
+}
+
+static trace_geometry_t CreateGeometry(const mbsp_t *bsp, const std::vector<const mface_t *> &faces)
+{
+    trace_geometry_t s;
+
+    auto add_tri = [&](const mface_t *face, int bsp_vert0, int bsp_vert1, int bsp_vert2, const modelinfo_t *modelinfo) {
+        s.vertices.push_back(Vertex_GetPos(bsp, bsp_vert0) + modelinfo->offset);
+        s.vertices.push_back(Vertex_GetPos(bsp, bsp_vert1) + modelinfo->offset);
+        s.vertices.push_back(Vertex_GetPos(bsp, bsp_vert2) + modelinfo->offset);
+
+        const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+
+        triinfo info;
+
+        info.face = face;
+        info.modelinfo = modelinfo;
+        info.texinfo = &bsp->texinfo[face->texinfo];
+
+        info.texture = Face_Texture(bsp, face);
+
+        // FIXME: don't these need to check extended_flags?
+        info.shadowworldonly = modelinfo->shadowworldonly.boolValue();
+        info.shadowself = modelinfo->shadowself.boolValue();
+        info.switchableshadow = modelinfo->switchableshadow.boolValue();
+        info.switchshadstyle = modelinfo->switchshadstyle.value();
+
+        info.channelmask = extended_flags.object_channel_mask.value_or(modelinfo->object_channel_mask.value());
+
+        info.alpha = Face_Alpha(bsp, modelinfo, face);
+
+        // mxd
+        if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+            const int surf_flags = Face_ContentsOrSurfaceFlags(bsp, face);
+            info.is_fence = surf_flags & Q2_SURF_ALPHATEST;
+            info.is_glass = !info.is_fence && (surf_flags & (Q2_SURF_TRANS33 | Q2_SURF_TRANS66));
+        } else {
+            const char *name = Face_TextureName(bsp, face);
+            info.is_fence = (name[0] == '{');
+            info.is_glass = (info.alpha < 1.0f);
+        }
+
+        s.triInfo.push_back(info);
+    };
+
+    for (const mface_t *face : faces) {
+        // NOTE: can be null for "skip" faces
+        const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+
+        if (!modelinfo || face->numedges < 3) {
+            continue;
+        }
+
+        for (int j = 2; j < face->numedges; j++) {
+            add_tri(face, Face_VertexAtIndex(bsp, face, j - 1), Face_VertexAtIndex(bsp, face, j),
+                Face_VertexAtIndex(bsp, face, 0), modelinfo);
+        }
+    }
+
+    return s;
+}
+
+static trace_geometry_t CreateGeometryFromWindings(const std::vector<polylib::winding_t> &windings)
+{
+    trace_geometry_t s;
+
+    for (const auto &winding : windings) {
+        Q_assert(winding.size() >= 3);
+
+        for (size_t j = 2; j < winding.size(); j++) {
+            s.vertices.push_back(winding.at(j - 1));
+            s.vertices.push_back(winding.at(j));
+            s.vertices.push_back(winding.at(0));
+        }
+    }
+
+    return s;
+}
+
+// building faces for skip-textured bmodels
+
+static qplane3d Node_Plane(const mbsp_t *bsp, const bsp2_dnode_t *node, bool side)
+{
+    qplane3d plane = bsp->dplanes[node->planenum];
+
+    if (side) {
+        return -plane;
+    }
+
+    return plane;
+}
+
+/**
+ * `planes` all of the node planes that bound this leaf, facing inward.
+ */
+static void Leaf_MakeFaces(const mbsp_t *bsp, const modelinfo_t *modelinfo, const mleaf_t *leaf,
+    const std::vector<qplane3d> &planes, std::vector<polylib::winding_t> &result)
+{
+    for (const qplane3d &plane : planes) {
+        // flip the inward-facing split plane to get the outward-facing plane of the face we're constructing
+        qplane3d faceplane = -plane;
+
+        std::optional<polylib::winding_t> winding = polylib::winding_t::from_plane(faceplane, 10e6);
+
+        // clip `winding` by all of the other planes
+        for (const qplane3d &plane2 : planes) {
+            if (&plane2 == &plane)
+                continue;
+
+            // discard the back, continue clipping the front part
+            winding = winding->clip_front(plane2);
+
+            // check if everything was clipped away
+            if (!winding)
+                break;
+        }
+
+        if (!winding) {
+            // logging::print("WARNING: winding clipped away\n");
+        } else {
+            result.push_back(winding->translate(modelinfo->offset));
+        }
+    }
+}
+
+static void MakeFaces_r(const mbsp_t *bsp, const modelinfo_t *modelinfo, const int nodenum,
+    std::vector<qplane3d> *planes, std::vector<polylib::winding_t> &result)
+{
+    if (nodenum < 0) {
+        const int leafnum = -nodenum - 1;
+        const mleaf_t *leaf = &bsp->dleafs[leafnum];
+
+        if ((bsp->loadversion->game->id == GAME_QUAKE_II) ? (leaf->contents & Q2_CONTENTS_SOLID)
+                                                          : leaf->contents == CONTENTS_SOLID) {
+            Leaf_MakeFaces(bsp, modelinfo, leaf, *planes, result);
+        }
+        return;
+    }
+
+    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+
+    // go down the front side
+    planes->push_back(Node_Plane(bsp, node, false));
+    MakeFaces_r(bsp, modelinfo, node->children[0], planes, result);
+    planes->pop_back();
+
+    // go down the back side
+    planes->push_back(Node_Plane(bsp, node, true));
+    MakeFaces_r(bsp, modelinfo, node->children[1], planes, result);
+    planes->pop_back();
+}
+
+static void MakeFaces(
+    const mbsp_t *bsp, const modelinfo_t *modelinfo, const dmodelh2_t *model, std::vector<polylib::winding_t> &result)
+{
+    std::vector<qplane3d> planes;
+    MakeFaces_r(bsp, modelinfo, model->headnode[0], &planes, result);
+    Q_assert(planes.empty());
+}
+
+static trace_scene_t Trace_GatherScene(const mbsp_t *bsp)
+{
+    std::vector<const mface_t *> skyfaces, solidfaces, filterfaces;
+
+    // check all modelinfos
+    for (size_t mi = 0; mi < bsp->dmodels.size(); mi++) {
+        const modelinfo_t *model = ModelInfoForModel(bsp, mi);
+
+        // check reasons that a bmodel can be shadow casting
+        const bool isWorld = model->isWorld();
+        const bool shadow = model->shadow.boolValue();
+        const bool shadowself = model->shadowself.boolValue();
+        const bool shadowworldonly = model->shadowworldonly.boolValue();
+        const bool switchableshadow = model->switchableshadow.boolValue();
+        const bool has_custom_channel_mask = (model->object_channel_mask.value() != CHANNEL_MASK_DEFAULT);
+
+        if (!(isWorld || shadow || shadowself || shadowworldonly || switchableshadow || has_custom_channel_mask))
+            continue;
+
+        for (int i = 0; i < model->model->numfaces; i++) {
+            const mface_t *face = BSP_GetFace(bsp, model->model->firstface + i);
+
+            // check for TEX_NOSHADOW
+            const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+            if (extended_flags.no_shadow)
+                continue;
+
+            // handle switchableshadow
+            if (switchableshadow) {
+                filterfaces.push_back(face);
+                continue;
+            }
+
+            // non-default channel mask
+            if (model->object_channel_mask.value() != CHANNEL_MASK_DEFAULT ||
+                extended_flags.object_channel_mask.value_or(CHANNEL_MASK_DEFAULT) != CHANNEL_MASK_DEFAULT) {
+                filterfaces.push_back(face);
+                continue;
+            }
+
+            const int contents_or_surf_flags = Face_ContentsOrSurfaceFlags(bsp, face); // mxd
+            const mtexinfo_t *texinfo = Face_Texinfo(bsp, face);
+            const bool is_q2 = bsp->loadversion->game->id == GAME_QUAKE_II;
+
+            // mxd. Skip NODRAW faces, but not SKY ones (Q2's sky01.wal has both flags set)
+            if (is_q2 && (contents_or_surf_flags & Q2_SURF_NODRAW) && !(contents_or_surf_flags & Q2_SURF_SKY))
+                continue;
+
+            // handle glass / water
+            const float alpha = Face_Alpha(bsp, model, face);
+            if (alpha < 1.0f ||
+                (is_q2 && (contents_or_surf_flags & (Q2_SURF_ALPHATEST | Q2_SURF_TRANS33 | Q2_SURF_TRANS66)))) {
+                filterfaces.push_back(face);
+                continue;
+            }
+
+            // fence
+            const char *texname = Face_TextureName(bsp, face);
+            if (texname[0] == '{') {
+                filterfaces.push_back(face);
+                continue;
+            }
+
+            // handle sky
+            if (is_q2) {
+                // Q2: arghrad compat: sky faces only emit sunlight if:
+                // sky flag set, light flag set, value nonzero
+                if ((contents_or_surf_flags & Q2_SURF_SKY) != 0 &&
+                    (!light_options.arghradcompat.value() ||
+                        ((contents_or_surf_flags & Q2_SURF_LIGHT) != 0 && texinfo->value != 0))) {
+                    skyfaces.push_back(face);
+                    continue;
+                }
+            } else {
+                // Q1
+                if (!Q_strncasecmp("sky", texname, 3)) {
+                    skyfaces.push_back(face);
+                    continue;
+                }
+            }
+
+            // liquids
+            if (/* texname[0] == '*' */ ContentsOrSurfaceFlags_IsTranslucent(bsp, contents_or_surf_flags)) { // mxd
+                if (!isWorld) {
+                    // world liquids never cast shadows; shadow casting bmodel liquids do
+                    solidfaces.push_back(face);
+                }
+                continue;
+            }
+
+            // solid faces
+
+            if (isWorld || shadow) {
+                solidfaces.push_back(face);
+            } else {
+                // shadowself or shadowworldonly
+                Q_assert(shadowself || shadowworldonly);
+                filterfaces.push_back(face);
+            }
+        }
+    }
+
+    /* Special handling of skip-textured bmodels */
+    std::vector<polylib::winding_t> skipwindings;
+    for (const modelinfo_t *modelinfo : tracelist) {
+        if (modelinfo->model->numfaces == 0) {
+            MakeFaces(bsp, modelinfo, modelinfo->model, skipwindings);
+        }
+    }
+
+    trace_scene_t scene;
+    scene.sky = CreateGeometry(bsp, skyfaces);
+    scene.solid = CreateGeometry(bsp, solidfaces);
+    scene.filter = CreateGeometry(bsp, filterfaces);
+    scene.skip = CreateGeometryFromWindings(skipwindings);
+
+    logging::print("\t{} sky faces\n", skyfaces.size());
+    logging::print("\t{} solid faces\n", solidfaces.size());
+    logging::print("\t{} filtered faces\n", filterfaces.size());
+    logging::print("\t{} shadow-casting skip faces\n", skipwindings.size());
+
+    if (light_options.alphamicromaps.value()) {
+        Trace_BuildMicromaps(scene);
+    }
+
+    return scene;
+}
+
+std::unique_ptr<trace_backend_t> Trace_CreateBackend(tracer_t tracer, const trace_scene_t &scene)
+{
+    switch (tracer) {
+        case tracer_t::EMBREE:
+#ifdef HAVE_EMBREE
+            return Embree_CreateBackend(scene);
+#else
+            FError("light was built without Embree; use -tracer bvh");
+#endif
+        case tracer_t::BVH: return BVH_CreateBackend(scene);
+        default: FError("unknown tracer");
+    }
+}
+
+void Trace_Init(const mbsp_t *bsp)
+{
+    Q_assert(!trace_backend);
+
+    logging::funcheader();
+    PROFILE_ZONE("Trace_Init");
+
+    trace_bsp = bsp;
+    trace_scene = Trace_GatherScene(bsp);
+
+    auto start = I_FloatTime();
+    trace_backend = Trace_CreateBackend(light_options.tracer.value(), trace_scene);
+
+    logging::print(logging::flag::STAT, "\t{} tracer built in {:.3}, {} KB\n", trace_backend->name(),
+        I_FloatTime() - start, trace_backend->memory_size() / 1024);
+}
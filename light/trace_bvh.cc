@@ -0,0 +1,677 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/trace_bvh.hh>
+
+#include <light/light.hh>
+
+#include <common/aabb.hh>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <limits>
+
+#ifdef __SSE2__
+#include <xmmintrin.h>
+#endif
+
+/*
+==============
+BVH build
+==============
+*/
+
+namespace
+{
+constexpr int num_bins = 16;
+// leaves up to this size are made when SAH says splitting doesn't pay off
+constexpr uint32_t max_leaf_size = 8;
+// nodes this small always become leaves
+constexpr uint32_t min_leaf_size = 2;
+// past this depth, splits are by median so the traversal stack stays bounded
+constexpr int max_sah_depth = 40;
+// relative cost of a box test vs a triangle test
+constexpr float traversal_cost = 1.0f;
+
+constexpr int stack_size = 256;
+
+struct build_prim_t
+{
+    aabb3f bounds;
+    qvec3f centroid;
+};
+
+struct build_node_t
+{
+    aabb3f bounds;
+    int32_t left = -1, right = -1;
+    uint32_t first = 0, count = 0;
+
+    inline bool is_leaf() const { return left < 0; }
+};
+
+inline float SurfaceArea(const aabb3f &bounds)
+{
+    const qvec3f size = bounds.size();
+    return 2.0f * (size[0] * size[1] + size[1] * size[2] + size[2] * size[0]);
+}
+
+class bvh_builder_t
+{
+    const std::vector<build_prim_t> &prims;
+
+public:
+    std::vector<uint32_t> order;
+    std::vector<build_node_t> nodes;
+
+    bvh_builder_t(const std::vector<build_prim_t> &prims_)
+        : prims(prims_),
+          order(prims_.size())
+    {
+        for (uint32_t i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        nodes.reserve(std::max<size_t>(1, (prims.size() * 2) / min_leaf_size));
+    }
+
+    int32_t build_r(uint32_t first, uint32_t count, int depth)
+    {
+        const int32_t index = static_cast<int32_t>(nodes.size());
+        nodes.emplace_back();
+
+        aabb3f bounds, centroid_bounds;
+        for (uint32_t i = first; i < first + count; i++) {
+            bounds += prims[order[i]].bounds;
+            centroid_bounds += prims[order[i]].centroid;
+        }
+        nodes[index].bounds = bounds;
+        nodes[index].first = first;
+        nodes[index].count = count;
+
+        if (count <= min_leaf_size) {
+            return index;
+        }
+
+        uint32_t mid = first + (count / 2);
+
+        if (depth < max_sah_depth) {
+            // binned SAH over the centroid bounds, on each axis
+            int best_axis = -1, best_split = 0;
+            float best_cost = std::numeric_limits<float>::max();
+
+            for (int axis = 0; axis < 3; axis++) {
+                const float lo = centroid_bounds.mins()[axis];
+                const float extent = centroid_bounds.maxs()[axis] - lo;
+                if (!(extent > 0)) {
+                    continue;
+                }
+                const float scale = num_bins / extent;
+
+                std::array<aabb3f, num_bins> bin_bounds;
+                std::array<uint32_t, num_bins> bin_count{};
+                for (uint32_t i = first; i < first + count; i++) {
+                    const build_prim_t &prim = prims[order[i]];
+                    const int bin = std::min(num_bins - 1, static_cast<int>((prim.centroid[axis] - lo) * scale));
+                    bin_bounds[bin] += prim.bounds;
+                    bin_count[bin]++;
+                }
+
+                // sweep from the right, then evaluate each split sweeping from the left
+                std::array<float, num_bins> right_cost{};
+                aabb3f right_bounds;
+                uint32_t right_count = 0;
+                for (int b = num_bins - 1; b > 0; b--) {
+                    right_bounds += bin_bounds[b];
+                    right_count += bin_count[b];
+                    right_cost[b] = right_count ? SurfaceArea(right_bounds) * right_count : 0.0f;
+                }
+
+                aabb3f left_bounds;
+                uint32_t left_count = 0;
+                for (int b = 1; b < num_bins; b++) {
+                    left_bounds += bin_bounds[b - 1];
+                    left_count += bin_count[b - 1];
+                    if (!left_count || left_count == count) {
+                        continue;
+                    }
+                    const float cost = SurfaceArea(left_bounds) * left_count + right_cost[b];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b;
+                    }
+                }
+            }
+
+            if (best_axis != -1) {
+                const float area = SurfaceArea(bounds);
+                const float split_cost = traversal_cost * area + best_cost;
+                const float leaf_cost = area * count;
+
+                if (split_cost >= leaf_cost && count <= max_leaf_size) {
+                    return index;
+                }
+
+                const float lo = centroid_bounds.mins()[best_axis];
+                const float scale = num_bins / (centroid_bounds.maxs()[best_axis] - lo);
+                const auto it = std::partition(
+                    order.begin() + first, order.begin() + first + count, [&](uint32_t prim) {
+                        const int bin =
+                            std::min(num_bins - 1, static_cast<int>((prims[prim].centroid[best_axis] - lo) * scale));
+                        return bin < best_split;
+                    });
+                const uint32_t split = static_cast<uint32_t>(it - order.begin());
+
+                if (split != first && split != first + count) {
+                    mid = split;
+                }
+            }
+        }
+
+        // otherwise (all centroids coincide, or too deep) split at the median index
+
+        const int32_t left = build_r(first, mid - first, depth + 1);
+        const int32_t right = build_r(mid, first + count - mid, depth + 1);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        return index;
+    }
+};
+
+// pads a stored box so rays grazing a face of it, such as rays along
+// axial brush faces, aren't lost to rounding in the slab test
+inline float PadMin(float v)
+{
+    return v - std::max(1e-3f, std::abs(v) * 1e-6f);
+}
+
+inline float PadMax(float v)
+{
+    return v + std::max(1e-3f, std::abs(v) * 1e-6f);
+}
+} // namespace
+
+static int32_t CollapseNode(const std::vector<build_node_t> &binary, int32_t binary_index,
+    aligned_vector<bvh_t::node_t> &nodes)
+{
+    const build_node_t &root = binary[binary_index];
+
+    // gather up to 4 children by opening the inner child with the largest area
+    std::vector<int32_t> children;
+    if (root.is_leaf()) {
+        children.push_back(binary_index);
+    } else {
+        children.push_back(root.left);
+        children.push_back(root.right);
+    }
+    while (children.size() < bvh_t::width) {
+        int best = -1;
+        float best_area = -1.0f;
+        for (size_t i = 0; i < children.size(); i++) {
+            const build_node_t &child = binary[children[i]];
+            if (!child.is_leaf() && SurfaceArea(child.bounds) > best_area) {
+                best = i;
+                best_area = SurfaceArea(child.bounds);
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        const build_node_t &opened = binary[children[best]];
+        children[best] = opened.left;
+        children.push_back(opened.right);
+    }
+
+    const int32_t index = static_cast<int32_t>(nodes.size());
+    nodes.emplace_back();
+
+    for (int lane = 0; lane < bvh_t::width; lane++) {
+        bvh_t::node_t &node = nodes[index];
+        for (int axis = 0; axis < 3; axis++) {
+            node.bounds[axis][lane] = std::numeric_limits<float>::infinity();
+            node.bounds[axis + 3][lane] = -std::numeric_limits<float>::infinity();
+        }
+        node.child[lane] = ~0;
+        node.count[lane] = 0;
+    }
+
+    for (size_t lane = 0; lane < children.size(); lane++) {
+        const build_node_t &child = binary[children[lane]];
+
+        int32_t child_index;
+        uint32_t child_count = 0;
+        if (child.is_leaf()) {
+            child_index = ~static_cast<int32_t>(child.first);
+            child_count = child.count;
+        } else {
+            child_index = CollapseNode(binary, children[lane], nodes);
+        }
+
+        // `nodes` may have been reallocated by the recursion
+        bvh_t::node_t &node = nodes[index];
+        for (int axis = 0; axis < 3; axis++) {
+            node.bounds[axis][lane] = PadMin(child.bounds.mins()[axis]);
+            node.bounds[axis + 3][lane] = PadMax(child.bounds.maxs()[axis]);
+        }
+        node.child[lane] = child_index;
+        node.count[lane] = child_count;
+    }
+
+    return index;
+}
+
+void bvh_t::build(const std::vector<qvec3f> &vertices)
+{
+    Q_assert(vertices.size() % 3 == 0);
+
+    nodes.clear();
+    triangles.clear();
+
+    const size_t num_triangles = vertices.size() / 3;
+    if (!num_triangles) {
+        return;
+    }
+
+    std::vector<build_prim_t> prims(num_triangles);
+    for (size_t i = 0; i < num_triangles; i++) {
+        aabb3f bounds;
+        bounds += vertices[i * 3];
+        bounds += vertices[i * 3 + 1];
+        bounds += vertices[i * 3 + 2];
+        prims[i] = {bounds, bounds.centroid()};
+    }
+
+    bvh_builder_t builder(prims);
+    builder.build_r(0, static_cast<uint32_t>(num_triangles), 0);
+
+    // triangles are stored in leaf order, so each leaf is a contiguous range
+    triangles.resize(num_triangles);
+    for (size_t i = 0; i < num_triangles; i++) {
+        const uint32_t id = builder.order[i];
+        const qvec3f &v0 = vertices[id * 3];
+        triangles[i] = {v0, vertices[id * 3 + 1] - v0, vertices[id * 3 + 2] - v0, id};
+    }
+
+    nodes.reserve(builder.nodes.size() / 2 + 1);
+    CollapseNode(builder.nodes, 0, nodes);
+}
+
+size_t bvh_t::memory_size() const
+{
+    return (nodes.size() * sizeof(node_t)) + (triangles.size() * sizeof(triangle_t));
+}
+
+/*
+==============
+BVH traversal
+==============
+*/
+
+namespace
+{
+struct ray_setup_t
+{
+    float origin[3];
+    float inv_dir[3];
+    // rows of node_t::bounds holding the entry/exit planes on each axis
+    int near_row[3], far_row[3];
+};
+
+inline ray_setup_t SetupRay(const qvec3f &origin, const qvec3f &dir)
+{
+    ray_setup_t setup;
+    for (int axis = 0; axis < 3; axis++) {
+        float d = dir[axis];
+        // keep the reciprocal finite so a zero component can't make 0 * inf = NaN
+        if (std::abs(d) < 1e-20f) {
+            d = std::copysign(1e-20f, d);
+        }
+        setup.origin[axis] = origin[axis];
+        setup.inv_dir[axis] = 1.0f / d;
+        setup.near_row[axis] = (d >= 0) ? axis : axis + 3;
+        setup.far_row[axis] = (d >= 0) ? axis + 3 : axis;
+    }
+    return setup;
+}
+
+// tests a ray against the 4 child boxes of a node; returns the lanes hit
+// and, if `tnear` isn't null, stores the entry distance of each lane
+inline int IntersectChildBoxes(const bvh_t::node_t &node, const ray_setup_t &ray, float tfar, float *tnear)
+{
+#ifdef __SSE2__
+    __m128 tmin = _mm_setzero_ps();
+    __m128 tmax = _mm_set1_ps(tfar);
+    for (int axis = 0; axis < 3; axis++) {
+        const __m128 origin = _mm_set1_ps(ray.origin[axis]);
+        const __m128 inv_dir = _mm_set1_ps(ray.inv_dir[axis]);
+        const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.near_row[axis]]), origin), inv_dir);
+        const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.far_row[axis]]), origin), inv_dir);
+        tmin = _mm_max_ps(tmin, t0);
+        tmax = _mm_min_ps(tmax, t1);
+    }
+    if (tnear) {
+        _mm_storeu_ps(tnear, tmin);
+    }
+    return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+    int hits = 0;
+    for (int lane = 0; lane < bvh_t::width; lane++) {
+        float tmin = 0.0f, tmax = tfar;
+        for (int axis = 0; axis < 3; axis++) {
+            const float t0 = (node.bounds[ray.near_row[axis]][lane] - ray.origin[axis]) * ray.inv_dir[axis];
+            const float t1 = (node.bounds[ray.far_row[axis]][lane] - ray.origin[axis]) * ray.inv_dir[axis];
+            tmin = std::max(tmin, t0);
+            tmax = std::min(tmax, t1);
+        }
+        if (tnear) {
+            tnear[lane] = tmin;
+        }
+        if (tmin <= tmax) {
+            hits |= (1 << lane);
+        }
+    }
+    return hits;
+#endif
+}
+
+// double sided Moller-Trumbore; hits in [0, tfar] are reported with their barycentrics
+inline bool IntersectTriangle(const bvh_t::triangle_t &tri, const qvec3f &origin, const qvec3f &dir, float tfar,
+    float &t_out, float &u_out, float &v_out)
+{
+    const qvec3f p = qv::cross(dir, tri.e2);
+    const float det = qv::dot(tri.e1, p);
+    if (det == 0.0f) {
+        return false;
+    }
+    const float inv_det = 1.0f / det;
+
+    const qvec3f s = origin - tri.v0;
+    const float u = qv::dot(s, p) * inv_det;
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+
+    const qvec3f q = qv::cross(s, tri.e1);
+    const float v = qv::dot(dir, q) * inv_det;
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+
+    const float t = qv::dot(tri.e2, q) * inv_det;
+    if (!(t >= 0.0f && t <= tfar)) {
+        return false;
+    }
+
+    t_out = t;
+    u_out = u;
+    v_out = v;
+    return true;
+}
+} // namespace
+
+template<bool any_hit>
+void bvh_t::traverse(ray_packet_t &packet, filter_t filter, void *ctx) const
+{
+    Q_assert(packet.count >= 0 && packet.count <= packet_size);
+
+    for (int i = 0; i < packet.count; i++) {
+        packet.hit[i] = no_hit;
+    }
+
+    if (nodes.empty() || !packet.count) {
+        return;
+    }
+
+    ray_setup_t rays[packet_size];
+    for (int i = 0; i < packet.count; i++) {
+        rays[i] = SetupRay(packet.origin[i], packet.dir[i]);
+    }
+
+    struct stack_entry_t
+    {
+        int32_t node;
+        uint32_t mask; // rays of the packet that entered the node
+    };
+    stack_entry_t stack[stack_size];
+    int stack_top = 0;
+
+    // rays still being traced; for any_hit, rays leave as soon as they're occluded
+    uint32_t active = (1u << packet.count) - 1;
+
+    stack[stack_top++] = {0, active};
+
+    while (stack_top) {
+        const stack_entry_t entry = stack[--stack_top];
+        const uint32_t mask = entry.mask & active;
+        if (!mask) {
+            continue;
+        }
+
+        const node_t &node = nodes[entry.node];
+
+        uint32_t lane_masks[width]{};
+        float lane_near[width];
+        bool first = true;
+        for (uint32_t m = mask; m; m &= m - 1) {
+            const int i = std::countr_zero(m);
+            // the entry distances of the first ray decide the visiting order
+            const int hits = IntersectChildBoxes(node, rays[i], packet.tfar[i], first ? lane_near : nullptr);
+            for (int lane = 0; lane < width; lane++) {
+                if (hits & (1 << lane)) {
+                    lane_masks[lane] |= (1u << i);
+                }
+            }
+            first = false;
+        }
+
+        // intersect leaves right away; collect the inner nodes to visit
+        int inner[width];
+        int num_inner = 0;
+        for (int lane = 0; lane < width; lane++) {
+            uint32_t lane_mask = lane_masks[lane] & active;
+            if (!lane_mask) {
+                continue;
+            }
+
+            if (node.child[lane] >= 0) {
+                inner[num_inner++] = lane;
+                continue;
+            }
+
+            const uint32_t first_tri = ~node.child[lane];
+            const uint32_t last_tri = first_tri + node.count[lane];
+            for (; lane_mask; lane_mask &= lane_mask - 1) {
+                const int i = std::countr_zero(lane_mask);
+
+                for (uint32_t k = first_tri; k < last_tri; k++) {
+                    const triangle_t &tri = triangles[k];
+                    float t, u, v;
+                    if (!IntersectTriangle(tri, packet.origin[i], packet.dir[i], packet.tfar[i], t, u, v)) {
+                        continue;
+                    }
+                    if (filter && !filter(ctx, i, tri, t, u, v)) {
+                        continue;
+                    }
+
+                    packet.hit[i] = tri.id;
+                    if constexpr (any_hit) {
+                        active &= ~(1u << i);
+                        break;
+                    } else {
+                        packet.tfar[i] = t;
+                    }
+                }
+            }
+        }
+
+        // push farthest first so the nearest is visited next
+        std::sort(inner, inner + num_inner, [&](int a, int b) { return lane_near[a] > lane_near[b]; });
+        for (int n = 0; n < num_inner; n++) {
+            Q_assert(stack_top < stack_size);
+            stack[stack_top++] = {node.child[inner[n]], lane_masks[inner[n]]};
+        }
+    }
+}
+
+void bvh_t::intersect(ray_packet_t &packet, filter_t filter, void *ctx) const
+{
+    traverse<false>(packet, filter, ctx);
+}
+
+void bvh_t::occluded(ray_packet_t &packet, filter_t filter, void *ctx) const
+{
+    traverse<true>(packet, filter, ctx);
+}
+
+/*
+==============
+BVH trace backend
+==============
+*/
+
+namespace
+{
+struct bvh_triinfo_t
+{
+    hittype_t type;
+    const triinfo *info; // null for skip geometry
+    bool filter; // hits need Trace_FilterHit
+};
+
+class bvh_backend_t : public trace_backend_t
+{
+    bvh_t bvh;
+    // indexed by triangle id
+    std::vector<bvh_triinfo_t> triinfos;
+
+    struct filter_context_t
+    {
+        const bvh_backend_t *backend;
+        raystream_common_t *rs;
+        int first_ray;
+        const bvh_t::ray_packet_t *packet;
+        const modelinfo_t *self;
+        int shadowmask;
+    };
+
+    static bool Filter(void *ctx, int ray, const bvh_t::triangle_t &tri, float t, float u, float v)
+    {
+        const filter_context_t &context = *static_cast<const filter_context_t *>(ctx);
+        const bvh_triinfo_t &hit = context.backend->triinfos[tri.id];
+
+        if (hit.filter) {
+            return Trace_FilterHit(context.rs, context.first_ray + ray, context.self, context.shadowmask, *hit.info,
+                context.packet->origin[ray], context.packet->dir[ray], t, u, v, qv::cross(tri.e1, tri.e2));
+        }
+
+        if (context.shadowmask != CHANNEL_MASK_DEFAULT) {
+            // skip geometry has no triinfo and casts on the default channel
+            const int channelmask = hit.info ? hit.info->channelmask : CHANNEL_MASK_DEFAULT;
+            return (channelmask & context.shadowmask) != 0;
+        }
+
+        return true;
+    }
+
+    void add_geometry(std::vector<qvec3f> &vertices, const trace_geometry_t &geometry, hittype_t type, bool filter)
+    {
+        vertices.insert(vertices.end(), geometry.vertices.begin(), geometry.vertices.end());
+        for (size_t i = 0; i < geometry.size(); i++) {
+            triinfos.push_back({type, geometry.triInfo.empty() ? nullptr : &geometry.triInfo[i], filter});
+        }
+    }
+
+    // fills `packet` from rays [first, first + packet.count) of `rs`
+    static void FillPacket(bvh_t::ray_packet_t &packet, const raystream_common_t &rs, int first)
+    {
+        packet.count = std::min(bvh_t::packet_size, rs._numrays - first);
+        for (int i = 0; i < packet.count; i++) {
+            packet.origin[i] = rs._ray_origins[first + i];
+            packet.dir[i] = rs._ray_dirs[first + i];
+            packet.tfar[i] = rs._rays_maxdist[first + i];
+        }
+    }
+
+public:
+    bvh_backend_t(const trace_scene_t &scene)
+    {
+        std::vector<qvec3f> vertices;
+        vertices.reserve(scene.sky.vertices.size() + scene.solid.vertices.size() + scene.filter.vertices.size() +
+                         scene.skip.vertices.size());
+
+        add_geometry(vertices, scene.sky, hittype_t::SKY, false);
+        add_geometry(vertices, scene.solid, hittype_t::SOLID, false);
+        add_geometry(vertices, scene.filter, hittype_t::SOLID, true);
+        add_geometry(vertices, scene.skip, hittype_t::SOLID, false);
+
+        bvh.build(vertices);
+    }
+
+    const char *name() const override { return "bvh"; }
+
+    void intersect(raystream_intersection_t &rs, const modelinfo_t *self, int shadowmask) override
+    {
+        bvh_t::ray_packet_t packet;
+        filter_context_t context{this, &rs, 0, &packet, self, shadowmask};
+
+        for (int first = 0; first < rs._numrays; first += bvh_t::packet_size) {
+            FillPacket(packet, rs, first);
+            context.first_ray = first;
+            bvh.intersect(packet, Filter, &context);
+
+            for (int i = 0; i < packet.count; i++) {
+                const int j = first + i;
+                rs._ray_hit_dist[j] = packet.tfar[i];
+                if (packet.hit[i] == bvh_t::no_hit) {
+                    rs._ray_hit_type[j] = hittype_t::NONE;
+                    rs._ray_hit_info[j] = nullptr;
+                } else {
+                    rs._ray_hit_type[j] = triinfos[packet.hit[i]].type;
+                    rs._ray_hit_info[j] = triinfos[packet.hit[i]].info;
+                }
+            }
+        }
+    }
+
+    void occluded(raystream_occlusion_t &rs, const modelinfo_t *self, int shadowmask) override
+    {
+        bvh_t::ray_packet_t packet;
+        filter_context_t context{this, &rs, 0, &packet, self, shadowmask};
+
+        for (int first = 0; first < rs._numrays; first += bvh_t::packet_size) {
+            FillPacket(packet, rs, first);
+            context.first_ray = first;
+            bvh.occluded(packet, Filter, &context);
+
+            for (int i = 0; i < packet.count; i++) {
+                rs._ray_occluded[first + i] = (packet.hit[i] != bvh_t::no_hit);
+            }
+        }
+    }
+
+    size_t memory_size() const override { return bvh.memory_size() + (triinfos.size() * sizeof(bvh_triinfo_t)); }
+};
+} // namespace
+
+std::unique_ptr<trace_backend_t> BVH_CreateBackend(const trace_scene_t &scene)
+{
+    return std::make_unique<bvh_backend_t>(scene);
+}
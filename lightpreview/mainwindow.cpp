@@ -54,6 +54,8 @@ See file, 'COPYING', for details.
 #include <vis/vis.hh>
 #include <light/light.hh>
 #include <common/bspinfo.hh>
+#include <common/pipeline.hh>
+#include <common/prtfile.hh>
 #include <fmt/chrono.h>
 
 #include "glview.h"
@@ -558,16 +560,23 @@ bspdata_t MainWindow::QbspVisLight_Common(const std::filesystem::path &name, std
     }
     args.push_back(name.string());
 
+    // the stages hand the bsp/portals over in memory; only the final .bsp is written
+    pipeline_data_t data;
+
     // run qbsp
     m_activeLogTab = ETLogTab::TAB_BSP;
 
-    InitQBSP(args);
-    ProcessFile();
+    qbsp_main(args, data);
 
     resetActiveTabText();
 
+    // the portals aren't needed on disk for vis, but the 3D view draws them from the .prt
+    if (data.prtfile) {
+        WriteBinaryPrtFile(fs::path(bsp_path).replace_extension(".prt"), *data.prtfile);
+    }
+
     // run vis
-    if (run_vis) {
+    if (run_vis && data.prtfile) {
         m_activeLogTab = ETLogTab::TAB_VIS;
         std::vector<std::string> vis_args{
             "", // the exe path, which we're ignoring in this case
@@ -579,7 +588,7 @@ bspdata_t MainWindow::QbspVisLight_Common(const std::filesystem::path &name, std
             vis_args.push_back(extra);
         }
         vis_args.push_back(name.string());
-        vis_main(vis_args);
+        vis_main(vis_args, data);
     }
 
     resetActiveTabText();
@@ -598,22 +607,18 @@ bspdata_t MainWindow::QbspVisLight_Common(const std::filesystem::path &name, std
         }
         light_args.push_back(name.string());
 
-        light_main(light_args);
+        light_main(light_args, data);
     }
 
     resetActiveTabText();
 
     m_activeLogTab = ETLogTab::TAB_LIGHTPREVIEW;
 
-    // serialize obj
-    {
-        bspdata_t bspdata;
-        LoadBSPFile(bsp_path, &bspdata);
-
-        ConvertBSPFormat(&bspdata, &bspver_generic);
-
-        return bspdata;
+    if (data.write_bsp) {
+        WritePipelineBSP(data, bsp_path);
     }
+
+    return std::move(data.bspdata);
 }
 
 static std::vector<std::string> ParseArgs(const QLineEdit *line_edit)
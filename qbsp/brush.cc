@@ -23,8 +23,10 @@
 #include <qbsp/brush.hh>
 
 #include <cstring>
+#include <fmt/chrono.h>
 #include <list>
 #include <common/log.hh>
+#include <common/parallel.hh>
 #include <qbsp/map.hh>
 #include <qbsp/qbsp.hh>
 
@@ -546,13 +548,14 @@ static void ExpandBrush(hullbrush_t &hullbrush, const aabb3d &hull_size)
 
 /*
 ===============
-LoadBrush
+LoadBrushSides
 
-Converts a mapbrush to a bsp brush
+Creates the sides of a bsp brush from a mapbrush, expanded for the hull.
+This is the part of LoadBrush that adds planes to the map, so it must
+run serially (and in brush order, to keep plane numbers deterministic).
 ===============
 */
-std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush, const contentflags_t &contents,
-    hull_index_t hullnum, std::optional<std::reference_wrapper<size_t>> num_clipped)
+static bspbrush_t LoadBrushSides(mapbrush_t &mapbrush, const contentflags_t &contents, hull_index_t hullnum)
 {
     // create the brush
     bspbrush_t brush{};
@@ -624,17 +627,29 @@ std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush
         }
 #else
 
-        if (!CreateBrushWindings(brush)) {
-            return std::nullopt;
+        if (CreateBrushWindings(brush)) {
+            hullbrush_t hullbrush{brush};
+            ExpandBrush(hullbrush, hull);
         }
-
-        hullbrush_t hullbrush{brush};
-        ExpandBrush(hullbrush, hull);
 #endif
     }
 
+    return brush;
+}
+
+/*
+===============
+FinishBrush
+
+Creates the windings of a brush made by LoadBrushSides and checks them.
+Only reads the map's planes, so brushes can be finished in parallel.
+===============
+*/
+static bool FinishBrush(const mapentity_t &src, bspbrush_t &brush, hull_index_t hullnum,
+    std::optional<std::reference_wrapper<size_t>> num_clipped)
+{
     if (!CreateBrushWindings(brush)) {
-        return std::nullopt;
+        return false;
     }
 
     for (auto &face : brush.sides) {
@@ -673,15 +688,53 @@ std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush
         brush.bounds = {-delta, delta};
     }
 
+    return true;
+}
+
+/*
+===============
+LoadBrush
+
+Converts a mapbrush to a bsp brush
+===============
+*/
+std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush, const contentflags_t &contents,
+    hull_index_t hullnum, std::optional<std::reference_wrapper<size_t>> num_clipped)
+{
+    bspbrush_t brush = LoadBrushSides(mapbrush, contents, hullnum);
+
+    if (!FinishBrush(src, brush, hullnum, num_clipped)) {
+        return std::nullopt;
+    }
+
     return brush;
 }
 
 //=============================================================================
 
-static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hullnum, content_stats_base_t &stats,
-    bspbrush_t::container &brushes, logging::percent_clock &clock, size_t &num_clipped)
+// a mapbrush picked for loading into a hull, and its result
+struct brush_load_job_t
+{
+    const mapentity_t *src;
+    mapbrush_t *mapbrush;
+    // hull 0 loads clip brushes only to include them in the model bounds
+    bool bounds_only;
+    bspbrush_t brush;
+    bool loaded = false;
+    size_t num_clipped = 0;
+};
+
+/*
+============
+Brush_CollectEntity
+
+Picks the brushes of `src` that go into the hull, and the contents each
+is loaded with. Only adds to `jobs`; the brushes are loaded afterwards.
+============
+*/
+static void Brush_CollectEntity(
+    mapentity_t &dst, mapentity_t &src, hull_index_t hullnum, std::vector<brush_load_job_t> &jobs)
 {
-    clock.max += src.mapbrushes.size();
 
     bool all_detail = false;
     bool all_detail_wall = false;
@@ -710,8 +763,6 @@ static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hu
     }
 
     for (auto &mapbrush : src.mapbrushes) {
-        clock();
-
         if (map.is_world_entity(src) || IsWorldBrushEntity(src) || IsNonRemoveWorldBrushEntity(src)) {
             if (map.region) {
                 if (map.region->bounds.disjoint(mapbrush.bounds)) {
@@ -797,9 +848,7 @@ static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hu
          */
         if (hullnum.has_value() && contents.is_clip(qbsp_options.target_game)) {
             if (hullnum.value() == 0) {
-                if (auto brush = LoadBrush(src, mapbrush, contents, hullnum, num_clipped)) {
-                    dst.bounds += brush->bounds;
-                }
+                jobs.push_back({&src, &mapbrush, true, LoadBrushSides(mapbrush, contents, hullnum)});
                 continue;
                 // for hull1, 2, etc., convert clip to CONTENTS_SOLID
             } else {
@@ -843,16 +892,7 @@ static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hu
         contents.set_mirrored(mapbrush.contents.mirror_inside);
         contents.set_clips_same_type(mapbrush.contents.clips_same_type);
 
-        auto brush = LoadBrush(src, mapbrush, contents, hullnum, num_clipped);
-
-        if (!brush) {
-            continue;
-        }
-
-        qbsp_options.target_game->count_contents_in_stats(brush->contents, stats);
-
-        dst.bounds += brush->bounds;
-        brushes.push_back(bspbrush_t::make_ptr(std::move(*brush)));
+        jobs.push_back({&src, &mapbrush, false, LoadBrushSides(mapbrush, contents, hullnum)});
     }
 }
 
@@ -871,10 +911,13 @@ void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::con
     bool is_world_entity = map.is_world_entity(entity);
 
     auto stats = qbsp_options.target_game->create_content_stats();
-    logging::percent_clock clock(0);
-    clock.displayElapsed = is_world_entity;
+    auto start = I_FloatTime();
 
-    Brush_LoadEntity(entity, entity, hullnum, *stats, brushes, clock, num_clipped);
+    // the sides of each brush are made serially, in order, since that adds planes
+    // to the map; the windings, which are most of the work, are made in parallel
+    std::vector<brush_load_job_t> jobs;
+
+    Brush_CollectEntity(entity, entity, hullnum, jobs);
 
     /*
      * If this is the world entity, find all func_group and func_detail
@@ -894,12 +937,40 @@ void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::con
             ProcessAreaPortal(source);
 
             if (IsWorldBrushEntity(source) || IsNonRemoveWorldBrushEntity(source)) {
-                Brush_LoadEntity(entity, source, hullnum, *stats, brushes, clock, num_clipped);
+                Brush_CollectEntity(entity, source, hullnum, jobs);
             }
         }
     }
 
-    clock.print();
+    logging::parallel_for_each(jobs, [hullnum](brush_load_job_t &job) {
+        job.loaded = FinishBrush(*job.src, job.brush, hullnum, job.num_clipped);
+    });
+
+    // gather the results in map order, so the output doesn't depend on scheduling
+    size_t num_loaded = 0;
+
+    for (brush_load_job_t &job : jobs) {
+        num_clipped += job.num_clipped;
+
+        if (!job.loaded) {
+            continue;
+        }
+
+        entity.bounds += job.brush.bounds;
+
+        if (job.bounds_only) {
+            continue;
+        }
+
+        qbsp_options.target_game->count_contents_in_stats(job.brush.contents, *stats);
+        brushes.push_back(bspbrush_t::make_ptr(std::move(job.brush)));
+        num_loaded++;
+    }
+
+    if (is_world_entity) {
+        logging::print(logging::flag::STAT, "     {:8} brushes loaded for hull {} in {:.3}\n", num_loaded,
+            hullnum ? std::to_string(hullnum.value()) : std::string("(all)"), I_FloatTime() - start);
+    }
 
     logging::header("CountBrushes");
 
@@ -24,6 +24,8 @@
 #include <climits>
 
 #include <common/log.hh>
+#include <common/parallel.hh>
+#include <common/profile.hh>
 #include <qbsp/brush.hh>
 #include <qbsp/map.hh>
 #include <qbsp/portals.hh>
@@ -31,6 +33,8 @@
 #include <qbsp/tree.hh>
 
 #include <list>
+#include <numeric>
+#include <unordered_map>
 #include <atomic>
 
 #include "tbb/task_group.h"
@@ -254,6 +258,59 @@ static int QuickTestBrushToPlanenum(const bspbrush_t &brush, int planenum, int *
 }
 #endif
 
+/*
+============
+CountBrushSplits
+
+For a brush straddling the plane, counts the visible faces that would be
+split and whether a hint face would be split. Bumps epsilonbrush if the
+brush only pokes through the plane by less than a unit.
+============
+*/
+static void CountBrushSplits(
+    const bspbrush_t &brush, const qbsp_plane_t &plane, int *numsplits, bool *hintsplit, int *epsilonbrush)
+{
+    // if both sides, count the visible faces split
+    vec_t d_front = 0;
+    vec_t d_back = 0;
+
+    for (const side_t &side : brush.sides) {
+        if (side.onnode)
+            continue; // on node, don't worry about splits
+        if (!side.is_visible())
+            continue; // we don't care about non-visible
+        auto &w = side.w;
+        if (!w)
+            continue;
+        int front = 0;
+        int back = 0;
+        for (auto &point : w) {
+            const double d = qv::dot(point, plane.get_normal()) - plane.get_dist();
+            if (d > d_front)
+                d_front = d;
+            if (d < d_back)
+                d_back = d;
+
+            if (d > 0.1) // PLANESIDE_EPSILON)
+                front = 1;
+            if (d < -0.1) // PLANESIDE_EPSILON)
+                back = 1;
+        }
+        if (front && back) {
+            if (!(side.get_texinfo().flags.is_hintskip)) {
+                (*numsplits)++;
+                if (side.get_texinfo().flags.is_hint) {
+                    *hintsplit = true;
+                }
+            }
+        }
+    }
+
+    if ((d_front > 0.0 && d_front < 1.0) || (d_back < 0.0 && d_back > -1.0)) {
+        (*epsilonbrush)++;
+    }
+}
+
 /*
 ============
 TestBrushToPlanenum
@@ -288,45 +345,7 @@ static int TestBrushToPlanenum(
         return s;
 
     if (numsplits && hintsplit && epsilonbrush) {
-        // if both sides, count the visible faces split
-        vec_t d_front = 0;
-        vec_t d_back = 0;
-
-        for (const side_t &side : brush.sides) {
-            if (side.onnode)
-                continue; // on node, don't worry about splits
-            if (!side.is_visible())
-                continue; // we don't care about non-visible
-            auto &w = side.w;
-            if (!w)
-                continue;
-            int front = 0;
-            int back = 0;
-            for (auto &point : w) {
-                const double d = qv::dot(point, plane.get_normal()) - plane.get_dist();
-                if (d > d_front)
-                    d_front = d;
-                if (d < d_back)
-                    d_back = d;
-
-                if (d > 0.1) // PLANESIDE_EPSILON)
-                    front = 1;
-                if (d < -0.1) // PLANESIDE_EPSILON)
-                    back = 1;
-            }
-            if (front && back) {
-                if (!(side.get_texinfo().flags.is_hintskip)) {
-                    (*numsplits)++;
-                    if (side.get_texinfo().flags.is_hint) {
-                        *hintsplit = true;
-                    }
-                }
-            }
-        }
-
-        if ((d_front > 0.0 && d_front < 1.0) || (d_back < 0.0 && d_back > -1.0)) {
-            (*epsilonbrush)++;
-        }
+        CountBrushSplits(brush, plane, numsplits, hintsplit, epsilonbrush);
     }
 
     return s;
@@ -899,6 +918,215 @@ static side_t *ChooseMidPlaneFromList(const bspbrush_t::container &brushes, cons
     return bestaxialplane ? bestaxialplane : bestanyplane;
 }
 
+/*
+================
+split_plane_table_t
+
+Per-node data for scoring split planes, built once per SelectSplitPlane
+call so each candidate plane can be scored without calling
+TestBrushToPlanenum on every brush.
+================
+*/
+struct split_plane_table_t
+{
+    size_t num_brushes = 0;
+
+    // brush bounds as separate arrays, for the non-axial box test
+    std::array<std::vector<vec_t>, 3> mins, maxs;
+
+    // for axial planes: brush maxs in ascending order, and brush indices
+    // in ascending order of mins (with the matching mins values)
+    std::array<std::vector<vec_t>, 3> sorted_maxs;
+    std::array<std::vector<uint32_t>, 3> by_mins;
+    std::array<std::vector<vec_t>, 3> by_mins_value;
+
+    // positive planenum => brushes with a side on that plane, and the
+    // side TestBrushToPlanenum reports for them (PSIDE_FACING included)
+    std::unordered_map<size_t, std::vector<std::pair<uint32_t, int>>> facing;
+};
+
+static split_plane_table_t MakeSplitPlaneTable(const bspbrush_t::container &brushes)
+{
+    split_plane_table_t table;
+    const size_t n = table.num_brushes = brushes.size();
+
+    for (int axis = 0; axis < 3; axis++) {
+        table.mins[axis].resize(n);
+        table.maxs[axis].resize(n);
+
+        for (size_t i = 0; i < n; i++) {
+            table.mins[axis][i] = brushes[i]->bounds.mins()[axis];
+            table.maxs[axis][i] = brushes[i]->bounds.maxs()[axis];
+        }
+
+        table.sorted_maxs[axis] = table.maxs[axis];
+        std::sort(table.sorted_maxs[axis].begin(), table.sorted_maxs[axis].end());
+
+        auto &order = table.by_mins[axis];
+        order.resize(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(),
+            [&](uint32_t a, uint32_t b) { return table.mins[axis][a] < table.mins[axis][b]; });
+
+        table.by_mins_value[axis].resize(n);
+        for (size_t k = 0; k < n; k++) {
+            table.by_mins_value[axis][k] = table.mins[axis][order[k]];
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        for (auto &side : brushes[i]->sides) {
+            auto &list = table.facing[side.planenum & ~1];
+
+            // same as TestBrushToPlanenum: the first side on the plane decides
+            if (!list.empty() && list.back().first == i) {
+                continue;
+            }
+
+            list.emplace_back(i, ((side.planenum & 1) ? PSIDE_FRONT : PSIDE_BACK) | PSIDE_FACING);
+        }
+    }
+
+    return table;
+}
+
+struct split_plane_score_t
+{
+    int front = 0;
+    int back = 0;
+    int facing = 0;
+    int splits = 0;
+    int epsilonbrush = 0;
+    bool hintsplit = false;
+};
+
+/*
+================
+ScoreSplitPlane
+
+Gives the same counts as calling TestBrushToPlanenum on every brush
+for positive_planenum.
+
+Axial planes are counted by binary searching the sorted extents; only
+brushes whose mins are behind the plane are scanned for straddlers.
+Other planes use a flat box-vs-plane loop over the bounds arrays.
+Only straddling brushes get the full winding test.
+================
+*/
+static split_plane_score_t ScoreSplitPlane(
+    const bspbrush_t::container &brushes, const split_plane_table_t &table, size_t positive_planenum)
+{
+    const size_t n = table.num_brushes;
+    const qbsp_plane_t &plane = map.get_plane(positive_planenum);
+    const vec_t dist = plane.get_dist();
+
+    split_plane_score_t score;
+
+    // all zero between calls; only the facing entries are set, and they're
+    // cleared again before returning, so this stays O(facing) per plane
+    thread_local static std::vector<uint8_t> is_facing;
+    thread_local static std::vector<uint32_t> straddlers;
+    if (is_facing.size() < n) {
+        is_facing.resize(n, 0);
+    }
+    straddlers.clear();
+
+    const std::vector<std::pair<uint32_t, int>> *facing = nullptr;
+    if (auto it = table.facing.find(positive_planenum); it != table.facing.end()) {
+        facing = &it->second;
+        for (auto &[i, s] : *facing) {
+            is_facing[i] = 1;
+        }
+    }
+
+    if (plane.get_type() < plane_type_t::PLANE_ANYX) {
+        const int axis = static_cast<int>(plane.get_type());
+        const vec_t front_dist = dist + PLANESIDE_EPSILON;
+        const vec_t back_dist = dist - PLANESIDE_EPSILON;
+
+        // box test: front if maxs > front_dist, back if mins < back_dist
+        const auto &sorted_maxs = table.sorted_maxs[axis];
+        const auto &by_mins_value = table.by_mins_value[axis];
+
+        score.front = static_cast<int>(
+            sorted_maxs.end() - std::upper_bound(sorted_maxs.begin(), sorted_maxs.end(), front_dist));
+        const size_t num_back =
+            std::lower_bound(by_mins_value.begin(), by_mins_value.end(), back_dist) - by_mins_value.begin();
+        score.back = static_cast<int>(num_back);
+
+        const auto &order = table.by_mins[axis];
+        const auto &maxs = table.maxs[axis];
+        for (size_t k = 0; k < num_back; k++) {
+            const uint32_t i = order[k];
+            if (maxs[i] > front_dist && !is_facing[i]) {
+                straddlers.push_back(i);
+            }
+        }
+
+        // facing brushes don't get the box test
+        if (facing) {
+            for (auto &[i, s] : *facing) {
+                if (table.maxs[axis][i] > front_dist)
+                    score.front--;
+                if (table.mins[axis][i] < back_dist)
+                    score.back--;
+            }
+        }
+    } else {
+        // same leading/trailing corners as BoxOnPlaneSide
+        const qvec3d &normal = plane.get_normal();
+        std::array<const vec_t *, 3> lead, trail;
+        for (int k = 0; k < 3; k++) {
+            lead[k] = normal[k] < 0 ? table.mins[k].data() : table.maxs[k].data();
+            trail[k] = normal[k] < 0 ? table.maxs[k].data() : table.mins[k].data();
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            const double dist1 = (normal[0] * lead[0][i] + normal[1] * lead[1][i] + normal[2] * lead[2][i]) - dist;
+            const double dist2 = (normal[0] * trail[0][i] + normal[1] * trail[1][i] + normal[2] * trail[2][i]) - dist;
+            const bool front = dist1 >= PLANESIDE_EPSILON;
+            const bool back = dist2 < PLANESIDE_EPSILON;
+
+            if (is_facing[i])
+                continue;
+
+            score.front += front;
+            score.back += back;
+
+            if (front && back) {
+                straddlers.push_back(i);
+            }
+        }
+    }
+
+    if (facing) {
+        for (auto &[i, s] : *facing) {
+            score.facing++;
+            if (s & PSIDE_FRONT)
+                score.front++;
+            if (s & PSIDE_BACK)
+                score.back++;
+
+            is_facing[i] = 0;
+        }
+    }
+
+    for (uint32_t i : straddlers) {
+        int bsplits = 0;
+        bool bhint = false;
+        CountBrushSplits(*brushes[i], plane, &bsplits, &bhint, &score.epsilonbrush);
+        score.splits += bsplits;
+
+        // TestBrushToPlanenum resets hintsplit for every brush, so the
+        // original loop only ever reported it for the last brush tested
+        if (i == n - 1) {
+            score.hintsplit = bhint;
+        }
+    }
+
+    return score;
+}
+
 /*
 ================
 SelectSplitPlane
@@ -956,6 +1184,8 @@ static side_t *SelectSplitPlane(
     side_t *bestside = nullptr;
     int bestvalue = -99999;
 
+    const split_plane_table_t table = MakeSplitPlaneTable(brushes);
+
     // the search order goes: (changed from q2 tools - see q2_detail_leak_test.map for the issue
     // with the vanilla q2 tools method):
     //
@@ -995,36 +1225,19 @@ static side_t *SelectSplitPlane(
                     continue; // would produce a tiny volume
 #endif
 
-                int front = 0;
-                int back = 0;
-                int facing = 0;
-                int splits = 0;
-                int epsilonbrush = 0;
-                bool hintsplit = false;
-
-                for (auto &test : brushes) {
-                    int bsplits;
-                    int s = TestBrushToPlanenum(*test, positive_planenum, &bsplits, &hintsplit, &epsilonbrush);
-
-                    splits += bsplits;
-                    if (bsplits && (s & PSIDE_FACING))
-                        Error("PSIDE_FACING with splits");
-
-                    test->testside = s;
-                    // if the brush shares this face, don't bother
-                    // testing that facenum as a splitter again
-                    if (s & PSIDE_FACING) {
-                        facing++;
-                        for (auto &testside : test->sides) {
-                            if ((testside.planenum & ~1) == (side.planenum & ~1)) {
+                const auto [front, back, facing, splits, epsilonbrush, hintsplit] =
+                    ScoreSplitPlane(brushes, table, positive_planenum);
+
+                // if a brush shares this face, don't bother
+                // testing that facenum as a splitter again
+                if (auto it = table.facing.find(positive_planenum); it != table.facing.end()) {
+                    for (auto &[i, s] : it->second) {
+                        for (auto &testside : brushes[i]->sides) {
+                            if ((testside.planenum & ~1) == positive_planenum) {
                                 testside.tested = true;
                             }
                         }
                     }
-                    if (s & PSIDE_FRONT)
-                        front++;
-                    if (s & PSIDE_BACK)
-                        back++;
                 }
 
                 // give a value estimate for using this plane
@@ -1040,15 +1253,9 @@ static side_t *SelectSplitPlane(
                 if (hintsplit && !(side.get_texinfo().flags.is_hint))
                     value = -9999999;
 
-                // save off the side test so we don't need
-                // to recalculate it when we actually seperate
-                // the brushes
                 if (value > bestvalue) {
                     bestvalue = value;
                     bestside = &side;
-                    for (auto &test : brushes) {
-                        test->side = test->testside;
-                    }
                 }
             }
         }
@@ -1062,6 +1269,14 @@ static side_t *SelectSplitPlane(
         }
     }
 
+    // save off the side test for the winner, so we don't need
+    // to recalculate it when we actually seperate the brushes
+    if (bestside) {
+        for (auto &test : brushes) {
+            test->side = TestBrushToPlanenum(*test, bestside->planenum & ~1, nullptr, nullptr, nullptr);
+        }
+    }
+
     //
     // clear all the tested flags we set
     //
@@ -1219,6 +1434,8 @@ BrushBSP
 */
 void BrushBSP(tree_t &tree, mapentity_t &entity, const bspbrush_t::container &brushlist, tree_split_t split_type)
 {
+    PROFILE_ZONE("BrushBSP", "brushes", brushlist.size());
+
     logging::header(__func__);
 
     if (brushlist.empty()) {
@@ -1391,55 +1608,59 @@ struct chopstats_t : logging::stat_tracker_t
     stat &c_from_split = register_stat("brushes created from the chompening");
 };
 
+// a brush in a chop list, tagged with the index of the input brush
+// it was carved from
+struct chop_entry_t
+{
+    size_t origin;
+    bspbrush_t::ptr brush;
+};
+
+using chop_list_t = std::list<chop_entry_t>;
+
+static chop_list_t ChopEntries(size_t origin, bspbrush_t::list &brushes)
+{
+    chop_list_t result;
+    for (auto &brush : brushes) {
+        result.push_back({origin, std::move(brush)});
+    }
+    return result;
+}
+
 /*
 =================
-ChopBrushes
+ChopBrushList
 
-Carves any intersecting solid brushes into the minimum number
-of non-intersecting brushes.
+The original serial chop, run on one cluster of brushes.
 
-Modifies the input list and may free destroyed brushes.
+New fragments are spliced in where the brush they replace was,
+and inherit its origin.
 =================
 */
-void ChopBrushes(bspbrush_t::container &brushes, bool allow_fragmentation)
+static void ChopBrushList(
+    chop_list_t &list, bool allow_fragmentation, chopstats_t &stats, logging::percent_clock &clock)
 {
-    size_t original_count = brushes.size();
-    logging::funcheader();
-
-    // convert brush container to list, so we don't lose
-    // track of the original ptrs and so we can re-organize things
-    bspbrush_t::list list{std::make_move_iterator(brushes.begin()), std::make_move_iterator(brushes.end())};
-
-    // clear original list
-    brushes.clear();
-
-    logging::percent_clock clock(list.size());
-    chopstats_t stats;
-
-    decltype(list)::iterator b1_it = list.begin();
+    chop_list_t::iterator b1_it = list.begin();
 
 newlist:
 
     if (!list.size()) {
-        // clear output since this is kind of an error...
-        brushes.clear();
         return;
     }
 
-    decltype(list)::iterator next;
+    chop_list_t::iterator next;
 
     for (; b1_it != list.end(); b1_it = next) {
-        clock.max = list.size();
         next = std::next(b1_it);
 
-        auto &b1 = *b1_it;
+        auto &b1 = b1_it->brush;
 
         if (b1->mapbrush->no_chop) {
             continue;
         }
 
         for (auto b2_it = next; b2_it != list.end(); b2_it++) {
-            auto &b2 = *b2_it;
+            auto &b2 = b2_it->brush;
 
             if (b2->mapbrush->no_chop) {
                 continue;
@@ -1460,6 +1681,7 @@ newlist:
 
                 if (sub.empty()) { // b1 is swallowed by b2
                     b1_it = list.erase(b1_it); // continue after b1_it
+                    clock.max--;
                     stats.c_swallowed++;
                     goto newlist;
                 }
@@ -1473,6 +1695,7 @@ newlist:
                 }
                 if (sub2.empty()) { // b2 is swallowed by b1
                     list.erase(b2_it);
+                    clock.max--;
                     // continue where b1_it was
                     stats.c_swallowed++;
                     goto newlist;
@@ -1491,13 +1714,18 @@ newlist:
 
             if (c1 < c2) {
                 stats.c_from_split += sub.size();
+                auto entries = ChopEntries(b1_it->origin, sub);
+                // the clock counts brushes across every cluster's list
+                clock.max += entries.size() - 1;
                 auto before = list.erase(b1_it); // remove the current brush, go back one
-                list.splice(before, sub); // splice new list in place of where the brush was
+                list.splice(before, entries); // splice new list in place of where the brush was
                 b1_it = before; // restart list with the new brushes
                 goto newlist;
             } else {
                 stats.c_from_split += sub2.size();
-                list.splice(b2_it, sub2); // splice new brushes before b2_it
+                auto entries = ChopEntries(b2_it->origin, sub2);
+                clock.max += entries.size() - 1;
+                list.splice(b2_it, entries); // splice new brushes before b2_it
                 list.erase(b2_it); // remove b2_it
                 // continue where b1_it left off
                 goto newlist;
@@ -1506,12 +1734,149 @@ newlist:
 
         clock();
     }
+}
+
+/*
+=================
+ChopClusters
+
+Groups the brushes into clusters that can interact during chopping:
+connected components of the "bounds overlap" graph, ignoring no_chop
+brushes. Chopping only ever produces fragments inside the brush being
+carved, so brushes in different clusters never touch each other.
+
+Pairs are found by sweep and prune on the X axis. Each cluster lists
+its brushes in input order.
+=================
+*/
+static std::vector<std::vector<size_t>> ChopClusters(const bspbrush_t::container &brushes)
+{
+    const size_t n = brushes.size();
+
+    // union-find
+    std::vector<size_t> parent(n);
+    std::iota(parent.begin(), parent.end(), 0);
+
+    auto find = [&](size_t i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+
+    std::vector<size_t> sorted;
+    sorted.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        if (!brushes[i]->mapbrush->no_chop) {
+            sorted.push_back(i);
+        }
+    }
+    std::sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b) {
+        return brushes[a]->bounds.mins()[0] < brushes[b]->bounds.mins()[0];
+    });
+
+    for (size_t k = 0; k < sorted.size(); k++) {
+        const bspbrush_t &b1 = *brushes[sorted[k]];
+
+        for (size_t m = k + 1; m < sorted.size(); m++) {
+            const bspbrush_t &b2 = *brushes[sorted[m]];
+
+            if (b2.bounds.mins()[0] >= b1.bounds.maxs()[0]) {
+                break;
+            }
+            if (b1.bounds.disjoint_or_touching(b2.bounds)) {
+                continue;
+            }
+
+            const size_t r1 = find(sorted[k]), r2 = find(sorted[m]);
+            if (r1 != r2) {
+                parent[std::max(r1, r2)] = std::min(r1, r2);
+            }
+        }
+    }
+
+    // roots are the lowest index in their cluster, so clusters come
+    // out ordered by their first brush
+    std::vector<std::vector<size_t>> clusters;
+    std::vector<size_t> cluster_of_root(n, std::numeric_limits<size_t>::max());
+
+    for (size_t i = 0; i < n; i++) {
+        const size_t root = find(i);
+        if (cluster_of_root[root] == std::numeric_limits<size_t>::max()) {
+            cluster_of_root[root] = clusters.size();
+            clusters.emplace_back();
+        }
+        clusters[cluster_of_root[root]].push_back(i);
+    }
+
+    return clusters;
+}
+
+/*
+=================
+ChopBrushes
+
+Carves any intersecting solid brushes into the minimum number
+of non-intersecting brushes.
+
+Independent clusters of overlapping brushes are chopped in parallel;
+the result is the same brush set, in the same order, as chopping the
+whole list serially.
+
+Modifies the input list and may free destroyed brushes.
+=================
+*/
+void ChopBrushes(bspbrush_t::container &brushes, bool allow_fragmentation)
+{
+    size_t original_count = brushes.size();
+    logging::funcheader();
+
+    logging::percent_clock clock(brushes.size());
+    chopstats_t stats;
+
+    const auto clusters = ChopClusters(brushes);
+    logging::print(logging::flag::STAT, "     {:8} chop clusters\n", clusters.size());
+
+    // output of each cluster
+    std::vector<chop_list_t> results(clusters.size());
+
+    // not logging::parallel_for; the clock reports progress by brush, not by cluster
+    tbb::parallel_for(static_cast<size_t>(0), clusters.size(), [&](size_t c) {
+        chop_list_t &list = results[c];
+
+        for (size_t i : clusters[c]) {
+            list.push_back({i, brushes[i]});
+        }
+
+        if (list.size() > 1) {
+            ChopBrushList(list, allow_fragmentation, stats, clock);
+        } else {
+            clock();
+        }
+    });
+
+    // every surviving brush descends from exactly one input brush and sits
+    // where that brush was; gather by origin to restore the serial order
+    std::vector<bspbrush_t::container> by_origin(original_count);
+
+    for (auto &list : results) {
+        for (auto &entry : list) {
+            by_origin[entry.origin].push_back(std::move(entry.brush));
+        }
+    }
+
+    brushes.clear();
+
+    for (auto &fragments : by_origin) {
+        brushes.insert(
+            brushes.end(), std::make_move_iterator(fragments.begin()), std::make_move_iterator(fragments.end()));
+    }
 
     // since chopbrushes can remove stuff, exact counts are hard...
-    clock.max = list.size();
+    clock.max = brushes.size();
     clock.print();
 
-    brushes.insert(brushes.begin(), std::make_move_iterator(list.begin()), std::make_move_iterator(list.end()));
     logging::print(logging::flag::STAT, "chopped {} brushes into {}\n", original_count, brushes.size());
 
     if (qbsp_options.debugchop.value()) {
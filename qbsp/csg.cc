@@ -29,6 +29,8 @@
 #include <common/parallel.hh>
 #include <atomic>
 #include <mutex>
+#include <numeric>
+#include <span>
 
 /*
 
@@ -273,8 +275,125 @@ struct csg_stats
 {
     std::atomic<int> fullyeatenbrushes{};
     std::atomic<int> postcsgfaces{};
+    size_t candidatepairs = 0;
 };
 
+/*
+==================
+csg_broadphase_t
+
+For each brush, the indices of the brushes it must be clipped against
+(same contents, overlapping or touching bounds), in ascending order.
+Stored as one flat array; brush i's candidates are
+candidates[offsets[i] .. offsets[i + 1]).
+==================
+*/
+struct csg_broadphase_t
+{
+    std::vector<size_t> offsets;
+    std::vector<size_t> candidates;
+
+    inline std::span<const size_t> operator[](size_t i) const
+    {
+        return {candidates.data() + offsets[i], candidates.data() + offsets[i + 1]};
+    }
+};
+
+// same test CSGFaces always used; touching brushes still need to be clipped
+inline bool CSG_BoundsOverlap(const aabb3d &a, const aabb3d &b)
+{
+    for (int j = 0; j < 3; j++) {
+        if (a.mins()[j] > b.maxs()[j])
+            return false;
+        if (a.maxs()[j] < b.mins()[j])
+            return false;
+    }
+    return true;
+}
+
+/*
+==================
+MakeCSGBroadphase
+
+Sweep and prune along the axis the brushes are most spread out on.
+Brushes are sorted by their minimum on that axis; each one only needs to
+be tested against the brushes after it in sorted order whose minimum is
+within its own maximum.
+==================
+*/
+static csg_broadphase_t MakeCSGBroadphase(const bspbrush_t::container &brushes)
+{
+    const size_t n = brushes.size();
+
+    csg_broadphase_t result;
+    result.offsets.resize(n + 1, 0);
+
+    if (!n) {
+        return result;
+    }
+
+    aabb3d centers;
+    for (auto &brush : brushes) {
+        centers += brush->bounds.centroid();
+    }
+    const qvec3d spread = centers.size();
+    const int axis = (spread[0] >= spread[1] && spread[0] >= spread[2]) ? 0 : (spread[1] >= spread[2]) ? 1 : 2;
+
+    std::vector<size_t> sorted(n);
+    std::iota(sorted.begin(), sorted.end(), 0);
+    std::stable_sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b) {
+        return brushes[a]->bounds.mins()[axis] < brushes[b]->bounds.mins()[axis];
+    });
+
+    // overlapping partners found scanning forward from each sorted position
+    std::vector<std::vector<size_t>> forward(n);
+
+    tbb::parallel_for(static_cast<size_t>(0), n, [&](size_t k) {
+        const bspbrush_t &brush = *brushes[sorted[k]];
+        const vec_t maxs = brush.bounds.maxs()[axis];
+
+        for (size_t m = k + 1; m < n; m++) {
+            const bspbrush_t &other = *brushes[sorted[m]];
+
+            if (other.bounds.mins()[axis] > maxs)
+                break;
+            if (!brush.contents.equals(qbsp_options.target_game, other.contents))
+                continue;
+            if (!CSG_BoundsOverlap(brush.bounds, other.bounds))
+                continue;
+
+            forward[k].push_back(sorted[m]);
+        }
+    });
+
+    // each pair is a candidate for both brushes
+    for (size_t k = 0; k < n; k++) {
+        result.offsets[sorted[k] + 1] += forward[k].size();
+        for (size_t other : forward[k]) {
+            result.offsets[other + 1]++;
+        }
+    }
+
+    std::partial_sum(result.offsets.begin(), result.offsets.end(), result.offsets.begin());
+    result.candidates.resize(result.offsets[n]);
+
+    std::vector<size_t> fill(result.offsets.begin(), result.offsets.end() - 1);
+    for (size_t k = 0; k < n; k++) {
+        const size_t i = sorted[k];
+        for (size_t other : forward[k]) {
+            result.candidates[fill[i]++] = other;
+            result.candidates[fill[other]++] = i;
+        }
+    }
+
+    // restore list order, so "later brushes override" still holds
+    tbb::parallel_for(static_cast<size_t>(0), n, [&](size_t i) {
+        std::sort(result.candidates.begin() + result.offsets[i], result.candidates.begin() + result.offsets[i + 1]);
+    });
+
+    return result;
+}
+
 /*
 ==================
 CSGFaces
@@ -323,6 +442,9 @@ bspbrush_t::container CSGFaces(bspbrush_t::container brushes)
 
     csg_stats stats{};
 
+    const csg_broadphase_t broadphase = MakeCSGBroadphase(brushes);
+    stats.candidatepairs = broadphase.candidates.size() / 2;
+
     // output vector for the parallel_for
     bspbrush_t::container brushvec_outsides;
     brushvec_outsides.resize(brushes.size());
@@ -344,33 +466,16 @@ bspbrush_t::container CSGFaces(bspbrush_t::container brushes)
         std::vector<side_t> outside;
         std::swap(outside, brush_result->sides);
 
-        bool overwrite = false;
+        // only brushes with equal contents and overlapping bounds,
+        // in list order
+        for (size_t j : broadphase[i]) {
+            const bspbrush_t::ptr &clipbrush = brushes[j];
 
-        for (auto &clipbrush : brushes) {
-            if (&brush == &clipbrush) {
-                /* Brushes further down the list override earlier ones.
-                 * This is only relevant for choosing a winner when there's two
-                 * overlapping faces.
-                 */
-                overwrite = true;
-                continue;
-            }
-            if (!brush->contents.equals(qbsp_options.target_game, clipbrush->contents)) {
-                /* Only consider clipping equal contents against each other */
-                continue;
-            }
-
-            /* check bounding box first */
-            // TODO: is this a disjoint check? brush->bounds.disjoint(clipbrush->bounds)?
-            int j;
-            for (j = 0; j < 3; j++) {
-                if (brush->bounds.mins()[j] > clipbrush->bounds.maxs()[j])
-                    break;
-                if (brush->bounds.maxs()[j] < clipbrush->bounds.mins()[j])
-                    break;
-            }
-            if (j < 3)
-                continue;
+            /* Brushes further down the list override earlier ones.
+             * This is only relevant for choosing a winner when there's two
+             * overlapping faces.
+             */
+            const bool overwrite = j > i;
 
             // divide faces by the planes of the new brush
             std::vector<side_t> inside;
@@ -399,6 +504,8 @@ bspbrush_t::container CSGFaces(bspbrush_t::container brushes)
 
     logging::print(logging::flag::STAT, "     {:8} post csg sides\n", stats.postcsgfaces.load());
     logging::print(logging::flag::STAT, "     {:8} fully eaten brushes\n", stats.fullyeatenbrushes.load());
+    logging::print(logging::flag::STAT, "     {:8} brush pairs tested ({} brushes)\n", stats.candidatepairs,
+        brushes.size());
 
     return brushvec_outsides;
 }
@@ -29,13 +29,16 @@
 
 #include <common/log.hh>
 #include <common/ostream.hh>
+#include <common/profile.hh>
+#include <atomic>
 #include <climits>
 #include <vector>
 #include <set>
-#include <list>
-#include <unordered_set>
 #include <utility>
 
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+
 static bool LeafSealsMap(const node_t *node)
 {
     Q_assert(node->is_leaf);
@@ -120,72 +123,184 @@ static bool OutsideFill_Passable(const portal_t *p)
     return !LeafSealsMap(p->nodes[0]) && !LeafSealsMap(p->nodes[1]);
 }
 
-static bool DetailFill_Passable(const portal_t *p)
+/*
+==================
+LeafGraph
+
+Returns the CSR leaf adjacency of the tree (see leaf_graph_t), building
+it on first use after MakeTreePortals. Edges of a leaf are stored in
+the same order as its portal list, so walking them visits portals in the
+same order as walking node->portals.
+==================
+*/
+static void GatherLeafs_r(node_t *node, leaf_graph_t &graph)
 {
-    if (!p->onnode) {
-        // portal to outside_node
-        return false;
+    if (!node->is_leaf) {
+        GatherLeafs_r(node->children[0], graph);
+        GatherLeafs_r(node->children[1], graph);
+        return;
+    }
+
+    node->leafgraph_index = graph.leafs.size();
+    graph.leafs.push_back(node);
+}
+
+static const leaf_graph_t &LeafGraph(tree_t &tree)
+{
+    leaf_graph_t &graph = tree.leafgraph;
+
+    if (!graph.empty()) {
+        return graph;
+    }
+
+    GatherLeafs_r(tree.headnode, graph);
+
+    graph.offsets.reserve(graph.leafs.size() + 1);
+    graph.offsets.push_back(0);
+
+    for (node_t *node : graph.leafs) {
+        int side;
+        for (portal_t *portal = node->portals; portal; portal = portal->next[!side]) {
+            side = (portal->nodes[0] == node);
+
+            if (!portal->onnode) {
+                // portal to outside_node
+                continue;
+            }
+
+            node_t *neighbour = portal->nodes[side];
+            Q_assert(neighbour->is_leaf);
+
+            graph.neighbours.push_back(neighbour->leafgraph_index);
+            graph.portals.push_back(portal);
+        }
+
+        graph.offsets.push_back(graph.neighbours.size());
     }
 
-    return !LeafSealsForDetailFill(p->nodes[0]) && !LeafSealsForDetailFill(p->nodes[1]);
+    return graph;
 }
 
 /*
 ==================
-FloodFillLeafsFromVoid
+BFSLeafGraph
 
-Sets outside_distance on leafs reachable from the void
+Level-synchronous breadth-first search over the leaf graph, starting
+from `start` (all at distance 0). A leaf for which `seals` is true is
+never entered or left. Returns the distance of every leaf, or -1 for
+unreachable ones.
 
-preconditions:
-- all leafs have outside_distance set to -1
+Each frontier is fully expanded before the next, so distances are the
+same as with a FIFO queue. Large frontiers are expanded in parallel;
+leafs are claimed with a compare-exchange, so the result doesn't depend
+on the thread schedule.
 ==================
 */
-static void FloodFillLeafsFromVoid(tree_t &tree)
+static constexpr size_t PARALLEL_FRONTIER_SIZE = 4096;
+
+template<typename F>
+static std::vector<int32_t> BFSLeafGraph(const leaf_graph_t &graph, const std::vector<uint32_t> &start, F &&seals)
 {
-    // breadth-first search
-    std::list<std::pair<node_t *, int>> queue;
-    std::unordered_set<node_t *> visited_nodes;
+    const size_t num_leafs = graph.leafs.size();
 
-    // push a node onto the queue which is in the void, but has a portal to outside_node
-    // NOTE: remember, the headnode has no relationship to the outside of the map.
-    {
-        const int side = (tree.outside_node.portals->nodes[0] == &tree.outside_node);
-        node_t *fillnode = tree.outside_node.portals->nodes[side];
+    std::vector<uint8_t> sealing(num_leafs);
+    for (size_t i = 0; i < num_leafs; i++) {
+        sealing[i] = seals(graph.leafs[i]);
+    }
 
-        Q_assert(fillnode != &tree.outside_node);
+    std::vector<int32_t> dist(num_leafs, -1);
+    std::vector<uint32_t> frontier, next;
 
-        // this must be true because the map is made from closed brushes, beyond which is void
-        Q_assert(!LeafSealsMap(fillnode));
-        queue.emplace_back(fillnode, 0);
+    for (uint32_t leaf : start) {
+        if (dist[leaf] == -1) {
+            dist[leaf] = 0;
+            frontier.push_back(leaf);
+        }
     }
 
-    while (!queue.empty()) {
-        const auto front = queue.front();
-        queue.pop_front();
+    tbb::enumerable_thread_specific<std::vector<uint32_t>> local_next;
 
-        auto [node, outside_distance] = front;
+    for (int32_t level = 1; !frontier.empty(); level++) {
+        next.clear();
 
-        if (visited_nodes.find(node) != visited_nodes.end()) {
-            // have already visited this node
-            continue;
+        if (frontier.size() < PARALLEL_FRONTIER_SIZE) {
+            for (uint32_t leaf : frontier) {
+                if (sealing[leaf]) {
+                    continue;
+                }
+                for (uint32_t e = graph.offsets[leaf]; e < graph.offsets[leaf + 1]; e++) {
+                    const uint32_t neighbour = graph.neighbours[e];
+
+                    if (!sealing[neighbour] && dist[neighbour] == -1) {
+                        dist[neighbour] = level;
+                        next.push_back(neighbour);
+                    }
+                }
+            }
+        } else {
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, frontier.size()), [&](const tbb::blocked_range<size_t> &r) {
+                std::vector<uint32_t> &out = local_next.local();
+
+                for (size_t i = r.begin(); i != r.end(); i++) {
+                    const uint32_t leaf = frontier[i];
+                    if (sealing[leaf]) {
+                        continue;
+                    }
+                    for (uint32_t e = graph.offsets[leaf]; e < graph.offsets[leaf + 1]; e++) {
+                        const uint32_t neighbour = graph.neighbours[e];
+
+                        if (sealing[neighbour]) {
+                            continue;
+                        }
+
+                        std::atomic_ref<int32_t> d(dist[neighbour]);
+                        int32_t expected = -1;
+                        if (d.load(std::memory_order_relaxed) == -1 &&
+                            d.compare_exchange_strong(expected, level, std::memory_order_relaxed)) {
+                            out.push_back(neighbour);
+                        }
+                    }
+                }
+            });
+
+            for (std::vector<uint32_t> &out : local_next) {
+                next.insert(next.end(), out.begin(), out.end());
+                out.clear();
+            }
         }
 
-        // visit node
-        visited_nodes.insert(node);
-        Q_assert(node->is_leaf);
-        node->outside_distance = outside_distance;
+        std::swap(frontier, next);
+    }
 
-        // push neighbouring nodes onto the back of the queue
-        int side;
-        for (portal_t *portal = node->portals; portal; portal = portal->next[!side]) {
-            side = (portal->nodes[0] == node);
+    return dist;
+}
 
-            if (!OutsideFill_Passable(portal))
-                continue;
+/*
+==================
+FloodFillLeafsFromVoid
 
-            node_t *neighbour = portal->nodes[side];
-            queue.emplace_back(neighbour, outside_distance + 1);
-        }
+Sets outside_distance on leafs reachable from the void
+
+preconditions:
+- all leafs have outside_distance set to -1
+==================
+*/
+static void FloodFillLeafsFromVoid(tree_t &tree, const leaf_graph_t &graph)
+{
+    // start from a node which is in the void, but has a portal to outside_node
+    // NOTE: remember, the headnode has no relationship to the outside of the map.
+    const int side = (tree.outside_node.portals->nodes[0] == &tree.outside_node);
+    node_t *fillnode = tree.outside_node.portals->nodes[side];
+
+    Q_assert(fillnode != &tree.outside_node);
+
+    // this must be true because the map is made from closed brushes, beyond which is void
+    Q_assert(!LeafSealsMap(fillnode));
+
+    const std::vector<int32_t> dist = BFSLeafGraph(graph, {fillnode->leafgraph_index}, LeafSealsMap);
+
+    for (size_t i = 0; i < graph.leafs.size(); i++) {
+        graph.leafs[i]->outside_distance = dist[i];
     }
 }
 
@@ -196,7 +311,7 @@ FindPortalsToVoid
 Given an occupied leaf, returns a list of porals leading to the void
 =============
 */
-static std::vector<portal_t *> FindPortalsToVoid(node_t *occupied_leaf)
+static std::vector<portal_t *> FindPortalsToVoid(const leaf_graph_t &graph, node_t *occupied_leaf)
 {
     Q_assert(occupied_leaf->occupant != nullptr);
     Q_assert(occupied_leaf->outside_distance >= 0);
@@ -215,14 +330,14 @@ static std::vector<portal_t *> FindPortalsToVoid(node_t *occupied_leaf)
         portal_t *bestportal = nullptr;
         int bestdist = node->outside_distance;
 
-        int side;
-        for (portal_t *portal = node->portals; portal; portal = portal->next[!side]) {
-            side = (portal->nodes[0] == node);
+        const uint32_t leaf = node->leafgraph_index;
+        for (uint32_t e = graph.offsets[leaf]; e < graph.offsets[leaf + 1]; e++) {
+            portal_t *portal = graph.portals[e];
 
             if (!OutsideFill_Passable(portal))
                 continue;
 
-            node_t *neighbour = portal->nodes[side];
+            node_t *neighbour = graph.leafs[graph.neighbours[e]];
             Q_assert(neighbour != node);
             Q_assert(neighbour->outside_distance >= 0);
 
@@ -542,7 +657,7 @@ static void SetOccupied_R(node_t *node, int dist)
 }
 #endif
 
-using portal_passable_t = bool (*)(const portal_t *);
+using leaf_seals_t = bool (*)(const node_t *);
 
 /*
 ==================
@@ -552,41 +667,33 @@ sets node->occupied to 1 or more to indicate the number of steps to a directly o
 ==================
 */
 static void BFSFloodFillFromOccupiedLeafs(
-    const std::vector<node_t *> &occupied_leafs, const portal_passable_t &predicate)
+    const leaf_graph_t &graph, const std::vector<node_t *> &occupied_leafs, leaf_seals_t seals)
 {
-    std::list<std::pair<node_t *, int>> queue;
+    std::vector<uint32_t> start;
+    start.reserve(occupied_leafs.size());
     for (node_t *leaf : occupied_leafs) {
-        queue.push_back(std::make_pair(leaf, 1));
+        start.push_back(leaf->leafgraph_index);
     }
 
-    while (!queue.empty()) {
-        auto pair = queue.front();
-        queue.pop_front();
-
-        node_t *node = pair.first;
-        const int dist = pair.second;
+    const std::vector<int32_t> dist = BFSLeafGraph(graph, start, seals);
 
-        if (node->occupied == 0) {
-            // we haven't visited this node yet
-            Q_assert(!node->detail_separator);
-            node->occupied = dist;
-
-            // push neighbouring nodes onto the back of the queue
-            int side;
-            for (portal_t *portal = node->portals; portal; portal = portal->next[!side]) {
-                side = (portal->nodes[0] == node);
-
-                if (!predicate(portal))
-                    continue;
-
-                node_t *neighbour = portal->nodes[side];
-                queue.push_back(std::make_pair(neighbour, dist + 1));
-            }
+    for (size_t i = 0; i < graph.leafs.size(); i++) {
+        if (dist[i] == -1) {
+            continue;
         }
+
+        node_t *node = graph.leafs[i];
+        Q_assert(!node->detail_separator);
+        node->occupied = dist[i] + 1;
     }
 }
 
-static std::vector<portal_t *> MakeLeakLine(node_t *outleaf, mapentity_t *&leakentity)
+struct flood_fill_stats_t : logging::stat_tracker_t
+{
+    stat &reached = register_stat("leafs reached by flood fill", true);
+};
+
+static std::vector<portal_t *> MakeLeakLine(const leaf_graph_t &graph, node_t *outleaf, mapentity_t *&leakentity)
 {
     std::vector<portal_t *> result;
 
@@ -604,14 +711,14 @@ static std::vector<portal_t *> MakeLeakLine(node_t *outleaf, mapentity_t *&leake
         portal_t *bestportal = nullptr;
         int bestoccupied = node->occupied;
 
-        int side;
-        for (portal_t *portal = node->portals; portal; portal = portal->next[!side]) {
-            side = (portal->nodes[0] == node);
+        const uint32_t leaf = node->leafgraph_index;
+        for (uint32_t e = graph.offsets[leaf]; e < graph.offsets[leaf + 1]; e++) {
+            portal_t *portal = graph.portals[e];
 
             if (!OutsideFill_Passable(portal))
                 continue;
 
-            node_t *neighbour = portal->nodes[side];
+            node_t *neighbour = graph.leafs[graph.neighbours[e]];
             Q_assert(neighbour != node);
             Q_assert(neighbour->occupied > 0);
 
@@ -669,6 +776,8 @@ Special cases: structural fully covered by detail still needs to be marked "visi
 */
 bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brushes)
 {
+    PROFILE_ZONE("FillOutside", "hull", hullnum.value_or(-1));
+
     node_t *node = tree.headnode;
 
     logging::funcheader();
@@ -691,6 +800,8 @@ bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brus
         return false;
     }
 
+    const leaf_graph_t &graph = LeafGraph(tree);
+
     mapentity_t *leakentity = nullptr;
     std::vector<portal_t *> leakline;
 
@@ -701,14 +812,14 @@ bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brus
     }
 
     if (filltype == settings::filltype_t::INSIDE) {
-        BFSFloodFillFromOccupiedLeafs(occupied_leafs, OutsideFill_Passable);
+        BFSFloodFillFromOccupiedLeafs(graph, occupied_leafs, LeafSealsMap);
 
         /* first check to see if an occupied leaf is hit */
         const int side = (tree.outside_node.portals->nodes[0] == &tree.outside_node);
         node_t *fillnode = tree.outside_node.portals->nodes[side];
 
         if (fillnode->occupied > 0) {
-            leakline = MakeLeakLine(fillnode, leakentity);
+            leakline = MakeLeakLine(graph, fillnode, leakentity);
             std::reverse(leakline.begin(), leakline.end());
         }
     } else {
@@ -716,7 +827,7 @@ bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brus
         //
         // We tried inside -> out and it leads to things like monster boxes getting inadvertently sealed,
         // or even whole sections of the map with no point entities - problems compounded by hull expansion.
-        FloodFillLeafsFromVoid(tree);
+        FloodFillLeafsFromVoid(tree, graph);
 
         // check for the occupied leaf closest to the void
         int best_leak_dist = INT_MAX;
@@ -735,7 +846,16 @@ bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brus
         if (best_leak) {
             leakentity = best_leak->occupant;
             Q_assert(leakentity != nullptr);
-            leakline = FindPortalsToVoid(best_leak);
+            leakline = FindPortalsToVoid(graph, best_leak);
+        }
+    }
+
+    // count the leafs the flood fill reached (from the entities, or from the void
+    // with -filltype outside)
+    flood_fill_stats_t fill_stats;
+    for (const node_t *leaf : graph.leafs) {
+        if (filltype == settings::filltype_t::INSIDE ? leaf->occupied > 0 : leaf->outside_distance >= 0) {
+            fill_stats.reached++;
         }
     }
 
@@ -831,7 +951,7 @@ void FillDetail(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brush
         return;
     }
 
-    BFSFloodFillFromOccupiedLeafs(occupied_leafs, DetailFill_Passable);
+    BFSFloodFillFromOccupiedLeafs(LeafGraph(tree), occupied_leafs, LeafSealsForDetailFill);
 
     // change the leaf contents
     detail_filled_leafs_stats_t stats;
@@ -29,11 +29,11 @@
 #include <qbsp/outside.hh>
 #include <qbsp/tree.hh>
 #include <common/log.hh>
+#include <common/profile.hh>
 #include <atomic>
 #include <common/prtfile.hh>
 
 #include "tbb/task_group.h"
-#include "common/vectorutils.hh"
 
 contentflags_t ClusterContents(const node_t *node)
 {
@@ -117,6 +117,56 @@ static void AddPortalToNodes(portal_t *p, node_t *front, node_t *back)
     back->portals = p;
 }
 
+/*
+================
+buildportal_memory_t
+================
+*/
+static void AtomicMax(std::atomic_int64_t &value, int64_t candidate)
+{
+    int64_t prev = value.load(std::memory_order_relaxed);
+    while (prev < candidate && !value.compare_exchange_weak(prev, candidate, std::memory_order_relaxed)) { }
+}
+
+void buildportal_memory_t::add(int64_t created, int64_t fragments, int64_t points)
+{
+    if (created) {
+        fragments_created += created;
+    }
+
+    const int64_t f = live_fragments.fetch_add(fragments, std::memory_order_relaxed) + fragments;
+    const int64_t p = live_points.fetch_add(points, std::memory_order_relaxed) + points;
+
+    // the two counters are read without a common lock, so this is approximate under concurrency
+    AtomicMax(peak_fragments, f);
+    AtomicMax(peak_bytes, f * int64_t(sizeof(buildportal_t)) + p * int64_t(sizeof(qvec3d)));
+}
+
+void buildportal_memory_t::print_memory_stats() const
+{
+    logging::print(logging::flag::STAT, "     {:8} portal fragments built\n", fragments_created.load());
+    logging::print(logging::flag::STAT, "     {:8} peak live portal fragments ({} KiB)\n", peak_fragments.load(),
+        peak_bytes.load() / 1024);
+}
+
+static int64_t CountPoints(const buildportal_list_t &portals)
+{
+    int64_t points = 0;
+    for (auto &p : portals) {
+        points += p.winding.size();
+    }
+    return points;
+}
+
+static void AppendBuildportals(buildportal_list_t &dest, buildportal_list_t &&src)
+{
+    if (dest.empty()) {
+        dest = std::move(src);
+    } else {
+        dest.insert(dest.end(), std::make_move_iterator(src.begin()), std::make_move_iterator(src.end()));
+    }
+}
+
 /*
 ================
 MakeHeadnodePortals
@@ -124,7 +174,7 @@ MakeHeadnodePortals
 The created portals will face the global outside_node
 ================
 */
-std::list<buildportal_t> MakeHeadnodePortals(tree_t &tree)
+buildportal_list_t MakeHeadnodePortals(tree_t &tree)
 {
     int i, j, n;
     std::array<buildportal_t, 6> portals{};
@@ -180,7 +230,6 @@ std::list<buildportal_t> MakeHeadnodePortals(tree_t &tree)
         }
     }
 
-    // move into std::list
     return {std::make_move_iterator(portals.begin()), std::make_move_iterator(portals.end())};
 }
 
@@ -226,7 +275,7 @@ portals in the node.
 ==================
 */
 static std::optional<buildportal_t> MakeNodePortal(
-    node_t *node, const std::list<buildportal_t> &boundary_portals, portalstats_t &stats)
+    node_t *node, const buildportal_list_t &boundary_portals, portalstats_t &stats)
 {
     auto w = BaseWindingForNode(node);
 
@@ -258,6 +307,8 @@ static std::optional<buildportal_t> MakeNodePortal(
         return std::nullopt;
     }
 
+    stats.memory.add(1, 1, w->size());
+
     buildportal_t new_portal{};
     new_portal.plane = node->get_plane();
     new_portal.onnode = node;
@@ -274,14 +325,15 @@ Move or split the portals that bound node so that the node's
 children have portals instead of node.
 ==============
 */
-static twosided<std::list<buildportal_t>> SplitNodePortals(
-    const node_t *node, std::list<buildportal_t> boundary_portals, portalstats_t &stats)
+static twosided<buildportal_list_t> SplitNodePortals(
+    const node_t *node, buildportal_list_t boundary_portals, portalstats_t &stats)
 {
     const auto &plane = node->get_plane();
     node_t *f = node->children[0];
     node_t *b = node->children[1];
 
-    twosided<std::list<buildportal_t>> result;
+    twosided<buildportal_list_t> result;
+    int64_t created = 0, dropped = 0, points = 0;
 
     for (auto &p : boundary_portals) {
         // which side of p `node` is on
@@ -312,6 +364,8 @@ static twosided<std::list<buildportal_t>> SplitNodePortals(
         }
 
         if (!frontwinding && !backwinding) { // tiny windings on both sides
+            dropped++;
+            points -= p.winding.size();
             continue;
         }
 
@@ -335,6 +389,9 @@ static twosided<std::list<buildportal_t>> SplitNodePortals(
         }
 
         // the winding is split
+        created++;
+        points += frontwinding->size() + backwinding->size() - p.winding.size();
+
         buildportal_t new_portal{};
         new_portal.plane = p.plane;
         new_portal.onnode = p.onnode;
@@ -355,6 +412,10 @@ static twosided<std::list<buildportal_t>> SplitNodePortals(
         result.back.push_back(std::move(new_portal));
     }
 
+    if (created || dropped || points) {
+        stats.memory.add(created, created - dropped, points);
+    }
+
     return result;
 }
 
@@ -363,9 +424,9 @@ static twosided<std::list<buildportal_t>> SplitNodePortals(
 MakePortalsFromBuildportals
 ================
 */
-void MakePortalsFromBuildportals(tree_t &tree, std::list<buildportal_t> &buildportals)
+void MakePortalsFromBuildportals(tree_t &tree, buildportal_list_t &buildportals, portalstats_t &stats)
 {
-    tree.portals.reserve(buildportals.size());
+    stats.memory.add(0, -static_cast<int64_t>(buildportals.size()), -CountPoints(buildportals));
 
     for (auto &buildportal : buildportals) {
         portal_t *new_portal = tree.create_portal();
@@ -374,6 +435,8 @@ void MakePortalsFromBuildportals(tree_t &tree, std::list<buildportal_t> &buildpo
         new_portal->winding = std::move(buildportal.winding);
         AddPortalToNodes(new_portal, buildportal.nodes[0], buildportal.nodes[1]);
     }
+
+    buildportals.clear();
 }
 
 /*
@@ -431,89 +494,85 @@ ClipNodePortalToTree_r
 
 Given portals which are connected to `node` on one side,
 descends the tree, splitting the portals as needed until they are connected to leaf nodes.
+The resulting fragments are appended to `result`.
 
 The other side of the portals will remain untouched.
 ==================
 */
-static std::list<buildportal_t> ClipNodePortalsToTree_r(
-    node_t *node, portaltype_t type, std::list<buildportal_t> portals, portalstats_t &stats)
+static void ClipNodePortalsToTree_r(node_t *node, portaltype_t type, buildportal_list_t portals,
+    buildportal_list_t &result, portalstats_t &stats)
 {
     if (portals.empty()) {
-        return portals;
+        return;
     }
     if (node->is_leaf || (type == portaltype_t::VIS && node->detail_separator)) {
-        return portals;
+        AppendBuildportals(result, std::move(portals));
+        return;
     }
 
     auto boundary_portals_split = SplitNodePortals(node, std::move(portals), stats);
 
-    auto front_fragments =
-        ClipNodePortalsToTree_r(node->children[0], type, std::move(boundary_portals_split.front), stats);
-    auto back_fragments =
-        ClipNodePortalsToTree_r(node->children[1], type, std::move(boundary_portals_split.back), stats);
-
-    std::list<buildportal_t> merged_result = std::move(front_fragments);
-    merged_result.splice(merged_result.end(), back_fragments);
-    return merged_result;
+    ClipNodePortalsToTree_r(node->children[0], type, std::move(boundary_portals_split.front), result, stats);
+    ClipNodePortalsToTree_r(node->children[1], type, std::move(boundary_portals_split.back), result, stats);
 }
 
 /*
 ==================
 MakeTreePortals_r
 
-Given the list of portals bounding `node`, returns the portal list for a fully-portalized `node`.
+Given the list of portals bounding `node`, appends the portal list for a fully-portalized `node`
+to `result`.
 ==================
 */
-std::list<buildportal_t> MakeTreePortals_r(node_t *node, portaltype_t type, std::list<buildportal_t> boundary_portals,
-    portalstats_t &stats, logging::percent_clock &clock)
+void MakeTreePortals_r(node_t *node, portaltype_t type, buildportal_list_t boundary_portals,
+    buildportal_list_t &result, portalstats_t &stats, logging::percent_clock &clock)
 {
     clock();
 
     if (node->is_leaf || (type == portaltype_t::VIS && node->detail_separator)) {
-        return boundary_portals;
+        AppendBuildportals(result, std::move(boundary_portals));
+        return;
     }
 
     // make the node portal before we move out the boundary_portals
     std::optional<buildportal_t> nodeportal = MakeNodePortal(node, boundary_portals, stats);
 
     // parallel part: split boundary_portals between the front and back, and obtain the fully
-    // portalized front/back sides in parallel
+    // portalized front/back sides in parallel. the front side appends straight to `result`,
+    // the back side to its own buffer which is appended afterwards, keeping the fragment order
+    // front, back, onnode regardless of scheduling
 
     auto boundary_portals_split = SplitNodePortals(node, std::move(boundary_portals), stats);
 
-    std::list<buildportal_t> result_portals_front, result_portals_back;
+    buildportal_list_t result_portals_back;
 
     tbb::task_group g;
     g.run([&]() {
-        result_portals_front =
-            MakeTreePortals_r(node->children[0], type, std::move(boundary_portals_split.front), stats, clock);
+        MakeTreePortals_r(node->children[0], type, std::move(boundary_portals_split.front), result, stats, clock);
     });
     g.run([&]() {
-        result_portals_back =
-            MakeTreePortals_r(node->children[1], type, std::move(boundary_portals_split.back), stats, clock);
+        MakeTreePortals_r(
+            node->children[1], type, std::move(boundary_portals_split.back), result_portals_back, stats, clock);
     });
     g.wait();
 
-    // sequential part: push the nodeportal down each side of the bsp so it connects leafs
+    AppendBuildportals(result, std::move(result_portals_back));
 
-    std::list<buildportal_t> result_portals_onnode;
+    // sequential part: push the nodeportal down each side of the bsp so it connects leafs
 
     if (nodeportal) {
         // to start with, `nodeportal` is a portal between node->children[0] and node->children[1]
 
         // these portal fragments have node->children[1] on one side, and the leaf nodes from
         // node->children[0] on the other side
-        std::list<buildportal_t> half_clipped =
-            ClipNodePortalsToTree_r(node->children[0], type, make_list(std::move(*nodeportal)), stats);
+        buildportal_list_t nodeportal_list;
+        nodeportal_list.push_back(std::move(*nodeportal));
 
-        result_portals_onnode = ClipNodePortalsToTree_r(node->children[1], type, std::move(half_clipped), stats);
-    }
+        buildportal_list_t half_clipped;
+        ClipNodePortalsToTree_r(node->children[0], type, std::move(nodeportal_list), half_clipped, stats);
 
-    // all done, merge together the lists and return
-    std::list<buildportal_t> merged_result = std::move(result_portals_front);
-    merged_result.splice(merged_result.end(), result_portals_back);
-    merged_result.splice(merged_result.end(), result_portals_onnode);
-    return merged_result;
+        ClipNodePortalsToTree_r(node->children[1], type, std::move(half_clipped), result, stats);
+    }
 }
 
 /*
@@ -523,6 +582,8 @@ MakeTreePortals
 */
 void MakeTreePortals(tree_t &tree)
 {
+    PROFILE_ZONE("MakeTreePortals");
+
     logging::funcheader();
 
     FreeTreePortals(tree);
@@ -533,11 +594,15 @@ void MakeTreePortals(tree_t &tree)
         logging::percent_clock clock(tree.nodes.size());
 
         portalstats_t stats{};
+        stats.memory.add(headnodeportals.size(), headnodeportals.size(), CountPoints(headnodeportals));
+
+        buildportal_list_t buildportals;
+        MakeTreePortals_r(tree.headnode, portaltype_t::TREE, std::move(headnodeportals), buildportals, stats, clock);
 
-        auto buildportals =
-            MakeTreePortals_r(tree.headnode, portaltype_t::TREE, std::move(headnodeportals), stats, clock);
+        MakePortalsFromBuildportals(tree, buildportals, stats);
 
-        MakePortalsFromBuildportals(tree, buildportals);
+        clock.print();
+        stats.memory.print_memory_stats();
     }
 
     logging::header("CalcTreeBounds");
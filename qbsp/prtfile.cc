@@ -23,6 +23,9 @@
 
 #include <common/log.hh>
 #include <common/ostream.hh>
+#include <common/pipeline.hh>
+#include <common/profile.hh>
+#include <common/prtfile.hh>
 #include <qbsp/map.hh>
 #include <qbsp/portals.hh>
 #include <qbsp/qbsp.hh>
@@ -46,16 +49,16 @@ static void WriteFloat(std::ofstream &portalFile, vec_t v)
         ewt::print(portalFile, "{} ", v);
 }
 
-static void WritePortals_r(node_t *node, std::ofstream &portalFile, bool clusters)
+static void GatherPortals_r(node_t *node, bool clusters, std::vector<prtfile_portal_t> &portals)
 {
     const portal_t *p, *next;
     const winding_t *w;
-    int i, front, back;
+    int front, back;
     qplane3d plane2;
 
     if (!node->is_leaf && !node->detail_separator) {
-        WritePortals_r(node->children[0], portalFile, clusters);
-        WritePortals_r(node->children[1], portalFile, clusters);
+        GatherPortals_r(node->children[0], clusters, portals);
+        GatherPortals_r(node->children[1], clusters, portals);
         return;
     }
     // at this point, `node` may be a leaf or a cluster
@@ -82,6 +85,9 @@ static void WritePortals_r(node_t *node, std::ofstream &portalFile, bool cluster
                 back_contents.to_string(qbsp_options.target_game), w->center());
         }
 
+        prtfile_portal_t &out = portals.emplace_back();
+        out.winding = prtfile_winding_t(w->begin(), w->end());
+
         /*
          * sometimes planes get turned around when they are very near the
          * changeover point between different axis.  interpret the plane the
@@ -89,16 +95,32 @@ static void WritePortals_r(node_t *node, std::ofstream &portalFile, bool cluster
          */
         plane2 = w->plane();
         if (qv::dot(p->plane.get_normal(), plane2.normal) < 1.0 - ANGLEEPSILON) {
-            ewt::print(portalFile, "{} {} {} ", w->size(), back, front);
+            out.leafnums[0] = back;
+            out.leafnums[1] = front;
         } else {
-            ewt::print(portalFile, "{} {} {} ", w->size(), front, back);
+            out.leafnums[0] = front;
+            out.leafnums[1] = back;
         }
+    }
+}
 
-        for (i = 0; i < w->size(); i++) {
+static std::vector<prtfile_portal_t> GatherPortals(node_t *headnode, bool clusters)
+{
+    std::vector<prtfile_portal_t> portals;
+    GatherPortals_r(headnode, clusters, portals);
+    return portals;
+}
+
+static void WritePortals(std::ofstream &portalFile, const std::vector<prtfile_portal_t> &portals)
+{
+    for (auto &p : portals) {
+        ewt::print(portalFile, "{} {} {} ", p.winding.size(), p.leafnums[0], p.leafnums[1]);
+
+        for (auto &point : p.winding) {
             ewt::print(portalFile, "(");
-            WriteFloat(portalFile, w->at(i)[0]);
-            WriteFloat(portalFile, w->at(i)[1]);
-            WriteFloat(portalFile, w->at(i)[2]);
+            WriteFloat(portalFile, point[0]);
+            WriteFloat(portalFile, point[1]);
+            WriteFloat(portalFile, point[2]);
             ewt::print(portalFile, ") ");
         }
         ewt::print(portalFile, "\n");
@@ -130,6 +152,27 @@ static int WritePTR2ClusterMapping_r(node_t *node, std::ofstream &portalFile, in
     return viscluster;
 }
 
+static int GatherClusterMapping_r(node_t *node, std::vector<prtfile_dleafinfo_t> &dleafinfos, int viscluster)
+{
+    if (!node->is_leaf) {
+        viscluster = GatherClusterMapping_r(node->children[0], dleafinfos, viscluster);
+        viscluster = GatherClusterMapping_r(node->children[1], dleafinfos, viscluster);
+        return viscluster;
+    }
+    if (node->contents.is_any_solid(qbsp_options.target_game))
+        return viscluster;
+
+    /* Same sanity check as WritePTR2ClusterMapping_r */
+    if (node->viscluster != viscluster)
+        viscluster++;
+    if (node->viscluster != viscluster)
+        FError("Internal error: Detail cluster mismatch");
+
+    dleafinfos[node->visleafnum + 1].cluster = node->viscluster;
+
+    return viscluster;
+}
+
 struct portal_state_t : logging::stat_tracker_t
 {
     stat &num_visleafs = register_stat("player-occupiable leaves");
@@ -192,6 +235,45 @@ static void NumberLeafs_r(node_t *node, portal_state_t &state, int cluster)
     CountPortals(node, state);
 }
 
+/*
+================
+MakePrtFile
+
+Builds the in-memory equivalent of the .prt that would be written, for
+-binaryprt and for handing the portals straight to vis
+================
+*/
+static prtfile_t MakePrtFile(node_t *headnode, const portal_state_t &state)
+{
+    prtfile_t prtfile{};
+
+    if (qbsp_options.target_game->id == GAME_QUAKE_II) {
+        // clusters, as in the PRT1 written for q2 below
+        prtfile.portalleafs = state.num_visclusters.count.load();
+        prtfile.portalleafs_real = 0;
+        prtfile.portals = GatherPortals(headnode, true);
+    } else if (!state.uses_detail) {
+        prtfile.portalleafs = prtfile.portalleafs_real = state.num_visleafs.count.load();
+        prtfile.portals = GatherPortals(headnode, false);
+    } else if (qbsp_options.forceprt1.value()) {
+        // clusters written as leafs, as in the -forceprt1 PRT1 below
+        prtfile.portalleafs = prtfile.portalleafs_real = state.num_visclusters.count.load();
+        prtfile.portals = GatherPortals(headnode, true);
+    } else {
+        // the same data as a PRT2
+        prtfile.portalleafs = state.num_visclusters.count.load();
+        prtfile.portalleafs_real = state.num_visleafs.count.load();
+        prtfile.portals = GatherPortals(headnode, true);
+        prtfile.dleafinfos.resize(prtfile.portalleafs_real + 1);
+        const int check = GatherClusterMapping_r(headnode, prtfile.dleafinfos, 0);
+        if (check != state.num_visclusters.count.load() - 1) {
+            FError("Internal error: Detail cluster mismatch");
+        }
+    }
+
+    return prtfile;
+}
+
 /*
 ================
 WritePortalfile
@@ -211,6 +293,16 @@ static void WritePortalfile(node_t *headnode, portal_state_t &state)
     fs::path name = qbsp_options.bsp_path;
     name.replace_extension("prt");
 
+    if (map.pipeline) {
+        map.pipeline->prtfile = MakePrtFile(headnode, state);
+        return;
+    }
+
+    if (qbsp_options.binaryprt.value()) {
+        WriteBinaryPrtFile(name, MakePrtFile(headnode, state));
+        return;
+    }
+
     std::ofstream portalFile(name, std::ios_base::out); // .prt files are intentionally text mode
     if (!portalFile)
         FError("Failed to open {}: {}", name, strerror(errno));
@@ -221,7 +313,7 @@ static void WritePortalfile(node_t *headnode, portal_state_t &state)
         ewt::print(portalFile, "PRT1\n");
         ewt::print(portalFile, "{}\n", state.num_visclusters.count.load());
         ewt::print(portalFile, "{}\n", state.num_visportals.count.load());
-        WritePortals_r(headnode, portalFile, true);
+        WritePortals(portalFile, GatherPortals(headnode, true));
         return;
     }
 
@@ -230,20 +322,20 @@ static void WritePortalfile(node_t *headnode, portal_state_t &state)
         ewt::print(portalFile, "PRT1\n");
         ewt::print(portalFile, "{}\n", state.num_visleafs.count.load());
         ewt::print(portalFile, "{}\n", state.num_visportals.count.load());
-        WritePortals_r(headnode, portalFile, false);
+        WritePortals(portalFile, GatherPortals(headnode, false));
     } else if (qbsp_options.forceprt1.value()) {
         /* Write a PRT1 file for loading in the map editor. Vis will reject it. */
         ewt::print(portalFile, "PRT1\n");
         ewt::print(portalFile, "{}\n", state.num_visclusters.count.load());
         ewt::print(portalFile, "{}\n", state.num_visportals.count.load());
-        WritePortals_r(headnode, portalFile, true);
+        WritePortals(portalFile, GatherPortals(headnode, true));
     } else {
         /* Write a PRT2 */
         ewt::print(portalFile, "PRT2\n");
         ewt::print(portalFile, "{}\n", state.num_visleafs.count.load());
         ewt::print(portalFile, "{}\n", state.num_visclusters.count.load());
         ewt::print(portalFile, "{}\n", state.num_visportals.count.load());
-        WritePortals_r(headnode, portalFile, true);
+        WritePortals(portalFile, GatherPortals(headnode, true));
         check = WritePTR2ClusterMapping_r(headnode, portalFile, 0);
         if (check != state.num_visclusters.count.load() - 1) {
             FError("Internal error: Detail cluster mismatch");
@@ -259,6 +351,8 @@ WritePortalFile
 */
 void WritePortalFile(tree_t &tree)
 {
+    PROFILE_ZONE("WritePortalFile");
+
     logging::funcheader();
 
     FreeTreePortals(tree);
@@ -270,9 +364,13 @@ void WritePortalFile(tree_t &tree)
 
         // vis portal generation doesn't use headnode portals
         portalstats_t stats{};
-        auto buildportals = MakeTreePortals_r(tree.headnode, portaltype_t::VIS, {}, stats, clock);
+        buildportal_list_t buildportals;
+        MakeTreePortals_r(tree.headnode, portaltype_t::VIS, {}, buildportals, stats, clock);
+
+        MakePortalsFromBuildportals(tree, buildportals, stats);
 
-        MakePortalsFromBuildportals(tree, buildportals);
+        clock.print();
+        stats.memory.print_memory_stats();
     }
 
     portal_state_t state{};
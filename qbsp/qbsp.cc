@@ -25,6 +25,9 @@
 #include <common/log.hh>
 #include <common/aabb.hh>
 #include <common/fs.hh>
+#include <common/pipeline.hh>
+#include <common/profile.hh>
+#include <common/statsjson.hh>
 #include <common/settings.hh>
 
 #include <qbsp/brush.hh>
@@ -512,10 +515,14 @@ qbsp_settings::qbsp_settings()
       leakdist{this, "leakdist", 0, &debugging_group, "space between leakfile points (default 0: no inbetween points)"},
       forceprt1{
           this, "forceprt1", false, &debugging_group, "force a PRT1 output file even if PRT2 is required for vis"},
+      binaryprt{this, "binaryprt", false, &map_development_group,
+          "write the .prt file in the binary PRTB format, which loads faster in vis but not in editors"},
       tjunc{this, {"tjunc", "notjunc"}, tjunclevel_t::MWT,
           {{"none", tjunclevel_t::NONE}, {"rotate", tjunclevel_t::ROTATE}, {"retopologize", tjunclevel_t::RETOPOLOGIZE},
               {"mwt", tjunclevel_t::MWT}},
           &debugging_group, "T-junction fix level"},
+      oldtjuncsearch{this, "oldtjuncsearch", false, &debugging_group,
+          "find T-junction vertices by walking the BSP rather than through a vertex grid (slower)"},
       objexport{
           this, "objexport", false, &debugging_group, "export the map file as .OBJ models during various CSG phases"},
       noextendedsurfflags{this, "noextendedsurfflags", false, &debugging_group, "suppress writing a .texinfo file"},
@@ -960,6 +967,8 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
     if (IsWorldBrushEntity(entity) || IsNonRemoveWorldBrushEntity(entity))
         return;
 
+    PROFILE_ZONE("ProcessEntity", "entity", &entity - map.entities.data(), "hull", hullnum.value_or(-1));
+
     // for notriggermodels: if we have at least one trigger-like texture, do special trigger stuff
     bool discarded_trigger = !map.is_world_entity(entity) && qbsp_options.notriggermodels.value() && IsTrigger(entity);
 
@@ -1072,6 +1081,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
             }
             CountLeafs(tree.headnode);
         }
+        tree.print_memory_stats();
         ExportClipNodes(entity, tree.headnode, hullnum.value());
         return;
     }
@@ -1235,6 +1245,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
 
     ExportDrawNodes(entity, tree.headnode, entity.firstoutputfacenumber.value());
     FreeTreePortals(tree);
+    tree.print_memory_stats();
 }
 
 /*
@@ -1690,6 +1701,7 @@ void InitQBSP(int argc, const char **argv)
 
     /* Start logging to <bspname>.log */
     logging::init(fs::path(qbsp_options.bsp_path).replace_extension("log"), qbsp_options);
+    statsjson::begin_stage("qbsp", qbsp_options);
 
     // Remove already existing files
     if (!qbsp_options.onlyents.value() && qbsp_options.convertmapformat.value() == conversion_t::none) {
@@ -1755,12 +1767,55 @@ int qbsp_main(int argc, const char **argv)
 
     // do it!
     auto start = I_FloatTime();
-    ProcessFile();
+    {
+        PROFILE_ZONE("qbsp");
+        ProcessFile();
+    }
+    auto end = I_FloatTime();
+
+    logging::print("\n{:.3} seconds elapsed\n", (end - start));
+
+    statsjson::end_stage();
+    profiling::write();
+    logging::close();
+
+    return 0;
+}
+
+/*
+==================
+qbsp_main
+
+In-memory variant: the .bsp, .prt and .texinfo.json are stored in `pipeline`
+rather than written, for the next stage to pick up
+==================
+*/
+int qbsp_main(const std::vector<std::string> &args, pipeline_data_t &pipeline)
+{
+    InitQBSP(args);
+
+    if (qbsp_options.onlyents.value() || qbsp_options.convertmapformat.value() != conversion_t::none) {
+        FError("-onlyents and -convert can't be used in a pipeline");
+    }
+
+    // InitQBSP resets the map, so this has to be set afterwards
+    map.pipeline = &pipeline;
+    pipeline = {};
+
+    auto start = I_FloatTime();
+    {
+        PROFILE_ZONE("qbsp");
+        ProcessFile();
+    }
     auto end = I_FloatTime();
 
     logging::print("\n{:.3} seconds elapsed\n", (end - start));
 
+    statsjson::end_stage();
+    profiling::write();
     logging::close();
 
+    map.pipeline = nullptr;
+
     return 0;
 }
@@ -23,7 +23,11 @@
 
 #include <qbsp/qbsp.hh>
 #include <qbsp/map.hh>
+#include <common/profile.hh>
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <unordered_map>
 
 struct tjunc_stats_t : logging::stat_tracker_t
 {
@@ -142,22 +146,16 @@ static void FindEdgeVerts_BruteForce(
  * This is to prevent func_detail_wall touching solid from creating
  * tjunc fixes. func_detail_wall is meant to act like a separate mesh,
  * so it shouldn't interact with solid.
+ *
+ * Two faces have tjunc interaction if they are in the same class.
  */
-static bool HasTJuncInteraction(const face_t *f1, const face_t *f2)
+static size_t TJuncInteractionClass(const face_t *f)
 {
     // FIXME: handle func_detail_fence, func_detail_illusionary,
     // liquids? make sure a combination of solid + func_detail_wall
     // is treated as solid?
 
-    if (f1->contents.back.is_detail_wall(qbsp_options.target_game) &&
-        !f2->contents.back.is_detail_wall(qbsp_options.target_game))
-        return false;
-
-    if (f2->contents.back.is_detail_wall(qbsp_options.target_game) &&
-        !f1->contents.back.is_detail_wall(qbsp_options.target_game))
-        return false;
-
-    return true;
+    return f->contents.back.is_detail_wall(qbsp_options.target_game) ? 1 : 0;
 }
 
 /*
@@ -165,11 +163,11 @@ static bool HasTJuncInteraction(const face_t *f1, const face_t *f2)
 FindEdgeVerts_FaceBounds_R
 
 Recursive function for matching nodes that intersect the aabb
-for vertex checking.
+for vertex checking. Only used with -oldtjuncsearch.
 ==========
 */
 static void FindEdgeVerts_FaceBounds_R(
-    const node_t *node, const face_t *f, const aabb3d &aabb, std::vector<size_t> &verts)
+    const node_t *node, size_t interaction_class, const aabb3d &aabb, std::vector<size_t> &verts)
 {
     if (node->is_leaf) {
         return;
@@ -178,7 +176,7 @@ static void FindEdgeVerts_FaceBounds_R(
     }
 
     for (auto &face : node->facelist) {
-        if (!HasTJuncInteraction(f, face.get()))
+        if (TJuncInteractionClass(face.get()) != interaction_class)
             continue;
         for (auto &v : face->original_vertices) {
             if (aabb.containsPoint(map.bsp.dvertexes[v])) {
@@ -187,27 +185,133 @@ static void FindEdgeVerts_FaceBounds_R(
         }
     }
 
-    FindEdgeVerts_FaceBounds_R(node->children[0], f, aabb, verts);
-    FindEdgeVerts_FaceBounds_R(node->children[1], f, aabb, verts);
+    FindEdgeVerts_FaceBounds_R(node->children[0], interaction_class, aabb, verts);
+    FindEdgeVerts_FaceBounds_R(node->children[1], interaction_class, aabb, verts);
 }
 
+/*
+==========
+tjunc_vertex_index_t
+
+Read-only uniform grid over the emitted vertices of the faces in one
+interaction class. Built once before the faces are fixed in parallel;
+each occupied cell is a range in `vertices`, so an edge query only visits
+the cells its AABB touches instead of walking the BSP for every edge.
+
+With -oldtjuncsearch, `headnode` is set instead of building the grid and
+queries walk the BSP as before, for comparing the two.
+==========
+*/
+struct tjunc_vertex_index_t
+{
+    static constexpr vec_t cell_size = 64.0;
+
+    const node_t *headnode = nullptr;
+    size_t interaction_class = 0;
+
+    // packed cell coordinate -> [begin, end) range in `vertices`
+    std::unordered_map<uint64_t, std::pair<uint32_t, uint32_t>> cells;
+    std::vector<size_t> vertices;
+
+    static qvec3i cell_of(const qvec3d &p) { return qvec3i(qv::floor(p / cell_size)); }
+
+    static uint64_t pack(const qvec3i &cell)
+    {
+        // 21 bits per axis covers +/- 2^20 cells, far past any map bounds
+        constexpr int32_t bias = 1 << 20;
+        constexpr uint64_t mask = (1 << 21) - 1;
+
+        return ((static_cast<uint64_t>(cell[0] + bias) & mask) << 42) |
+               ((static_cast<uint64_t>(cell[1] + bias) & mask) << 21) |
+               (static_cast<uint64_t>(cell[2] + bias) & mask);
+    }
+
+    void build(std::vector<size_t> verts)
+    {
+        // faces share vertices; each only needs to be tested once per edge
+        std::sort(verts.begin(), verts.end());
+        verts.erase(std::unique(verts.begin(), verts.end()), verts.end());
+
+        std::vector<std::pair<uint64_t, size_t>> keyed;
+        keyed.reserve(verts.size());
+
+        for (size_t v : verts) {
+            keyed.emplace_back(pack(cell_of(map.bsp.dvertexes[v])), v);
+        }
+
+        std::sort(keyed.begin(), keyed.end());
+
+        vertices.reserve(keyed.size());
+
+        for (size_t i = 0; i < keyed.size(); i++) {
+            if (i == 0 || keyed[i].first != keyed[i - 1].first) {
+                cells.emplace(keyed[i].first, std::make_pair(static_cast<uint32_t>(i), static_cast<uint32_t>(i)));
+            }
+
+            cells[keyed[i].first].second = i + 1;
+            vertices.push_back(keyed[i].second);
+        }
+    }
+
+    void query(const aabb3d &aabb, std::vector<size_t> &verts) const
+    {
+        if (headnode) {
+            FindEdgeVerts_FaceBounds_R(headnode, interaction_class, aabb, verts);
+            return;
+        }
+
+        auto test_range = [&](const std::pair<uint32_t, uint32_t> &range) {
+            for (uint32_t i = range.first; i < range.second; i++) {
+                if (aabb.containsPoint(map.bsp.dvertexes[vertices[i]])) {
+                    verts.push_back(vertices[i]);
+                }
+            }
+        };
+
+        const qvec3i mins = cell_of(aabb.mins()), maxs = cell_of(aabb.maxs());
+        uint64_t num_cells = 1;
+
+        for (size_t i = 0; i < 3; i++) {
+            num_cells *= static_cast<uint64_t>(maxs[i] - mins[i]) + 1;
+        }
+
+        // very long diagonal edges can touch more cells than are occupied
+        if (num_cells > cells.size()) {
+            for (auto &[key, range] : cells) {
+                test_range(range);
+            }
+            return;
+        }
+
+        for (int32_t x = mins[0]; x <= maxs[0]; x++) {
+            for (int32_t y = mins[1]; y <= maxs[1]; y++) {
+                for (int32_t z = mins[2]; z <= maxs[2]; z++) {
+                    if (auto it = cells.find(pack({x, y, z})); it != cells.end()) {
+                        test_range(it->second);
+                    }
+                }
+            }
+        }
+    }
+};
+
 /*
 ==========
 FindEdgeVerts_FaceBounds
 
 Use a loose AABB around the line and only capture vertices that intersect it.
 
-f is the face we're fixing; this will affect the candidate other faces
-because not everything has tjunc interactions (e.g. func_detail_wall and worldspawn.)
+`index` holds the vertices of the faces that have tjunc interaction with
+the face we're fixing (e.g. func_detail_wall and worldspawn don't.)
 ==========
 */
 static void FindEdgeVerts_FaceBounds(
-    const node_t *headnode, const face_t *f, const qvec3d &p1, const qvec3d &p2, std::vector<size_t> &verts)
+    const tjunc_vertex_index_t &index, const qvec3d &p1, const qvec3d &p2, std::vector<size_t> &verts)
 {
     // magic number, average of "usual" points per edge
     verts.reserve(8);
 
-    FindEdgeVerts_FaceBounds_R(headnode, f, (aabb3d{} + p1 + p2).grow(qvec3d(1.0, 1.0, 1.0)), verts);
+    index.query((aabb3d{} + p1 + p2).grow(qvec3d(1.0, 1.0, 1.0)), verts);
 }
 
 /*
@@ -277,7 +381,7 @@ Generate a superface (the input face `f` but with all of the
 verts in the world added that lay on the line) and return it
 ==================
 */
-static std::vector<size_t> CreateSuperFace(node_t *headnode, face_t *f, tjunc_stats_t &stats)
+static std::vector<size_t> CreateSuperFace(const tjunc_vertex_index_t &index, face_t *f, tjunc_stats_t &stats)
 {
     std::vector<size_t> superface;
 
@@ -297,7 +401,7 @@ static std::vector<size_t> CreateSuperFace(node_t *headnode, face_t *f, tjunc_st
         qvec3d e2 = map.bsp.dvertexes[v2];
 
         edge_verts.clear();
-        FindEdgeVerts_FaceBounds(headnode, f, edge_start, e2, edge_verts);
+        FindEdgeVerts_FaceBounds(index, edge_start, e2, edge_verts);
 
         vec_t len;
         qvec3d edge_dir = qv::normalize(e2 - edge_start, len);
@@ -736,7 +840,7 @@ FixFaceEdges
 If the face has any T-junctions, fix them here.
 ==================
 */
-static void FixFaceEdges(node_t *headnode, face_t *f, tjunc_stats_t &stats)
+static void FixFaceEdges(const tjunc_vertex_index_t &index, face_t *f, tjunc_stats_t &stats)
 {
     // we were asked not to bother fixing any of the faces.
     if (qbsp_options.tjunc.value() == settings::tjunclevel_t::NONE) {
@@ -744,7 +848,7 @@ static void FixFaceEdges(node_t *headnode, face_t *f, tjunc_stats_t &stats)
         return;
     }
 
-    std::vector<size_t> superface = CreateSuperFace(headnode, f, stats);
+    std::vector<size_t> superface = CreateSuperFace(index, f, stats);
 
     if (superface.size() < 3) {
         // entire face collapsed
@@ -885,6 +989,8 @@ TJunc fixing entry point
 */
 void TJunc(node_t *headnode)
 {
+    PROFILE_ZONE("TJunc");
+
     logging::funcheader();
 
     tjunc_stats_t stats{};
@@ -892,5 +998,28 @@ void TJunc(node_t *headnode)
 
     FindFaces_r(headnode, faces);
 
-    logging::parallel_for_each(faces, [&](auto &face) { FixFaceEdges(headnode, face, stats); });
+    // one vertex index per interaction class, so each face only searches
+    // the vertices it's allowed to pick up
+    std::array<tjunc_vertex_index_t, 2> indices;
+
+    if (qbsp_options.oldtjuncsearch.value()) {
+        for (size_t i = 0; i < indices.size(); i++) {
+            indices[i].headnode = headnode;
+            indices[i].interaction_class = i;
+        }
+    } else {
+        std::array<std::vector<size_t>, 2> class_verts;
+
+        for (face_t *face : faces) {
+            auto &verts = class_verts[TJuncInteractionClass(face)];
+            verts.insert(verts.end(), face->original_vertices.begin(), face->original_vertices.end());
+        }
+
+        for (size_t i = 0; i < indices.size(); i++) {
+            indices[i].build(std::move(class_verts[i]));
+        }
+    }
+
+    logging::parallel_for_each(
+        faces, [&](auto &face) { FixFaceEdges(indices[TJuncInteractionClass(face)], face, stats); });
 }
@@ -32,7 +32,7 @@
 
 portal_t *tree_t::create_portal()
 {
-    return portals.emplace_back(std::make_unique<portal_t>()).get();
+    return portals.create();
 }
 
 node_t *tree_t::create_node()
@@ -42,6 +42,8 @@ node_t *tree_t::create_node()
     return &(*it);
 }
 
+tree_t::~tree_t() = default;
+
 void tree_t::clear()
 {
     headnode = nullptr;
@@ -52,6 +54,28 @@ void tree_t::clear()
     nodes.clear();
 }
 
+size_t tree_t::portal_winding_bytes() const
+{
+    size_t bytes = 0;
+
+    portals.for_each([&](const portal_t &portal) { bytes += portal.winding.size() * sizeof(qvec3d); });
+
+    return bytes;
+}
+
+void tree_t::print_memory_stats() const
+{
+    const size_t node_bytes = nodes.size() * sizeof(node_t);
+    const size_t portal_bytes = portals.peak_bytes() + std::max(peak_portal_winding_bytes, portal_winding_bytes());
+
+    logging::print(logging::flag::STAT, "     {:8} tree nodes ({} KiB)\n", nodes.size(), node_bytes / 1024);
+    logging::print(logging::flag::STAT, "     {:8} portal allocations\n", portals.total_allocations());
+    logging::print(logging::flag::STAT, "     {:8} peak live portals ({} KiB with windings, {} KiB reserved)\n",
+        portals.peak_size(), portal_bytes / 1024, portals.reserved_bytes() / 1024);
+    logging::print(logging::flag::STAT, "     {:8} KiB peak tree memory (nodes + portals)\n",
+        (node_bytes + portal_bytes) / 1024);
+}
+
 /*
 ==================
 FreeTreePortals_r
@@ -68,8 +92,6 @@ static void ClearNodePortals_r(node_t *node)
     node->portals = nullptr;
 }
 
-#include <tbb/parallel_for_each.h>
-
 void FreeTreePortals(tree_t &tree)
 {
     if (tree.headnode) {
@@ -77,9 +99,13 @@ void FreeTreePortals(tree_t &tree)
         tree.outside_node.portals = nullptr;
     }
 
-    tbb::parallel_for_each(tree.portals, [](std::unique_ptr<portal_t> &portal) { portal.reset(); });
+    // the portals only grow until they're freed, so this is their high-water mark
+    tree.peak_portal_winding_bytes = std::max(tree.peak_portal_winding_bytes, tree.portal_winding_bytes());
 
+    // destroys the portals (and their windings) in place; the slabs stay allocated
+    // for the next MakeTreePortals on this tree
     tree.portals.clear();
+    tree.leafgraph.clear();
 }
 
 //============================================================================
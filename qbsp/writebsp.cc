@@ -29,6 +29,7 @@
 #include <algorithm>
 #include <cstdint>
 #include <common/json.hh>
+#include <common/pipeline.hh>
 #include <fstream>
 
 #include <stdexcept>
@@ -448,6 +449,11 @@ static void WriteExtendedTexinfoFlags(void)
         texinfofile[std::to_string(*tx.outputnum)].swap(t);
     }
 
+    if (map.pipeline) {
+        map.pipeline->texinfo_flags = std::move(texinfofile);
+        return;
+    }
+
     std::ofstream(file, std::ios_base::out | std::ios_base::binary) << texinfofile;
 }
 
@@ -517,6 +523,16 @@ static void WriteBSPFile()
 
     qbsp_options.bsp_path.replace_extension("bsp");
 
+    if (map.pipeline) {
+        PrintBSPFileSizes(&bspdata);
+
+        // hand the bsp to the next stage in the generic format; loadversion
+        // keeps track of the format it should eventually be written as
+        ConvertBSPFormat(&bspdata, &bspver_generic);
+        map.pipeline->bspdata = std::move(bspdata);
+        return;
+    }
+
     WriteBSPFile(qbsp_options.bsp_path, &bspdata);
     logging::print("Wrote {}\n", qbsp_options.bsp_path);
 
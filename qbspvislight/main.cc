@@ -0,0 +1,35 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <qbspvislight/qbspvislight.hh>
+#include <common/settings.hh>
+#include <common/log.hh>
+
+int main(int argc, const char **argv)
+{
+    logging::preinitialize();
+
+    try {
+        return qbspvislight_main(argc, argv);
+    } catch (const settings::quit_after_help_exception &) {
+        return 0;
+    } catch (const std::exception &e) {
+        exit_on_exception(e);
+    }
+}
@@ -0,0 +1,248 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <qbspvislight/qbspvislight.hh>
+
+#include <common/fs.hh>
+#include <common/imglib.hh>
+#include <common/json.hh>
+#include <common/log.hh>
+#include <common/pipeline.hh>
+#include <common/profile.hh>
+#include <common/statsjson.hh>
+#include <qbsp/qbsp.hh>
+#include <vis/vis.hh>
+#include <light/light.hh>
+
+#include <fmt/core.h>
+
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <optional>
+
+qbspvislight_args_t SplitQbspVisLightArgs(const std::vector<std::string> &args)
+{
+    if (args.empty()) {
+        FError("no map name given");
+    }
+
+    qbspvislight_args_t result;
+
+    // argv[0], which the stages ignore
+    result.qbsp.push_back("qbsp");
+    result.vis.push_back("vis");
+    result.light.push_back("light");
+
+    std::vector<std::string> *current = &result.qbsp;
+
+    // the stages are in a fixed order, so once in the light options a -light
+    // is light's own (an alias of -minlight) rather than a stage separator
+    for (size_t i = 0; i < args.size() - 1; i++) {
+        const std::string &arg = args[i];
+
+        if (current == &result.qbsp && arg == "-vis") {
+            result.run_vis = true;
+            current = &result.vis;
+        } else if (current != &result.light && arg == "-light") {
+            result.run_light = true;
+            current = &result.light;
+        } else {
+            current->push_back(arg);
+        }
+    }
+
+    const std::string &mapname = args.back();
+    result.qbsp.push_back(mapname);
+    result.vis.push_back(mapname);
+    result.light.push_back(mapname);
+
+    return result;
+}
+
+static void PrintUsage()
+{
+    fmt::print("usage: qbspvislight [qbsp options] [-vis [vis options]] [-light [light options]] mapname\n"
+               "       qbspvislight -server\n");
+}
+
+// runs the stages and returns the path of the .bsp written, if any
+static std::optional<fs::path> RunPipeline(const qbspvislight_args_t &args)
+{
+    pipeline_data_t data;
+
+    qbsp_main(args.qbsp, data);
+
+    if (args.run_vis) {
+        if (data.prtfile) {
+            vis_main(args.vis, data);
+        } else {
+            logging::print("WARNING: no portals from qbsp (map leaked?), skipping vis\n");
+        }
+    }
+
+    if (args.run_light) {
+        light_main(args.light, data);
+    }
+
+    if (!data.write_bsp) {
+        return std::nullopt;
+    }
+
+    fs::path bsp_path = fs::path(args.qbsp.back()).replace_extension("bsp");
+    WritePipelineBSP(data, bsp_path);
+    return bsp_path;
+}
+
+/*
+ * ==============
+ * server
+ *
+ * One JSON object per line in each direction. Requests:
+ *
+ *   {"id": <anything>, "args": ["-vis", "-light", "/path/to/map.map"]}
+ *   {"id": <anything>, "command": "quit"}
+ *
+ * `args` are the same as on the command line. Each request gets one response:
+ *
+ *   {"id": <same>, "ok": true, "bsp": "/path/to/map.bsp", "elapsed": 1.5, "log": "..."}
+ *   {"id": <same>, "ok": false, "error": "...", "elapsed": 0.1, "log": "..."}
+ *
+ * The log is captured rather than printed (no percent/progress lines), so
+ * nothing but responses is written to `out`. A {"ready": true, ...} line is
+ * written once at startup.
+ * ==============
+ */
+static json RunServerJob(const json &request)
+{
+    json response = json::object();
+
+    if (request.contains("id")) {
+        response["id"] = request.at("id");
+    }
+
+    std::mutex log_mutex;
+    std::string log;
+
+    logging::set_print_callback([&](logging::flag logflag, const char *str) {
+        if (logflag == logging::flag::PERCENT || logflag == logging::flag::PROGRESS) {
+            return;
+        }
+
+        std::unique_lock lock(log_mutex);
+        log += str;
+    });
+
+    // a -profile or -statsjson from an earlier job would otherwise keep recording into this one
+    profiling::reset();
+    statsjson::reset();
+
+    const auto start = I_FloatTime();
+
+    try {
+        const auto arglist = request.at("args").get<std::vector<std::string>>();
+
+        // the help text is printed straight to stdout, where it would corrupt the responses
+        for (const std::string &arg : arglist) {
+            const std::string_view name = std::string_view(arg).substr(std::min(arg.find_first_not_of('-'), arg.size()));
+
+            if (arg.starts_with('-') && (name == "help" || name == "h" || name == "?" || name == "rst")) {
+                throw std::invalid_argument(fmt::format("{} isn't available in server mode", arg));
+            }
+        }
+
+        const auto args = SplitQbspVisLightArgs(arglist);
+
+        if (auto bsp_path = RunPipeline(args)) {
+            response["bsp"] = bsp_path->string();
+        } else {
+            response["bsp"] = nullptr;
+        }
+
+        response["ok"] = true;
+    } catch (const std::exception &e) {
+        // a stage may have been interrupted with its log still open
+        logging::close();
+
+        response["ok"] = false;
+        response["error"] = e.what();
+    }
+
+    logging::set_print_callback(nullptr);
+
+    response["elapsed"] = (I_FloatTime() - start).count();
+    response["log"] = std::move(log);
+
+    return response;
+}
+
+int qbspvislight_server(std::istream &in, std::ostream &out)
+{
+    fs::set_keep_archives(true);
+    img::set_keep_textures(true);
+
+    out << json{{"ready", true}, {"version", ERICWTOOLS_VERSION}} << std::endl;
+
+    std::string line;
+
+    while (std::getline(in, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+
+        json request;
+        json response;
+
+        try {
+            request = json::parse(line);
+        } catch (const json::exception &e) {
+            response = {{"ok", false}, {"error", fmt::format("malformed request: {}", e.what())}};
+            out << response << std::endl;
+            continue;
+        }
+
+        if (request.value("command", "compile") == "quit") {
+            break;
+        }
+
+        response = RunServerJob(request);
+        out << response << std::endl;
+    }
+
+    fs::set_keep_archives(false);
+    img::set_keep_textures(false);
+
+    return 0;
+}
+
+int qbspvislight_main(int argc, const char **argv)
+{
+    if (argc == 2 && !strcmp(argv[1], "-server")) {
+        return qbspvislight_server(std::cin, std::cout);
+    }
+
+    if (argc < 2) {
+        PrintUsage();
+        return 1;
+    }
+
+    RunPipeline(SplitQbspVisLightArgs(std::vector<std::string>(argv + 1, argv + argc)));
+
+    return 0;
+}
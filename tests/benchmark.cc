@@ -3,8 +3,14 @@
 #include <vis/vis.hh>
 #include <common/qvec.hh>
 #include <common/polylib.hh>
+#include <common/log.hh>
+#include <common/settings.hh>
+#include <light/trace_bvh.hh>
+#include "test_qbsp.hh"
 
 #include <array>
+#include <random>
+#include <thread>
 #include <vector>
 
 TEST_CASE("winding" * doctest::test_suite("benchmark") * doctest::skip())
@@ -164,3 +170,121 @@ TEST_CASE("vector math")
     b.doNotOptimizeAway(vec0);
     b.doNotOptimizeAway(vec1);
 }
+
+static void bench_logging_contention(ankerl::nanobench::Bench &bench, bool async)
+{
+    settings::common_settings options;
+    options.log.set_value(false, settings::source::COMMANDLINE);
+    options.asynclog.set_value(async, settings::source::COMMANDLINE);
+
+    logging::init({}, options);
+
+    constexpr int num_threads = 8;
+    constexpr int messages_per_thread = 1000;
+
+    bench.batch(num_threads * messages_per_thread)
+        .unit("message")
+        .run(async ? "logging::print, 8 threads, async writer" : "logging::print, 8 threads, synchronous", [&]() {
+            std::vector<std::thread> threads;
+
+            for (int t = 0; t < num_threads; t++) {
+                threads.emplace_back([t]() {
+                    for (int i = 0; i < messages_per_thread; i++) {
+                        logging::print("thread {} message {}\n", t, i);
+                    }
+                });
+            }
+
+            for (auto &thread : threads) {
+                thread.join();
+            }
+
+            logging::flush();
+        });
+
+    logging::close();
+}
+
+TEST_CASE("logging contention" * doctest::test_suite("benchmark") * doctest::skip())
+{
+    ankerl::nanobench::Bench bench;
+    bench.minEpochIterations(1);
+
+    bench_logging_contention(bench, false);
+    bench_logging_contention(bench, true);
+}
+
+TEST_CASE("ChopBrushes" * doctest::test_suite("benchmark") * doctest::skip())
+{
+    // ChopBrushes runs for every clipping hull; with -chop it also runs for hull 0
+    ankerl::nanobench::Bench bench;
+    bench.minEpochIterations(1);
+
+    for (const char *map : {"q1_rocks.map", "q1_mountain.map"}) {
+        bench.run(fmt::format("qbsp {}", map), [&] { ankerl::nanobench::doNotOptimizeAway(LoadTestmapQ1(map)); });
+        bench.run(fmt::format("qbsp -chop {}", map),
+            [&] { ankerl::nanobench::doNotOptimizeAway(LoadTestmapQ1(map, {"-chop"})); });
+    }
+}
+
+TEST_CASE("TJunc" * doctest::test_suite("benchmark") * doctest::skip())
+{
+    // the BSP walk that the vertex grid replaced, against the grid, on the same maps
+    ankerl::nanobench::Bench bench;
+    bench.minEpochIterations(1);
+
+    for (const char *map : {"qbsp_tjunc_many_sided_face.map", "q1_tjunc_angled_face.map", "q1_mountain.map"}) {
+        bench.run(fmt::format("qbsp -oldtjuncsearch {}", map),
+            [&] { ankerl::nanobench::doNotOptimizeAway(LoadTestmapQ1(map, {"-oldtjuncsearch"})); });
+        bench.run(fmt::format("qbsp {}", map), [&] { ankerl::nanobench::doNotOptimizeAway(LoadTestmapQ1(map)); });
+    }
+}
+
+TEST_CASE("bvh_t" * doctest::test_suite("benchmark") * doctest::skip())
+{
+    // triangle soup roughly the size of a mid-sized map; compare with -tracer embree by
+    // running light on a real map, which prints the build time and memory of each backend
+    std::mt19937 engine(0);
+    std::uniform_real_distribution<float> pos(-4096.0f, 4096.0f);
+    std::uniform_real_distribution<float> offset(-64.0f, 64.0f);
+
+    std::vector<qvec3f> vertices;
+    for (int i = 0; i < 100000; i++) {
+        const qvec3f center{pos(engine), pos(engine), pos(engine)};
+        for (int j = 0; j < 3; j++) {
+            vertices.push_back(center + qvec3f(offset(engine), offset(engine), offset(engine)));
+        }
+    }
+
+    ankerl::nanobench::Bench bench;
+    bench.minEpochIterations(1);
+
+    bvh_t bvh;
+    bench.run("bvh_t::build", [&] { bvh.build(vertices); });
+
+    // packets of rays leaving one point, like the shadow rays of a luxel
+    std::vector<bvh_t::ray_packet_t> packets(1000);
+    for (auto &packet : packets) {
+        const qvec3f origin{pos(engine), pos(engine), pos(engine)};
+        packet.count = bvh_t::packet_size;
+        for (int i = 0; i < packet.count; i++) {
+            packet.origin[i] = origin;
+            packet.dir[i] = qv::normalize(qvec3f{offset(engine), offset(engine), offset(engine)});
+            packet.tfar[i] = 2048.0f;
+        }
+    }
+
+    bench.batch(packets.size() * bvh_t::packet_size).unit("ray");
+    bench.run("bvh_t::occluded", [&] {
+        for (auto packet : packets) {
+            bvh.occluded(packet);
+            ankerl::nanobench::doNotOptimizeAway(packet.hit);
+        }
+    });
+    bench.run("bvh_t::intersect", [&] {
+        for (auto packet : packets) {
+            bvh.intersect(packet);
+            ankerl::nanobench::doNotOptimizeAway(packet.hit);
+        }
+    });
+}
@@ -1,14 +1,29 @@
 #include <doctest/doctest.h>
 
 #include <light/light.hh>
+#include <light/lightgrid.hh>
 #include <light/ltface.hh>
 #include <light/surflight.hh>
+#include <light/trace.hh>
+#include <light/trace_bvh.hh>
 #include <common/bspinfo.hh>
+#include <common/imglib.hh>
+#include <common/json.hh>
+#include <common/pipeline.hh>
+#include <common/statsjson.hh>
 #include <qbsp/qbsp.hh>
 #include <testmaps.hh>
 #include <vis/vis.hh>
 #include "test_qbsp.hh"
 
+#include <fstream>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <random>
+
 static testresults_t QbspVisLight_Common(const std::filesystem::path &name, std::vector<std::string> extra_qbsp_args,
     std::vector<std::string> extra_light_args, runvis_t run_vis)
 {
@@ -185,6 +200,787 @@ TEST_CASE("-world_units_per_luxel, -lightgrid")
     }
 }
 
+struct decoded_lightgrid_t
+{
+    qvec3i grid_size;
+    // per grid point, in grid index order; nullopt if occluded
+    std::vector<std::optional<std::vector<std::pair<uint8_t, qvec3b>>>> points;
+};
+
+// expands a LIGHTGRID_OCTREE lump back into a dense grid
+static decoded_lightgrid_t DecodeLightgridOctree(const std::vector<uint8_t> &lump)
+{
+    constexpr uint32_t FLAG_OCCLUDED = 1u << 30;
+
+    imemstream stream(lump.data(), lump.size());
+    stream >> endianness<std::endian::little>;
+
+    qvec3f grid_dist, grid_mins;
+    decoded_lightgrid_t result;
+    uint8_t num_styles;
+    uint32_t root, num_nodes, num_leafs;
+
+    stream >= grid_dist;
+    stream >= result.grid_size;
+    stream >= grid_mins;
+    stream >= num_styles;
+    stream >= root;
+
+    const qvec3i size = result.grid_size;
+    auto grid_index = [&](int x, int y, int z) { return (z * size[0] * size[1]) + (y * size[0]) + x; };
+
+    // leafs only cover the parts of the grid that aren't entirely occluded
+    result.points.resize(size[0] * size[1] * size[2]);
+
+    stream >= num_nodes;
+    stream.seekg(num_nodes * (sizeof(qvec3i) + (8 * sizeof(uint32_t))), std::ios_base::cur);
+
+    stream >= num_leafs;
+    for (uint32_t l = 0; l < num_leafs; l++) {
+        qvec3i mins, leaf_size;
+        stream >= mins;
+        stream >= leaf_size;
+
+        for (int z = mins[2]; z < mins[2] + leaf_size[2]; ++z) {
+            for (int y = mins[1]; y < mins[1] + leaf_size[1]; ++y) {
+                for (int x = mins[0]; x < mins[0] + leaf_size[0]; ++x) {
+                    uint8_t used_styles;
+                    stream >= used_styles;
+
+                    if (used_styles == 0xff) {
+                        continue;
+                    }
+
+                    auto &samples = result.points[grid_index(x, y, z)].emplace();
+                    for (uint8_t i = 0; i < used_styles; i++) {
+                        uint8_t style;
+                        qvec3b color;
+                        stream >= style;
+                        stream >= color;
+                        samples.emplace_back(style, color);
+                    }
+                }
+            }
+        }
+    }
+
+    REQUIRE(stream);
+    CHECK(stream.tellg() == static_cast<std::streamoff>(lump.size()));
+    // a fully occluded grid would have no leafs to compare
+    CHECK(!(root & FLAG_OCCLUDED));
+
+    return result;
+}
+
+TEST_CASE("-lightgrid_adaptive")
+{
+    constexpr int threshold = 2;
+
+    auto [dense_bsp, dense_bspx] = QbspVisLight_Q2("q2_lightmap_custom_scale.map", {"-lightgrid"});
+    auto [adaptive_bsp, adaptive_bspx] = QbspVisLight_Q2("q2_lightmap_custom_scale.map",
+        {"-lightgrid", "-lightgrid_adaptive", "-lightgrid_adaptive_threshold", std::to_string(threshold)});
+
+    REQUIRE(dense_bspx.find("LIGHTGRID_OCTREE") != dense_bspx.end());
+    REQUIRE(adaptive_bspx.find("LIGHTGRID_OCTREE") != adaptive_bspx.end());
+
+    const decoded_lightgrid_t dense = DecodeLightgridOctree(dense_bspx.at("LIGHTGRID_OCTREE"));
+    const decoded_lightgrid_t adaptive = DecodeLightgridOctree(adaptive_bspx.at("LIGHTGRID_OCTREE"));
+
+    // occlusion doesn't depend on lighting, so both have the same points
+    REQUIRE(dense.grid_size == adaptive.grid_size);
+    REQUIRE(dense.points.size() == adaptive.points.size());
+
+    size_t compared = 0, lit = 0;
+
+    for (size_t i = 0; i < dense.points.size(); i++) {
+        INFO("grid point ", i);
+        REQUIRE(dense.points[i].has_value() == adaptive.points[i].has_value());
+
+        if (!adaptive.points[i]) {
+            continue;
+        }
+
+        // how close interpolated points get to the dense grid depends on the
+        // lighting between the corners; see "-lightgrid_adaptive cells" for
+        // what the subdivision itself guarantees
+        for (const auto &[style, color] : *adaptive.points[i]) {
+            if (color != qvec3b{}) {
+                lit++;
+            }
+        }
+
+        compared++;
+    }
+
+    CHECK(compared > 0);
+    CHECK(lit > 0);
+}
+
+TEST_CASE("-lightgrid_adaptive cells")
+{
+    constexpr float threshold = 2;
+    const qvec3i size{33, 33, 17};
+    const int num_points = size[0] * size[1] * size[2];
+
+    auto grid_index = [&](const qvec3i &p) { return (size[0] * size[1] * p[2]) + (size[0] * p[1]) + p[0]; };
+    auto grid_point = [&](int i) {
+        return qvec3i{i % size[0], (i / size[0]) % size[1], i / (size[0] * size[1])};
+    };
+
+    // a block of solid covering whole initial cells, and a thin slab
+    std::vector<uint8_t> occlusion(num_points);
+    for (int i = 0; i < num_points; i++) {
+        const qvec3i p = grid_point(i);
+        occlusion[i] = (p[0] <= 16 && p[1] <= 16 && p[2] <= 8) || (p[2] == 12 && p[0] >= 20 && p[0] <= 22);
+    }
+
+    // a point light's falloff, and a second style that switches on along x
+    auto light = [](const qvec3i &p) {
+        lightgrid_samples_t samples;
+        const double dist2 = qv::length2(qvec3d(p) - qvec3d{25, 25, 12});
+        samples.add(qvec3d{255, 128, 64} * (50.0 / (50.0 + dist2)), 0);
+        if (p[0] >= 28) {
+            samples.add({40, 40, 40}, 1);
+        }
+        return samples;
+    };
+
+    std::vector<std::atomic_int> evaluations(num_points);
+    std::vector<lightgrid_samples_t> results(num_points);
+
+    const lightgrid_adaptive_result_t result = CalcLightgridAdaptive(
+        size, occlusion, threshold,
+        [&](int i) {
+            evaluations[i]++;
+            return light(grid_point(i));
+        },
+        results);
+
+    size_t open_points = 0, evaluated = 0;
+    for (int i = 0; i < num_points; i++) {
+        INFO("grid point ", i);
+        CHECK(evaluations[i] <= 1);
+        if (occlusion[i]) {
+            CHECK(evaluations[i] == 0);
+            continue;
+        }
+        open_points++;
+        if (evaluations[i]) {
+            CHECK(results[i] == light(grid_point(i)));
+            evaluated++;
+        }
+    }
+    CHECK(evaluated == result.evaluated_points);
+
+    // every open point that wasn't lit belongs to exactly one cell and lies
+    // between that cell's corners, which agree to within the threshold
+    std::vector<int> owners(num_points);
+    size_t interpolated = 0;
+
+    for (const lightgrid_cell_t &cell : result.interpolated_cells) {
+        INFO("cell ", cell.mins, " ", cell.maxs);
+
+        std::array<const lightgrid_samples_t *, 8> corners;
+        for (int k = 0; k < 8; k++) {
+            const qvec3i corner{(k & 4) ? cell.maxs[0] : cell.mins[0], (k & 2) ? cell.maxs[1] : cell.mins[1],
+                (k & 1) ? cell.maxs[2] : cell.mins[2]};
+            corners[k] = &results[grid_index(corner)];
+        }
+
+        bool all_occluded = true;
+        qvec3i owned_maxs;
+        for (int axis = 0; axis < 3; axis++) {
+            owned_maxs[axis] = (cell.maxs[axis] == size[axis] - 1) ? cell.maxs[axis] : cell.maxs[axis] - 1;
+        }
+
+        for (int z = cell.mins[2]; z <= cell.maxs[2]; z++) {
+            for (int y = cell.mins[1]; y <= cell.maxs[1]; y++) {
+                for (int x = cell.mins[0]; x <= cell.maxs[0]; x++) {
+                    const int i = grid_index({x, y, z});
+                    all_occluded = all_occluded && occlusion[i];
+
+                    if (x > owned_maxs[0] || y > owned_maxs[1] || z > owned_maxs[2] || occlusion[i] ||
+                        evaluations[i]) {
+                        continue;
+                    }
+
+                    INFO("point ", qvec3i{x, y, z});
+                    CHECK(owners[i]++ == 0);
+                    interpolated++;
+
+                    for (size_t s = 0; s < results[i].samples_by_style.size(); s++) {
+                        const lightgrid_sample_t &sample = results[i].samples_by_style[s];
+
+                        for (const lightgrid_samples_t *corner : corners) {
+                            CHECK(corner->samples_by_style[s].used == sample.used);
+                            CHECK(corner->samples_by_style[s].style == sample.style);
+                        }
+                        if (!sample.used) {
+                            break;
+                        }
+
+                        for (int c = 0; c < 3; c++) {
+                            double lo = corners[0]->samples_by_style[s].color[c], hi = lo;
+                            for (const lightgrid_samples_t *corner : corners) {
+                                lo = std::min(lo, corner->samples_by_style[s].color[c]);
+                                hi = std::max(hi, corner->samples_by_style[s].color[c]);
+                            }
+
+                            CHECK(hi - lo <= threshold);
+                            CHECK(sample.color[c] >= lo - 1e-6);
+                            CHECK(sample.color[c] <= hi + 1e-6);
+                        }
+                    }
+                }
+            }
+        }
+
+        // solid is dropped outright instead of being split down to single points
+        CHECK_FALSE(all_occluded);
+    }
+
+    CHECK(interpolated == result.interpolated_points);
+    CHECK(evaluated + interpolated == open_points);
+    // the light's falloff is smooth enough that the grid isn't lit densely
+    CHECK(interpolated > 0);
+}
+
+TEST_CASE("-skysamples")
+{
+    // q1_mountain.map uses _sunlight2; capping the traced sky directions
+    // should give roughly the same overall brightness as tracing all of them
+    auto [full_bsp, full_bspx, full_lit] = QbspVisLight_Q1("q1_mountain.map", {});
+    auto [sampled_bsp, sampled_bspx, sampled_lit] = QbspVisLight_Q1("q1_mountain.map", {"-skysamples", "16"});
+
+    REQUIRE(!full_bsp.dlightdata.empty());
+    REQUIRE(!sampled_bsp.dlightdata.empty());
+
+    auto average = [](const std::vector<uint8_t> &data) {
+        return std::accumulate(data.begin(), data.end(), 0.0) / data.size();
+    };
+
+    const double full_avg = average(full_bsp.dlightdata);
+    const double sampled_avg = average(sampled_bsp.dlightdata);
+
+    CHECK(full_avg > 0);
+    CHECK(sampled_avg == doctest::Approx(full_avg).epsilon(0.1));
+}
+
+TEST_CASE("-skysamples 0 lights each sky sun on its own")
+{
+    // by default the _sunlight2 dome of q1_mountain.map is lit one sun at a time,
+    // with each sun's rays gated per sample, as before -skysamples existed
+    auto [default_bsp, default_bspx, default_lit] = QbspVisLight_Q1("q1_mountain.map", {});
+    const uint32_t default_rays = total_light_rays;
+
+    // more directions than the dome has, so every one is traced, once for all the suns along it
+    auto [shared_bsp, shared_bspx, shared_lit] = QbspVisLight_Q1("q1_mountain.map", {"-skysamples", "2048"});
+    const uint32_t shared_rays = total_light_rays;
+
+    REQUIRE(!default_bsp.dlightdata.empty());
+    REQUIRE(default_bsp.dlightdata.size() == shared_bsp.dlightdata.size());
+
+    // the same light arrives either way; only rounding and the order it's summed in differ
+    for (size_t i = 0; i < default_bsp.dlightdata.size(); i++) {
+        INFO("luxel ", i);
+        CHECK(std::abs(int(default_bsp.dlightdata[i]) - int(shared_bsp.dlightdata[i])) <= 1);
+    }
+
+    // both gate each sample before tracing, so sharing never traces more
+    CHECK(shared_rays > 0);
+    CHECK(shared_rays <= default_rays);
+}
+
+TEST_CASE("-adaptiveextra")
+{
+    // q1_sunlight.map has sun shadows crossing otherwise flat floors; supersampling
+    // only the contrasty luxels should come out close to full -extra4. -soft 0, so
+    // each output luxel only depends on its own samples
+    auto [full_bsp, full_bspx, full_lit] = QbspVisLight_Q1("q1_sunlight.map", {"-extra4", "-soft", "0"});
+    auto [adaptive_bsp, adaptive_bspx, adaptive_lit] =
+        QbspVisLight_Q1("q1_sunlight.map", {"-extra4", "-soft", "0", "-adaptiveextra"});
+
+    // rays are counted as traced, and only supersampled faces trace more than one sample per luxel
+    CHECK(adaptive_flat_rays > 0);
+    CHECK(adaptive_supersample_rays > 0);
+    CHECK(adaptive_supersample_rays < adaptive_edge_rays);
+
+    // a threshold of 1 only supersamples the partially covered luxels, so luxels
+    // that come out differently from it were supersampled for their contrast
+    auto [center_bsp, center_bspx, center_lit] = QbspVisLight_Q1(
+        "q1_sunlight.map", {"-extra4", "-soft", "0", "-adaptiveextra", "-adaptiveextra_threshold", "1"});
+
+    REQUIRE(full_bsp.dlightdata.size() == adaptive_bsp.dlightdata.size());
+    REQUIRE(center_bsp.dlightdata.size() == adaptive_bsp.dlightdata.size());
+
+    double total_error = 0;
+    size_t contrasty = 0, contrasty_exact = 0;
+    double contrasty_error = 0, contrasty_center_error = 0;
+
+    for (size_t i = 0; i < full_bsp.dlightdata.size(); i++) {
+        const int full = full_bsp.dlightdata[i];
+        const int adaptive = adaptive_bsp.dlightdata[i];
+        const int center = center_bsp.dlightdata[i];
+
+        total_error += std::abs(full - adaptive);
+
+        if (adaptive != center) {
+            contrasty++;
+            contrasty_exact += (adaptive == full);
+            contrasty_error += std::abs(full - adaptive);
+            contrasty_center_error += std::abs(full - center);
+        }
+    }
+
+    CHECK(total_error / full_bsp.dlightdata.size() < 2.0);
+
+    // every sample of a supersampled luxel is lit as -extra4 lights it. only the
+    // samples outside a face, which are filled in from their neighbours, can pick
+    // up a neighbouring luxel's unsupersampled samples
+    REQUIRE(contrasty > 0);
+    CHECK(contrasty_exact >= contrasty * 9 / 10);
+    CHECK(contrasty_error * 4 < contrasty_center_error);
+}
+
+// same as QbspVisLight_Common, but handing the data between stages in memory
+static mbsp_t QbspVisLight_Pipeline(const std::filesystem::path &name, runvis_t run_vis)
+{
+    auto map_path = std::filesystem::path(testmaps_dir) / name;
+    auto bsp_path = fs::weakly_canonical(fs::path(test_quake_maps_dir)) / name.filename();
+    bsp_path.replace_extension(".bsp");
+
+    auto wal_metadata_path = std::filesystem::path(testmaps_dir) / "q2_wal_metadata";
+
+    pipeline_data_t data;
+
+    qbsp_main({"", "-noverbose", "-path", wal_metadata_path.string(), map_path.string(), bsp_path.string()}, data);
+
+    if (run_vis == runvis_t::yes) {
+        vis_main({"", bsp_path.string()}, data);
+    }
+
+    light_main({"", "-nodefaultpaths", "-path", wal_metadata_path.string(), bsp_path.string()}, data);
+
+    REQUIRE(data.bspdata.version == &bspver_generic);
+    return std::move(std::get<mbsp_t>(data.bspdata.bsp));
+}
+
+TEST_CASE("in-memory pipeline matches qbsp/vis/light run separately")
+{
+    // q1_lightignore.map also has extended texinfo flags, which normally go through .texinfo.json
+    auto [file_bsp, file_bspx, file_lit] = QbspVisLight_Q1("q1_lightignore.map", {}, runvis_t::yes);
+    auto pipeline_bsp = QbspVisLight_Pipeline("q1_lightignore.map", runvis_t::yes);
+
+    CHECK(pipeline_bsp.loadversion == file_bsp.loadversion);
+    CHECK(pipeline_bsp.dfaces.size() == file_bsp.dfaces.size());
+    CHECK(pipeline_bsp.dleafs.size() == file_bsp.dleafs.size());
+    CHECK(!pipeline_bsp.dvis.bits.empty());
+    CHECK(pipeline_bsp.dvis.bits == file_bsp.dvis.bits);
+    CHECK(pipeline_bsp.dlightdata == file_bsp.dlightdata);
+    CHECK(pipeline_bsp.dentdata == file_bsp.dentdata);
+}
+
+static void CheckStatsObject(const json &stats)
+{
+    REQUIRE(stats.is_object());
+
+    for (const auto &[name, count] : stats.items()) {
+        INFO(name);
+        CHECK(!name.empty());
+        CHECK(count.is_number_unsigned());
+    }
+}
+
+TEST_CASE("-statsjson schema")
+{
+    const fs::path stats_path = fs::temp_directory_path() / "statsjson_schema.json";
+    fs::remove(stats_path);
+
+    auto map_path = std::filesystem::path(testmaps_dir) / "q1_lightignore.map";
+    auto bsp_path = fs::weakly_canonical(fs::path(test_quake_maps_dir)) / "q1_lightignore.bsp";
+    auto wal_metadata_path = std::filesystem::path(testmaps_dir) / "q2_wal_metadata";
+
+    // stages run in one process add to the same file
+    pipeline_data_t data;
+    qbsp_main({"", "-noverbose", "-statsjson", stats_path.string(), "-path", wal_metadata_path.string(),
+                  map_path.string(), bsp_path.string()},
+        data);
+    vis_main({"", "-statsjson", stats_path.string(), bsp_path.string()}, data);
+    light_main({"", "-statsjson", stats_path.string(), "-nodefaultpaths", "-path", wal_metadata_path.string(),
+                   bsp_path.string()},
+        data);
+    statsjson::reset();
+
+    std::ifstream stream(stats_path);
+    REQUIRE(stream);
+    const json stats = json::parse(stream);
+
+    CHECK(stats.at("schema_version") == 1);
+    CHECK(stats.at("ericw_tools_version").is_string());
+    CHECK(stats.at("hardware_threads").is_number_unsigned());
+    CHECK(stats.at("peak_rss_bytes").get<uint64_t>() > 0);
+
+    const json &stages = stats.at("stages");
+    REQUIRE(stages.size() == 3);
+
+    std::map<std::string, std::map<std::string, uint64_t>> section_stats;
+
+    for (const json &stage : stages) {
+        INFO(stage.at("tool"));
+        CHECK(stage.at("seconds").get<double>() >= 0);
+        CHECK(stage.at("threads").get<size_t>() >= 1);
+        CHECK(stage.at("peak_rss_bytes").get<uint64_t>() > 0);
+        CheckStatsObject(stage.at("counters"));
+
+        const json &sections = stage.at("sections");
+        REQUIRE(sections.is_array());
+        REQUIRE(!sections.empty());
+        // the first section covers the stage up to its first header
+        CHECK(sections.front().at("name") == stage.at("tool"));
+
+        for (const json &section : sections) {
+            CHECK(section.at("name").is_string());
+            CHECK(section.at("seconds").get<double>() >= 0);
+            CheckStatsObject(section.at("stats"));
+            CheckStatsObject(section.at("warnings"));
+
+            for (const auto &[name, count] : section.at("stats").items()) {
+                section_stats[section.at("name").get<std::string>()][name] += count.get<uint64_t>();
+            }
+        }
+    }
+
+    CHECK(stages[0].at("tool") == "qbsp");
+    CHECK(stages[1].at("tool") == "vis");
+    CHECK(stages[2].at("tool") == "light");
+
+    // stat trackers report under the header they were created after, zeros included
+    CHECK(section_stats["BrushBSP"]["nodes"] > 0);
+    CHECK(section_stats["BrushBSP"]["leaves"] > 0);
+    CHECK(section_stats["BrushBSP"].contains("bogus brushes"));
+
+    CHECK(stages[1].at("counters").contains("c_chains"));
+    CHECK(stages[1].at("counters").at("visdatasize").get<uint64_t>() > 0);
+    CHECK(stages[2].at("counters").at("total_light_rays").get<uint64_t>() > 0);
+    CHECK(stages[2].at("counters").at("total_samplepoints").get<uint64_t>() > 0);
+
+    fs::remove(stats_path);
+}
+
+TEST_CASE("Lightmap_Pack round trip")
+{
+    std::mt19937 engine(0);
+    std::uniform_real_distribution<float> dis(-1.0f, 1.0f);
+
+    // mostly-dark lightmap with a wide range of values
+    lightmap_t lm{};
+    lm.style = 1;
+    lm.resize(1000);
+    for (size_t i = 0; i < lm.size(); i += 3) {
+        const float scale = std::pow(10.0f, dis(engine) * 4.0f);
+        lm.colors[i] = qvec3f(std::abs(dis(engine)), std::abs(dis(engine)), std::abs(dis(engine))) * scale;
+        lm.directions[i] = qvec3f(dis(engine), dis(engine), dis(engine)) * scale;
+    }
+    const auto colors = lm.colors;
+    const auto directions = lm.directions;
+
+    SUBCASE("float is exact")
+    {
+        Lightmap_Pack(lm, false);
+        CHECK(lm.is_packed());
+        CHECK(lm.size() == 1000);
+        CHECK(lm.colors.empty());
+        CHECK(lm.packed.colors.size() == 334);
+
+        Lightmap_Unpack(lm);
+        CHECK(!lm.is_packed());
+        CHECK(lm.colors == colors);
+        CHECK(lm.directions == directions);
+    }
+
+    SUBCASE("half is within half precision of the largest value")
+    {
+        Lightmap_Pack(lm, true);
+        CHECK(lm.size() == 1000);
+        CHECK(lm.packed.half_colors.size() == 334);
+
+        Lightmap_Unpack(lm);
+        REQUIRE(lm.colors.size() == colors.size());
+
+        for (size_t i = 0; i < colors.size(); i++) {
+            for (int j = 0; j < 3; j++) {
+                // 11 bits of mantissa; tiny values may be subnormal relative to the largest
+                CHECK(std::abs(lm.colors[i][j] - colors[i][j]) <= std::abs(colors[i][j]) / 2048.0f + 1e-3f);
+                CHECK(std::abs(lm.directions[i][j] - directions[i][j]) <=
+                      std::abs(directions[i][j]) / 2048.0f + 1e-3f);
+            }
+        }
+    }
+}
+
+TEST_CASE("-compactlightmaps")
+{
+    // light_general.map has switchable light styles; the packed lightmaps must
+    // produce the same output within 1 step per channel
+    auto [bsp, bspx, lit] = QbspVisLight_Q1("light_general.map", {"-lit", "-bounce"});
+    auto [compact_bsp, compact_bspx, compact_lit] =
+        QbspVisLight_Q1("light_general.map", {"-lit", "-bounce", "-compactlightmaps"});
+
+    REQUIRE(bsp.dlightdata.size() == compact_bsp.dlightdata.size());
+    REQUIRE(lit.size() == compact_lit.size());
+
+    for (size_t i = 0; i < bsp.dlightdata.size(); i++) {
+        INFO("lightdata byte ", i);
+        CHECK(std::abs(int(bsp.dlightdata[i]) - int(compact_bsp.dlightdata[i])) <= 1);
+    }
+    for (size_t i = 0; i < lit.size(); i++) {
+        INFO("lit byte ", i);
+        CHECK(std::abs(int(lit[i]) - int(compact_lit[i])) <= 1);
+    }
+}
+
+// closest hit distance (or -1) of a ray against every triangle, for checking bvh_t
+static float BruteForceHitDist(const std::vector<qvec3f> &vertices, const qvec3f &origin, const qvec3f &dir,
+    float tfar, const std::function<bool(size_t)> &accept)
+{
+    float best = -1.0f;
+    for (size_t i = 0; i < vertices.size() / 3; i++) {
+        if (!accept(i)) {
+            continue;
+        }
+        const qvec3f e1 = vertices[i * 3 + 1] - vertices[i * 3];
+        const qvec3f e2 = vertices[i * 3 + 2] - vertices[i * 3];
+        const qvec3f p = qv::cross(dir, e2);
+        const float det = qv::dot(e1, p);
+        if (det == 0.0f) {
+            continue;
+        }
+        const qvec3f s = origin - vertices[i * 3];
+        const float u = qv::dot(s, p) / det;
+        const qvec3f q = qv::cross(s, e1);
+        const float v = qv::dot(dir, q) / det;
+        const float t = qv::dot(e2, q) / det;
+        if (u < 0 || v < 0 || u + v > 1 || t < 0 || t > tfar) {
+            continue;
+        }
+        if (best < 0 || t < best) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+TEST_CASE("bvh_t matches brute force")
+{
+    std::mt19937 engine(0);
+    std::uniform_real_distribution<float> pos(-512.0f, 512.0f);
+    std::uniform_real_distribution<float> offset(-64.0f, 64.0f);
+
+    std::vector<qvec3f> vertices;
+    for (int i = 0; i < 2000; i++) {
+        const qvec3f center{pos(engine), pos(engine), pos(engine)};
+        if (i % 4 == 0) {
+            // axial triangles, like brush faces, to exercise rays grazing the node bounds
+            vertices.push_back(center);
+            vertices.push_back(center + qvec3f(offset(engine), offset(engine), 0));
+            vertices.push_back(center + qvec3f(offset(engine), offset(engine), 0));
+        } else {
+            for (int j = 0; j < 3; j++) {
+                vertices.push_back(center + qvec3f(offset(engine), offset(engine), offset(engine)));
+            }
+        }
+    }
+
+    bvh_t bvh;
+    bvh.build(vertices);
+    CHECK(bvh.num_nodes() > 1);
+
+    // accept only even triangles, to check that the filter sees every candidate
+    auto even_filter = [](void *, int, const bvh_t::triangle_t &tri, float, float, float) {
+        return (tri.id % 2) == 0;
+    };
+
+    for (int n = 0; n < 500; n++) {
+        bvh_t::ray_packet_t packet;
+        packet.count = bvh_t::packet_size;
+        for (int i = 0; i < packet.count; i++) {
+            packet.origin[i] = {pos(engine), pos(engine), pos(engine)};
+            packet.dir[i] = qv::normalize(qvec3f{offset(engine), offset(engine), offset(engine)});
+            // every 4th ray is axial
+            if (i % 4 == 0) {
+                packet.dir[i] = {0, 0, (n % 2) ? 1.0f : -1.0f};
+            }
+            packet.tfar[i] = 1024.0f;
+        }
+
+        for (bool filtered : {false, true}) {
+            auto accept = [&](size_t id) { return !filtered || (id % 2) == 0; };
+
+            bvh_t::ray_packet_t closest = packet;
+            bvh.intersect(closest, filtered ? +even_filter : nullptr);
+
+            bvh_t::ray_packet_t any = packet;
+            bvh.occluded(any, filtered ? +even_filter : nullptr);
+
+            for (int i = 0; i < packet.count; i++) {
+                const float expected = BruteForceHitDist(vertices, packet.origin[i], packet.dir[i], 1024.0f, accept);
+
+                INFO("ray ", n, " ", i, " filtered ", filtered);
+                if (expected < 0) {
+                    CHECK(closest.hit[i] == bvh_t::no_hit);
+                    CHECK(any.hit[i] == bvh_t::no_hit);
+                } else {
+                    REQUIRE(closest.hit[i] != bvh_t::no_hit);
+                    CHECK(accept(closest.hit[i]));
+                    CHECK(closest.tfar[i] == doctest::Approx(expected).epsilon(1e-4));
+                    CHECK(any.hit[i] != bvh_t::no_hit);
+                }
+            }
+        }
+    }
+}
+
+// builds the level `level` micromap of `tri` and checks it against
+// SampleTexture at random points; returns how many it resolved
+static int CheckMicromap(
+    const std::array<qvec3f, 3> &tri, const mtexinfo_t &texinfo, const img::texture &texture, int level)
+{
+    std::vector<uint64_t> micromap(Micromap_NumWords(level));
+    Micromap_Build(tri, &texinfo, &texture, level, micromap.data());
+
+    std::mt19937 engine(0);
+    std::uniform_real_distribution<float> dis(0.0f, 1.0f);
+
+    int resolved = 0;
+    for (int i = 0; i < 10000; i++) {
+        float u = dis(engine), v = dis(engine);
+        if (u + v > 1.0f) {
+            u = 1.0f - u;
+            v = 1.0f - v;
+        }
+        const qvec3f point = tri[0] * (1.0f - u - v) + tri[1] * u + tri[2] * v;
+        const qvec4b sample = SampleTexture(nullptr, &texinfo, &texture, nullptr, point);
+
+        INFO("level ", level, " u ", u, " v ", v);
+        switch (Micromap_State(micromap.data(), level, u, v)) {
+            case micromap_state_t::OPAQUE:
+                CHECK(sample[3] == 255);
+                resolved++;
+                break;
+            case micromap_state_t::TRANSPARENT:
+                CHECK(sample[3] < 255);
+                resolved++;
+                break;
+            case micromap_state_t::UNKNOWN: break;
+        }
+    }
+
+    return resolved;
+}
+
+TEST_CASE("alpha micromaps agree with SampleTexture")
+{
+    // 16x16 fence texture: left half opaque, right half transparent, and a
+    // checkerboard in the bottom rows so some micro-triangles are mixed
+    img::texture texture;
+    texture.width = texture.height = 16;
+    texture.pixels.resize(16 * 16);
+    for (int y = 0; y < 16; y++) {
+        for (int x = 0; x < 16; x++) {
+            const bool opaque = (y >= 12) ? ((x + y) % 2) == 0 : x < 8;
+            texture.pixels[(y * 16) + x] = {255, 255, 255, static_cast<uint8_t>(opaque ? 255 : 0)};
+        }
+    }
+
+    // texture coordinates are world x/y, so the texture repeats across the triangle
+    mtexinfo_t texinfo{};
+    texinfo.vecs.at(0, 0) = 1;
+    texinfo.vecs.at(1, 1) = 1;
+
+    const std::array<qvec3f, 3> tri{qvec3f{-4, -4, 0}, qvec3f{44, -4, 0}, qvec3f{-4, 44, 0}};
+
+    const int level = Micromap_LevelFor(tri, &texinfo, &texture);
+    CHECK(level > 0);
+    CHECK(level <= MICROMAP_MAX_LEVEL);
+
+    // away from the stripe edges and the checkerboard, hits shouldn't need a texture sample
+    CHECK(CheckMicromap(tri, texinfo, texture, level) > 3000);
+}
+
+TEST_CASE("alpha micromaps of slivers spanning several texture periods")
+{
+    // 4x4 texture with a transparent stripe running at the same slope as the
+    // sliver, but shifted two rows up: within the first texture period the
+    // sliver only covers opaque texels, further along it wraps onto the stripe
+    img::texture texture;
+    texture.width = texture.height = 4;
+    texture.pixels.resize(4 * 4);
+    for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 4; x++) {
+            const bool opaque = ((y - (x / 2)) & 3) != 2;
+            texture.pixels[(y * 4) + x] = {255, 255, 255, static_cast<uint8_t>(opaque ? 255 : 0)};
+        }
+    }
+
+    mtexinfo_t texinfo{};
+    texinfo.vecs.at(0, 0) = 1;
+    texinfo.vecs.at(1, 1) = 1;
+
+    auto check_micromap = [&](const std::array<qvec3f, 3> &tri) {
+        return CheckMicromap(tri, texinfo, texture, Micromap_LevelFor(tri, &texinfo, &texture));
+    };
+
+    SUBCASE("a single micro-triangle")
+    {
+        // 1.5 texels of area, so it isn't subdivided
+        const std::array<qvec3f, 3> tri{qvec3f{0.3, 0.1, 0}, qvec3f{10.3, 5.1, 0}, qvec3f{0.3, 0.4, 0}};
+        CHECK(Micromap_LevelFor(tri, &texinfo, &texture) == 0);
+        check_micromap(tri);
+    }
+
+    SUBCASE("a long strip")
+    {
+        const std::array<qvec3f, 3> tri{qvec3f{0.3, 0.1, 0}, qvec3f{40.3, 20.1, 0}, qvec3f{0.3, 1.3, 0}};
+        check_micromap(tri);
+    }
+
+    SUBCASE("an opaque texture still resolves")
+    {
+        for (auto &pixel : texture.pixels) {
+            pixel[3] = 255;
+        }
+
+        const std::array<qvec3f, 3> tri{qvec3f{0.3, 0.1, 0}, qvec3f{40.3, 20.1, 0}, qvec3f{0.3, 1.3, 0}};
+        CHECK(check_micromap(tri) == 10000);
+    }
+}
+
+TEST_CASE("point tree matches BSP_FindLeafAtPoint")
+{
+    auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_mountain.map", {});
+
+    Light_BuildPointTree(&bsp);
+
+    const aabb3d bounds{bsp.dmodels[0].mins, bsp.dmodels[0].maxs};
+    std::mt19937 engine(0);
+    std::uniform_real_distribution<vec_t> dis(0.0, 1.0);
+
+    std::vector<qvec3f> points;
+    for (int i = 0; i < 1000; i++) {
+        points.emplace_back(bounds.mins() + qvec3d(dis(engine), dis(engine), dis(engine)) * bounds.size());
+    }
+
+    std::vector<const mleaf_t *> leafs(points.size());
+    Light_PointsInLeafs(&bsp, points, leafs);
+
+    for (size_t i = 0; i < points.size(); i++) {
+        const mleaf_t *expected = BSP_FindLeafAtPoint(&bsp, &bsp.dmodels[0], points[i]);
+
+        CHECK(Light_PointInLeaf(&bsp, points[i]) == expected);
+        CHECK(leafs[i] == expected);
+    }
+}
+
 TEST_CASE("emissive cube artifacts")
 {
     // A cube with surface flags "light", value "100", placed in a hallway.
@@ -562,6 +1358,61 @@ TEST_CASE("light channel mask (_object_channel_mask, _light_channel_mask, _shado
     }
 }
 
+TEST_CASE("-tracer bvh")
+{
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_translucency.map", {"-tracer", "bvh"});
+
+    {
+        INFO("glass tints the light passing through it");
+
+        auto *face_under_water = BSP_FindFaceAtPoint(&bsp, &bsp.dmodels[0], {152, -96, 32});
+        REQUIRE(face_under_water);
+
+        CheckFaceLuxels(bsp, *face_under_water, [](qvec3b sample) { CHECK(sample == qvec3b(100, 150, 100)); });
+    }
+
+    {
+        INFO("under _light_alpha 0 is not tinted");
+
+        auto *under_alpha_0_glass = BSP_FindFaceAtPoint(&bsp, &bsp.dmodels[0], {-296, -96, 40});
+        REQUIRE(under_alpha_0_glass);
+
+        CheckFaceLuxels(bsp, *under_alpha_0_glass, [](qvec3b sample) { CHECK(sample == qvec3b(150)); });
+    }
+
+    {
+        INFO("shadow channel masks are honoured");
+
+        auto [group_bsp, group_bspx] = QbspVisLight_Q2("q2_light_group.map", {"-tracer", "bvh"});
+
+        auto *face_on_pillar = BSP_FindFaceAtPoint(&group_bsp, &group_bsp.dmodels[1], {680, 1248, 1000});
+        REQUIRE(face_on_pillar);
+
+        CheckFaceLuxels(group_bsp, *face_on_pillar, [](qvec3b sample) { CHECK(sample == qvec3b(255, 0, 0)); });
+    }
+}
+
+#ifdef HAVE_EMBREE
+TEST_CASE("-tracer bvh matches -tracer embree")
+{
+    auto [embree_bsp, embree_bspx, embree_lit] =
+        QbspVisLight_Q1("light_general.map", {"-lit", "-bounce", "-tracer", "embree"});
+    auto [bvh_bsp, bvh_bspx, bvh_lit] = QbspVisLight_Q1("light_general.map", {"-lit", "-bounce", "-tracer", "bvh"});
+
+    REQUIRE(embree_bsp.dlightdata.size() == bvh_bsp.dlightdata.size());
+
+    // the backends may disagree on rays that exactly graze an edge, so allow a few
+    // luxels to differ
+    size_t differing = 0;
+    for (size_t i = 0; i < embree_bsp.dlightdata.size(); i++) {
+        if (std::abs(int(embree_bsp.dlightdata[i]) - int(bvh_bsp.dlightdata[i])) > 1) {
+            differing++;
+        }
+    }
+    CHECK(differing <= embree_bsp.dlightdata.size() / 100);
+}
+#endif
+
 TEST_CASE("light channel mask / dirt interaction")
 {
     auto [bsp, bspx] = QbspVisLight_Q2("q2_light_group_dirt.map", {});
@@ -11,6 +11,9 @@
 #include <common/prtfile.hh>
 #include <common/qvec.hh>
 #include <common/log.hh>
+#include <common/json.hh>
+#include <common/profile.hh>
+#include <common/statsjson.hh>
 #include <testmaps.hh>
 
 #include <fstream>
@@ -18,6 +21,7 @@
 #include <stdexcept>
 #include <tuple>
 #include <map>
+#include <set>
 #include <doctest/doctest.h>
 #include "testutils.hh"
 
@@ -196,6 +200,38 @@ void CheckFilled(const mbsp_t &bsp)
     }
 }
 
+std::vector<qvec3d> LoadPointFile(const std::filesystem::path &path)
+{
+    std::vector<qvec3d> points;
+    std::ifstream stream(path);
+
+    for (qvec3d point; stream >> point[0] >> point[1] >> point[2];) {
+        points.push_back(point);
+    }
+
+    return points;
+}
+
+std::vector<std::map<std::string, uint64_t>> FinishStatsJson(
+    const std::filesystem::path &stats_path, std::string_view section_name)
+{
+    // LoadTestmap doesn't finish the stage, so the file isn't written yet
+    statsjson::end_stage();
+    statsjson::reset();
+
+    std::ifstream stream(stats_path);
+    REQUIRE(stream);
+    const json stats = json::parse(stream);
+
+    std::vector<std::map<std::string, uint64_t>> result;
+    for (const json &section : stats.at("stages").back().at("sections")) {
+        if (section.at("name") == section_name) {
+            result.push_back(section.at("stats").get<std::map<std::string, uint64_t>>());
+        }
+    }
+    return result;
+}
+
 #if 0
 mbsp_t LoadBsp(const std::filesystem::path &path_in)
 {
@@ -1172,6 +1208,24 @@ TEST_CASE("q1_detail_wall tjuncs" * doctest::test_suite("testmaps_q1"))
     CHECK(w.size() == 5);
 }
 
+TEST_CASE("-oldtjuncsearch matches the vertex grid" * doctest::test_suite("testmaps_q1"))
+{
+    for (const char *map : {"q1_tjunc_angled_face.map", "qbsp_tjunc_many_sided_face.map", "q1_detail_wall.map"}) {
+        INFO(map);
+
+        const auto [old_bsp, old_bspx, old_prt] = LoadTestmapQ1(map, {"-oldtjuncsearch"});
+        const auto [bsp, bspx, prt] = LoadTestmapQ1(map);
+
+        CHECK(old_bsp.dvertexes == bsp.dvertexes);
+        CHECK(old_bsp.dsurfedges == bsp.dsurfedges);
+
+        REQUIRE(old_bsp.dfaces.size() == bsp.dfaces.size());
+        for (size_t i = 0; i < bsp.dfaces.size(); i++) {
+            CHECK(old_bsp.dfaces[i].numedges == bsp.dfaces[i].numedges);
+        }
+    }
+}
+
 TEST_CASE("q1_detail_wall_intersecting_detail" * doctest::test_suite("testmaps_q1") * doctest::may_fail())
 {
     const auto [bsp, bspx, prt] = LoadTestmapQ1("q1_detail_wall_intersecting_detail.map");
@@ -1262,6 +1316,35 @@ TEST_CASE("qbsp_sealing_point_entity_on_outside" * doctest::test_suite("testmaps
     REQUIRE(prt.has_value());
 }
 
+TEST_CASE("q1_leaked" * doctest::test_suite("testmaps_q1"))
+{
+    const auto pts_path = fs::path(testmaps_dir) / "q1_leaked.pts";
+    const auto stats_path = fs::temp_directory_path() / "q1_leaked_stats.json";
+    fs::remove(pts_path);
+
+    const auto [bsp, bspx, prt] = LoadTestmapQ1("q1_leaked.map", {"-statsjson", stats_path.string()});
+    const auto fill_stats = FinishStatsJson(stats_path, "FillOutside");
+    fs::remove(stats_path);
+
+    CHECK(!prt);
+
+    // the leak line is written for hull 0; values are from the flood fill that walked the portals
+    // of the tree, before the leaf graph
+    const auto leakline = LoadPointFile(pts_path);
+    REQUIRE(leakline.size() == 8);
+    CHECK(leakline.front() == qvec3d(-56, -96, 120)); // info_player_start
+    CHECK(leakline.back() == qvec3d(-144, -204, 128));
+
+    // all hulls leak, so none get filled
+    const std::vector<uint64_t> expected_reached{15, 26, 33};
+    REQUIRE(fill_stats.size() == expected_reached.size());
+    for (size_t i = 0; i < fill_stats.size(); i++) {
+        INFO("hull ", i);
+        CHECK(fill_stats[i].at("leafs reached by flood fill") == expected_reached[i]);
+        CHECK(!fill_stats[i].contains("outside leaves"));
+    }
+}
+
 TEST_CASE("q1_sealing_hull1_onnode" * doctest::test_suite("testmaps_q1"))
 {
     const auto [bsp, bspx, prt] = LoadTestmapQ1("q1_sealing_hull1_onnode.map");
@@ -1955,3 +2038,184 @@ TEST_CASE("hl_basic")
     CHECK(64 == bsp.dtex.textures[1].width);
     CHECK(64 == bsp.dtex.textures[1].height);
 }
+
+static void CheckPrtFilesEqual(const prtfile_t &a, const prtfile_t &b, vec_t epsilon)
+{
+    CHECK(a.portalleafs == b.portalleafs);
+    CHECK(a.portalleafs_real == b.portalleafs_real);
+
+    REQUIRE(a.portals.size() == b.portals.size());
+    for (size_t i = 0; i < a.portals.size(); i++) {
+        CHECK(a.portals[i].leafnums[0] == b.portals[i].leafnums[0]);
+        CHECK(a.portals[i].leafnums[1] == b.portals[i].leafnums[1]);
+
+        REQUIRE(a.portals[i].winding.size() == b.portals[i].winding.size());
+        for (size_t j = 0; j < a.portals[i].winding.size(); j++) {
+            CHECK(qv::epsilonEqual(a.portals[i].winding[j], b.portals[i].winding[j], epsilon));
+        }
+    }
+
+    REQUIRE(a.dleafinfos.size() == b.dleafinfos.size());
+    for (size_t i = 0; i < a.dleafinfos.size(); i++) {
+        CHECK(a.dleafinfos[i].cluster == b.dleafinfos[i].cluster);
+    }
+}
+
+TEST_CASE("binary prt round trip" * doctest::test_suite("qbsp"))
+{
+    const fs::path path = fs::temp_directory_path() / "binary_prt_round_trip.prt";
+
+    prtfile_t prt{};
+    prt.portals.resize(2);
+    prt.portals[0].winding = prtfile_winding_t{{0, 0, 0}, {0, 64.125, 0}, {0, 64.125, 1.0 / 3.0}};
+    prt.portals[0].leafnums[0] = 0;
+    prt.portals[0].leafnums[1] = 1;
+    prt.portals[1].winding = prtfile_winding_t{{1e-7, -8, 352}, {56, -8, 352}, {56, -8, 96}, {-160.5, -8, 96}};
+    prt.portals[1].leafnums[0] = 1;
+    prt.portals[1].leafnums[1] = 0;
+
+    SUBCASE("clusters (PRT2)")
+    {
+        prt.portalleafs = 2;
+        prt.portalleafs_real = 3;
+        prt.dleafinfos.resize(4);
+        prt.dleafinfos[1].cluster = 0;
+        prt.dleafinfos[2].cluster = 0;
+        prt.dleafinfos[3].cluster = 1;
+
+        WriteBinaryPrtFile(path, prt);
+        CheckPrtFilesEqual(prt, LoadPrtFile(path, &bspver_q1), 0);
+    }
+
+    SUBCASE("leafs (PRT1)")
+    {
+        prt.portalleafs = 2;
+        prt.portalleafs_real = 2;
+
+        WriteBinaryPrtFile(path, prt);
+
+        // the loader fills in the identity cluster mapping
+        prt.dleafinfos.resize(3);
+        prt.dleafinfos[1].cluster = 0;
+        prt.dleafinfos[2].cluster = 1;
+        CheckPrtFilesEqual(prt, LoadPrtFile(path, &bspver_q1), 0);
+    }
+
+    SUBCASE("Q2 clusters")
+    {
+        prt.portalleafs = 2;
+        prt.portalleafs_real = 0;
+
+        WriteBinaryPrtFile(path, prt);
+        CheckPrtFilesEqual(prt, LoadPrtFile(path, &bspver_q2), 0);
+    }
+
+    fs::remove(path);
+}
+
+TEST_CASE("-binaryprt matches the text .prt" * doctest::test_suite("testmaps_q1"))
+{
+    const auto [text_bsp, text_bspx, text_prt] = LoadTestmapQ1("qbsp_func_detail.map");
+    REQUIRE(text_prt.has_value());
+    CHECK(text_prt->portalleafs != text_prt->portalleafs_real); // PRT2
+
+    const auto [binary_bsp, binary_bspx, binary_prt] = LoadTestmapQ1("qbsp_func_detail.map", {"-binaryprt"});
+    REQUIRE(binary_prt.has_value());
+
+    // the text format rounds near-integer coordinates
+    CheckPrtFilesEqual(*text_prt, *binary_prt, ZERO_EPSILON * 2);
+}
+
+TEST_CASE("-binaryprt -forceprt1 matches the text .prt" * doctest::test_suite("testmaps_q1"))
+{
+    const auto [text_bsp, text_bspx, text_prt] = LoadTestmapQ1("qbsp_func_detail.map", {"-forceprt1"});
+    REQUIRE(text_prt.has_value());
+
+    const auto [binary_bsp, binary_bspx, binary_prt] =
+        LoadTestmapQ1("qbsp_func_detail.map", {"-forceprt1", "-binaryprt"});
+    REQUIRE(binary_prt.has_value());
+
+    // clusters are written as leafs, with no cluster mapping
+    CHECK(binary_prt->portalleafs == binary_prt->portalleafs_real);
+
+    CheckPrtFilesEqual(*text_prt, *binary_prt, ZERO_EPSILON * 2);
+}
+
+TEST_CASE("-binaryprt matches the text .prt (Q2)" * doctest::test_suite("testmaps_q2"))
+{
+    const auto [text_bsp, text_bspx, text_prt] = LoadTestmapQ2("q2_detail.map");
+    REQUIRE(text_prt.has_value());
+
+    const auto [binary_bsp, binary_bspx, binary_prt] = LoadTestmapQ2("q2_detail.map", {"-binaryprt"});
+    REQUIRE(binary_prt.has_value());
+
+    CheckPrtFilesEqual(*text_prt, *binary_prt, ZERO_EPSILON * 2);
+}
+
+TEST_CASE("-profile writes a chrome trace" * doctest::test_suite("testmaps_q1"))
+{
+    const fs::path path = fs::temp_directory_path() / "qbsp_profile.json";
+    fs::remove(path);
+
+    LoadTestmapQ1("qbsp_func_detail.map", {"-profile", path.string()});
+    profiling::write();
+    profiling::reset();
+
+    std::ifstream stream(path);
+    REQUIRE(stream);
+    const json trace = json::parse(stream);
+
+    std::set<std::string> names;
+    for (const json &event : trace.at("traceEvents")) {
+        if (event.at("ph") == "X") {
+            CHECK(event.at("dur").get<double>() >= 0);
+            names.insert(event.at("name").get<std::string>());
+        }
+    }
+
+    CHECK(names.contains("ProcessEntity"));
+    CHECK(names.contains("BrushBSP"));
+    CHECK(names.contains("MakeTreePortals"));
+    CHECK(names.contains("WriteBSPFile"));
+
+    // nothing is recorded once reset
+    CHECK_FALSE(profiling::enabled);
+
+    fs::remove(path);
+}
+
+TEST_CASE("-profile keeps stage zones when detail zones wrap" * doctest::test_suite("testmaps_q1"))
+{
+    const fs::path path = fs::temp_directory_path() / "qbsp_profile_wrap.json";
+    fs::remove(path);
+
+    LoadTestmapQ1("qbsp_func_detail.map", {"-profile", path.string()});
+
+    // as a big map's per-face zones would, on the thread that recorded the stages
+    for (size_t i = 0; i < profiling::detail_capacity * 2; i++) {
+        PROFILE_DETAIL_ZONE("DirectLightFace", "face", i);
+    }
+
+    profiling::write();
+    profiling::reset();
+
+    std::ifstream stream(path);
+    REQUIRE(stream);
+    const json trace = json::parse(stream);
+
+    std::set<std::string> names;
+    size_t detail_zones = 0;
+    for (const json &event : trace.at("traceEvents")) {
+        if (event.at("ph") == "X") {
+            names.insert(event.at("name").get<std::string>());
+            detail_zones += event.at("name") == "DirectLightFace";
+        }
+    }
+
+    CHECK(names.contains("ProcessEntity"));
+    CHECK(names.contains("BrushBSP"));
+    CHECK(detail_zones == profiling::detail_capacity);
+    CHECK(trace.at("otherData").at("dropped_events") == profiling::detail_capacity);
+
+    fs::remove(path);
+}
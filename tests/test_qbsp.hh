@@ -1,6 +1,7 @@
 #include <common/bspfile.hh>
 #include <common/prtfile.hh>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 
@@ -19,6 +20,12 @@ std::tuple<mbsp_t, bspxentries_t, std::optional<prtfile_t>> LoadTestmapQ1(
     const std::filesystem::path &name, std::vector<std::string> extra_args = {});
 void CheckFilled(const mbsp_t &bsp, hull_index_t hullnum);
 void CheckFilled(const mbsp_t &bsp);
+// reads a .pts leak line
+std::vector<qvec3d> LoadPointFile(const std::filesystem::path &path);
+// for LoadTestmap runs with -statsjson <stats_path>: writes the file and returns the
+// stats of every section called `section_name`, in order
+std::vector<std::map<std::string, uint64_t>> FinishStatsJson(
+    const std::filesystem::path &stats_path, std::string_view section_name);
 std::map<std::string, std::vector<const mface_t *>> MakeTextureToFaceMap(const mbsp_t &bsp);
 const texvecf &GetTexvecs(const char *map, const char *texname);
 std::vector<std::string> TexNames(const mbsp_t &bsp, std::vector<const mface_t *> faces);
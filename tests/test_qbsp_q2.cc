@@ -3,6 +3,7 @@
 #include <common/qvec.hh>
 
 #include <cstring>
+#include <fstream>
 #include <set>
 #include <stdexcept>
 #include <tuple>
@@ -11,6 +12,8 @@
 #include "test_qbsp.hh"
 #include "testutils.hh"
 
+#include <testmaps.hh>
+
 TEST_CASE("detail" * doctest::test_suite("testmaps_q2"))
 {
     const auto [bsp, bspx, prt] = LoadTestmapQ2("q2_detail.map");
@@ -638,9 +641,30 @@ TEST_CASE("q2_mirrorinside" * doctest::test_suite("testmaps_q2"))
  */
 TEST_CASE("q2_leaked" * doctest::test_suite("testmaps_q2"))
 {
-    const auto [bsp, bspx, prt] = LoadTestmapQ2("q2_leaked.map");
+    const auto pts_path = fs::path(testmaps_dir) / "q2_leaked.pts";
+    const auto stats_path = fs::temp_directory_path() / "q2_leaked_stats.json";
+    fs::remove(pts_path);
+
+    const auto [bsp, bspx, prt] = LoadTestmapQ2("q2_leaked.map", {"-statsjson", stats_path.string()});
+    const auto fill_stats = FinishStatsJson(stats_path, "FillOutside");
+    fs::remove(stats_path);
 
     CHECK(!prt);
+
+    // the leak line from the flood fill is written as a point file; values are from the
+    // flood fill that walked the portals of the tree, before the leaf graph
+    {
+        const auto leakline = LoadPointFile(pts_path);
+        REQUIRE(leakline.size() == 2);
+        CHECK(leakline.front() == qvec3d(112, 436, 120)); // info_player_start
+        CHECK(leakline.back() == qvec3d(40, 372, 108));
+    }
+
+    // no filling is done on a leak
+    REQUIRE(fill_stats.size() == 1);
+    CHECK(fill_stats[0].at("leafs reached by flood fill") == 6);
+    CHECK(!fill_stats[0].contains("outside leaves"));
+
     CHECK(GAME_QUAKE_II == bsp.loadversion->game->id);
 
     CHECK(bsp.dareaportals.size() == 1);
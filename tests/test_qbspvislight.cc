@@ -0,0 +1,159 @@
+#include <doctest/doctest.h>
+
+#include <common/bspfile.hh>
+#include <common/fs.hh>
+#include <common/json.hh>
+#include <common/log.hh>
+#include <qbspvislight/qbspvislight.hh>
+
+#include <sstream>
+
+#include "testmaps.hh"
+
+TEST_CASE("SplitQbspVisLightArgs")
+{
+    SUBCASE("qbsp only") {
+        auto args = SplitQbspVisLightArgs({"-bsp2", "test.map"});
+
+        CHECK(args.qbsp == std::vector<std::string>{"qbsp", "-bsp2", "test.map"});
+        CHECK(!args.run_vis);
+        CHECK(!args.run_light);
+    }
+
+    SUBCASE("all stages") {
+        auto args = SplitQbspVisLightArgs({"-bsp2", "-vis", "-fast", "-light", "-extra4", "test.map"});
+
+        CHECK(args.qbsp == std::vector<std::string>{"qbsp", "-bsp2", "test.map"});
+        CHECK(args.vis == std::vector<std::string>{"vis", "-fast", "test.map"});
+        CHECK(args.light == std::vector<std::string>{"light", "-extra4", "test.map"});
+        CHECK(args.run_vis);
+        CHECK(args.run_light);
+    }
+
+    SUBCASE("-light is light's own option once in the light options") {
+        auto args = SplitQbspVisLightArgs({"-light", "-light", "20", "test.map"});
+
+        CHECK(args.qbsp == std::vector<std::string>{"qbsp", "test.map"});
+        CHECK(args.light == std::vector<std::string>{"light", "-light", "20", "test.map"});
+        CHECK(!args.run_vis);
+        CHECK(args.run_light);
+    }
+}
+
+TEST_CASE("qbspvislight -server")
+{
+    // compile a copy of the map, so the .bsp doesn't end up in testmaps
+    const fs::path dir = fs::temp_directory_path() / "ericw-tools-qbspvislight-server";
+    fs::create_directories(dir);
+
+    const fs::path map_path = dir / "q1_cube.map";
+    fs::copy_file(fs::path(testmaps_dir) / "q1_cube.map", map_path, fs::copy_options::overwrite_existing);
+
+    // -verbose for the "Reusing archive" messages; it sticks in logging::mask, so put that back afterwards
+    const auto saved_mask = logging::mask;
+    const json compile_args = {"-wadpath", testmaps_dir, "-verbose", "-light", map_path.string()};
+
+    std::stringstream in;
+    in << json{{"id", 1}, {"args", compile_args}} << "\n";
+    in << json{{"id", 2}, {"args", compile_args}} << "\n";
+    in << "not json\n";
+    in << json{{"id", 4}, {"args", {"-notarealoption", map_path.string()}}} << "\n";
+    in << json{{"id", 5}, {"args", {"-help"}}} << "\n";
+    in << json{{"command", "quit"}} << "\n";
+    in << json{{"id", 7}, {"args", compile_args}} << "\n";
+
+    std::stringstream out;
+    CHECK(0 == qbspvislight_server(in, out));
+
+    logging::mask = saved_mask;
+
+    std::vector<json> responses;
+    for (std::string line; std::getline(out, line);) {
+        responses.push_back(json::parse(line));
+    }
+
+    // ready line + one response per request before "quit"
+    REQUIRE(responses.size() == 6);
+
+    CHECK(responses[0].at("ready") == true);
+
+    for (int i : {1, 2}) {
+        INFO("compile request ", i);
+        CHECK(responses[i].at("id") == i);
+        CHECK(responses[i].at("ok") == true);
+        CHECK(responses[i].at("bsp") == fs::path(map_path).replace_extension("bsp").string());
+        CHECK(responses[i].at("elapsed").get<double>() > 0.0);
+        CHECK(!responses[i].at("log").get<std::string>().empty());
+    }
+    CHECK(fs::exists(fs::path(map_path).replace_extension("bsp")));
+
+    // the second compile found the wads from the first one still loaded
+    CHECK(responses[1].at("log").get<std::string>().find("Reusing archive") == std::string::npos);
+    CHECK(responses[2].at("log").get<std::string>().find("Reusing archive") != std::string::npos);
+
+    CHECK(responses[3].at("ok") == false);
+    CHECK(!responses[3].contains("id"));
+
+    CHECK(responses[4].at("id") == 4);
+    CHECK(responses[4].at("ok") == false);
+    CHECK(responses[4].at("error").get<std::string>().find("notarealoption") != std::string::npos);
+
+    CHECK(responses[5].at("id") == 5);
+    CHECK(responses[5].at("ok") == false);
+}
+
+static std::vector<uint8_t> LoadVisData(fs::path bsp_path)
+{
+    bspdata_t bspdata;
+    LoadBSPFile(bsp_path, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+
+    return std::get<mbsp_t>(bspdata.bsp).dvis.bits;
+}
+
+TEST_CASE("qbspvislight -server runs vis on different maps")
+{
+    const fs::path dir = fs::temp_directory_path() / "ericw-tools-qbspvislight-server-vis";
+    fs::create_directories(dir);
+
+    const fs::path wall_path = dir / "q1_detail_wall.map";
+    const fs::path detail_path = dir / "qbsp_func_detail.map";
+    fs::copy_file(fs::path(testmaps_dir) / "q1_detail_wall.map", wall_path, fs::copy_options::overwrite_existing);
+    fs::copy_file(
+        fs::path(testmaps_dir) / "qbsp_func_detail.map", detail_path, fs::copy_options::overwrite_existing);
+
+    auto run_server = [&](const std::vector<fs::path> &maps) {
+        std::stringstream in;
+        int id = 1;
+        for (auto &map : maps) {
+            in << json{{"id", id++}, {"args", {"-wadpath", testmaps_dir, "-vis", map.string()}}} << "\n";
+        }
+        in << json{{"command", "quit"}} << "\n";
+
+        std::stringstream out;
+        CHECK(0 == qbspvislight_server(in, out));
+
+        std::vector<json> responses;
+        for (std::string line; std::getline(out, line);) {
+            responses.push_back(json::parse(line));
+        }
+
+        REQUIRE(responses.size() == maps.size() + 1);
+        for (size_t i = 1; i < responses.size(); i++) {
+            INFO("vis request ", i);
+            CHECK(responses[i].at("ok") == true);
+        }
+    };
+
+    const fs::path detail_bsp = fs::path(detail_path).replace_extension("bsp");
+
+    // vis on its own in a fresh server
+    run_server({detail_path});
+    const auto expected = LoadVisData(detail_bsp);
+    REQUIRE(!expected.empty());
+
+    // the same map after another one has been vised in the same process
+    fs::remove(detail_bsp);
+    run_server({wall_path, detail_path, wall_path});
+    CHECK(LoadVisData(detail_bsp) == expected);
+}
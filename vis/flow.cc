@@ -2,6 +2,7 @@
 #include <vis/leafbits.hh>
 #include <common/log.hh>
 #include <common/parallel.hh>
+#include <common/profile.hh>
 
 /*
   ==============
@@ -447,5 +448,7 @@ static void BasePortalThread(size_t portalnum)
 */
 void BasePortalVis(void)
 {
+    PROFILE_ZONE("BasePortalVis");
+
     logging::parallel_for(0, numportals * 2, BasePortalThread);
 }
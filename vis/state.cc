@@ -137,6 +137,11 @@ void SaveVisState(void)
     dvisstate_t state;
     dportal_t pstate;
 
+    // no state file when vis runs in-memory
+    if (statefile.empty()) {
+        return;
+    }
+
     std::ofstream out(statetmpfile, std::ios_base::out | std::ios_base::binary);
     out << endianness<std::endian::little>;
 
@@ -189,7 +194,7 @@ void SaveVisState(void)
 
 void CleanVisState(void)
 {
-    if (fs::exists(statefile)) {
+    if (!statefile.empty() && fs::exists(statefile)) {
         fs::remove(statefile);
     }
 }
@@ -201,7 +206,7 @@ bool LoadVisState(void)
     dvisstate_t state;
     dportal_t pstate;
 
-    if (vis_options.nostate.value()) {
+    if (vis_options.nostate.value() || statefile.empty()) {
         return false;
     }
 
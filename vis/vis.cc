@@ -5,6 +5,8 @@
 #include <common/bsputils.hh>
 #include <common/fs.hh>
 #include <common/parallel.hh>
+#include <common/profile.hh>
+#include <common/statsjson.hh>
 
 #include <climits>
 #include <cstdint>
@@ -369,6 +371,7 @@ static visstats_t LeafThread()
     if (!p)
         return {};
 
+    PROFILE_DETAIL_ZONE("PortalFlow", "portal", p - portals.data(), "mightsee", p->nummightsee);
     visstats_t stats = PortalFlow(p);
 
     PortalCompleted(stats, p);
@@ -486,6 +489,8 @@ static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
 */
 visstats_t CalcPortalVis(const mbsp_t *bsp)
 {
+    PROFILE_ZONE("CalcPortalVis");
+
     // fastvis just uses mightsee for a very loose bound
     if (vis_options.fast.value()) {
         for (auto &p : portals) {
@@ -535,6 +540,8 @@ visstats_t CalcPortalVis(const mbsp_t *bsp)
 */
 visstats_t CalcVis(mbsp_t *bsp)
 {
+    PROFILE_ZONE("CalcVis");
+
     if (LoadVisState()) {
         logging::print("Loaded previous state. Resuming progress...\n");
     } else {
@@ -573,6 +580,7 @@ visstats_t CalcVis(mbsp_t *bsp)
 // ===========================================================================
 
 #include <fstream>
+#include <common/pipeline.hh>
 #include <common/prtfile.hh>
 
 /*
@@ -580,10 +588,8 @@ visstats_t CalcVis(mbsp_t *bsp)
   LoadPortals
   ============
 */
-static void LoadPortals(const fs::path &name, mbsp_t *bsp)
+static void LoadPortals(const prtfile_t &prtfile, mbsp_t *bsp)
 {
-    const prtfile_t prtfile = LoadPrtFile(name, bsp->loadversion);
-
     portalleafs = prtfile.portalleafs;
     portalleafs_real = prtfile.portalleafs_real;
 
@@ -676,12 +682,40 @@ static void LoadPortals(const fs::path &name, mbsp_t *bsp)
 
 void vis_reset()
 {
-    // FIXME: clear other data
+    portalfile.clear();
+    statefile.clear();
+    statetmpfile.clear();
+
+    // vis can run more than once per process (qbspvislight's server mode);
+    // LoadPortals resizes these, which would keep the previous map's leaf
+    // portal pointers around
+    numportals = 0;
+    portalleafs = 0;
+    portalleafs_real = 0;
+    portals.clear();
+    leafs.clear();
+    vismap.clear();
+    originalvismapsize = 0;
+    uncompressed.clear();
+    compressed.clear();
+    totalvis = 0;
+    leafbytes = 0;
+    leaflongs = 0;
+    leafbytes_real = 0;
 
     vis_options.reset();
 }
 
-int vis_main(int argc, const char **argv)
+/*
+  ===========
+  vis_main
+
+  When `pipeline` is given, the bsp and portals are taken from it and the
+  result is left there instead of being written out. No state files are
+  used in that case, as there's no .prt to check them against.
+  ===========
+*/
+static int vis_main(int argc, const char **argv, pipeline_data_t *pipeline)
 {
     vis_reset();
 
@@ -696,15 +730,21 @@ int vis_main(int argc, const char **argv)
                       .replace_filename(vis_options.sourceMap.stem().string() + "-vis")
                       .replace_extension("log"),
         vis_options);
+    statsjson::begin_stage("vis", vis_options);
 
     stateinterval = std::chrono::minutes(5); /* 5 minutes */
     starttime = statetime = I_FloatTime();
 
-    LoadBSPFile(vis_options.sourceMap, &bspdata);
+    if (pipeline) {
+        bspdata = std::move(pipeline->bspdata);
+        loadversion = bspdata.loadversion;
+    } else {
+        LoadBSPFile(vis_options.sourceMap, &bspdata);
+        loadversion = bspdata.version;
+    }
 
-    bspdata.version->game->init_filesystem(vis_options.sourceMap, vis_options);
+    loadversion->game->init_filesystem(vis_options.sourceMap, vis_options);
 
-    loadversion = bspdata.version;
     ConvertBSPFormat(&bspdata, &bspver_generic);
 
     mbsp_t &bsp = std::get<mbsp_t>(bspdata.bsp);
@@ -722,11 +762,19 @@ int vis_main(int argc, const char **argv)
             originalvismapsize = portalleafs * ((portalleafs + 7) / 8);
         }
     } else {
-        portalfile = fs::path(vis_options.sourceMap).replace_extension("prt");
-        LoadPortals(portalfile, &bsp);
+        if (pipeline) {
+            if (!pipeline->prtfile) {
+                FError("no portals to vis (did the map leak?)");
+            }
 
-        statefile = fs::path(vis_options.sourceMap).replace_extension("vis");
-        statetmpfile = fs::path(vis_options.sourceMap).replace_extension("vi0");
+            LoadPortals(*pipeline->prtfile, &bsp);
+        } else {
+            portalfile = fs::path(vis_options.sourceMap).replace_extension("prt");
+            LoadPortals(LoadPrtFile(portalfile, bsp.loadversion), &bsp);
+
+            statefile = fs::path(vis_options.sourceMap).replace_extension("vis");
+            statetmpfile = fs::path(vis_options.sourceMap).replace_extension("vi0");
+        }
 
         if (bsp.loadversion->game->id != GAME_QUAKE_II) {
             uncompressed.resize(portalleafs * leafbytes_real);
@@ -742,19 +790,38 @@ int vis_main(int argc, const char **argv)
         bsp.dvis.bits = std::move(vismap);
         bsp.dvis.bits.shrink_to_fit();
         logging::print("visdatasize:{}  compressed from {}\n", bsp.dvis.bits.size(), originalvismapsize);
+
+        statsjson::add_counter("c_portaltest", stats.c_portaltest);
+        statsjson::add_counter("c_portalpass", stats.c_portalpass);
+        statsjson::add_counter("c_portalcheck", stats.c_portalcheck);
+        statsjson::add_counter("c_mightseeupdate", stats.c_mightseeupdate);
+        statsjson::add_counter("c_noclip", stats.c_noclip);
+        statsjson::add_counter("c_vistest", stats.c_vistest);
+        statsjson::add_counter("c_mighttest", stats.c_mighttest);
+        statsjson::add_counter("c_chains", stats.c_chains);
+        statsjson::add_counter("c_leafskip", stats.c_leafskip);
+        statsjson::add_counter("c_portalskip", stats.c_portalskip);
+        statsjson::add_counter("visdatasize", bsp.dvis.bits.size());
+        statsjson::add_counter("uncompressed_visdatasize", originalvismapsize);
     }
 
     // no ambient sounds for Q2
     if (bsp.loadversion->game->id != GAME_QUAKE_II) {
+        PROFILE_ZONE("CalcAmbientSounds");
         CalcAmbientSounds(&bsp);
     } else {
+        PROFILE_ZONE("CalcPHS");
         CalcPHS(&bsp);
     }
 
-    /* Convert data format back if necessary */
-    ConvertBSPFormat(&bspdata, loadversion);
+    if (pipeline) {
+        pipeline->bspdata = std::move(bspdata);
+    } else {
+        /* Convert data format back if necessary */
+        ConvertBSPFormat(&bspdata, loadversion);
 
-    WriteBSPFile(vis_options.sourceMap, &bspdata);
+        WriteBSPFile(vis_options.sourceMap, &bspdata);
+    }
 
     endtime = I_FloatTime();
     logging::print("{:.2} elapsed\n", (endtime - starttime));
@@ -763,17 +830,35 @@ int vis_main(int argc, const char **argv)
         CleanVisState();
     }
 
+    statsjson::end_stage();
+    profiling::write();
     logging::close();
 
     return 0;
 }
 
-int vis_main(const std::vector<std::string> &args)
+int vis_main(int argc, const char **argv)
+{
+    return vis_main(argc, argv, nullptr);
+}
+
+static std::vector<const char *> ArgPointers(const std::vector<std::string> &args)
 {
     std::vector<const char *> argPtrs;
     for (const std::string &arg : args) {
         argPtrs.push_back(arg.data());
     }
+    return argPtrs;
+}
 
-    return vis_main(argPtrs.size(), argPtrs.data());
+int vis_main(const std::vector<std::string> &args)
+{
+    auto argPtrs = ArgPointers(args);
+    return vis_main(argPtrs.size(), argPtrs.data(), nullptr);
+}
+
+int vis_main(const std::vector<std::string> &args, pipeline_data_t &pipeline)
+{
+    auto argPtrs = ArgPointers(args);
+    return vis_main(argPtrs.size(), argPtrs.data(), &pipeline);
 }